@@ -0,0 +1,936 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Stress test of cross-thread URB completion, see "Threading" in vdp/usb.h, and
+ * of gadget threaded dispatch. Runs without vdphci: URB events are injected into
+ * a device that has no kernel behind it and DEvents are collected by a sink.
+ */
+
+#include "vdp/usb.h"
+#include "vdp/usb_gadget.h"
+#include "vdp/byte_order.h"
+#include "vdp_usb_device.h"
+#include "vdp_usb_mpsc.h"
+#include "vdphci-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+
+#define NUM_THREADS 4
+
+#define NUM_NODES 200000
+
+#define NUM_ROUNDS 20
+
+/*
+ * URBs per thread per round.
+ */
+#define NUM_URBS 300
+
+#define URB_LENGTH 8
+
+/*
+ * How a thread finishes its URB, by URB index.
+ */
+typedef enum
+{
+    finish_complete_async = 0,
+    finish_complete_sync = 1,
+    finish_free_async = 2,
+    finish_count = 3
+} finish_type;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAILED at line %d: %s\n", __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+/*
+ * MPSC queue.
+ * @{
+ */
+
+struct test_node
+{
+    struct vdp_usb_mpsc_node node;
+    int producer;
+    vdp_u32 seq;
+};
+
+struct producer
+{
+    pthread_t thread;
+    struct vdp_usb_mpsc* q;
+    struct test_node* nodes;
+    int number;
+};
+
+static void* producer_thread(void* arg)
+{
+    struct producer* p = arg;
+    vdp_u32 i;
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        p->nodes[i].producer = p->number;
+        p->nodes[i].seq = i;
+
+        vdp_usb_mpsc_push(p->q, &p->nodes[i].node);
+    }
+
+    return NULL;
+}
+
+static void test_mpsc(void)
+{
+    struct vdp_usb_mpsc q;
+    struct producer producers[NUM_THREADS];
+    vdp_u32 next_seq[NUM_THREADS];
+    vdp_u32 num_popped = 0;
+    int i;
+
+    vdp_usb_mpsc_init(&q);
+
+    for (i = 0; i < NUM_THREADS; ++i) {
+        producers[i].q = &q;
+        producers[i].nodes = malloc(sizeof(struct test_node) * NUM_NODES);
+        producers[i].number = i;
+        next_seq[i] = 0;
+
+        CHECK(producers[i].nodes);
+    }
+
+    for (i = 0; i < NUM_THREADS; ++i) {
+        CHECK(pthread_create(&producers[i].thread, NULL, &producer_thread, &producers[i]) == 0);
+    }
+
+    /*
+     * Every node is popped exactly once, nodes of a producer come in push order.
+     */
+
+    while (num_popped < (NUM_THREADS * NUM_NODES)) {
+        struct vdp_usb_mpsc_node* node = vdp_usb_mpsc_pop(&q);
+        struct test_node* tnode;
+
+        if (!node) {
+            sched_yield();
+            continue;
+        }
+
+        tnode = vdp_containerof(node, struct test_node, node);
+
+        CHECK((tnode->producer >= 0) && (tnode->producer < NUM_THREADS));
+        CHECK(tnode->seq == next_seq[tnode->producer]);
+
+        ++next_seq[tnode->producer];
+        ++num_popped;
+    }
+
+    CHECK(vdp_usb_mpsc_pop(&q) == NULL);
+
+    for (i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(producers[i].thread, NULL);
+        free(producers[i].nodes);
+    }
+
+    printf("mpsc: %u nodes from %d producers OK\n", num_popped, NUM_THREADS);
+}
+
+/*
+ * @}
+ */
+
+/*
+ * URB completion.
+ * @{
+ */
+
+/*
+ * URB 'seq_num' of a round is handled by thread (seq_num - 1) % NUM_THREADS and
+ * finished according to its index within that thread.
+ */
+static inline int urb_thread(vdp_u32 seq_num)
+{
+    return (seq_num - 1) % NUM_THREADS;
+}
+
+static inline finish_type urb_finish(vdp_u32 seq_num)
+{
+    return ((seq_num - 1) / NUM_THREADS) % finish_count;
+}
+
+struct sink_state
+{
+    /*
+     * Completions per URB, sync ones come from worker threads.
+     */
+    int num_completed[NUM_THREADS * NUM_URBS + 1];
+
+    /*
+     * Last async completion per thread, async ones come from flush only.
+     */
+    vdp_u32 last_async[NUM_THREADS];
+};
+
+static int sink(void* sink_data, const struct iovec* vec, int count)
+{
+    struct sink_state* state = sink_data;
+    char buff[sizeof(struct vdphci_devent_header) + sizeof(struct vdphci_devent_urb) + URB_LENGTH];
+    struct vdphci_devent_header header;
+    struct vdphci_devent_urb urb;
+    size_t size = 0;
+    vdp_u32 value;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        CHECK((size + vec[i].iov_len) <= sizeof(buff));
+        memcpy(&buff[size], vec[i].iov_base, vec[i].iov_len);
+        size += vec[i].iov_len;
+    }
+
+    CHECK(size == (sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff) + URB_LENGTH));
+
+    memcpy(&header, &buff[0], sizeof(header));
+    memcpy(&urb, &buff[sizeof(header)], vdp_offsetof(struct vdphci_devent_urb, data.buff));
+    memcpy(&value, &buff[sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff)], sizeof(value));
+
+    CHECK(header.type == vdphci_devent_type_urb);
+    CHECK((urb.seq_num > 0) && (urb.seq_num <= (NUM_THREADS * NUM_URBS)));
+    CHECK(urb.status == vdphci_urb_status_completed);
+    CHECK(urb.actual_length == URB_LENGTH);
+    CHECK(value == urb.seq_num);
+    CHECK(urb_finish(urb.seq_num) != finish_free_async);
+
+    __atomic_add_fetch(&state->num_completed[urb.seq_num], 1, __ATOMIC_RELAXED);
+
+    if (urb_finish(urb.seq_num) == finish_complete_async) {
+        int thread = urb_thread(urb.seq_num);
+
+        CHECK(urb.seq_num > state->last_async[thread]);
+
+        state->last_async[thread] = urb.seq_num;
+    }
+
+    return 0;
+}
+
+struct worker
+{
+    pthread_t thread;
+    struct vdp_usb_urb* urbs[NUM_URBS];
+    int num_urbs;
+    int* num_done;
+};
+
+static void* worker_thread(void* arg)
+{
+    struct worker* w = arg;
+    int i;
+
+    for (i = 0; i < w->num_urbs; ++i) {
+        struct vdp_usb_urb* urb = w->urbs[i];
+        vdp_u32 value = urb->id;
+
+        memset(urb->transfer_buffer, 0, urb->transfer_length);
+        memcpy(urb->transfer_buffer, &value, sizeof(value));
+
+        urb->actual_length = URB_LENGTH;
+        urb->status = vdp_usb_urb_status_completed;
+
+        switch (urb_finish(urb->id)) {
+        case finish_complete_async:
+            CHECK(vdp_usb_complete_urb_async(urb) == vdp_usb_success);
+            break;
+        case finish_complete_sync:
+            CHECK(vdp_usb_complete_urb(urb) == vdp_usb_success);
+            vdp_usb_free_urb_async(urb);
+            break;
+        default:
+            vdp_usb_free_urb_async(urb);
+            break;
+        }
+    }
+
+    __atomic_add_fetch(w->num_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static struct vdp_usb_urb* inject_urb(struct vdp_usb_device* device, vdp_u32 seq_num)
+{
+    char buff[sizeof(struct vdphci_hevent_header) + sizeof(struct vdphci_hevent_urb)];
+    struct vdphci_hevent_header header;
+    struct vdphci_hevent_urb urb;
+    struct vdp_usb_event event;
+
+    memset(&header, 0, sizeof(header));
+    memset(&urb, 0, sizeof(urb));
+
+    header.type = vdphci_hevent_type_urb;
+    header.length = vdp_offsetof(struct vdphci_hevent_urb, data.buff);
+
+    urb.seq_num = seq_num;
+    urb.type = vdphci_urb_type_bulk;
+    urb.endpoint_address = 0x81;
+    urb.transfer_length = URB_LENGTH;
+
+    memcpy(&buff[0], &header, sizeof(header));
+    memcpy(&buff[sizeof(header)], &urb, header.length);
+
+    CHECK(vdp_usb_device_inject_event(device, &buff[0], sizeof(header) + header.length, &event) == vdp_usb_success);
+    CHECK(event.type == vdp_usb_event_urb);
+    CHECK(event.data.urb->id == seq_num);
+
+    return event.data.urb;
+}
+
+static void test_completion(struct vdp_usb_context* context)
+{
+    struct vdp_usb_device* device = NULL;
+    struct sink_state* state;
+    struct worker workers[NUM_THREADS];
+    struct pollfd pfd;
+    int round, i;
+
+    state = malloc(sizeof(*state));
+
+    CHECK(state);
+
+    CHECK(vdp_usb_device_create(context, 0, -1, 0, 0, &device) == vdp_usb_success);
+
+    device->sink = &sink;
+    device->sink_data = state;
+
+    pfd.fd = vdp_usb_device_get_completion_fd(device);
+    pfd.events = POLLIN;
+
+    for (round = 0; round < NUM_ROUNDS; ++round) {
+        int num_done = 0;
+        vdp_u32 seq_num;
+
+        memset(state, 0, sizeof(*state));
+
+        for (i = 0; i < NUM_THREADS; ++i) {
+            workers[i].num_urbs = 0;
+            workers[i].num_done = &num_done;
+        }
+
+        /*
+         * Events are read on this thread only, then URBs are handed out.
+         */
+
+        for (seq_num = 1; seq_num <= (NUM_THREADS * NUM_URBS); ++seq_num) {
+            struct worker* w = &workers[urb_thread(seq_num)];
+
+            w->urbs[w->num_urbs++] = inject_urb(device, seq_num);
+        }
+
+        for (i = 0; i < NUM_THREADS; ++i) {
+            CHECK(pthread_create(&workers[i].thread, NULL, &worker_thread, &workers[i]) == 0);
+        }
+
+        while (__atomic_load_n(&num_done, __ATOMIC_ACQUIRE) < NUM_THREADS) {
+            pfd.revents = 0;
+
+            if (poll(&pfd, 1, 10) > 0) {
+                CHECK(vdp_usb_device_flush(device) == vdp_usb_success);
+            }
+        }
+
+        for (i = 0; i < NUM_THREADS; ++i) {
+            pthread_join(workers[i].thread, NULL);
+        }
+
+        CHECK(vdp_usb_device_flush(device) == vdp_usb_success);
+
+        /*
+         * Everything queued got drained and freed, each URB is completed once,
+         * or not at all if it was freed.
+         */
+
+        CHECK(device->num_completions == 0);
+        CHECK(device->pool.num_outstanding == 0);
+
+        for (seq_num = 1; seq_num <= (NUM_THREADS * NUM_URBS); ++seq_num) {
+            CHECK(state->num_completed[seq_num] == ((urb_finish(seq_num) == finish_free_async) ? 0 : 1));
+        }
+    }
+
+    vdp_usb_device_close(device);
+
+    free(state);
+
+    printf("completion: %d rounds of %d urbs from %d threads OK\n",
+        NUM_ROUNDS, NUM_THREADS * NUM_URBS, NUM_THREADS);
+}
+
+/*
+ * @}
+ */
+
+/*
+ * Gadget threaded dispatch.
+ * @{
+ */
+
+/*
+ * Bulk URBs per round, they alternate between two endpoints.
+ */
+#define GADGET_NUM_URBS (NUM_THREADS * NUM_URBS)
+
+/*
+ * A control URB, GET_STATUS or CLEAR_FEATURE(HALT), goes after this many bulk URBs.
+ */
+#define GADGET_CONTROL_EVERY 8
+
+/*
+ * Pending URBs unlinked one by one, the rest are unlinked as a set.
+ */
+#define GADGET_NUM_SINGLE_UNLINKS 16
+
+#define GADGET_MAX_URBS (GADGET_NUM_URBS + (GADGET_NUM_URBS / GADGET_CONTROL_EVERY))
+
+/*
+ * How endpoint callbacks finish a bulk URB, by URB id.
+ */
+typedef enum
+{
+    gadget_finish_complete = 0,
+    gadget_finish_stall = 1,
+    gadget_finish_pending = 2,
+    gadget_finish_count = 3
+} gadget_finish_type;
+
+static inline gadget_finish_type gadget_urb_finish(vdp_u32 seq_num)
+{
+    return seq_num % gadget_finish_count;
+}
+
+typedef enum
+{
+    gadget_expect_none = 0,
+    gadget_expect_completed = 1,
+    gadget_expect_stall = 2,
+    gadget_expect_unlinked = 3,
+    gadget_expect_status = 4,
+    gadget_expect_control = 5
+} gadget_expect;
+
+struct gadget_sink_state
+{
+    /*
+     * URB 'seq_num' is at 'seq_num - base'.
+     */
+    vdp_u32 base;
+
+    gadget_expect expected[GADGET_MAX_URBS];
+    int num_completed[GADGET_MAX_URBS];
+
+    int num_urbs;
+    int num_done;
+};
+
+static int gadget_sink(void* sink_data, const struct iovec* vec, int count)
+{
+    struct gadget_sink_state* state = sink_data;
+    char buff[sizeof(struct vdphci_devent_header) + sizeof(struct vdphci_devent_urb) + URB_LENGTH];
+    struct vdphci_devent_header header;
+    struct vdphci_devent_urb urb;
+    size_t size = 0;
+    vdp_u32 index;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        CHECK((size + vec[i].iov_len) <= sizeof(buff));
+        memcpy(&buff[size], vec[i].iov_base, vec[i].iov_len);
+        size += vec[i].iov_len;
+    }
+
+    CHECK(size >= (sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff)));
+
+    memcpy(&header, &buff[0], sizeof(header));
+    memcpy(&urb, &buff[sizeof(header)], vdp_offsetof(struct vdphci_devent_urb, data.buff));
+
+    CHECK(header.type == vdphci_devent_type_urb);
+    CHECK((urb.seq_num > state->base) && ((urb.seq_num - state->base) <= state->num_urbs));
+
+    index = urb.seq_num - state->base - 1;
+
+    switch (state->expected[index]) {
+    case gadget_expect_completed: {
+        vdp_u32 value;
+
+        CHECK(urb.status == vdphci_urb_status_completed);
+        CHECK(urb.actual_length == URB_LENGTH);
+        memcpy(&value, &buff[sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff)], sizeof(value));
+        CHECK(value == urb.seq_num);
+        break;
+    }
+    case gadget_expect_stall:
+        CHECK(urb.status == vdphci_urb_status_stall);
+        break;
+    case gadget_expect_unlinked:
+        CHECK(urb.status == vdphci_urb_status_unlinked);
+        break;
+    case gadget_expect_status: {
+        /*
+         * Halt bit, it races with completions on the worker, either value is fine.
+         */
+        vdp_u8 status[2];
+
+        CHECK(urb.status == vdphci_urb_status_completed);
+        CHECK(urb.actual_length == 2);
+        memcpy(&status[0], &buff[sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff)], 2);
+        CHECK((status[0] <= 1) && (status[1] == 0));
+        break;
+    }
+    case gadget_expect_control:
+        CHECK(urb.status == vdphci_urb_status_completed);
+        break;
+    default:
+        CHECK(0);
+        break;
+    }
+
+    CHECK(++state->num_completed[index] == 1);
+
+    ++state->num_done;
+
+    return 0;
+}
+
+/*
+ * Endpoint callbacks, these run on workers.
+ * @{
+ */
+
+static void gadget_ep_enable(struct vdp_usb_gadget_ep* ep, int value)
+{
+}
+
+static void gadget_ep_enqueue(struct vdp_usb_gadget_ep* ep, struct vdp_usb_gadget_request* request)
+{
+    switch (gadget_urb_finish(request->id)) {
+    case gadget_finish_complete: {
+        vdp_u32 value = request->id;
+
+        memset(request->transfer_buffer, 0, request->transfer_length);
+        memcpy(request->transfer_buffer, &value, sizeof(value));
+
+        request->actual_length = URB_LENGTH;
+        request->status = vdp_usb_urb_status_completed;
+        break;
+    }
+    case gadget_finish_stall:
+        request->status = vdp_usb_urb_status_stall;
+        break;
+    default:
+        return;
+    }
+
+    CHECK(request->complete(request) == vdp_usb_success);
+
+    if (request->status == vdp_usb_urb_status_stall) {
+        /*
+         * Let the event thread look at the halt bit while the worker's
+         * write is fresh.
+         */
+        sched_yield();
+    }
+
+    request->destroy(request);
+}
+
+static void gadget_ep_dequeue(struct vdp_usb_gadget_ep* ep, struct vdp_usb_gadget_request* request)
+{
+    CHECK(gadget_urb_finish(request->id) == gadget_finish_pending);
+
+    request->status = vdp_usb_urb_status_unlinked;
+    CHECK(request->complete(request) == vdp_usb_success);
+    request->destroy(request);
+}
+
+static vdp_usb_urb_status gadget_ep_clear_stall(struct vdp_usb_gadget_ep* ep)
+{
+    return vdp_usb_urb_status_completed;
+}
+
+static void gadget_ep_destroy(struct vdp_usb_gadget_ep* ep)
+{
+}
+
+/*
+ * @}
+ */
+
+static void gadget_interface_enable(struct vdp_usb_gadget_interface* interface, int value)
+{
+}
+
+static void gadget_interface_destroy(struct vdp_usb_gadget_interface* interface)
+{
+}
+
+static void gadget_config_enable(struct vdp_usb_gadget_config* config, int value)
+{
+}
+
+static void gadget_config_destroy(struct vdp_usb_gadget_config* config)
+{
+}
+
+static void gadget_reset(struct vdp_usb_gadget* gadget, int start)
+{
+}
+
+static void gadget_power(struct vdp_usb_gadget* gadget, int on)
+{
+}
+
+static void gadget_set_address(struct vdp_usb_gadget* gadget, vdp_u32 address)
+{
+}
+
+static void gadget_destroy(struct vdp_usb_gadget* gadget)
+{
+}
+
+static struct vdp_usb_gadget* create_gadget(void)
+{
+    struct vdp_usb_gadget_ep_caps ep0_caps =
+    {
+        .address = 0,
+        .dir = vdp_usb_gadget_ep_inout,
+        .type = vdp_usb_gadget_ep_control,
+        .max_packet_size = 64
+    };
+    struct vdp_usb_gadget_ep_caps ep_caps =
+    {
+        .dir = vdp_usb_gadget_ep_in,
+        .type = vdp_usb_gadget_ep_bulk,
+        .max_packet_size = 512
+    };
+    struct vdp_usb_gadget_ep_ops ep_ops =
+    {
+        .enable = gadget_ep_enable,
+        .enqueue = gadget_ep_enqueue,
+        .dequeue = gadget_ep_dequeue,
+        .clear_stall = gadget_ep_clear_stall,
+        .destroy = gadget_ep_destroy
+    };
+    struct vdp_usb_gadget_ep* interface_eps[3] = { NULL, NULL, NULL };
+    struct vdp_usb_gadget_interface_caps interface_caps =
+    {
+        .number = 0,
+        .alt_setting = 0,
+        .klass = 0xFF,
+        .endpoints = interface_eps
+    };
+    struct vdp_usb_gadget_interface_ops interface_ops =
+    {
+        .enable = gadget_interface_enable,
+        .destroy = gadget_interface_destroy
+    };
+    struct vdp_usb_gadget_interface* interfaces[2] = { NULL, NULL };
+    struct vdp_usb_gadget_config_caps config_caps =
+    {
+        .number = 1,
+        .attributes = vdp_usb_gadget_config_att_one,
+        .max_power = 50,
+        .interfaces = interfaces
+    };
+    struct vdp_usb_gadget_config_ops config_ops =
+    {
+        .enable = gadget_config_enable,
+        .destroy = gadget_config_destroy
+    };
+    struct vdp_usb_string strings[] =
+    {
+        {0, NULL},
+    };
+    struct vdp_usb_string_table string_tables[] =
+    {
+        {0x0409, strings},
+        {0, NULL},
+    };
+    struct vdp_usb_gadget_config* configs[2] = { NULL, NULL };
+    struct vdp_usb_gadget_caps caps =
+    {
+        .bcd_usb = 0x0200,
+        .vendor_id = 0x1234,
+        .product_id = 0x5678,
+        .string_tables = string_tables,
+        .configs = configs
+    };
+    struct vdp_usb_gadget_ops ops =
+    {
+        .reset = gadget_reset,
+        .power = gadget_power,
+        .set_address = gadget_set_address,
+        .destroy = gadget_destroy
+    };
+
+    caps.endpoint0 = vdp_usb_gadget_ep_create(&ep0_caps, &ep_ops, NULL);
+    ep_caps.address = 1;
+    interface_eps[0] = vdp_usb_gadget_ep_create(&ep_caps, &ep_ops, NULL);
+    ep_caps.address = 2;
+    interface_eps[1] = vdp_usb_gadget_ep_create(&ep_caps, &ep_ops, NULL);
+    interfaces[0] = vdp_usb_gadget_interface_create(&interface_caps, &interface_ops, NULL);
+    configs[0] = vdp_usb_gadget_config_create(&config_caps, &config_ops, NULL);
+
+    CHECK(caps.endpoint0 && interface_eps[0] && interface_eps[1] && interfaces[0] && configs[0]);
+
+    return vdp_usb_gadget_create(&caps, &ops, NULL);
+}
+
+static void gadget_signal(struct vdp_usb_gadget* gadget, vdp_usb_signal_type type)
+{
+    struct vdp_usb_event event;
+
+    event.type = vdp_usb_event_signal;
+    event.data.signal.type = type;
+
+    vdp_usb_gadget_event(gadget, &event);
+}
+
+static void gadget_inject(struct vdp_usb_gadget* gadget, struct vdp_usb_device* device,
+    struct gadget_sink_state* state, vdp_u8 endpoint_address,
+    const struct vdp_usb_control_setup* setup, gadget_expect expected)
+{
+    char buff[sizeof(struct vdphci_hevent_header) + sizeof(struct vdphci_hevent_urb) + sizeof(*setup)];
+    struct vdphci_hevent_header header;
+    struct vdphci_hevent_urb urb;
+    struct vdp_usb_event event;
+
+    memset(&header, 0, sizeof(header));
+    memset(&urb, 0, sizeof(urb));
+
+    header.type = vdphci_hevent_type_urb;
+    header.length = vdp_offsetof(struct vdphci_hevent_urb, data.buff);
+
+    urb.seq_num = state->base + state->num_urbs + 1;
+    urb.endpoint_address = endpoint_address;
+
+    if (setup) {
+        urb.type = vdphci_urb_type_control;
+        urb.transfer_length = vdp_u16le_to_cpu(setup->wLength);
+        memcpy(&buff[sizeof(header) + header.length], setup, sizeof(*setup));
+        header.length += sizeof(*setup);
+    } else {
+        urb.type = vdphci_urb_type_bulk;
+        urb.transfer_length = URB_LENGTH;
+    }
+
+    memcpy(&buff[0], &header, sizeof(header));
+    memcpy(&buff[sizeof(header)], &urb, vdp_offsetof(struct vdphci_hevent_urb, data.buff));
+
+    CHECK(vdp_usb_device_inject_event(device, &buff[0], sizeof(header) + header.length, &event) == vdp_usb_success);
+    CHECK(event.type == vdp_usb_event_urb);
+
+    state->expected[state->num_urbs++] = expected;
+
+    vdp_usb_gadget_event(gadget, &event);
+}
+
+static void gadget_control(struct vdp_usb_gadget* gadget, struct vdp_usb_device* device,
+    struct gadget_sink_state* state, vdp_u8 request_type, vdp_u8 request, vdp_u16 value,
+    vdp_u16 index, vdp_u16 length, gadget_expect expected)
+{
+    struct vdp_usb_control_setup setup;
+
+    setup.bRequestType = request_type;
+    setup.bRequest = request;
+    setup.wValue = vdp_cpu_to_u16le(value);
+    setup.wIndex = vdp_cpu_to_u16le(index);
+    setup.wLength = vdp_cpu_to_u16le(length);
+
+    gadget_inject(gadget, device, state, (request_type & 0x80), &setup, expected);
+}
+
+static void gadget_wait(struct vdp_usb_device* device, struct gadget_sink_state* state)
+{
+    struct pollfd pfd;
+
+    pfd.fd = vdp_usb_device_get_completion_fd(device);
+    pfd.events = POLLIN;
+
+    while (state->num_done < state->num_urbs) {
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 10) > 0) {
+            CHECK(vdp_usb_device_flush(device) == vdp_usb_success);
+        }
+    }
+}
+
+static void test_gadget(struct vdp_usb_context* context)
+{
+    struct vdp_usb_device* device = NULL;
+    struct vdp_usb_workers* workers;
+    struct vdp_usb_gadget* gadget;
+    struct gadget_sink_state* state;
+    vdp_u32* unlink_ids;
+    int round, i;
+
+    state = malloc(sizeof(*state));
+    unlink_ids = malloc(sizeof(*unlink_ids) * GADGET_NUM_URBS);
+
+    CHECK(state && unlink_ids);
+
+    memset(state, 0, sizeof(*state));
+
+    CHECK(vdp_usb_device_create(context, 0, -1, 0, 0, &device) == vdp_usb_success);
+
+    device->sink = &gadget_sink;
+    device->sink_data = state;
+
+    workers = vdp_usb_workers_create(NUM_THREADS);
+    gadget = create_gadget();
+
+    CHECK(workers && gadget);
+    CHECK(vdp_usb_gadget_set_workers(gadget, workers) == vdp_usb_success);
+
+    gadget_signal(gadget, vdp_usb_signal_power_on);
+    gadget_signal(gadget, vdp_usb_signal_reset_start);
+    gadget_signal(gadget, vdp_usb_signal_reset_end);
+
+    gadget_control(gadget, device, state, VDP_USB_REQUESTTYPE_RECIPIENT_DEVICE,
+        VDP_USB_REQUEST_SET_CONFIGURATION, 1, 0, 0, gadget_expect_control);
+
+    gadget_wait(device, state);
+
+    for (round = 0; round < NUM_ROUNDS; ++round) {
+        struct vdp_usb_event event;
+        vdp_u32 num_unlinks = 0;
+
+        state->base += state->num_urbs;
+        state->num_urbs = 0;
+        state->num_done = 0;
+        memset(state->num_completed, 0, sizeof(state->num_completed));
+
+        /*
+         * Workers complete and stall while this thread reads and clears halt.
+         */
+
+        for (i = 0; i < GADGET_NUM_URBS; ++i) {
+            vdp_u8 endpoint_address = 0x80 | (1 + (i % 2));
+            vdp_u32 seq_num = state->base + state->num_urbs + 1;
+            static const gadget_expect expected[gadget_finish_count] =
+            {
+                gadget_expect_completed,
+                gadget_expect_stall,
+                gadget_expect_unlinked
+            };
+
+            if (gadget_urb_finish(seq_num) == gadget_finish_pending) {
+                unlink_ids[num_unlinks++] = seq_num;
+            }
+
+            gadget_inject(gadget, device, state, endpoint_address, NULL, expected[gadget_urb_finish(seq_num)]);
+
+            if ((i % GADGET_CONTROL_EVERY) == (GADGET_CONTROL_EVERY - 1)) {
+                if ((i / GADGET_CONTROL_EVERY) % 2) {
+                    gadget_control(gadget, device, state,
+                        VDP_USB_REQUESTTYPE_RECIPIENT_ENDPOINT,
+                        VDP_USB_REQUEST_CLEAR_FEATURE, VDP_USB_FEATURE_ENDPOINT_HALT,
+                        endpoint_address, 0, gadget_expect_control);
+                } else {
+                    gadget_control(gadget, device, state,
+                        0x80 | VDP_USB_REQUESTTYPE_RECIPIENT_ENDPOINT,
+                        VDP_USB_REQUEST_GET_STATUS, 0, endpoint_address, 2, gadget_expect_status);
+                }
+            }
+
+            CHECK(vdp_usb_device_flush(device) == vdp_usb_success);
+        }
+
+        /*
+         * Pending URBs are split between the endpoints, single unlinks and
+         * unlink sets both have to find them on the right one.
+         */
+
+        for (i = 0; i < GADGET_NUM_SINGLE_UNLINKS; ++i) {
+            event.type = vdp_usb_event_unlink_urb;
+            event.data.unlink_urb.id = unlink_ids[i];
+
+            vdp_usb_gadget_event(gadget, &event);
+        }
+
+        event.type = vdp_usb_event_unlink_urbs;
+        event.data.unlink_urbs.ids = &unlink_ids[GADGET_NUM_SINGLE_UNLINKS];
+        event.data.unlink_urbs.count = num_unlinks - GADGET_NUM_SINGLE_UNLINKS;
+
+        vdp_usb_gadget_event(gadget, &event);
+
+        gadget_wait(device, state);
+
+        CHECK(vdp_usb_device_flush(device) == vdp_usb_success);
+
+        CHECK(device->num_completions == 0);
+        CHECK(device->pool.num_outstanding == 0);
+
+        for (i = 0; i < state->num_urbs; ++i) {
+            CHECK(state->num_completed[i] == 1);
+        }
+    }
+
+    vdp_usb_gadget_destroy(gadget);
+    vdp_usb_workers_destroy(workers);
+
+    vdp_usb_device_close(device);
+
+    free(unlink_ids);
+    free(state);
+
+    printf("gadget: %d rounds of %d urbs on %d workers OK\n",
+        NUM_ROUNDS, GADGET_NUM_URBS, NUM_THREADS);
+}
+
+/*
+ * @}
+ */
+
+int main(int argc, char* argv[])
+{
+    struct vdp_usb_context* context = NULL;
+
+    CHECK(vdp_usb_init(stdout, vdp_log_error, &context) == vdp_usb_success);
+
+    test_mpsc();
+
+    test_completion(context);
+
+    test_gadget(context);
+
+    vdp_usb_cleanup(context);
+
+    return 0;
+}
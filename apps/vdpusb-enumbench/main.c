@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdp/usb.h"
+#include "vdp/usb_filter.h"
+#include "vdp/byte_order.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+/*
+ * Enumeration benchmark: attaches N minimal vendor-class devices and measures
+ * time from attach until the host sets a configuration on each of them.
+ */
+
+static int done = 0;
+
+struct bench_device
+{
+    struct vdp_usb_device* device;
+    int device_num;
+    vdp_u64 configured_ns;
+    int configured;
+};
+
+static struct bench_device* devices = NULL;
+static int num_devices = 0;
+static int num_configured = 0;
+static vdp_u64 attach_ns = 0;
+
+static void print_error(vdp_usb_result res, const char* fmt, ...)
+{
+    if (fmt) {
+        printf("error: ");
+        va_list args;
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+        printf(" (%s)\n", vdp_usb_result_to_str(res));
+    } else {
+        printf("error: %s\n", vdp_usb_result_to_str(res));
+    }
+}
+
+static vdp_u64 get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (vdp_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct vdp_usb_interface_descriptor bench_interface_descriptor =
+{
+    .bLength = sizeof(struct vdp_usb_interface_descriptor),
+    .bDescriptorType = VDP_USB_DT_INTERFACE,
+    .bInterfaceNumber = 0,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 0,
+    .bInterfaceClass = 0xFF, /* Vendor specific */
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,
+    .iInterface = 0
+};
+
+static struct vdp_usb_descriptor_header *bench_descriptors[] =
+{
+    (struct vdp_usb_descriptor_header *)&bench_interface_descriptor,
+    NULL,
+};
+
+static const struct vdp_usb_string bench_us_strings[] =
+{
+    {1, "vdpusb"},
+    {2, "Enumeration benchmark"},
+    {0, NULL},
+};
+
+static const struct vdp_usb_string_table bench_string_tables[] =
+{
+    {0x0409, bench_us_strings},
+    {0, NULL},
+};
+
+static vdp_usb_urb_status bench_get_device_descriptor(void* user_data,
+    struct vdp_usb_device_descriptor* descriptor)
+{
+    struct bench_device* bdev = user_data;
+
+    descriptor->bLength = sizeof(*descriptor);
+    descriptor->bDescriptorType = VDP_USB_DT_DEVICE;
+    descriptor->bcdUSB = vdp_cpu_to_u16le(0x0200);
+    descriptor->bDeviceClass = 0;
+    descriptor->bDeviceSubClass = 0;
+    descriptor->bDeviceProtocol = 0;
+    descriptor->bMaxPacketSize0 = 64;
+    descriptor->idVendor = vdp_cpu_to_u16le(0x1d6b);
+    descriptor->idProduct = vdp_cpu_to_u16le(0x0100 + bdev->device_num);
+    descriptor->bcdDevice = vdp_cpu_to_u16le(0x0100);
+    descriptor->iManufacturer = 1;
+    descriptor->iProduct = 2;
+    descriptor->iSerialNumber = 0;
+    descriptor->bNumConfigurations = 1;
+
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_get_qualifier_descriptor(void* user_data,
+    struct vdp_usb_qualifier_descriptor* descriptor)
+{
+    descriptor->bLength = sizeof(*descriptor);
+    descriptor->bDescriptorType = VDP_USB_DT_QUALIFIER;
+    descriptor->bcdUSB = vdp_cpu_to_u16le(0x0200);
+    descriptor->bDeviceClass = 0;
+    descriptor->bDeviceSubClass = 0;
+    descriptor->bDeviceProtocol = 0;
+    descriptor->bMaxPacketSize0 = 64;
+    descriptor->bNumConfigurations = 1;
+    descriptor->bRESERVED = 0;
+
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_get_config_descriptor(void* user_data,
+    vdp_u8 index,
+    struct vdp_usb_config_descriptor* descriptor,
+    struct vdp_usb_descriptor_header*** other)
+{
+    descriptor->bLength = sizeof(*descriptor);
+    descriptor->bDescriptorType = VDP_USB_DT_CONFIG;
+    descriptor->bNumInterfaces = 1;
+    descriptor->bConfigurationValue = 1;
+    descriptor->iConfiguration = 0;
+    descriptor->bmAttributes = VDP_USB_CONFIG_ATT_ONE;
+    descriptor->bMaxPower = 50;
+
+    *other = bench_descriptors;
+
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_get_string_descriptor(void* user_data,
+    const struct vdp_usb_string_table** tables)
+{
+    *tables = bench_string_tables;
+
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_set_address(void* user_data,
+    vdp_u16 address)
+{
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_set_configuration(void* user_data,
+    vdp_u8 configuration)
+{
+    struct bench_device* bdev = user_data;
+
+    if (!bdev->configured && (configuration != 0)) {
+        bdev->configured_ns = get_time_ns() - attach_ns;
+        bdev->configured = 1;
+        ++num_configured;
+    }
+
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_get_status(void* user_data,
+    vdp_u8 recipient, vdp_u8 index, vdp_u16* status)
+{
+    switch (recipient) {
+    case VDP_USB_REQUESTTYPE_RECIPIENT_DEVICE:
+    case VDP_USB_REQUESTTYPE_RECIPIENT_INTERFACE:
+    case VDP_USB_REQUESTTYPE_RECIPIENT_ENDPOINT:
+        return vdp_usb_urb_status_completed;
+    default:
+        return vdp_usb_urb_status_stall;
+    }
+}
+
+static vdp_usb_urb_status bench_enable_feature(void* user_data,
+    vdp_u8 recipient, vdp_u8 index, vdp_u16 feature, int enable)
+{
+    return vdp_usb_urb_status_stall;
+}
+
+static vdp_usb_urb_status bench_get_interface(void* user_data,
+    vdp_u8 interface, vdp_u8* alt_setting)
+{
+    *alt_setting = 0;
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_set_interface(void* user_data,
+    vdp_u8 interface, vdp_u8 alt_setting)
+{
+    return vdp_usb_urb_status_completed;
+}
+
+static vdp_usb_urb_status bench_set_descriptor(void* user_data,
+    vdp_u16 value, vdp_u16 index, const vdp_byte* data,
+    vdp_u32 len)
+{
+    return vdp_usb_urb_status_stall;
+}
+
+static struct vdp_usb_filter_ops bench_filter_ops =
+{
+    .get_device_descriptor = bench_get_device_descriptor,
+    .get_qualifier_descriptor = bench_get_qualifier_descriptor,
+    .get_config_descriptor = bench_get_config_descriptor,
+    .get_string_descriptor = bench_get_string_descriptor,
+    .set_address = bench_set_address,
+    .set_configuration = bench_set_configuration,
+    .get_status = bench_get_status,
+    .enable_feature = bench_enable_feature,
+    .get_interface = bench_get_interface,
+    .set_interface = bench_set_interface,
+    .set_descriptor = bench_set_descriptor
+};
+
+static int process_event(struct bench_device* bdev)
+{
+    vdp_usb_result vdp_res;
+    struct vdp_usb_event event;
+
+    vdp_res = vdp_usb_device_get_event(bdev->device, &event);
+
+    if (vdp_res != vdp_usb_success) {
+        print_error(vdp_res, "cannot get event from device #%d", bdev->device_num);
+
+        return 0;
+    }
+
+    if (event.type == vdp_usb_event_urb) {
+        if (!vdp_usb_filter(event.data.urb, &bench_filter_ops, bdev)) {
+            event.data.urb->status = vdp_usb_urb_status_stall;
+        }
+        vdp_usb_complete_urb(event.data.urb);
+        vdp_usb_free_urb(event.data.urb);
+    }
+
+    return 1;
+}
+
+static void print_results(void)
+{
+    vdp_u64 total = 0, max = 0;
+    int i;
+
+    for (i = 0; i < num_devices; ++i) {
+        if (!devices[i].configured) {
+            printf("device #%d: not configured\n", devices[i].device_num);
+            continue;
+        }
+
+        printf("device #%d: configured in %.3f ms\n", devices[i].device_num,
+            (double)devices[i].configured_ns / 1000000.0);
+
+        total += devices[i].configured_ns;
+
+        if (devices[i].configured_ns > max) {
+            max = devices[i].configured_ns;
+        }
+    }
+
+    if (num_configured > 0) {
+        printf("%d/%d devices configured, mean %.3f ms, max %.3f ms\n",
+            num_configured, num_devices,
+            (double)total / num_configured / 1000000.0,
+            (double)max / 1000000.0);
+    } else {
+        printf("0/%d devices configured\n", num_devices);
+    }
+}
+
+static int run(int count, int bulk)
+{
+    int ret = 1;
+    vdp_usb_result vdp_res;
+    struct vdp_usb_context* context = NULL;
+    struct vdp_usb_device** device_ptrs = NULL;
+    vdp_usb_speed* speeds = NULL;
+    struct pollfd* pfds = NULL;
+    vdp_u8 device_lower, device_upper;
+    int i;
+
+    vdp_res = vdp_usb_init(stdout, vdp_log_warning, &context);
+
+    if (vdp_res != vdp_usb_success) {
+        print_error(vdp_res, "cannot initialize context");
+
+        return 1;
+    }
+
+    vdp_res = vdp_usb_get_device_range(context, &device_lower, &device_upper);
+
+    if (vdp_res != vdp_usb_success) {
+        print_error(vdp_res, "cannot get device range");
+
+        goto out1;
+    }
+
+    if (count > (device_upper - device_lower + 1)) {
+        printf("error: only %d devices available\n", device_upper - device_lower + 1);
+
+        goto out1;
+    }
+
+    devices = calloc(count, sizeof(*devices));
+    device_ptrs = calloc(count, sizeof(*device_ptrs));
+    speeds = calloc(count, sizeof(*speeds));
+    pfds = calloc(count, sizeof(*pfds));
+
+    if (!devices || !device_ptrs || !speeds || !pfds) {
+        printf("error: cannot allocate memory\n");
+
+        goto out2;
+    }
+
+    for (i = 0; i < count; ++i) {
+        devices[i].device_num = device_lower + i;
+
+        vdp_res = vdp_usb_device_open(context, (vdp_u8)devices[i].device_num, &devices[i].device);
+
+        if (vdp_res != vdp_usb_success) {
+            print_error(vdp_res, "cannot open device #%d", devices[i].device_num);
+
+            goto out2;
+        }
+
+        device_ptrs[i] = devices[i].device;
+        speeds[i] = vdp_usb_speed_high;
+        ++num_devices;
+    }
+
+    attach_ns = get_time_ns();
+
+    if (bulk) {
+        vdp_res = vdp_usb_devices_attach(device_ptrs, speeds, count);
+
+        if (vdp_res != vdp_usb_success) {
+            print_error(vdp_res, "cannot attach devices");
+
+            goto out2;
+        }
+    } else {
+        for (i = 0; i < count; ++i) {
+            vdp_res = vdp_usb_device_attach(devices[i].device, speeds[i]);
+
+            if (vdp_res != vdp_usb_success) {
+                print_error(vdp_res, "cannot attach device #%d", devices[i].device_num);
+
+                goto out3;
+            }
+        }
+    }
+
+    while (!done && (num_configured < count)) {
+        int io_res;
+
+        for (i = 0; i < count; ++i) {
+            vdp_fd fd;
+
+            vdp_res = vdp_usb_device_wait_event(devices[i].device, &fd);
+
+            if (vdp_res != vdp_usb_success) {
+                print_error(vdp_res, "device #%d wait for event failed", devices[i].device_num);
+
+                goto out3;
+            }
+
+            pfds[i].fd = fd;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        io_res = poll(pfds, count, -1);
+
+        if (io_res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            printf("poll error: %s\n", strerror(errno));
+
+            goto out3;
+        }
+
+        for (i = 0; i < count; ++i) {
+            if ((pfds[i].revents & POLLIN) && !process_event(&devices[i])) {
+                goto out3;
+            }
+        }
+    }
+
+    print_results();
+
+    ret = 0;
+
+out3:
+    if (bulk) {
+        vdp_usb_devices_detach(device_ptrs, count);
+    } else {
+        for (i = 0; i < count; ++i) {
+            vdp_usb_device_detach(devices[i].device);
+        }
+    }
+out2:
+    for (i = 0; i < num_devices; ++i) {
+        vdp_usb_device_close(devices[i].device);
+    }
+    free(pfds);
+    free(speeds);
+    free(device_ptrs);
+    free(devices);
+out1:
+    vdp_usb_cleanup(context);
+
+    return ret;
+}
+
+static void sig_handler(int signum)
+{
+    done = 1;
+}
+
+int main(int argc, char* argv[])
+{
+    int count;
+
+    signal(SIGINT, &sig_handler);
+
+    if (argc < 2) {
+        printf("usage: vdpusb-enumbench <num_devices> [--bulk]\n");
+        return 1;
+    }
+
+    count = atoi(argv[1]);
+
+    if (count <= 0) {
+        printf("error: bad number of devices\n");
+        return 1;
+    }
+
+    return run(count, (argc > 2) && (strcmp(argv[2], "--bulk") == 0));
+}
@@ -24,6 +24,7 @@
  */
 
 #include "vdp/usb_gadget.h"
+#include "vdp/usb_loop.h"
 #include "vdp/usb_hid.h"
 #include "vdp/byte_order.h"
 #include <stdio.h>
@@ -35,7 +36,7 @@
 #include <assert.h>
 #include <signal.h>
 
-static int done = 0;
+static struct vdp_usb_loop* loop = NULL;
 
 static void print_error(vdp_usb_result res, const char* fmt, ...)
 {
@@ -380,13 +381,14 @@ static struct vdp_usb_gadget* create_gadget()
     return vdp_usb_gadget_create(&caps, &ops, NULL);
 }
 
-static int run(int device_num)
+static int run(int device_num, int num_threads)
 {
     int ret = 1;
     vdp_usb_result vdp_res;
     struct vdp_usb_context* context = NULL;
     struct vdp_usb_device* device = NULL;
     vdp_u8 device_lower, device_upper;
+    struct vdp_usb_workers* workers = NULL;
 
     vdp_res = vdp_usb_init(stdout, vdp_log_debug, &context);
 
@@ -420,43 +422,50 @@ static int run(int device_num)
 
     struct vdp_usb_gadget* gadget = create_gadget();
 
-    while (!done) {
-        int io_res;
-        fd_set read_fds;
-        vdp_fd fd;
-        struct vdp_usb_event event;
+    if (num_threads > 0) {
+        workers = vdp_usb_workers_create(num_threads);
 
-        vdp_res = vdp_usb_device_wait_event(device, &fd);
+        if (!workers) {
+            printf("error: cannot create %d workers\n", num_threads);
+
+            goto out2;
+        }
+
+        vdp_res = vdp_usb_gadget_set_workers(gadget, workers);
 
         if (vdp_res != vdp_usb_success) {
-            print_error(vdp_res, "device #%d wait for event failed", device_num);
+            print_error(vdp_res, "cannot set gadget workers");
 
             goto out2;
         }
+    }
 
-        FD_ZERO(&read_fds);
-        FD_SET(fd, &read_fds);
+    vdp_res = vdp_usb_loop_create(context, &loop);
 
-        io_res = select(fd + 1, &read_fds, NULL, NULL, NULL);
+    if (vdp_res != vdp_usb_success) {
+        print_error(vdp_res, "cannot create loop");
 
-        if (io_res < 0) {
-            printf("select error: %s\n", strerror(errno));
+        goto out2;
+    }
 
-            goto out2;
-        }
+    vdp_res = vdp_usb_loop_add_gadget(loop, device, gadget);
 
-        assert(io_res == 1);
+    if (vdp_res != vdp_usb_success) {
+        print_error(vdp_res, "cannot add device #%d to loop", device_num);
 
-        vdp_res = vdp_usb_device_get_event(device, &event);
+        goto out2;
+    }
 
-        if (vdp_res != vdp_usb_success) {
-            print_error(vdp_res, "cannot get event from device #%d", device_num);
+    vdp_res = vdp_usb_loop_run(loop);
 
-            goto out2;
-        }
+    if (vdp_res != vdp_usb_success) {
+        print_error(vdp_res, "device #%d loop failed", device_num);
 
-        vdp_usb_gadget_event(gadget, &event);
-    };
+        goto out2;
+    }
+
+    vdp_usb_loop_destroy(loop);
+    loop = NULL;
 
     vdp_usb_gadget_destroy(gadget);
     gadget = NULL;
@@ -472,7 +481,12 @@ static int run(int device_num)
     ret = 0;
 
 out2:
+    if (loop) {
+        vdp_usb_loop_destroy(loop);
+        loop = NULL;
+    }
     vdp_usb_gadget_destroy(gadget);
+    vdp_usb_workers_destroy(workers);
     vdp_usb_device_close(device);
 out1:
     vdp_usb_cleanup(context);
@@ -482,7 +496,9 @@ out1:
 
 static void sig_handler(int signum)
 {
-    done = 1;
+    if (loop) {
+        vdp_usb_loop_stop(loop);
+    }
 }
 
 int main(int argc, char* argv[])
@@ -490,9 +506,9 @@ int main(int argc, char* argv[])
     signal(SIGINT, &sig_handler);
 
     if (argc < 2) {
-        printf("usage: vdpusb-mouse2 <port>\n");
+        printf("usage: vdpusb-mouse2 <port> [num_threads]\n");
         return 1;
     }
 
-    return run(atoi(argv[1]));
+    return run(atoi(argv[1]), (argc > 2) ? atoi(argv[2]) : 0);
 }
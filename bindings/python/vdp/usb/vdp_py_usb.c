@@ -65,6 +65,8 @@ PyMODINIT_FUNC initusb(void)
     PyModule_AddIntConstant(module, "SIGNAL_RESET_END", vdp_usb_signal_reset_end);
     PyModule_AddIntConstant(module, "SIGNAL_POWER_ON", vdp_usb_signal_power_on);
     PyModule_AddIntConstant(module, "SIGNAL_POWER_OFF", vdp_usb_signal_power_off);
+    PyModule_AddIntConstant(module, "SIGNAL_SUSPEND", vdp_usb_signal_suspend);
+    PyModule_AddIntConstant(module, "SIGNAL_RESUME", vdp_usb_signal_resume);
 
     PyModule_AddIntConstant(module, "URB_CONTROL", vdp_usb_urb_control);
     PyModule_AddIntConstant(module, "URB_ISO", vdp_usb_urb_iso);
@@ -159,6 +161,7 @@ PyMODINIT_FUNC initusb(void)
     PyModule_AddIntConstant(module, "HID_DT_PHYSICAL", VDP_USB_HID_DT_PHYSICAL);
 
     PyModule_AddIntConstant(module, "URB_ZERO_PACKET", VDP_USB_URB_ZERO_PACKET);
+    PyModule_AddIntConstant(module, "URB_MAPPED", VDP_USB_URB_MAPPED);
 
     vdp_py_usb_error_init(module);
     vdp_py_usb_context_init(module);
@@ -81,6 +81,79 @@ void vdp_usb_cleanup(struct vdp_usb_context* context);
  */
 vdp_usb_result vdp_usb_get_device_range(struct vdp_usb_context* context, vdp_u8* device_lower, vdp_u8* device_upper);
 
+/*
+ * 'busnum' and 'portnum' are the host side USB bus and root hub port of the device,
+ * -1 if unknown (older vdphci module that doesn't export them via sysfs).
+ */
+struct vdp_usb_device_info
+{
+    vdp_u8 device_number;
+    int busnum;
+    int portnum;
+};
+
+/*
+ * Get all devices in system sorted by device number. At most 'max_infos' are
+ * stored into 'infos', '*num_infos' is set to the total number of devices, i.e. one can pass
+ * 'max_infos' = 0 to only count them. Devices are listed from vdphci sysfs class, /dev is only
+ * scanned if the class doesn't exist. Returns vdp_usb_not_found if no devices are found
+ * in the system.
+ */
+vdp_usb_result vdp_usb_get_devices(struct vdp_usb_context* context,
+    struct vdp_usb_device_info* infos,
+    int max_infos,
+    int* num_infos);
+
+/*
+ * @}
+ */
+
+/*
+ * Device monitor, reports devices appearing and disappearing (i.e. vdphci being
+ * loaded/unloaded) via kernel uevents, so there's no need to poll 'vdp_usb_get_devices'.
+ * @{
+ */
+
+struct vdp_usb_monitor;
+
+typedef enum
+{
+    vdp_usb_monitor_event_none = 0,
+    vdp_usb_monitor_event_add = 1,
+    vdp_usb_monitor_event_remove = 2
+} vdp_usb_monitor_event_type;
+
+struct vdp_usb_monitor_event
+{
+    vdp_usb_monitor_event_type type;
+
+    /*
+     * For vdp_usb_monitor_event_remove 'busnum' and 'portnum' are -1.
+     */
+    struct vdp_usb_device_info info;
+};
+
+/*
+ * If udev is running events are taken from it, i.e. device node already exists when
+ * vdp_usb_monitor_event_add is reported.
+ */
+vdp_usb_result vdp_usb_monitor_create(struct vdp_usb_context* context,
+    struct vdp_usb_monitor** monitor);
+
+void vdp_usb_monitor_destroy(struct vdp_usb_monitor* monitor);
+
+/*
+ * Becomes readable when there're events, it's non-blocking.
+ */
+vdp_fd vdp_usb_monitor_get_fd(struct vdp_usb_monitor* monitor);
+
+/*
+ * Get next event, 'event->type' is vdp_usb_monitor_event_none if there're no more events
+ * pending. Events that aren't about vdphci devices are skipped.
+ */
+vdp_usb_result vdp_usb_monitor_get_event(struct vdp_usb_monitor* monitor,
+    struct vdp_usb_monitor_event* event);
+
 /*
  * @}
  */
@@ -129,9 +202,93 @@ vdp_usb_result vdp_usb_device_attach(struct vdp_usb_device* device,
  */
 vdp_usb_result vdp_usb_device_detach(struct vdp_usb_device* device);
 
+/*
+ * Wake the host up after 'vdp_usb_signal_suspend', the device then gets
+ * 'vdp_usb_signal_resume'. Only call this if the host has enabled remote wakeup
+ * with SET_FEATURE(DEVICE_REMOTE_WAKEUP), it's a no-op if the device isn't suspended.
+ */
+vdp_usb_result vdp_usb_device_remote_wakeup(struct vdp_usb_device* device);
+
+/*
+ * Same as calling vdp_usb_device_attach on each of 'devices' with corresponding 'speeds',
+ * but devices on the same bus are attached at once, the system then enumerates them
+ * together instead of one by one.
+ */
+vdp_usb_result vdp_usb_devices_attach(struct vdp_usb_device** devices,
+    const vdp_usb_speed* speeds,
+    int count);
+
+/*
+ * Same as calling vdp_usb_device_detach on each of 'devices', see vdp_usb_devices_attach.
+ */
+vdp_usb_result vdp_usb_devices_detach(struct vdp_usb_device** devices,
+    int count);
+
 int vdp_usb_device_get_busnum(struct vdp_usb_device* device);
 int vdp_usb_device_get_portnum(struct vdp_usb_device* device);
 
+/*
+ * Enable zero-copy mode for bulk and interrupt URBs with transfer length >= 'threshold',
+ * 'threshold' == 0 turns zero-copy mode off (the default).
+ * In zero-copy mode URB's 'transfer_buffer' points directly to the kernel's transfer buffer
+ * pages (VDP_USB_URB_MAPPED is set in 'flags'), OUT data is consumed and IN data is filled
+ * in place, completion only carries status and length. Not all URBs can be mapped, the ones
+ * that can't are copied as usual. Use large thresholds, mapping is more expensive than
+ * copying for small transfers.
+ */
+vdp_usb_result vdp_usb_device_set_map_threshold(struct vdp_usb_device* device,
+    vdp_u32 threshold);
+
+/*
+ * When enabled all pending URB unlinks are reported as a single vdp_usb_event_unlink_urbs
+ * event instead of vdp_usb_event_unlink_urb per URB, disabled by default. Host drivers
+ * tend to kill all their URBs at once (interface reset, driver unbind, suspend), this
+ * saves a lot of events.
+ */
+vdp_usb_result vdp_usb_device_set_unlink_sets(struct vdp_usb_device* device,
+    int enable);
+
+/*
+ * When enabled URBs carry submission time, see VDP_USB_URB_TIMING, disabled by default.
+ */
+vdp_usb_result vdp_usb_device_set_urb_timing(struct vdp_usb_device* device,
+    int enable);
+
+/*
+ * Bus emulation parameters, see vdp_usb_device_set_shaping.
+ */
+struct vdp_usb_shaping
+{
+    /*
+     * Bytes per second, 0 - unlimited.
+     */
+    vdp_u32 bandwidth;
+
+    /*
+     * Bytes that can go at once after the bus has been idle.
+     */
+    vdp_u32 burst;
+
+    /*
+     * Latency in us, indexed by vdp_usb_urb_type.
+     */
+    vdp_u32 latency[4];
+
+    /*
+     * Maximum random latency in us.
+     */
+    vdp_u32 jitter;
+};
+
+/*
+ * Make the host see completed URBs as if they went through a real bus: completion is
+ * delayed according to 'shaping', the order is kept. 'shaping' == NULL turns shaping off
+ * (the default). Useful for benchmarking host side drivers. Values are limited as
+ * VDPHCI_SHAPING_XXX describe, vdp_usb_protocol_error is returned for values out of the limits.
+ */
+vdp_usb_result vdp_usb_device_set_shaping(struct vdp_usb_device* device,
+    const struct vdp_usb_shaping* shaping);
+
 /*
  * @}
  */
@@ -146,7 +303,8 @@ typedef enum
     vdp_usb_event_none = 0,
     vdp_usb_event_signal = 1,
     vdp_usb_event_urb = 2,
-    vdp_usb_event_unlink_urb = 3
+    vdp_usb_event_unlink_urb = 3,
+    vdp_usb_event_unlink_urbs = 4
 } vdp_usb_event_type;
 
 typedef enum
@@ -154,7 +312,9 @@ typedef enum
     vdp_usb_signal_reset_start = 0,
     vdp_usb_signal_reset_end = 1,
     vdp_usb_signal_power_on = 2,
-    vdp_usb_signal_power_off = 3
+    vdp_usb_signal_power_off = 3,
+    vdp_usb_signal_suspend = 4,
+    vdp_usb_signal_resume = 5
 } vdp_usb_signal_type;
 
 int vdp_usb_signal_type_validate(int value);
@@ -257,6 +417,12 @@ struct vdp_usb_control_setup
 #define VDP_USB_REQUEST_LOOPBACK_DATA_READ  0x16
 #define VDP_USB_REQUEST_SET_INTERFACE_DS    0x17
 
+/*
+ * Standard feature selectors.
+ */
+#define VDP_USB_FEATURE_ENDPOINT_HALT        0x00
+#define VDP_USB_FEATURE_DEVICE_REMOTE_WAKEUP 0x01
+
 const char* vdp_usb_request_type_direction_to_str(vdp_u8 bRequestType);
 
 const char* vdp_usb_request_type_type_to_str(vdp_u8 bRequestType);
@@ -276,6 +442,8 @@ struct vdp_usb_urb
     vdp_usb_urb_type type;
 
 #define VDP_USB_URB_ZERO_PACKET (1 << 0)
+#define VDP_USB_URB_MAPPED (1 << 1)
+#define VDP_USB_URB_TIMING (1 << 2)
     vdp_u32 flags;
 
     vdp_u8 endpoint_address;
@@ -295,6 +463,18 @@ struct vdp_usb_urb
     vdp_usb_urb_status status;
 
     struct vdp_usb_iso_packet* iso_packets;
+
+    /*
+     * VDP_USB_URB_TIMING only, when the URB was submitted: CLOCK_MONOTONIC time in ns
+     * and USB frame number. Queueing delay is the current CLOCK_MONOTONIC time minus
+     * 'enqueue_time'.
+     * @{
+     */
+    vdp_u64 enqueue_time;
+    vdp_u32 frame_number;
+    /*
+     * @}
+     */
 };
 
 /*
@@ -309,6 +489,17 @@ struct vdp_usb_unlink_urb
     vdp_u32 id;
 };
 
+/*
+ * Same as vdp_usb_unlink_urb, but for many URBs at once, see vdp_usb_device_set_unlink_sets.
+ * 'ids' are sorted in ascending order, they're owned by the device and are valid
+ * until the next vdp_usb_device_get_event call.
+ */
+struct vdp_usb_unlink_urbs
+{
+    const vdp_u32* ids;
+    vdp_u32 count;
+};
+
 struct vdp_usb_event
 {
     vdp_usb_event_type type;
@@ -318,9 +509,17 @@ struct vdp_usb_event
         struct vdp_usb_signal signal;
         struct vdp_usb_urb* urb;
         struct vdp_usb_unlink_urb unlink_urb;
+        struct vdp_usb_unlink_urbs unlink_urbs;
     } data;
 };
 
+/*
+ * Get the size of the pending event as the kernel reports it, 0 if there're no events.
+ * vdp_usb_device_get_event learns event sizes by itself, this is for users that
+ * want to size their own buffers.
+ */
+vdp_usb_result vdp_usb_device_get_event_size(struct vdp_usb_device* device, vdp_u32* size);
+
 /*
  * Instruct the device to wait for incoming event. Returned 'fd' can be
  * used in 'select'/'WaitForXXXObject' to wait for event. Once it's set, you can call
@@ -328,6 +527,19 @@ struct vdp_usb_event
  */
 vdp_usb_result vdp_usb_device_wait_event(struct vdp_usb_device* device, vdp_fd* fd);
 
+/*
+ * Signal eventfd 'fd' each time the device gets new events, -1 detaches it.
+ * Many devices can share one eventfd, so a single thread can wait on it for all of them
+ * and then call vdp_usb_device_get_ready_ports to find out which need attention.
+ */
+vdp_usb_result vdp_usb_device_set_eventfd(struct vdp_usb_device* device, vdp_fd fd);
+
+/*
+ * Get a bitmap of devices on the same bus as 'device' that have pending events,
+ * bit N is set when the device with port number N (see vdp_usb_device_get_portnum) has them.
+ */
+vdp_usb_result vdp_usb_device_get_ready_ports(struct vdp_usb_device* device, vdp_u32* ready);
+
 /*
  * Returns the event.
  * Note that 'event.type' can be 'vdp_usb_event_none' on return, in this case you'll have to wait for event again.
@@ -336,6 +548,17 @@ vdp_usb_result vdp_usb_device_wait_event(struct vdp_usb_device* device, vdp_fd*
  */
 vdp_usb_result vdp_usb_device_get_event(struct vdp_usb_device* device, struct vdp_usb_event* event);
 
+/*
+ * Same as vdp_usb_device_get_event, but gets up to 'max_events' pending events with
+ * a single system call. '*num_events' receives the number of events returned, it's 0 if
+ * there were none, 'none' events are never returned. On error events returned so far are
+ * still valid and must be handled.
+ */
+vdp_usb_result vdp_usb_device_get_events(struct vdp_usb_device* device,
+    struct vdp_usb_event* events,
+    int max_events,
+    int* num_events);
+
 /*
  * Complete an URB event. Though it's not required, URBs should be completed in the same order
  * in which they were received since it's more natural for
@@ -343,12 +566,251 @@ vdp_usb_result vdp_usb_device_get_event(struct vdp_usb_device* device, struct vd
  */
 vdp_usb_result vdp_usb_complete_urb(struct vdp_usb_urb* urb);
 
+struct iovec;
+
+/*
+ * Same as vdp_usb_complete_urb, but the payload is taken from 'iov' instead
+ * of 'urb->transfer_buffer', it's passed to the kernel without copying.
+ * For non-isochronous IN URBs 'actual_length' is set to the total length of 'iov',
+ * for isochronous IN URBs 'iov' must hold exactly 'transfer_length' bytes laid out as
+ * in 'transfer_buffer', OUT and mapped URBs have no payload, so 'iovcnt' must be 0.
+ */
+vdp_usb_result vdp_usb_complete_urb_iov(struct vdp_usb_urb* urb,
+    const struct iovec* iov,
+    int iovcnt);
+
+/*
+ * Stream 'length' bytes of 'data' to a non-isochronous IN URB that isn't mapped without
+ * completing it, so large transfers can be served as data becomes available. Chunks are
+ * appended one after another, 'urb->actual_length' counts bytes streamed so far.
+ * The URB is completed when its buffer is full, when a chunk that isn't a multiple of
+ * endpoint's max packet size is streamed (short packet) or when 'final' is non-zero, in which
+ * case 'urb->status' is used. Once completed the URB must still be freed with vdp_usb_free_urb.
+ */
+vdp_usb_result vdp_usb_complete_urb_data(struct vdp_usb_urb* urb,
+    const void* data,
+    vdp_u32 length,
+    int final);
+
+/*
+ * Complete several URBs, possibly of different devices. URBs of the same device are
+ * completed with a single system call in the order they're given. All URBs are completed
+ * even if some of them fail, the first error is returned.
+ */
+vdp_usb_result vdp_usb_complete_urbs(struct vdp_usb_urb** urbs, int count);
+
 /*
  * Frees the URB returned by vdp_usb_device_get_event.
- * Must be called when you're done with the URB.
+ * Must be called when you're done with the URB. URB memory is recycled by the device
+ * it came from, it's fine to free URBs after the device was closed.
  */
 void vdp_usb_free_urb(struct vdp_usb_urb* urb);
 
+/*
+ * Threading.
+ *
+ * A device and its URBs belong to one thread, the event thread, that's the one
+ * that calls vdp_usb_device_get_event(s). Other threads may work on URBs they
+ * were handed, but they may only finish them with:
+ *
+ * + vdp_usb_complete_urb_async and vdp_usb_free_urb_async. Both are lock-free
+ *   and can be called from any number of threads concurrently. Once queued
+ *   the URB belongs to the device again and mustn't be touched.
+ * + vdp_usb_complete_urb, vdp_usb_complete_urb_iov and vdp_usb_complete_urb_data,
+ *   these are a single system call each, but the URB must then be given back
+ *   with vdp_usb_free_urb_async.
+ *
+ * Everything else, including vdp_usb_free_urb and vdp_usb_complete_urbs, must be
+ * called on the event thread. The event thread drains the queue with
+ * vdp_usb_device_flush when completion fd becomes readable, vdp_usb_loop does that
+ * automatically. URBs queued from different threads are completed in the order
+ * they were queued, URBs queued from the same thread - in program order.
+ * Async functions mustn't be called once the device is closed, URBs still
+ * queued at that point are freed without being completed.
+ * @{
+ */
+
+/*
+ * Queue the URB for completion, it's completed and freed on next
+ * vdp_usb_device_flush. The URB is validated right away, on error it's
+ * not queued and still belongs to the caller.
+ */
+vdp_usb_result vdp_usb_complete_urb_async(struct vdp_usb_urb* urb);
+
+/*
+ * Queue the URB to be freed on next vdp_usb_device_flush.
+ */
+void vdp_usb_free_urb_async(struct vdp_usb_urb* urb);
+
+/*
+ * Readable when there're queued URBs, vdp_usb_device_flush resets it.
+ */
+vdp_fd vdp_usb_device_get_completion_fd(struct vdp_usb_device* device);
+
+/*
+ * Complete and free queued URBs, URBs to complete are sent to the kernel
+ * in batches of up to 64 with one system call per batch.
+ * All queued URBs are handled even if some fail, the first error is returned.
+ */
+vdp_usb_result vdp_usb_device_flush(struct vdp_usb_device* device);
+
+/*
+ * @}
+ */
+
+/*
+ * Event buffer and URB allocation counters of a device. In steady state
+ * 'num_mallocs' and 'num_frees' stay the same, only 'num_allocs' grows.
+ */
+struct vdp_usb_alloc_stats
+{
+    /*
+     * Buffers taken from the device pool.
+     */
+    vdp_u64 num_allocs;
+
+    /*
+     * Times the pool had to call malloc/free.
+     */
+    vdp_u64 num_mallocs;
+    vdp_u64 num_frees;
+};
+
+vdp_usb_result vdp_usb_device_get_alloc_stats(struct vdp_usb_device* device,
+    struct vdp_usb_alloc_stats* stats);
+
+/*
+ * Number of vdp_usb_event_type, vdp_usb_urb_type and vdp_usb_urb_status values.
+ * @{
+ */
+#define VDP_USB_STATS_EVENT_TYPES 5
+#define VDP_USB_STATS_URB_TYPES 4
+#define VDP_USB_STATS_URB_STATUSES 6
+/*
+ * @}
+ */
+
+/*
+ * Bucket N counts URBs completed within [2^N, 2^(N+1)) nanoseconds of being read,
+ * bucket 0 also counts 0 and the last one also counts everything above.
+ */
+#define VDP_USB_STATS_LATENCY_BUCKETS 32
+
+/*
+ * Runtime statistics of a device, all counters are since the device was opened.
+ */
+struct vdp_usb_stats
+{
+    /*
+     * Events read, indexed by vdp_usb_event_type, vdp_usb_event_none counts
+     * reads that found nothing.
+     */
+    vdp_u64 num_events[VDP_USB_STATS_EVENT_TYPES];
+
+    /*
+     * System calls made to read events, with batched reads (vdp_usb_device_get_events)
+     * it's less than the number of events.
+     */
+    vdp_u64 num_reads;
+
+    /*
+     * Times an event didn't fit the read buffer and had to be read again with
+     * a bigger one, see vdp_usb_device_get_event.
+     */
+    vdp_u64 num_regrows;
+
+    /*
+     * URBs sent back to the kernel, indexed by vdp_usb_urb_type and vdp_usb_urb_status.
+     * @{
+     */
+    vdp_u64 num_urbs_by_type[VDP_USB_STATS_URB_TYPES];
+    vdp_u64 num_urbs_by_status[VDP_USB_STATS_URB_STATUSES];
+    /*
+     * @}
+     */
+
+    /*
+     * 'actual_length' of completed URBs, IN is device to host.
+     * @{
+     */
+    vdp_u64 bytes_in;
+    vdp_u64 bytes_out;
+    /*
+     * @}
+     */
+
+    /*
+     * Time from URB being read to it being sent back to the kernel, i.e. how long
+     * the device held it. Asynchronously completed URBs are counted when flushed.
+     */
+    vdp_u64 latency[VDP_USB_STATS_LATENCY_BUCKETS];
+};
+
+/*
+ * Call this from the event thread. Event and read counters are maintained by
+ * the event thread. URB counters are updated atomically since URBs may be
+ * completed synchronously on any thread (see "Threading" above), so they're
+ * exact per field, but the snapshot isn't consistent across fields, e.g.
+ * a URB can be already counted in 'num_urbs_by_type' and not yet in 'latency'.
+ */
+vdp_usb_result vdp_usb_device_get_stats(struct vdp_usb_device* device,
+    struct vdp_usb_stats* stats);
+
+/*
+ * @}
+ */
+
+/*
+ * URB capture in Linux usbmon pcap format (LINKTYPE_USB_LINUX_MMAPPED), the file
+ * opens in Wireshark. Every URB read from the kernel is recorded as a submission and every
+ * URB sent back as a completion. Recording is lock-free and doesn't block: records go to a ring
+ * that's written out by a background thread, if the ring is full they're dropped.
+ * Device number is reported as USB device address and busnum as bus number.
+ * @{
+ */
+
+struct vdp_usb_capture;
+
+/*
+ * Bit of 'endpoint_address' in endpoint mask of vdp_usb_device_set_capture, control endpoints
+ * have both IN and OUT URBs.
+ */
+#define VDP_USB_CAPTURE_EP(endpoint_address) \
+    (1U << (((endpoint_address) & 0x0F) + (((endpoint_address) & 0x80) ? 16 : 0)))
+
+#define VDP_USB_CAPTURE_ALL 0xFFFFFFFFU
+
+/*
+ * Create 'file_path' and start the writer thread. At most 'snaplen' bytes of each URB's payload
+ * are recorded, 0 means 4096. 'ring_size' is the number of records that can be pending, it's
+ * rounded up to a power of two, 0 means 1024. Ring memory is about 'ring_size' * 'snaplen'.
+ */
+vdp_usb_result vdp_usb_capture_create(struct vdp_usb_context* context,
+    const char* file_path,
+    vdp_u32 snaplen,
+    vdp_u32 ring_size,
+    struct vdp_usb_capture** capture);
+
+/*
+ * Writes out pending records and closes the file, detach all devices from
+ * 'capture' first.
+ */
+void vdp_usb_capture_destroy(struct vdp_usb_capture* capture);
+
+/*
+ * Records dropped because the ring was full.
+ */
+vdp_u64 vdp_usb_capture_get_num_dropped(struct vdp_usb_capture* capture);
+
+/*
+ * Record URBs of 'device' whose endpoints are in 'endpoints' mask (see VDP_USB_CAPTURE_EP)
+ * to 'capture', many devices may share the same capture. NULL 'capture' stops recording.
+ * Call this from the event thread.
+ */
+vdp_usb_result vdp_usb_device_set_capture(struct vdp_usb_device* device,
+    struct vdp_usb_capture* capture,
+    vdp_u32 endpoints);
+
 /*
  * @}
  */
@@ -320,6 +320,11 @@ struct vdp_usb_gadget_ops
     void (*set_address)(struct vdp_usb_gadget* /*gadget*/, vdp_u32 /*address*/);
 
     void (*destroy)(struct vdp_usb_gadget* /*gadget*/);
+
+    /*
+     * Optional, called on suspend/resume.
+     */
+    void (*suspend)(struct vdp_usb_gadget* /*gadget*/, int /*suspended*/);
 };
 
 struct vdp_usb_gadget_caps
@@ -345,6 +350,14 @@ struct vdp_usb_gadget
     void* priv;
 
     vdp_u32 address;
+
+    /*
+     * Host has enabled remote wakeup, the device may call
+     * 'vdp_usb_device_remote_wakeup' while it's suspended.
+     */
+    int remote_wakeup;
+
+    int suspended;
 };
 
 struct vdp_usb_gadget* vdp_usb_gadget_create(const struct vdp_usb_gadget_caps* caps,
@@ -354,6 +367,47 @@ void vdp_usb_gadget_event(struct vdp_usb_gadget* gadget, struct vdp_usb_event* e
 
 void vdp_usb_gadget_destroy(struct vdp_usb_gadget* gadget);
 
+/*
+ * @}
+ */
+
+/*
+ * USB Gadget threaded dispatch.
+ *
+ * By default all callbacks run on the thread that calls vdp_usb_gadget_event.
+ * Once vdp_usb_gadget_set_workers is called endpoint callbacks (enable, enqueue,
+ * dequeue, clear_stall) run on a worker pool instead. Every endpoint is pinned
+ * to one worker, so callbacks of an endpoint never run concurrently and requests
+ * are enqueued in URB order, while different endpoints (and different gadgets
+ * sharing the pool) run in parallel. Gadget, config and interface callbacks
+ * still run on the event thread.
+ *
+ * In this mode request->complete and request->destroy must be called from
+ * the endpoint's callbacks, URBs are completed with vdp_usb_complete_urb_async,
+ * so the event thread must call vdp_usb_device_flush (vdp_usb_loop does that).
+ * Endpoint's 'active', 'stalled' and 'requests' belong to its worker, only
+ * the endpoint's callbacks may look at them.
+ * @{
+ */
+
+struct vdp_usb_workers;
+
+/*
+ * 'num_threads' <= 0 means one thread per online CPU.
+ */
+struct vdp_usb_workers* vdp_usb_workers_create(int num_threads);
+
+/*
+ * Gadgets that use 'workers' must be destroyed first.
+ */
+void vdp_usb_workers_destroy(struct vdp_usb_workers* workers);
+
+/*
+ * Must be called before the first vdp_usb_gadget_event.
+ */
+vdp_usb_result vdp_usb_gadget_set_workers(struct vdp_usb_gadget* gadget,
+    struct vdp_usb_workers* workers);
+
 /*
  * @}
  */
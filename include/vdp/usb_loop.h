@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_LOOP_H_
+#define _VDP_USB_LOOP_H_
+
+#include "vdp/usb.h"
+#include "vdp/usb_gadget.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop API.
+ *
+ * Serves many devices, user fds and timers from one thread, only sources that
+ * are ready are looked at, so the cost of an iteration doesn't depend on the
+ * number of devices. A ready device is drained up to a budget of events per
+ * iteration, so busy devices can't starve the others.
+ *
+ * Sources can be added and removed from within callbacks, the loop itself
+ * isn't thread-safe.
+ */
+
+struct vdp_usb_loop;
+
+struct vdp_usb_loop_timer;
+
+#define VDP_USB_LOOP_READ (1 << 0)
+#define VDP_USB_LOOP_WRITE (1 << 1)
+#define VDP_USB_LOOP_ERROR (1 << 2)
+
+/*
+ * Default number of events handled per device per iteration.
+ */
+#define VDP_USB_LOOP_DEFAULT_BUDGET 16
+
+/*
+ * Called for each event of a device added with vdp_usb_loop_add_device, URB
+ * events must be completed and freed by the callback, just like with vdp_usb_device_get_event.
+ */
+typedef void (*vdp_usb_loop_device_cb)(struct vdp_usb_loop* /*loop*/,
+    struct vdp_usb_device* /*device*/,
+    struct vdp_usb_event* /*event*/,
+    void* /*user_data*/);
+
+/*
+ * 'events' is a combination of VDP_USB_LOOP_XXX.
+ */
+typedef void (*vdp_usb_loop_fd_cb)(struct vdp_usb_loop* /*loop*/,
+    vdp_fd /*fd*/,
+    int /*events*/,
+    void* /*user_data*/);
+
+typedef void (*vdp_usb_loop_timer_cb)(struct vdp_usb_loop* /*loop*/,
+    struct vdp_usb_loop_timer* /*timer*/,
+    void* /*user_data*/);
+
+vdp_usb_result vdp_usb_loop_create(struct vdp_usb_context* context,
+    struct vdp_usb_loop** loop);
+
+/*
+ * Sources still registered are removed, devices, gadgets and fds themselves
+ * are not closed.
+ */
+void vdp_usb_loop_destroy(struct vdp_usb_loop* loop);
+
+/*
+ * Max number of events handled per device per iteration.
+ */
+vdp_usb_result vdp_usb_loop_set_budget(struct vdp_usb_loop* loop, int budget);
+
+/*
+ * Events of 'device' are passed to vdp_usb_gadget_event of 'gadget'.
+ */
+vdp_usb_result vdp_usb_loop_add_gadget(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device,
+    struct vdp_usb_gadget* gadget);
+
+/*
+ * Events of 'device' are passed to 'cb'.
+ */
+vdp_usb_result vdp_usb_loop_add_device(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device,
+    vdp_usb_loop_device_cb cb,
+    void* user_data);
+
+/*
+ * Works for both vdp_usb_loop_add_gadget and vdp_usb_loop_add_device.
+ */
+vdp_usb_result vdp_usb_loop_remove_device(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device);
+
+/*
+ * 'events' is a combination of VDP_USB_LOOP_READ and VDP_USB_LOOP_WRITE,
+ * errors are always reported.
+ */
+vdp_usb_result vdp_usb_loop_add_fd(struct vdp_usb_loop* loop,
+    vdp_fd fd,
+    int events,
+    vdp_usb_loop_fd_cb cb,
+    void* user_data);
+
+vdp_usb_result vdp_usb_loop_modify_fd(struct vdp_usb_loop* loop,
+    vdp_fd fd,
+    int events);
+
+vdp_usb_result vdp_usb_loop_remove_fd(struct vdp_usb_loop* loop, vdp_fd fd);
+
+/*
+ * Call 'cb' in 'timeout_ms' and then every 'interval_ms' if it's not 0.
+ */
+vdp_usb_result vdp_usb_loop_add_timer(struct vdp_usb_loop* loop,
+    vdp_u32 timeout_ms,
+    vdp_u32 interval_ms,
+    vdp_usb_loop_timer_cb cb,
+    void* user_data,
+    struct vdp_usb_loop_timer** timer);
+
+void vdp_usb_loop_remove_timer(struct vdp_usb_loop* loop,
+    struct vdp_usb_loop_timer* timer);
+
+/*
+ * Wait for up to 'timeout_ms' (-1 means forever) and dispatch whatever is ready.
+ * Being interrupted by a signal is not an error. If a device fails, the first
+ * error is returned after the others were dispatched.
+ */
+vdp_usb_result vdp_usb_loop_run_once(struct vdp_usb_loop* loop, int timeout_ms);
+
+/*
+ * Dispatch until vdp_usb_loop_stop is called or an error occurs.
+ */
+vdp_usb_result vdp_usb_loop_run(struct vdp_usb_loop* loop);
+
+/*
+ * Makes vdp_usb_loop_run return, can be called from a callback or from a signal
+ * handler.
+ */
+void vdp_usb_loop_stop(struct vdp_usb_loop* loop);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_REPLAY_H_
+#define _VDP_USB_REPLAY_H_
+
+#include "vdp/usb.h"
+#include "vdp/usb_gadget.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Replay API.
+ *
+ * Feeds URBs recorded with vdp_usb_capture (or any usbmon pcap, e.g. captured by Wireshark
+ * on the host) into a gadget, without vdphci or a host. Completions the gadget makes are
+ * checked against the recorded ones and time spent in vdp_usb_gadget_event is measured
+ * per URB. At maximum speed the same trace always produces the same sequence of events,
+ * so it's a reproducible benchmark of gadget code.
+ *
+ * Isochronous URBs aren't replayed. OUT payload that wasn't captured in full
+ * (snaplen) is padded with zeroes, IN payload is only checked as far as it was captured.
+ * URBs that were unlinked in the trace are unlinked at the same point of the replay,
+ * URBs still pending at the end are unlinked too.
+ */
+
+struct vdp_usb_replay;
+
+struct vdp_usb_replay_urb
+{
+    /*
+     * URB id as seen by the gadget, URBs are numbered from 1 in submission order.
+     */
+    vdp_u32 id;
+
+    vdp_usb_urb_type type;
+
+    vdp_u8 endpoint_address;
+
+    vdp_u32 transfer_length;
+
+    /*
+     * Nanoseconds spent in vdp_usb_gadget_event submitting the URB.
+     */
+    vdp_u64 handler_time;
+
+    /*
+     * Recorded completion, if it's in the trace.
+     * @{
+     */
+    int has_expected;
+    vdp_usb_urb_status expected_status;
+    vdp_u32 expected_actual_length;
+    /*
+     * @}
+     */
+
+    /*
+     * Completion made by the gadget.
+     * @{
+     */
+    int completed;
+    vdp_usb_urb_status status;
+    vdp_u32 actual_length;
+    /*
+     * @}
+     */
+
+    /*
+     * Completed the same way as recorded: status, length and IN payload.
+     */
+    int match;
+};
+
+struct vdp_usb_replay_stats
+{
+    vdp_u32 num_urbs;
+
+    /*
+     * Recorded URBs that weren't replayed: isochronous, with setup that
+     * wasn't captured, or with OUT length too big to fit an HEvent.
+     */
+    vdp_u32 num_skipped;
+
+    vdp_u32 num_completed;
+
+    /*
+     * URBs with recorded completion that didn't match it.
+     */
+    vdp_u32 num_mismatched;
+
+    /*
+     * Handler time in nanoseconds.
+     * @{
+     */
+    vdp_u64 total_handler_time;
+    vdp_u64 max_handler_time;
+    /*
+     * @}
+     */
+
+    /*
+     * Wall time of the whole replay in nanoseconds.
+     */
+    vdp_u64 run_time;
+};
+
+/*
+ * Called for every replayed URB once the replay is over, in submission order.
+ */
+typedef void (*vdp_usb_replay_urb_cb)(const struct vdp_usb_replay_urb* /*urb*/,
+    void* /*user_data*/);
+
+/*
+ * Load pcap trace from 'file_path', only URBs of USB device 'devnum' are taken,
+ * -1 means the device of the first URB in the trace. For traces recorded with
+ * vdp_usb_capture 'devnum' is VDP device number.
+ */
+vdp_usb_result vdp_usb_replay_create(struct vdp_usb_context* context,
+    const char* file_path,
+    int devnum,
+    struct vdp_usb_replay** replay);
+
+void vdp_usb_replay_destroy(struct vdp_usb_replay* replay);
+
+/*
+ * Power on and reset 'gadget', then feed it the trace, either as fast as possible or,
+ * if 'realtime' is set, with recorded timing. 'gadget' may use workers. 'cb' and 'stats'
+ * are optional. Can be called many times, e.g. with different gadgets.
+ */
+vdp_usb_result vdp_usb_replay_run(struct vdp_usb_replay* replay,
+    struct vdp_usb_gadget* gadget,
+    int realtime,
+    vdp_usb_replay_urb_cb cb,
+    void* user_data,
+    struct vdp_usb_replay_stats* stats);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif
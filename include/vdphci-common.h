@@ -43,6 +43,30 @@ extern "C" {
  */
 #define VDPHCI_MAX_PORTS 10
 
+/*
+ * Maximum number of virtual hub downstream ports, see 'vdphci_hub_ports' module parameter.
+ */
+#define VDPHCI_MAX_HUB_PORTS 15
+
+/*
+ * Maximum number of devices per HCD, root hub ports come first, then virtual
+ * hub ports.
+ */
+#define VDPHCI_MAX_DEVICES (VDPHCI_MAX_PORTS + VDPHCI_MAX_HUB_PORTS)
+
+/*
+ * Minor of the mux device relative to the first device, device node is VDPHCI_MUX_NAME.
+ * Ports are served by the mux device as described in 'vdphci_mux_header'.
+ */
+#define VDPHCI_MUX_MINOR VDPHCI_MAX_DEVICES
+
+#define VDPHCI_MUX_NAME "vdphci-mux"
+
+/*
+ * Minors used by one HCD.
+ */
+#define VDPHCI_NUM_MINORS (VDPHCI_MUX_MINOR + 1)
+
 /*
  * This is devfs device file prefix.
  */
@@ -64,6 +88,206 @@ struct vdphci_info
 
 #define VDPHCI_IOC_GET_INFO _IOR(VDPHCI_IOC_MAGIC, 0, struct vdphci_info)
 
+/*
+ * Set per-file options. Options are reset each time the device is opened.
+ */
+struct vdphci_options
+{
+    /*
+     * Report large bulk and interrupt URBs as mapped (see VDPHCI_URB_MAPPED) instead of
+     * copying their payload.
+     */
+#define VDPHCI_OPTION_MAP (1 << 0)
+    /*
+     * Report pending URB unlinks as a single 'vdphci_hevent_unlink_urbs' event instead of
+     * a 'vdphci_hevent_unlink_urb' event per URB.
+     */
+#define VDPHCI_OPTION_UNLINK_SET (1 << 1)
+    /*
+     * Append 'vdphci_h_urb_timing' to URB HEvents, see VDPHCI_URB_TIMING.
+     */
+#define VDPHCI_OPTION_TIMING (1 << 2)
+    __u32 flags;
+
+    /*
+     * VDPHCI_OPTION_MAP only, URBs with transfer length less than this are still copied,
+     * for small transfers memcpy is cheaper than mmap/munmap.
+     */
+    __u32 map_threshold;
+};
+
+#define VDPHCI_IOC_SET_OPTIONS _IOW(VDPHCI_IOC_MAGIC, 1, struct vdphci_options)
+
+/*
+ * Get the size of the pending HEvent including the header, i.e. the buffer size
+ * needed to read it in one go, 0 if there're no events.
+ */
+#define VDPHCI_IOC_GET_EVENT_SIZE _IOR(VDPHCI_IOC_MAGIC, 2, __u32)
+
+/*
+ * Make the port behave like a real bus: completed URBs are given back to the host
+ * not sooner than the bandwidth limit, latency and jitter allow. URBs are still
+ * given back in completion order. All zeroes turn shaping off, it's off each
+ * time the device is opened. Values out of the limits below are rejected with EINVAL.
+ */
+#define VDPHCI_SHAPING_MIN_BANDWIDTH 1000
+#define VDPHCI_SHAPING_MAX_LATENCY 10000000
+#define VDPHCI_SHAPING_MAX_JITTER 10000000
+
+struct vdphci_shaping
+{
+    /*
+     * Bus bandwidth in bytes per second, 0 - unlimited, otherwise at least
+     * VDPHCI_SHAPING_MIN_BANDWIDTH.
+     */
+    __u32 bandwidth;
+
+    /*
+     * Bandwidth only, number of bytes that can be transferred at once after
+     * the bus has been idle for a while.
+     */
+    __u32 burst;
+
+    /*
+     * Latency in us, indexed by 'vdphci_urb_type', up to VDPHCI_SHAPING_MAX_LATENCY.
+     */
+    __u32 latency[4];
+
+    /*
+     * Up to this many us of random latency is added to each URB, up to
+     * VDPHCI_SHAPING_MAX_JITTER.
+     */
+    __u32 jitter;
+};
+
+#define VDPHCI_IOC_SET_SHAPING _IOW(VDPHCI_IOC_MAGIC, 3, struct vdphci_shaping)
+
+/*
+ * Attach/detach several ports of the same HCD at once, can be issued on any opened port
+ * of that HCD. All ports involved must be opened. Same as sending 'vdphci_dsignal_attached'/
+ * 'vdphci_dsignal_detached' to each port, but the host polls root hub once for
+ * all of them, so they get enumerated together.
+ */
+struct vdphci_port_attach
+{
+    /*
+     * Port number as reported by VDPHCI_IOC_GET_INFO.
+     */
+    __u8 portnum;
+
+    /*
+     * Non-zero - attach, zero - detach.
+     */
+    __u8 attach;
+
+    /*
+     * 'vdphci_speed', attach only.
+     */
+    __u8 speed;
+
+    __u8 reserved;
+};
+
+struct vdphci_ports_attach
+{
+    __u32 count;
+
+    struct vdphci_port_attach ports[VDPHCI_MAX_DEVICES];
+};
+
+#define VDPHCI_IOC_ATTACH_PORTS _IOW(VDPHCI_IOC_MAGIC, 4, struct vdphci_ports_attach)
+
+/*
+ * Read/write several events with a single call, each vector is one event, just like
+ * one read()/write() call.
+ */
+struct vdphci_io_vec
+{
+    /*
+     * User buffer pointer.
+     */
+    __u64 buff;
+
+    __u32 size;
+
+    /*
+     * Set by the driver, number of bytes read/written or negative error code.
+     */
+    __s32 result;
+};
+
+struct vdphci_io_batch
+{
+    /*
+     * Pointer to 'count' vectors.
+     */
+    __u64 vecs;
+
+    __u32 count;
+
+    __u32 reserved;
+};
+
+/*
+ * Maximum number of vectors per call.
+ */
+#define VDPHCI_IO_BATCH_MAX 64
+
+/*
+ * Read pending HEvents, never blocks. Returns number of vectors filled, 0 if there
+ * were no events. Processing stops after an event that didn't fit its vector (header only
+ * is returned, as with read()) and after an unlink set event, so there's at most
+ * one unlink set event per call.
+ */
+#define VDPHCI_IOC_GET_EVENTS _IOW(VDPHCI_IOC_MAGIC, 5, struct vdphci_io_batch)
+
+/*
+ * Write DEvents. All vectors are processed even if some of them fail, returns
+ * number of vectors.
+ */
+#define VDPHCI_IOC_PUT_EVENTS _IOW(VDPHCI_IOC_MAGIC, 6, struct vdphci_io_batch)
+
+/*
+ * Signal an eventfd each time a new HEvent is available on the port, -1 detaches it.
+ * The same eventfd can be attached to many ports, use VDPHCI_IOC_GET_READY_PORTS to find out
+ * which of them have events. If the port has events already the eventfd is signaled right away.
+ * It's detached each time the device is closed.
+ */
+#define VDPHCI_IOC_SET_EVENTFD _IOW(VDPHCI_IOC_MAGIC, 7, __s32)
+
+/*
+ * Can be issued on any opened port of an HCD, returns a bitmap of that HCD's ports
+ * that have pending HEvents, bit N is for port number N as reported by VDPHCI_IOC_GET_INFO.
+ */
+#define VDPHCI_IOC_GET_READY_PORTS _IOR(VDPHCI_IOC_MAGIC, 8, __u32)
+
+/*
+ * Opening the mux device claims all ports of the HCD that aren't opened already
+ * (as if they were opened by the same file), closing it releases them. HEvents of all
+ * claimed ports are read from the mux and DEvents are written to it, each one is
+ * preceded by this header, i.e. a read returns "mux header + HEvent" and a write takes
+ * "mux header + DEvent". Reads serve ports round robin, an event that doesn't fit is
+ * reported the same way as for a port (mux header + HEvent header) and stays pending.
+ * Ioctls supported by the mux: VDPHCI_IOC_SET_OPTIONS (applies to all claimed
+ * ports, VDPHCI_OPTION_MAP isn't supported), VDPHCI_IOC_ATTACH_PORTS,
+ * VDPHCI_IOC_GET_EVENTS, VDPHCI_IOC_PUT_EVENTS (each vector holds a mux header too) and
+ * VDPHCI_IOC_GET_READY_PORTS (claimed ports only), VDPHCI_IOC_GET_MUX_PORTS.
+ */
+struct vdphci_mux_header
+{
+    /*
+     * Port number as reported by VDPHCI_IOC_GET_INFO.
+     */
+    __u32 portnum;
+
+    __u32 reserved;
+};
+
+/*
+ * Mux only, returns bitmap of ports claimed by the mux, bit N is for port number N.
+ */
+#define VDPHCI_IOC_GET_MUX_PORTS _IOR(VDPHCI_IOC_MAGIC, 9, __u32)
+
 /*
  * HEvent related. HEvents are sent by HCD to device.
  */
@@ -73,6 +297,7 @@ typedef enum
     vdphci_hevent_type_signal = 0,
     vdphci_hevent_type_urb = 1,
     vdphci_hevent_type_unlink_urb = 2,
+    vdphci_hevent_type_unlink_urbs = 3,
 } vdphci_hevent_type;
 
 /*
@@ -96,7 +321,9 @@ typedef enum
     vdphci_hsignal_reset_start = 0,
     vdphci_hsignal_reset_end = 1,
     vdphci_hsignal_power_on = 2,
-    vdphci_hsignal_power_off = 3
+    vdphci_hsignal_power_off = 3,
+    vdphci_hsignal_suspend = 4,
+    vdphci_hsignal_resume = 5
 } vdphci_hsignal;
 
 /*
@@ -132,6 +359,41 @@ struct vdphci_h_iso_packet
     __u32 length;
 };
 
+/*
+ * Describes transfer buffer pages of a mapped URB.
+ */
+struct vdphci_h_map
+{
+    /*
+     * mmap() offset in pages, i.e. user should pass 'pgoff * page_size' as mmap() offset.
+     */
+    __u32 pgoff;
+
+    /*
+     * Number of bytes to map, it's always a multiple of page size and equals to
+     * the transfer length.
+     */
+    __u32 length;
+};
+
+/*
+ * Describes when URB was submitted, see VDPHCI_URB_TIMING.
+ */
+struct vdphci_h_urb_timing
+{
+    /*
+     * CLOCK_MONOTONIC time in ns.
+     */
+    __u64 enqueue_time;
+
+    /*
+     * USB frame number.
+     */
+    __u32 frame_number;
+
+    __u32 reserved;
+};
+
 /*
  * User receives this event when the system submits an URB for the device.
  * Of course, physical device never receives URBs, it receives packets, but we're reporting
@@ -164,6 +426,17 @@ struct vdphci_hevent_urb
      * extra zero length packet.
      */
 #define VDPHCI_URB_ZERO_PACKET (1 << 0)
+    /*
+     * URB payload isn't copied, 'data.map' describes the transfer buffer pages instead.
+     * User should mmap() them with MAP_SHARED, fill/consume the data in place and send
+     * URB DEvent without payload. The mapping is valid until URB DEvent is sent.
+     */
+#define VDPHCI_URB_MAPPED (1 << 1)
+    /*
+     * The last sizeof('vdphci_h_urb_timing') bytes of the event is 'vdphci_h_urb_timing',
+     * it's not necessarily aligned. Set when VDPHCI_OPTION_TIMING is on.
+     */
+#define VDPHCI_URB_TIMING (1 << 2)
     __u32 flags;
 
     /*
@@ -206,6 +479,11 @@ struct vdphci_hevent_urb
          * of OUT transfer this array is immediately followed by transfer data.
          */
         struct vdphci_h_iso_packet packets[1];
+
+        /*
+         * VDPHCI_URB_MAPPED only, where to mmap() transfer buffer from.
+         */
+        struct vdphci_h_map map;
     } data;
 };
 
@@ -222,6 +500,25 @@ struct vdphci_hevent_unlink_urb
     __u32 seq_num;
 };
 
+/*
+ * VDPHCI_OPTION_UNLINK_SET only, same as 'vdphci_hevent_unlink_urb', but for
+ * all URBs unlinked so far (e.g. on interface reset or driver unbind), in unlink order.
+ * If user's buffer isn't large enough to hold all of them, but can hold at least one
+ * then 'count' is as many as fit and the rest is reported in the next event.
+ */
+struct vdphci_hevent_unlink_urbs
+{
+    /*
+     * Size of 'seq_nums' array.
+     */
+    __u32 count;
+
+    /*
+     * Which URBs to terminate.
+     */
+    __u32 seq_nums[1];
+};
+
 /*
  * DEvent related. DEvents are sent by device to HCD.
  */
@@ -229,7 +526,8 @@ struct vdphci_hevent_unlink_urb
 typedef enum
 {
     vdphci_devent_type_signal = 0,
-    vdphci_devent_type_urb = 1
+    vdphci_devent_type_urb = 1,
+    vdphci_devent_type_urb_data = 2
 } vdphci_devent_type;
 
 /*
@@ -246,7 +544,12 @@ struct vdphci_devent_header
 typedef enum
 {
     vdphci_dsignal_attached = 0,
-    vdphci_dsignal_detached = 1
+    vdphci_dsignal_detached = 1,
+    /*
+     * Device wants to leave suspend state, it's ignored unless the device
+     * was signaled with 'vdphci_hsignal_suspend'. 'speed' is not used.
+     */
+    vdphci_dsignal_remote_wakeup = 2
 } vdphci_dsignal;
 
 typedef enum
@@ -320,7 +623,7 @@ struct vdphci_devent_urb
     union
     {
         /*
-         * Use only in case of non-isochronous IN transfers.
+         * Use only in case of non-isochronous IN transfers that aren't mapped.
          */
         char buff[1];
 
@@ -332,6 +635,48 @@ struct vdphci_devent_urb
     } data;
 };
 
+/*
+ * Complete the URB with 'status' after appending the data.
+ */
+#define VDPHCI_URB_DATA_FINAL (1 << 0)
+
+/*
+ * Streams a chunk of data to a non-isochronous IN URB that isn't mapped, without completing
+ * it. Chunks are appended one after another, the URB is completed when:
+ * + its buffer is full, or
+ * + a chunk that isn't a multiple of endpoint's max packet size is sent (short packet,
+ *   zero-length chunk included), so chunks in the middle of a transfer must be multiples
+ *   of max packet size, or
+ * + VDPHCI_URB_DATA_FINAL is set.
+ * Chunks for URBs that were already completed or unlinked are silently dropped.
+ * 'vdphci_devent_urb' may still be sent for a partially streamed URB, it replaces everything
+ * streamed so far.
+ */
+struct vdphci_devent_urb_data
+{
+    /*
+     * Every URB is identified by its sequence number.
+     */
+    __u32 seq_num;
+
+    /*
+     * VDPHCI_URB_DATA_XXX.
+     */
+    __u32 flags;
+
+    /*
+     * VDPHCI_URB_DATA_FINAL only, the status to complete the URB with.
+     */
+    vdphci_urb_status status;
+
+    /*
+     * Number of bytes in 'buff'.
+     */
+    __u32 length;
+
+    char buff[1];
+};
+
 #ifdef __cplusplus
 };
 #endif /* __cplusplus */
@@ -28,6 +28,7 @@
 #include "print.h"
 #include "vdphci_platform_driver.h"
 #include "vdphci_controllers.h"
+#include "vdphci_class.h"
 
 MODULE_AUTHOR("Stanislav Vorobiov");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -36,11 +37,42 @@ int vdphci_major = 0;
 
 module_param(vdphci_major, int, S_IRUGO);
 
+/*
+ * Number of virtual hub downstream ports, the hub takes the last root hub port.
+ */
+int vdphci_hub_ports = 0;
+
+module_param(vdphci_hub_ports, int, S_IRUGO);
+
+/*
+ * Bitmask of device numbers that are in-kernel loopback devices instead of
+ * being driven by the user.
+ */
+unsigned int vdphci_loopback_ports = 0;
+
+module_param(vdphci_loopback_ports, uint, S_IRUGO);
+
+/*
+ * Run port queue self-test and benchmarks on load, the module fails to load
+ * if the self-test fails.
+ */
+int vdphci_selftest = 0;
+
+module_param(vdphci_selftest, int, S_IRUGO);
+
 int vdphci_init(void)
 {
-    int ret = vdphci_platform_driver_register();
+    int ret = vdphci_class_register();
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = vdphci_platform_driver_register();
 
     if (ret != 0) {
+        vdphci_class_unregister();
+
         return ret;
     }
 
@@ -49,9 +81,25 @@ int vdphci_init(void)
     if (ret != 0) {
         vdphci_platform_driver_unregister();
 
+        vdphci_class_unregister();
+
         return ret;
     }
 
+    if (vdphci_selftest) {
+        ret = vdphci_controllers_selftest();
+
+        if (ret != 0) {
+            vdphci_controllers_remove();
+
+            vdphci_platform_driver_unregister();
+
+            vdphci_class_unregister();
+
+            return ret;
+        }
+    }
+
     print_info("module loaded\n");
 
     return 0;
@@ -63,6 +111,8 @@ void vdphci_cleanup(void)
 
     vdphci_platform_driver_unregister();
 
+    vdphci_class_unregister();
+
     print_info("module unloaded\n");
 }
 
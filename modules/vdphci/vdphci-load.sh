@@ -2,16 +2,29 @@
 MODULE_NAME="vdphci"
 DEVICE_NAME="vdphcidev"
 DEVICE_LOWER=0
-DEVICE_UPPER=10
+DEVICE_UPPER=24
+MUX_NAME="vdphci-mux"
+MUX_MINOR=25
 
 sudo insmod ./$MODULE_NAME.ko $* || exit 1
 
 # Retrieve major number
 DEVICE_MAJOR=`awk "\\$2==\"$MODULE_NAME\" {print \\$1}" /proc/devices`
 
-sudo rm -f /dev/${DEVICE_NAME}*
+# Nodes are normally created by udev from vdphci sysfs class, only
+# fall back to making them by hand when there's no udev around.
+if command -v udevadm > /dev/null 2>&1; then
+    sudo udevadm settle
+fi
 
 for (( I=$DEVICE_LOWER; I<=$DEVICE_UPPER; I++ )) do
-    sudo mknod /dev/${DEVICE_NAME}${I} c $DEVICE_MAJOR $I
-    sudo chmod 0666 /dev/${DEVICE_NAME}${I}
+    if [ ! -c /dev/${DEVICE_NAME}${I} ]; then
+        sudo mknod /dev/${DEVICE_NAME}${I} c $DEVICE_MAJOR $I
+        sudo chmod 0666 /dev/${DEVICE_NAME}${I}
+    fi
 done
+
+if [ ! -c /dev/${MUX_NAME} ]; then
+    sudo mknod /dev/${MUX_NAME} c $DEVICE_MAJOR $MUX_MINOR
+    sudo chmod 0666 /dev/${MUX_NAME}
+fi
@@ -1,7 +1,9 @@
 #!/bin/bash
 MODULE_NAME="vdphci"
 DEVICE_NAME="vdphcidev"
+MUX_NAME="vdphci-mux"
 
 sudo rmmod ./$MODULE_NAME.ko || exit 1
 
 sudo rm -f /dev/${DEVICE_NAME}*
+sudo rm -f /dev/${MUX_NAME}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdphci_class.h"
+#include "vdphci-common.h"
+#include "print.h"
+#include <linux/err.h>
+
+struct class* vdphci_class = NULL;
+
+/*
+ * Device nodes are world accessible, same as vdphci-load.sh used to make them.
+ */
+static char* vdphci_class_devnode(struct device* dev, umode_t* mode)
+{
+    if (mode) {
+        *mode = 0666;
+    }
+
+    return NULL;
+}
+
+int vdphci_class_register(void)
+{
+    vdphci_class = class_create(THIS_MODULE, VDPHCI_NAME);
+
+    if (IS_ERR(vdphci_class)) {
+        int ret = PTR_ERR(vdphci_class);
+
+        print_error("unable to create device class: %d\n", ret);
+
+        vdphci_class = NULL;
+
+        return ret;
+    }
+
+    vdphci_class->devnode = vdphci_class_devnode;
+
+    return 0;
+}
+
+void vdphci_class_unregister(void)
+{
+    class_destroy(vdphci_class);
+    vdphci_class = NULL;
+}
@@ -26,13 +26,20 @@
 #include <linux/platform_device.h>
 #include "vdphci_controllers.h"
 #include "vdphci_platform_driver.h"
+#include "vdphci_selftest.h"
 #include "debug.h"
+#include "print.h"
+#include "vdphci-common.h"
 
 extern int vdphci_major;
+extern int vdphci_hub_ports;
+extern unsigned int vdphci_loopback_ports;
 
 static struct vdphci_platform_data vdphci_controller_pdata =
 {
     .num_ports = 5,
+    .num_hub_ports = 0,
+    .loopback_mask = 0,
     .major = 0
 };
 
@@ -56,7 +63,14 @@ int vdphci_controllers_add(void)
 {
     int ret;
 
+    if ((vdphci_hub_ports < 0) || (vdphci_hub_ports > VDPHCI_MAX_HUB_PORTS)) {
+        print_error("vdphci_hub_ports must be <= %d\n", VDPHCI_MAX_HUB_PORTS);
+        return -EINVAL;
+    }
+
     vdphci_controller_pdata.major = vdphci_major;
+    vdphci_controller_pdata.num_hub_ports = vdphci_hub_ports;
+    vdphci_controller_pdata.loopback_mask = vdphci_loopback_ports;
 
     ret = platform_device_register(&vdphci_controller);
 
@@ -71,3 +85,14 @@ void vdphci_controllers_remove(void)
 {
     platform_device_unregister(&vdphci_controller);
 }
+
+int vdphci_controllers_selftest(void)
+{
+    struct usb_hcd* hcd = platform_get_drvdata(&vdphci_controller);
+
+    if (!hcd) {
+        return -ENODEV;
+    }
+
+    return vdphci_selftest_run(hcd);
+}
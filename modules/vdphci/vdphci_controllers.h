@@ -30,4 +30,9 @@ int vdphci_controllers_add(void);
 
 void vdphci_controllers_remove(void);
 
+/*
+ * Run self-test against the first controller.
+ */
+int vdphci_controllers_selftest(void);
+
 #endif
@@ -24,12 +24,15 @@
  */
 
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "debug.h"
 #include "print.h"
 #include "vdphci_device.h"
 #include "vdphci_port.h"
 #include "vdphci_hcd.h"
 #include "vdphci_direct_io.h"
+#include "vdphci_class.h"
 
 static int vdphci_device_translate_urb_status(vdphci_urb_status status, int* res)
 {
@@ -57,6 +60,55 @@ static int vdphci_device_translate_urb_status(vdphci_urb_status status, int* res
     return 1;
 }
 
+static int vdphci_device_translate_speed(vdphci_speed speed, enum usb_device_speed* res)
+{
+    switch (speed) {
+    case vdphci_speed_low:
+        *res = USB_SPEED_LOW;
+        break;
+    case vdphci_speed_full:
+        *res = USB_SPEED_FULL;
+        break;
+    case vdphci_speed_high:
+        *res = USB_SPEED_HIGH;
+        break;
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * 'cdev_mutex' and HCD lock must be held, returns non-zero if port status has changed
+ * and ports must be invalidated.
+ */
+static int vdphci_device_attach_locked(struct vdphci_device* device, int attach,
+    enum usb_device_speed speed,
+    struct list_head* giveback_list)
+{
+    attach = !!attach;
+
+    if (attach == vdphci_port_is_device_attached(device->port)) {
+        return 0;
+    }
+
+    vdphci_port_set_device_attached(device->port, attach, speed);
+    vdphci_port_update(device->port, giveback_list);
+
+    if (attach) {
+        dprintk("%s, device %d: attached\n",
+            vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
+            (int)device->port->number);
+    } else {
+        dprintk("%s, device %d: detached\n",
+            vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
+            (int)device->port->number);
+    }
+
+    return 1;
+}
+
 /*
  * 'cdev_mutex' must be held
  */
@@ -71,30 +123,14 @@ static int vdphci_device_attach_nolock(struct vdphci_device* device, int attach,
 
     dprintk("enter\n");
 
-    attach = !!attach;
-
     vdphci_hcd_lock(device->parent_hcd, flags);
-    if (attach != vdphci_port_is_device_attached(device->port)) {
-        vdphci_port_set_device_attached(device->port, attach, speed);
-        vdphci_port_update(device->port, &giveback_list);
-        need_invalidate = 1;
-    }
+    need_invalidate = vdphci_device_attach_locked(device, attach, speed, &giveback_list);
     vdphci_hcd_unlock(device->parent_hcd, flags);
 
     vdphci_port_giveback_urbs(&giveback_list);
 
     if (need_invalidate) {
         vdphci_hcd_invalidate_ports(device->parent_hcd);
-
-        if (attach) {
-            dprintk("%s, device %d: attached\n",
-                vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
-                (int)device->port->number);
-        } else {
-            dprintk("%s, device %d: detached\n",
-                vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
-                (int)device->port->number);
-        }
     }
 
     dprintk("exit\n");
@@ -102,9 +138,143 @@ static int vdphci_device_attach_nolock(struct vdphci_device* device, int attach,
     return 0;
 }
 
-static int vdphci_device_open(struct inode* inode, struct file* file)
+/*
+ * 'cdev_mutex' must be held
+ */
+static void vdphci_device_remote_wakeup_nolock(struct vdphci_device* device)
 {
-    struct vdphci_device* device = cdev_to_vdphci_device(inode->i_cdev);
+    unsigned long flags;
+    int wakeup, bus_suspended;
+
+    vdphci_hcd_lock(device->parent_hcd, flags);
+    wakeup = vdphci_port_remote_wakeup(device->port);
+    bus_suspended = vdphci_port_is_hcd_suspended(device->port);
+    vdphci_hcd_unlock(device->parent_hcd, flags);
+
+    if (!wakeup) {
+        /*
+         * Not suspended, nothing to do.
+         */
+
+        return;
+    }
+
+    dprintk("%s, device %d: remote wakeup\n",
+        vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
+        (int)device->port->number);
+
+    if (bus_suspended) {
+        usb_hcd_resume_root_hub(vdphci_hcd_to_usb_hcd(device->parent_hcd));
+    }
+
+    vdphci_hcd_invalidate_ports(device->parent_hcd);
+}
+
+/*
+ * Attach/detach several ports of the same HCD at once, the host sees all
+ * port status changes in one root hub poll. 'cdev_mutex' must NOT be held, mutexes of
+ * all ports involved are taken in port order.
+ */
+int vdphci_device_attach_ports(struct vdphci_hcd* hcd,
+    const struct vdphci_ports_attach* ports)
+{
+    struct vdphci_device* devices[VDPHCI_MAX_DEVICES];
+    enum usb_device_speed speeds[VDPHCI_MAX_DEVICES];
+    int attach[VDPHCI_MAX_DEVICES];
+    int locked[VDPHCI_MAX_DEVICES];
+    struct list_head giveback_list;
+    unsigned long flags;
+    int need_invalidate = 0;
+    int num_devices = vdphci_hcd_num_devices(hcd);
+    int retval = 0;
+    int i, j;
+
+    if (ports->count > VDPHCI_MAX_DEVICES) {
+        return -EINVAL;
+    }
+
+    memset(devices, 0, sizeof(devices));
+    memset(locked, 0, sizeof(locked));
+
+    for (j = 0; j < ports->count; ++j) {
+        const struct vdphci_port_attach* port = &ports->ports[j];
+
+        for (i = 0; i < num_devices; ++i) {
+            if (hcd->devices[i].port->number == port->portnum) {
+                break;
+            }
+        }
+
+        if ((i >= num_devices) || devices[i]) {
+            return -EINVAL;
+        }
+
+        devices[i] = &hcd->devices[i];
+        attach[i] = port->attach;
+        speeds[i] = USB_SPEED_UNKNOWN;
+
+        if (attach[i] && !vdphci_device_translate_speed(port->speed, &speeds[i])) {
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < num_devices; ++i) {
+        if (!devices[i]) {
+            continue;
+        }
+
+        if (mutex_lock_interruptible(&devices[i]->cdev_mutex) != 0) {
+            retval = -ERESTARTSYS;
+
+            goto out;
+        }
+
+        locked[i] = 1;
+
+        if (!devices[i]->opened) {
+            /*
+             * Nobody's going to serve the device.
+             */
+            retval = -ENODEV;
+
+            goto out;
+        }
+    }
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    vdphci_hcd_lock(hcd, flags);
+
+    for (i = 0; i < num_devices; ++i) {
+        if (devices[i]) {
+            need_invalidate |= vdphci_device_attach_locked(devices[i],
+                attach[i],
+                speeds[i],
+                &giveback_list);
+        }
+    }
+
+    vdphci_hcd_unlock(hcd, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+
+    if (need_invalidate) {
+        vdphci_hcd_invalidate_ports(hcd);
+    }
+
+out:
+    for (i = num_devices - 1; i >= 0; --i) {
+        if (locked[i]) {
+            mutex_unlock(&devices[i]->cdev_mutex);
+        }
+    }
+
+    return retval;
+}
+
+int vdphci_device_claim(struct vdphci_device* device, struct file* file)
+{
+    unsigned long flags;
 
     BUG_ON(in_atomic());
 
@@ -112,22 +282,24 @@ static int vdphci_device_open(struct inode* inode, struct file* file)
         return -ERESTARTSYS;
     }
 
-    if (file->f_mode & FMODE_EXEC) {
-        mutex_unlock(&device->cdev_mutex);
-
-        return -EPERM;
-    }
+    if (device->opened || vdphci_port_get_hub(device->port) || vdphci_port_get_loopback(device->port)) {
+        /*
+         * Port with the virtual hub or the loopback device on it can't be driven by the user.
+         */
 
-    if (device->opened) {
         mutex_unlock(&device->cdev_mutex);
 
         return -EBUSY;
     }
 
-    file->private_data = device;
-
     device->opened = 1;
 
+    memset(&device->options, 0, sizeof(device->options));
+
+    vdphci_hcd_lock(device->parent_hcd, flags);
+    vdphci_port_set_mapping(device->port, file->f_mapping);
+    vdphci_hcd_unlock(device->parent_hcd, flags);
+
     mutex_unlock(&device->cdev_mutex);
 
     dprintk("%s, device %d: file %p opened\n",
@@ -135,19 +307,35 @@ static int vdphci_device_open(struct inode* inode, struct file* file)
         (int)device->port->number,
         file);
 
-    return nonseekable_open(inode, file);
+    return 0;
 }
 
-static int vdphci_device_release(struct inode* inode, struct file* file)
+void vdphci_device_unclaim(struct vdphci_device* device, struct file* file)
 {
-    struct vdphci_device* device = cdev_to_vdphci_device(inode->i_cdev);
+    unsigned long flags;
+    struct vdphci_shaping no_shaping;
+    struct eventfd_ctx* eventfd;
 
     BUG_ON(in_atomic());
 
+    memset(&no_shaping, 0, sizeof(no_shaping));
+
     mutex_lock(&device->cdev_mutex);
 
     vdphci_device_attach_nolock(device, 0, USB_SPEED_UNKNOWN);
 
+    vdphci_port_flush_unmap(device->port);
+
+    vdphci_hcd_lock(device->parent_hcd, flags);
+    vdphci_port_set_mapping(device->port, NULL);
+    vdphci_shaper_set_params(&device->port->shaper, &no_shaping);
+    eventfd = vdphci_port_set_eventfd(device->port, NULL);
+    vdphci_hcd_unlock(device->parent_hcd, flags);
+
+    if (eventfd) {
+        eventfd_ctx_put(eventfd);
+    }
+
     dprintk("%s, device %d: file %p closed\n",
         vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
         (int)device->port->number,
@@ -156,6 +344,33 @@ static int vdphci_device_release(struct inode* inode, struct file* file)
     device->opened = 0;
 
     mutex_unlock(&device->cdev_mutex);
+}
+
+static int vdphci_device_open(struct inode* inode, struct file* file)
+{
+    struct vdphci_device* device = cdev_to_vdphci_device(inode->i_cdev);
+    int ret;
+
+    if (file->f_mode & FMODE_EXEC) {
+        return -EPERM;
+    }
+
+    ret = vdphci_device_claim(device, file);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    file->private_data = device;
+
+    return nonseekable_open(inode, file);
+}
+
+static int vdphci_device_release(struct inode* inode, struct file* file)
+{
+    struct vdphci_device* device = cdev_to_vdphci_device(inode->i_cdev);
+
+    vdphci_device_unclaim(device, file);
 
     return 0;
 }
@@ -165,8 +380,7 @@ static int vdphci_device_release(struct inode* inode, struct file* file)
  * @{
  */
 
-static int vdphci_device_process_signal_devent(struct vdphci_device* device, const char __user* buf,
-    struct page** pages,
+static int vdphci_device_process_signal_devent(struct vdphci_device* device, const struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     struct vdphci_devent_signal signal_devent;
@@ -177,7 +391,7 @@ static int vdphci_device_process_signal_devent(struct vdphci_device* device, con
     }
 
     retval = vdphci_direct_read(&signal_devent, sizeof(signal_devent),
-        sizeof(struct vdphci_devent_header), buf, pages);
+        sizeof(struct vdphci_devent_header), dbuf);
 
     if (retval != 0) {
         return retval;
@@ -187,17 +401,7 @@ static int vdphci_device_process_signal_devent(struct vdphci_device* device, con
     case vdphci_dsignal_attached: {
         enum usb_device_speed speed;
 
-        switch (signal_devent.speed) {
-        case vdphci_speed_low:
-            speed = USB_SPEED_LOW;
-            break;
-        case vdphci_speed_full:
-            speed = USB_SPEED_FULL;
-            break;
-        case vdphci_speed_high:
-            speed = USB_SPEED_HIGH;
-            break;
-        default:
+        if (!vdphci_device_translate_speed(signal_devent.speed, &speed)) {
             return -EINVAL;
         }
 
@@ -208,6 +412,10 @@ static int vdphci_device_process_signal_devent(struct vdphci_device* device, con
         retval = vdphci_device_attach_nolock(device, 0, USB_SPEED_UNKNOWN);
         break;
     }
+    case vdphci_dsignal_remote_wakeup: {
+        vdphci_device_remote_wakeup_nolock(device);
+        break;
+    }
     default:
         retval = -EINVAL;
         break;
@@ -225,8 +433,7 @@ static int vdphci_device_process_signal_devent(struct vdphci_device* device, con
 
 static int vdphci_device_write_in_other_urb(const struct vdphci_devent_urb* urb_devent,
     struct urb* urb,
-    const char __user* buf,
-    struct page** pages,
+    const struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
@@ -241,7 +448,7 @@ static int vdphci_device_write_in_other_urb(const struct vdphci_devent_urb* urb_
 
     retval = vdphci_direct_read(urb->transfer_buffer, count,
         sizeof(struct vdphci_devent_header) + offsetof(struct vdphci_devent_urb, data.buff),
-        buf, pages);
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -258,8 +465,7 @@ static int vdphci_device_write_in_other_urb(const struct vdphci_devent_urb* urb_
 
 static int vdphci_device_write_in_iso_urb(const struct vdphci_devent_urb* urb_devent,
     struct urb* urb,
-    const char __user* buf,
-    struct page** pages,
+    const struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
@@ -283,7 +489,7 @@ static int vdphci_device_write_in_iso_urb(const struct vdphci_devent_urb* urb_de
             sizeof(struct vdphci_devent_header) +
             offsetof(struct vdphci_devent_urb, data.buff) +
             sizeof(packet) * i,
-            buf, pages);
+            dbuf);
 
         if (retval != 0) {
             return retval;
@@ -308,7 +514,7 @@ static int vdphci_device_write_in_iso_urb(const struct vdphci_devent_urb* urb_de
         sizeof(struct vdphci_devent_header) +
         offsetof(struct vdphci_devent_urb, data.buff) +
         (urb->number_of_packets * sizeof(struct vdphci_d_iso_packet)),
-        buf, pages);
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -322,8 +528,7 @@ static int vdphci_device_write_in_iso_urb(const struct vdphci_devent_urb* urb_de
 
 static int vdphci_device_write_out_other_urb(const struct vdphci_devent_urb* urb_devent,
     struct urb* urb,
-    const char __user* buf,
-    struct page** pages,
+    const struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     if (urb_devent->actual_length > urb->transfer_buffer_length) {
@@ -345,8 +550,7 @@ static int vdphci_device_write_out_other_urb(const struct vdphci_devent_urb* urb
 
 static int vdphci_device_write_out_iso_urb(const struct vdphci_devent_urb* urb_devent,
     struct urb* urb,
-    const char __user* buf,
-    struct page** pages,
+    const struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
@@ -370,7 +574,7 @@ static int vdphci_device_write_out_iso_urb(const struct vdphci_devent_urb* urb_d
             sizeof(struct vdphci_devent_header) +
             offsetof(struct vdphci_devent_urb, data.buff) +
             sizeof(packet) * i,
-            buf, pages);
+            dbuf);
 
         if (retval != 0) {
             return retval;
@@ -397,12 +601,35 @@ static int vdphci_device_write_out_iso_urb(const struct vdphci_devent_urb* urb_d
     return 0;
 }
 
+/*
+ * Mapped URB's data is already in place, only status and length are sent.
+ */
+static int vdphci_device_write_mapped_urb(const struct vdphci_devent_urb* urb_devent,
+    struct urb* urb,
+    size_t count)
+{
+    if (count != 0) {
+        return -EINVAL;
+    }
+
+    if (urb_devent->actual_length > urb->transfer_buffer_length) {
+        return -EINVAL;
+    }
+
+    if (!vdphci_device_translate_urb_status(urb_devent->status, &urb->status)) {
+        return -EINVAL;
+    }
+
+    urb->actual_length = urb_devent->actual_length;
+
+    return 0;
+}
+
 /*
  * @}
  */
 
-static int vdphci_device_process_urb_devent(struct vdphci_device* device, const char __user* buf,
-    struct page** pages,
+static int vdphci_device_process_urb_devent(struct vdphci_device* device, const struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     struct vdphci_devent_urb urb_devent;
@@ -419,7 +646,7 @@ static int vdphci_device_process_urb_devent(struct vdphci_device* device, const
     }
 
     retval = vdphci_direct_read(&urb_devent, offsetof(struct vdphci_devent_urb, data.buff),
-        sizeof(struct vdphci_devent_header), buf, pages);
+        sizeof(struct vdphci_devent_header), dbuf);
 
     if (retval != 0) {
         return retval;
@@ -444,22 +671,24 @@ static int vdphci_device_process_urb_devent(struct vdphci_device* device, const
         goto out;
     }
 
-    if (usb_pipein(urb_khevent->urb->pipe)) {
+    if (urb_khevent->map_pages) {
+        retval = vdphci_device_write_mapped_urb(&urb_devent,
+            urb_khevent->urb,
+            event_data_size);
+    } else if (usb_pipein(urb_khevent->urb->pipe)) {
         switch (usb_pipetype(urb_khevent->urb->pipe)) {
         case PIPE_CONTROL:
         case PIPE_BULK:
         case PIPE_INTERRUPT:
             retval = vdphci_device_write_in_other_urb(&urb_devent,
                 urb_khevent->urb,
-                buf,
-                pages,
+                dbuf,
                 event_data_size);
             break;
         case PIPE_ISOCHRONOUS:
             retval = vdphci_device_write_in_iso_urb(&urb_devent,
                 urb_khevent->urb,
-                buf,
-                pages,
+                dbuf,
                 event_data_size);
             break;
         default:
@@ -474,15 +703,13 @@ static int vdphci_device_process_urb_devent(struct vdphci_device* device, const
         case PIPE_INTERRUPT:
             retval = vdphci_device_write_out_other_urb(&urb_devent,
                 urb_khevent->urb,
-                buf,
-                pages,
+                dbuf,
                 event_data_size);
             break;
         case PIPE_ISOCHRONOUS:
             retval = vdphci_device_write_out_iso_urb(&urb_devent,
                 urb_khevent->urb,
-                buf,
-                pages,
+                dbuf,
                 event_data_size);
             break;
         default:
@@ -494,6 +721,113 @@ static int vdphci_device_process_urb_devent(struct vdphci_device* device, const
 
     if (retval >= 0) {
         vdphci_port_khevent_urb_remove(device->port, urb_khevent, &giveback_list);
+
+        vdphci_shaper_add(&device->port->shaper, &giveback_list);
+    }
+
+out:
+    vdphci_hcd_unlock(device->parent_hcd, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+
+    return retval;
+}
+
+static int vdphci_device_process_urb_data_devent(struct vdphci_device* device, const struct vdphci_direct_buf* dbuf,
+    size_t count)
+{
+    struct vdphci_devent_urb_data data_devent;
+    size_t data_offset = sizeof(struct vdphci_devent_header) + offsetof(struct vdphci_devent_urb_data, buff);
+    int retval = 0;
+    unsigned long flags;
+    struct vdphci_khevent_urb* urb_khevent;
+    struct urb* urb;
+    struct list_head giveback_list;
+    int status = 0;
+    unsigned int maxp;
+    int complete = 0;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    if (count < data_offset) {
+        return -EINVAL;
+    }
+
+    retval = vdphci_direct_read(&data_devent, offsetof(struct vdphci_devent_urb_data, buff),
+        sizeof(struct vdphci_devent_header), dbuf);
+
+    if (retval != 0) {
+        return retval;
+    }
+
+    if (data_devent.length != (count - data_offset)) {
+        return -EINVAL;
+    }
+
+    if ((data_devent.flags & VDPHCI_URB_DATA_FINAL) &&
+        !vdphci_device_translate_urb_status(data_devent.status, &status)) {
+        return -EINVAL;
+    }
+
+    vdphci_hcd_lock(device->parent_hcd, flags);
+
+    urb_khevent = vdphci_port_khevent_urb_find(device->port, data_devent.seq_num);
+
+    if (!urb_khevent) {
+        retval = 0;
+
+        goto out;
+    }
+
+    urb = urb_khevent->urb;
+
+    if (urb_khevent->map_pages ||
+        !usb_pipein(urb->pipe) ||
+        (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS)) {
+        retval = -EINVAL;
+
+        goto out;
+    }
+
+    if (data_devent.length > (urb->transfer_buffer_length - urb->actual_length)) {
+        retval = -EINVAL;
+
+        goto out;
+    }
+
+    retval = vdphci_direct_read(urb->transfer_buffer + urb->actual_length, data_devent.length,
+        data_offset, dbuf);
+
+    if (retval != 0) {
+        goto out;
+    }
+
+    urb->actual_length += data_devent.length;
+
+    maxp = usb_maxpacket(urb->dev, urb->pipe, usb_pipeout(urb->pipe));
+
+    if (data_devent.flags & VDPHCI_URB_DATA_FINAL) {
+        complete = 1;
+    } else if (urb->actual_length == urb->transfer_buffer_length) {
+        complete = 1;
+    } else if ((data_devent.length == 0) || (maxp == 0) || ((data_devent.length % maxp) != 0)) {
+        /*
+         * Short packet, the transfer ends early.
+         */
+
+        if (urb->transfer_flags & URB_SHORT_NOT_OK) {
+            status = -EREMOTEIO;
+        }
+
+        complete = 1;
+    }
+
+    if (complete) {
+        urb->status = status;
+
+        vdphci_port_khevent_urb_remove(device->port, urb_khevent, &giveback_list);
+
+        vdphci_shaper_add(&device->port->shaper, &giveback_list);
     }
 
 out:
@@ -515,8 +849,7 @@ out:
 
 static int vdphci_device_process_signal_hevent(
     const struct vdphci_khevent_signal* event,
-    char __user* buf,
-    struct page** pages,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
@@ -528,7 +861,7 @@ static int vdphci_device_process_signal_hevent(
     uheader.type = vdphci_hevent_type_signal;
     uheader.length = sizeof(uevent);
 
-    retval = vdphci_direct_write(0, sizeof(uheader), &uheader, buf, pages);
+    retval = vdphci_direct_write(0, sizeof(uheader), &uheader, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -540,7 +873,7 @@ static int vdphci_device_process_signal_hevent(
 
     uevent.signal = event->signal;
 
-    retval = vdphci_direct_write(sizeof(uheader), sizeof(uevent), &uevent, buf, pages);
+    retval = vdphci_direct_write(sizeof(uheader), sizeof(uevent), &uevent, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -551,8 +884,8 @@ static int vdphci_device_process_signal_hevent(
 
 static int vdphci_urb_hevent_write_common(u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages)
+    u32 flags,
+    struct vdphci_direct_buf* dbuf)
 {
     struct vdphci_hevent_urb data;
 
@@ -583,7 +916,7 @@ static int vdphci_urb_hevent_write_common(u32 seq_num,
         break;
     }
 
-    data.flags = 0;
+    data.flags = flags;
 
     if (urb->transfer_flags & URB_ZERO_PACKET) {
         data.flags |= VDPHCI_URB_ZERO_PACKET;
@@ -614,8 +947,31 @@ static int vdphci_urb_hevent_write_common(u32 seq_num,
     return vdphci_direct_write(sizeof(struct vdphci_hevent_header),
         offsetof(struct vdphci_hevent_urb, data.buff),
         &data,
-        buf,
-        pages);
+        dbuf);
+}
+
+/*
+ * Size of URB HEvent data, i.e. what the routines below write WITHOUT THE HEADER.
+ */
+static size_t vdphci_urb_hevent_data_size(struct urb* urb, int mapped)
+{
+    if (mapped) {
+        return offsetof(struct vdphci_hevent_urb, data.map) + sizeof(struct vdphci_h_map);
+    }
+
+    switch (usb_pipetype(urb->pipe)) {
+    case PIPE_CONTROL:
+        return offsetof(struct vdphci_hevent_urb, data.buff) +
+            sizeof(struct usb_ctrlrequest) +
+            (usb_pipein(urb->pipe) ? 0 : urb->transfer_buffer_length);
+    case PIPE_ISOCHRONOUS:
+        return offsetof(struct vdphci_hevent_urb, data.packets) +
+            (sizeof(struct vdphci_h_iso_packet) * urb->number_of_packets) +
+            (usb_pipein(urb->pipe) ? 0 : urb->transfer_buffer_length);
+    default:
+        return offsetof(struct vdphci_hevent_urb, data.buff) +
+            (usb_pipein(urb->pipe) ? 0 : urb->transfer_buffer_length);
+    }
 }
 
 /*
@@ -634,19 +990,18 @@ static int vdphci_urb_hevent_write_common(u32 seq_num,
 static int vdphci_device_read_in_control_urb(
     u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
-    size_t data_size = offsetof(struct vdphci_hevent_urb, data.buff) +
-        sizeof(struct usb_ctrlrequest);
+    size_t data_size = vdphci_urb_hevent_data_size(urb, 0);
 
     if (count < data_size) {
         return data_size;
     }
 
-    retval = vdphci_urb_hevent_write_common(seq_num, urb, buf, pages);
+    retval = vdphci_urb_hevent_write_common(seq_num, urb, flags, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -656,8 +1011,7 @@ static int vdphci_device_read_in_control_urb(
         offsetof(struct vdphci_hevent_urb, data.buff),
         sizeof(struct usb_ctrlrequest),
         urb->setup_packet,
-        buf,
-        pages);
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -669,18 +1023,18 @@ static int vdphci_device_read_in_control_urb(
 static int vdphci_device_read_in_other_urb(
     u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
-    size_t data_size = offsetof(struct vdphci_hevent_urb, data.buff);
+    size_t data_size = vdphci_urb_hevent_data_size(urb, 0);
 
     if (count < data_size) {
         return data_size;
     }
 
-    retval = vdphci_urb_hevent_write_common(seq_num, urb, buf, pages);
+    retval = vdphci_urb_hevent_write_common(seq_num, urb, flags, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -692,20 +1046,19 @@ static int vdphci_device_read_in_other_urb(
 static int vdphci_device_read_in_iso_urb(
     u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int i;
     int retval = 0;
-    size_t data_size = offsetof(struct vdphci_hevent_urb, data.packets) +
-        (sizeof(struct vdphci_h_iso_packet) * urb->number_of_packets);
+    size_t data_size = vdphci_urb_hevent_data_size(urb, 0);
 
     if (count < data_size) {
         return data_size;
     }
 
-    retval = vdphci_urb_hevent_write_common(seq_num, urb, buf, pages);
+    retval = vdphci_urb_hevent_write_common(seq_num, urb, flags, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -721,8 +1074,7 @@ static int vdphci_device_read_in_iso_urb(
             (sizeof(struct vdphci_h_iso_packet) * i),
             sizeof(struct vdphci_h_iso_packet),
             &packet,
-            buf,
-            pages);
+            dbuf);
 
         if (retval != 0) {
             return retval;
@@ -735,19 +1087,18 @@ static int vdphci_device_read_in_iso_urb(
 static int vdphci_device_read_out_control_urb(
     u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
-    size_t data_size = offsetof(struct vdphci_hevent_urb, data.buff) +
-        sizeof(struct usb_ctrlrequest) + urb->transfer_buffer_length;
+    size_t data_size = vdphci_urb_hevent_data_size(urb, 0);
 
     if (count < data_size) {
         return data_size;
     }
 
-    retval = vdphci_urb_hevent_write_common(seq_num, urb, buf, pages);
+    retval = vdphci_urb_hevent_write_common(seq_num, urb, flags, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -757,8 +1108,7 @@ static int vdphci_device_read_out_control_urb(
         offsetof(struct vdphci_hevent_urb, data.buff),
         sizeof(struct usb_ctrlrequest),
         urb->setup_packet,
-        buf,
-        pages);
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -769,8 +1119,7 @@ static int vdphci_device_read_out_control_urb(
         sizeof(struct usb_ctrlrequest),
         urb->transfer_buffer_length,
         urb->transfer_buffer,
-        buf,
-        pages);
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -782,19 +1131,18 @@ static int vdphci_device_read_out_control_urb(
 static int vdphci_device_read_out_other_urb(
     u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
-    size_t data_size = offsetof(struct vdphci_hevent_urb, data.buff) +
-        urb->transfer_buffer_length;
+    size_t data_size = vdphci_urb_hevent_data_size(urb, 0);
 
     if (count < data_size) {
         return data_size;
     }
 
-    retval = vdphci_urb_hevent_write_common(seq_num, urb, buf, pages);
+    retval = vdphci_urb_hevent_write_common(seq_num, urb, flags, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -804,8 +1152,7 @@ static int vdphci_device_read_out_other_urb(
         offsetof(struct vdphci_hevent_urb, data.buff),
         urb->transfer_buffer_length,
         urb->transfer_buffer,
-        buf,
-        pages);
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -817,21 +1164,19 @@ static int vdphci_device_read_out_other_urb(
 static int vdphci_device_read_out_iso_urb(
     u32 seq_num,
     struct urb* urb,
-    char __user* buf,
-    struct page** pages,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
     int i;
-    size_t data_size = offsetof(struct vdphci_hevent_urb, data.packets) +
-        (sizeof(struct vdphci_h_iso_packet) * urb->number_of_packets) +
-        urb->transfer_buffer_length;
+    size_t data_size = vdphci_urb_hevent_data_size(urb, 0);
 
     if (count < data_size) {
         return data_size;
     }
 
-    retval = vdphci_urb_hevent_write_common(seq_num, urb, buf, pages);
+    retval = vdphci_urb_hevent_write_common(seq_num, urb, flags, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -847,8 +1192,7 @@ static int vdphci_device_read_out_iso_urb(
             (sizeof(struct vdphci_h_iso_packet) * i),
             sizeof(struct vdphci_h_iso_packet),
             &packet,
-            buf,
-            pages);
+            dbuf);
 
         if (retval != 0) {
             return retval;
@@ -860,8 +1204,46 @@ static int vdphci_device_read_out_iso_urb(
         (sizeof(struct vdphci_h_iso_packet) * urb->number_of_packets),
         urb->transfer_buffer_length,
         urb->transfer_buffer,
-        buf,
-        pages);
+        dbuf);
+
+    if (retval != 0) {
+        return retval;
+    }
+
+    return data_size;
+}
+
+static int vdphci_device_read_mapped_urb(
+    struct vdphci_port* port,
+    struct vdphci_khevent_urb* event,
+    u32 flags,
+    struct vdphci_direct_buf* dbuf,
+    size_t count)
+{
+    int retval = 0;
+    struct vdphci_h_map map;
+    size_t data_size = vdphci_urb_hevent_data_size(event->urb, 1);
+
+    if (count < data_size) {
+        return data_size;
+    }
+
+    vdphci_port_khevent_urb_map(port, event);
+
+    retval = vdphci_urb_hevent_write_common(event->seq_num, event->urb, flags | VDPHCI_URB_MAPPED, dbuf);
+
+    if (retval != 0) {
+        return retval;
+    }
+
+    map.pgoff = event->map_pgoff;
+    map.length = event->map_pages << PAGE_SHIFT;
+
+    retval = vdphci_direct_write(sizeof(struct vdphci_hevent_header) +
+        offsetof(struct vdphci_hevent_urb, data.map),
+        sizeof(map),
+        &map,
+        dbuf);
 
     if (retval != 0) {
         return retval;
@@ -874,26 +1256,70 @@ static int vdphci_device_read_out_iso_urb(
  * @}
  */
 
+/*
+ * Only whole pages of a buffer that we can translate to pfns can be mapped, otherwise
+ * we'd expose memory that doesn't belong to the URB.
+ */
+static int vdphci_device_urb_mappable(struct vdphci_device* device, struct urb* urb)
+{
+    if (!(device->options.flags & VDPHCI_OPTION_MAP)) {
+        return 0;
+    }
+
+    if ((usb_pipetype(urb->pipe) != PIPE_BULK) &&
+        (usb_pipetype(urb->pipe) != PIPE_INTERRUPT)) {
+        return 0;
+    }
+
+    if ((urb->transfer_buffer_length == 0) ||
+        (urb->transfer_buffer_length < device->options.map_threshold)) {
+        return 0;
+    }
+
+    if (!PAGE_ALIGNED(urb->transfer_buffer) ||
+        !PAGE_ALIGNED(urb->transfer_buffer_length)) {
+        return 0;
+    }
+
+    return virt_addr_valid(urb->transfer_buffer) || is_vmalloc_addr(urb->transfer_buffer);
+}
+
 static int vdphci_device_process_urb_hevent(
-    const struct vdphci_khevent_urb* event,
-    char __user* buf,
-    struct page** pages,
+    struct vdphci_device* device,
+    struct vdphci_khevent_urb* event,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
     int wr_retval = 0;
     struct vdphci_hevent_header uheader;
     size_t event_data_size = count - sizeof(uheader);
+    u32 flags = 0;
 
     BUG_ON(count < sizeof(uheader));
 
-    if (usb_pipein(event->urb->pipe)) {
+    if (device->options.flags & VDPHCI_OPTION_TIMING) {
+        /*
+         * Timing goes after the data, leave room for it.
+         */
+        flags |= VDPHCI_URB_TIMING;
+        event_data_size = (event_data_size < sizeof(struct vdphci_h_urb_timing)) ? 0 :
+            (event_data_size - sizeof(struct vdphci_h_urb_timing));
+    }
+
+    if (vdphci_device_urb_mappable(device, event->urb)) {
+        retval = vdphci_device_read_mapped_urb(device->port,
+            event,
+            flags,
+            dbuf,
+            event_data_size);
+    } else if (usb_pipein(event->urb->pipe)) {
         switch (usb_pipetype(event->urb->pipe)) {
         case PIPE_CONTROL: {
             retval = vdphci_device_read_in_control_urb(event->seq_num,
                 event->urb,
-                buf,
-                pages,
+                flags,
+                dbuf,
                 event_data_size);
             break;
         }
@@ -901,15 +1327,15 @@ static int vdphci_device_process_urb_hevent(
         case PIPE_INTERRUPT:
             retval = vdphci_device_read_in_other_urb(event->seq_num,
                 event->urb,
-                buf,
-                pages,
+                flags,
+                dbuf,
                 event_data_size);
             break;
         case PIPE_ISOCHRONOUS:
             retval = vdphci_device_read_in_iso_urb(event->seq_num,
                 event->urb,
-                buf,
-                pages,
+                flags,
+                dbuf,
                 event_data_size);
             break;
         default:
@@ -921,8 +1347,8 @@ static int vdphci_device_process_urb_hevent(
         case PIPE_CONTROL: {
             retval = vdphci_device_read_out_control_urb(event->seq_num,
                 event->urb,
-                buf,
-                pages,
+                flags,
+                dbuf,
                 event_data_size);
             break;
         }
@@ -930,15 +1356,15 @@ static int vdphci_device_process_urb_hevent(
         case PIPE_INTERRUPT:
             retval = vdphci_device_read_out_other_urb(event->seq_num,
                 event->urb,
-                buf,
-                pages,
+                flags,
+                dbuf,
                 event_data_size);
             break;
         case PIPE_ISOCHRONOUS:
             retval = vdphci_device_read_out_iso_urb(event->seq_num,
                 event->urb,
-                buf,
-                pages,
+                flags,
+                dbuf,
                 event_data_size);
             break;
         default:
@@ -951,10 +1377,33 @@ static int vdphci_device_process_urb_hevent(
         return retval;
     }
 
+    if (flags & VDPHCI_URB_TIMING) {
+        if (retval <= event_data_size) {
+            struct vdphci_h_urb_timing timing;
+
+            memset(&timing, 0, sizeof(timing));
+
+            timing.enqueue_time = ktime_to_ns(event->enqueue_time);
+            timing.frame_number = event->frame_number;
+
+            wr_retval = vdphci_direct_write(sizeof(uheader) + retval,
+                sizeof(timing),
+                &timing,
+                dbuf);
+
+            if (wr_retval != 0) {
+                return wr_retval;
+            }
+        }
+
+        retval += sizeof(struct vdphci_h_urb_timing);
+        event_data_size += sizeof(struct vdphci_h_urb_timing);
+    }
+
     uheader.type = vdphci_hevent_type_urb;
     uheader.length = retval;
 
-    wr_retval = vdphci_direct_write(0, sizeof(uheader), &uheader, buf, pages);
+    wr_retval = vdphci_direct_write(0, sizeof(uheader), &uheader, dbuf);
 
     if (wr_retval != 0) {
         return wr_retval;
@@ -969,8 +1418,7 @@ static int vdphci_device_process_urb_hevent(
 
 static int vdphci_device_process_unlink_urb_hevent(
     const struct vdphci_khevent_unlink_urb* event,
-    char __user* buf,
-    struct page** pages,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     int retval = 0;
@@ -982,7 +1430,7 @@ static int vdphci_device_process_unlink_urb_hevent(
     uheader.type = vdphci_hevent_type_unlink_urb;
     uheader.length = sizeof(uevent);
 
-    retval = vdphci_direct_write(0, sizeof(uheader), &uheader, buf, pages);
+    retval = vdphci_direct_write(0, sizeof(uheader), &uheader, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -994,7 +1442,7 @@ static int vdphci_device_process_unlink_urb_hevent(
 
     uevent.seq_num = event->khevent_urb->seq_num;
 
-    retval = vdphci_direct_write(sizeof(uheader), sizeof(uevent), &uevent, buf, pages);
+    retval = vdphci_direct_write(sizeof(uheader), sizeof(uevent), &uevent, dbuf);
 
     if (retval != 0) {
         return retval;
@@ -1003,9 +1451,88 @@ static int vdphci_device_process_unlink_urb_hevent(
     return sizeof(uheader) + sizeof(uevent);
 }
 
+/*
+ * Number of seq nums written at once by 'vdphci_device_process_unlink_urbs_hevent'.
+ */
+#define VDPHCI_UNLINK_URBS_CHUNK 32
+
+/*
+ * Reports up to all pending 'unlink urb' khevents at once, 'num_events' receives
+ * the number of khevents consumed.
+ */
+static int vdphci_device_process_unlink_urbs_hevent(
+    struct vdphci_port* port,
+    struct vdphci_direct_buf* dbuf,
+    size_t count,
+    unsigned int* num_events)
+{
+    int retval = 0;
+    struct vdphci_hevent_header uheader;
+    struct vdphci_hevent_unlink_urbs uevent;
+    struct vdphci_khevent_unlink_urb* event = NULL;
+    u32 seq_nums[VDPHCI_UNLINK_URBS_CHUNK];
+    size_t offset = sizeof(uheader) + offsetof(struct vdphci_hevent_unlink_urbs, seq_nums);
+    unsigned int i, j;
+
+    BUG_ON(count < sizeof(uheader));
+
+    uevent.count = vdphci_port_get_num_unlink_urbs(port);
+
+    BUG_ON(uevent.count == 0);
+
+    if (count < (offset + sizeof(seq_nums[0]) * uevent.count)) {
+        uevent.count = (count < offset) ? 0 : ((count - offset) / sizeof(seq_nums[0]));
+    }
+
+    uheader.type = vdphci_hevent_type_unlink_urbs;
+    uheader.length = offsetof(struct vdphci_hevent_unlink_urbs, seq_nums) +
+        sizeof(seq_nums[0]) * (uevent.count ? uevent.count : vdphci_port_get_num_unlink_urbs(port));
+
+    retval = vdphci_direct_write(0, sizeof(uheader), &uheader, dbuf);
+
+    if (retval != 0) {
+        return retval;
+    }
+
+    if (uevent.count == 0) {
+        return sizeof(uheader);
+    }
+
+    retval = vdphci_direct_write(sizeof(uheader),
+        offsetof(struct vdphci_hevent_unlink_urbs, seq_nums),
+        &uevent,
+        dbuf);
+
+    if (retval != 0) {
+        return retval;
+    }
+
+    for (i = 0; i < uevent.count; i += j) {
+        for (j = 0; (j < VDPHCI_UNLINK_URBS_CHUNK) && ((i + j) < uevent.count); ++j) {
+            event = vdphci_port_khevent_unlink_urb_next(port, event);
+
+            BUG_ON(event == NULL);
+
+            seq_nums[j] = event->khevent_urb->seq_num;
+        }
+
+        retval = vdphci_direct_write(offset + sizeof(seq_nums[0]) * i,
+            sizeof(seq_nums[0]) * j,
+            seq_nums,
+            dbuf);
+
+        if (retval != 0) {
+            return retval;
+        }
+    }
+
+    *num_events = uevent.count;
+
+    return sizeof(uheader) + uheader.length;
+}
+
 static int vdphci_device_process_no_hevent(
-    char __user* buf,
-    struct page** pages,
+    struct vdphci_direct_buf* dbuf,
     size_t count)
 {
     struct vdphci_hevent_header uheader;
@@ -1019,51 +1546,110 @@ static int vdphci_device_process_no_hevent(
  * @}
  */
 
-static ssize_t vdphci_device_write(struct file* file, const char __user* buf, size_t count, loff_t* f_pos)
+/*
+ * Size of 'event' as read() would return it, including the header. Must be called with
+ * HCD lock held.
+ */
+static size_t vdphci_device_hevent_size(struct vdphci_device* device,
+    const struct vdphci_khevent* event)
 {
-    struct vdphci_device* device = file->private_data;
-    int retval = 0;
-    struct page** pages;
-    int num_pages;
-    struct vdphci_devent_header header;
+    const struct vdphci_khevent_urb* urb_event;
+
+    switch (event->type) {
+    case vdphci_hevent_type_signal:
+        return sizeof(struct vdphci_hevent_header) + sizeof(struct vdphci_hevent_signal);
+    case vdphci_hevent_type_urb:
+        urb_event = (const struct vdphci_khevent_urb*)event;
+        return sizeof(struct vdphci_hevent_header) +
+            vdphci_urb_hevent_data_size(urb_event->urb,
+                vdphci_device_urb_mappable(device, urb_event->urb)) +
+            ((device->options.flags & VDPHCI_OPTION_TIMING) ? sizeof(struct vdphci_h_urb_timing) : 0);
+    case vdphci_hevent_type_unlink_urb:
+        if (device->options.flags & VDPHCI_OPTION_UNLINK_SET) {
+            return sizeof(struct vdphci_hevent_header) +
+                offsetof(struct vdphci_hevent_unlink_urbs, seq_nums) +
+                sizeof(u32) * vdphci_port_get_num_unlink_urbs(device->port);
+        }
+        return sizeof(struct vdphci_hevent_header) + sizeof(struct vdphci_hevent_unlink_urb);
+    default:
+        BUG_ON(1);
+        return sizeof(struct vdphci_hevent_header);
+    }
+}
 
-    dprintk("%s, device %d: write %d to file %p\n",
-        vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
-        (int)device->port->number,
-        (int)count,
-        file);
+/*
+ * Size of the pending event or 0 if there's none. 'min_size' (can be NULL) receives
+ * the smallest buffer size the event can be read with, it's less than the returned size
+ * only for events that can be read partially.
+ */
+static size_t vdphci_device_next_hevent_size(struct vdphci_device* device, size_t* min_size)
+{
+    unsigned long flags;
+    struct vdphci_khevent* event;
+    size_t size = 0;
 
-    if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
-        return -ERESTARTSYS;
+    vdphci_hcd_lock(device->parent_hcd, flags);
+
+    event = vdphci_port_khevent_current(device->port);
+
+    if (event) {
+        size = vdphci_device_hevent_size(device, event);
     }
 
-    if (count < sizeof(header)) {
-        retval = -EINVAL;
+    if (min_size) {
+        if (event && (event->type == vdphci_hevent_type_unlink_urb) &&
+            (device->options.flags & VDPHCI_OPTION_UNLINK_SET)) {
+            *min_size = sizeof(struct vdphci_hevent_header) +
+                offsetof(struct vdphci_hevent_unlink_urbs, seq_nums) + sizeof(u32);
+        } else {
+            *min_size = size;
+        }
+    }
+
+    vdphci_hcd_unlock(device->parent_hcd, flags);
 
-        goto fail;
+    return size;
+}
+
+/*
+ * Process one DEvent, 'cdev_mutex' must be held. Returns number of bytes written.
+ */
+ssize_t vdphci_device_write_one(struct vdphci_device* device, struct iov_iter* from)
+{
+    size_t count = iov_iter_count(from);
+    int retval = 0;
+    struct vdphci_direct_buf dbuf;
+    struct vdphci_devent_header header;
+
+    if (count < sizeof(header)) {
+        return -EINVAL;
     }
 
-    retval = vdphci_direct_read_start(buf, count, &pages, &num_pages);
+    retval = vdphci_direct_read_start(from, &dbuf);
 
     if (retval != 0) {
-        goto fail;
+        return retval;
     }
 
-    retval = vdphci_direct_read(&header, sizeof(header), 0, buf, pages);
+    retval = vdphci_direct_read(&header, sizeof(header), 0, &dbuf);
 
     if (retval != 0) {
-        vdphci_direct_read_end(pages, num_pages);
+        vdphci_direct_read_end(&dbuf);
 
-        goto fail;
+        return retval;
     }
 
     switch (header.type) {
     case vdphci_devent_type_signal: {
-        retval = vdphci_device_process_signal_devent(device, buf, pages, count);
+        retval = vdphci_device_process_signal_devent(device, &dbuf, count);
         break;
     }
     case vdphci_devent_type_urb: {
-        retval = vdphci_device_process_urb_devent(device, buf, pages, count);
+        retval = vdphci_device_process_urb_devent(device, &dbuf, count);
+        break;
+    }
+    case vdphci_devent_type_urb_data: {
+        retval = vdphci_device_process_urb_data_devent(device, &dbuf, count);
         break;
     }
     default:
@@ -1071,50 +1657,80 @@ static ssize_t vdphci_device_write(struct file* file, const char __user* buf, si
         break;
     }
 
-    vdphci_direct_read_end(pages, num_pages);
+    vdphci_direct_read_end(&dbuf);
 
     if (retval < 0) {
-        goto fail;
+        return retval;
     }
 
-    *f_pos += count;
-
-fail:
-    mutex_unlock(&device->cdev_mutex);
-
-    return retval;
+    return count;
 }
 
-static ssize_t vdphci_device_read(struct file* file, char __user* buf, size_t count, loff_t *f_pos)
+static ssize_t vdphci_device_write_iter(struct kiocb* iocb, struct iov_iter* from)
 {
+    struct file* file = iocb->ki_filp;
     struct vdphci_device* device = file->private_data;
-    unsigned long flags;
-    struct vdphci_khevent* event = NULL;
-    int retval = 0;
-    int no_event = 0;
-    struct page** pages;
-    int num_pages;
+    ssize_t retval;
 
-    dprintk("%s, device %d: read %d from file %p\n",
+    dprintk("%s, device %d: write %d to file %p\n",
         vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
         (int)device->port->number,
-        (int)count,
+        (int)iov_iter_count(from),
         file);
 
     if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
         return -ERESTARTSYS;
     }
 
+    retval = vdphci_device_write_one(device, from);
+
+    if (retval > 0) {
+        iocb->ki_pos += retval;
+    }
+
+    mutex_unlock(&device->cdev_mutex);
+
+    return retval;
+}
+
+ssize_t vdphci_device_read_one(struct vdphci_device* device, struct iov_iter* to,
+    vdphci_hevent_type* type)
+{
+    size_t count = iov_iter_count(to);
+    size_t event_size, event_min_size;
+    unsigned long flags;
+    struct vdphci_khevent* event = NULL;
+    int retval = 0;
+    int no_event = 0;
+    unsigned int num_events = 1;
+    struct vdphci_direct_buf dbuf;
+
     if (count < sizeof(struct vdphci_hevent_header)) {
-        retval = -EINVAL;
+        return -EINVAL;
+    }
 
-        goto fail;
+    /*
+     * Only pin what the pending event needs, users tend to read with buffers sized for
+     * the largest event they expect. If the event changes before we take the lock
+     * the routines below will see the actual 'count' and act accordingly.
+     */
+
+    event_size = vdphci_device_next_hevent_size(device, &event_min_size);
+
+    if (event_min_size > count) {
+        event_size = sizeof(struct vdphci_hevent_header);
+    } else if ((event_size == 0) || (event_size > count)) {
+        event_size = count;
     }
 
-    retval = vdphci_direct_write_start(buf, count, &pages, &num_pages);
+    iov_iter_truncate(to, event_size);
+
+    count = iov_iter_count(to);
+
+    retval = vdphci_direct_write_start(to, &dbuf);
 
     if (retval != 0) {
-        goto fail;
+        return retval;
     }
 
     vdphci_hcd_lock(device->parent_hcd, flags);
@@ -1122,29 +1738,41 @@ static ssize_t vdphci_device_read(struct file* file, char __user* buf, size_t co
     event = vdphci_port_khevent_current(device->port);
 
     if (event) {
+        if (type) {
+            *type = ((device->options.flags & VDPHCI_OPTION_UNLINK_SET) &&
+                (event->type == vdphci_hevent_type_unlink_urb)) ?
+                vdphci_hevent_type_unlink_urbs : event->type;
+        }
+
         switch (event->type) {
         case vdphci_hevent_type_signal: {
             retval = vdphci_device_process_signal_hevent(
                 (const struct vdphci_khevent_signal*)event,
-                buf,
-                pages,
+                &dbuf,
                 count);
             break;
         }
         case vdphci_hevent_type_urb: {
             retval = vdphci_device_process_urb_hevent(
-                (const struct vdphci_khevent_urb*)event,
-                buf,
-                pages,
+                device,
+                (struct vdphci_khevent_urb*)event,
+                &dbuf,
                 count);
             break;
         }
         case vdphci_hevent_type_unlink_urb: {
-            retval = vdphci_device_process_unlink_urb_hevent(
-                (const struct vdphci_khevent_unlink_urb*)event,
-                buf,
-                pages,
-                count);
+            if (device->options.flags & VDPHCI_OPTION_UNLINK_SET) {
+                retval = vdphci_device_process_unlink_urbs_hevent(
+                    device->port,
+                    &dbuf,
+                    count,
+                    &num_events);
+            } else {
+                retval = vdphci_device_process_unlink_urb_hevent(
+                    (const struct vdphci_khevent_unlink_urb*)event,
+                    &dbuf,
+                    count);
+            }
             break;
         }
         default:
@@ -1158,37 +1786,152 @@ static ssize_t vdphci_device_read(struct file* file, char __user* buf, size_t co
 
     if (no_event) {
         retval = vdphci_device_process_no_hevent(
-            buf,
-            pages,
+            &dbuf,
             count);
     }
 
     if (retval > sizeof(struct vdphci_hevent_header)) {
         /*
-         * Event has been processed, move on
+         * Event(s) has been processed, move on
          */
 
-        vdphci_port_khevent_proceed(device->port);
+        while (num_events-- > 0) {
+            vdphci_port_khevent_proceed(device->port);
+        }
     }
 
     vdphci_hcd_unlock(device->parent_hcd, flags);
 
-    vdphci_direct_write_end(pages, num_pages);
+    vdphci_direct_write_end(&dbuf);
 
-    if (retval < 0) {
-        goto fail;
+    BUG_ON(retval > (int)count);
+
+    return retval;
+}
+
+static ssize_t vdphci_device_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct file* file = iocb->ki_filp;
+    struct vdphci_device* device = file->private_data;
+    ssize_t retval;
+
+    dprintk("%s, device %d: read %d from file %p\n",
+        vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
+        (int)device->port->number,
+        (int)iov_iter_count(to),
+        file);
+
+    if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+        return -ERESTARTSYS;
     }
 
-    BUG_ON(retval > count);
+    retval = vdphci_device_read_one(device, to, NULL);
 
-    *f_pos += retval;
+    if (retval > 0) {
+        iocb->ki_pos += retval;
+    }
 
-fail:
     mutex_unlock(&device->cdev_mutex);
 
     return retval;
 }
 
+long vdphci_device_io_batch(const struct vdphci_io_batch* batch,
+    int write,
+    vdphci_device_io_fn io,
+    void* opaque)
+{
+    struct vdphci_io_vec* vecs;
+    struct vdphci_io_vec __user* uvecs = (struct vdphci_io_vec __user*)(uintptr_t)batch->vecs;
+    long retval = 0;
+    u32 i;
+
+    if ((batch->count == 0) || (batch->count > VDPHCI_IO_BATCH_MAX)) {
+        return -EINVAL;
+    }
+
+    vecs = kmalloc(sizeof(*vecs) * batch->count, GFP_KERNEL);
+
+    if (!vecs) {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(vecs, uvecs, sizeof(*vecs) * batch->count) != 0) {
+        retval = -EFAULT;
+
+        goto out_free;
+    }
+
+    for (i = 0; i < batch->count; ++i) {
+        struct iovec iov;
+        struct iov_iter iter;
+        int last = 0;
+        ssize_t res;
+
+        res = import_single_range(write ? WRITE : READ,
+            (void __user*)(uintptr_t)vecs[i].buff,
+            vecs[i].size,
+            &iov,
+            &iter);
+
+        if (res == 0) {
+            res = io(opaque, &iter, write, &last);
+        }
+
+        vecs[i].result = res;
+
+        if (write) {
+            continue;
+        }
+
+        if (res == 0) {
+            /*
+             * No more events.
+             */
+
+            break;
+        }
+
+        if ((res < 0) || last) {
+            ++i;
+
+            break;
+        }
+    }
+
+    retval = i;
+
+    if ((i > 0) && (copy_to_user(uvecs, vecs, sizeof(*vecs) * i) != 0)) {
+        retval = -EFAULT;
+    }
+
+out_free:
+    kfree(vecs);
+
+    return retval;
+}
+
+/*
+ * 'vdphci_device_io_fn' for the device itself, 'cdev_mutex' must be held.
+ */
+static ssize_t vdphci_device_io_one(void* opaque, struct iov_iter* iter, int write, int* last)
+{
+    struct vdphci_device* device = opaque;
+    vdphci_hevent_type type = vdphci_hevent_type_signal;
+    ssize_t res;
+
+    if (write) {
+        return vdphci_device_write_one(device, iter);
+    }
+
+    res = vdphci_device_read_one(device, iter, &type);
+
+    *last = (res <= (ssize_t)sizeof(struct vdphci_hevent_header)) ||
+        (type == vdphci_hevent_type_unlink_urbs);
+
+    return res;
+}
+
 static unsigned int vdphci_device_poll(struct file* file, struct poll_table_struct* wait)
 {
     int ret;
@@ -1208,6 +1951,119 @@ static unsigned int vdphci_device_poll(struct file* file, struct poll_table_stru
     return ret;
 }
 
+static int vdphci_device_mmap(struct file* file, struct vm_area_struct* vma)
+{
+    struct vdphci_device* device = file->private_data;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long flags;
+    struct vdphci_khevent_urb* event;
+    void* buffer;
+    int ret = 0;
+
+    if (!(vma->vm_flags & VM_SHARED)) {
+        return -EINVAL;
+    }
+
+    vdphci_port_map_lock(device->port);
+
+    vdphci_hcd_lock(device->parent_hcd, flags);
+
+    event = vdphci_port_khevent_urb_find_mapped(device->port,
+        vma->vm_pgoff,
+        size >> PAGE_SHIFT);
+
+    if (event) {
+        /*
+         * From now on this URB can't be given back until 'unmap_work' zaps
+         * the mapping and 'unmap_work' can't run until we release 'map_mutex'.
+         */
+        event->mapped = 1;
+    }
+
+    vdphci_hcd_unlock(device->parent_hcd, flags);
+
+    if (!event) {
+        ret = -EINVAL;
+
+        goto out;
+    }
+
+    buffer = event->urb->transfer_buffer;
+
+    vma->vm_flags |= VM_DONTCOPY;
+
+    if (is_vmalloc_addr(buffer)) {
+        unsigned long offset;
+
+        for (offset = 0; offset < size; offset += PAGE_SIZE) {
+            ret = remap_pfn_range(vma,
+                vma->vm_start + offset,
+                vmalloc_to_pfn(buffer + offset),
+                PAGE_SIZE,
+                vma->vm_page_prot);
+
+            if (ret != 0) {
+                break;
+            }
+        }
+    } else {
+        ret = remap_pfn_range(vma,
+            vma->vm_start,
+            virt_to_phys(buffer) >> PAGE_SHIFT,
+            size,
+            vma->vm_page_prot);
+    }
+
+    dprintk("%s, device %d: urb %u mapped at %lu, %lu bytes: %d\n",
+        vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.bus_name,
+        (int)device->port->number,
+        event->seq_num,
+        vma->vm_pgoff,
+        size,
+        ret);
+
+out:
+    vdphci_port_map_unlock(device->port);
+
+    return ret;
+}
+
+static int vdphci_device_set_eventfd(struct vdphci_device* device, int fd)
+{
+    struct eventfd_ctx* eventfd = NULL;
+    unsigned long flags;
+
+    if (fd >= 0) {
+        eventfd = eventfd_ctx_fdget(fd);
+
+        if (IS_ERR(eventfd)) {
+            return PTR_ERR(eventfd);
+        }
+    } else if (fd != -1) {
+        return -EINVAL;
+    }
+
+    vdphci_hcd_lock(device->parent_hcd, flags);
+
+    swap(eventfd, device->port->eventfd);
+
+    if (device->port->eventfd && vdphci_port_khevent_current(device->port)) {
+        /*
+         * Events that are pending already won't signal it.
+         */
+
+        eventfd_signal(device->port->eventfd, 1);
+    }
+
+    vdphci_hcd_unlock(device->parent_hcd, flags);
+
+    if (eventfd) {
+        eventfd_ctx_put(eventfd);
+    }
+
+    return 0;
+}
+
 static long vdphci_device_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
 {
     struct vdphci_device* device = file->private_data;
@@ -1215,7 +2071,15 @@ static long vdphci_device_ioctl(struct file* file, unsigned int cmd, unsigned lo
     union
     {
         struct vdphci_info info;
+        struct vdphci_options options;
+        __u32 event_size;
+        struct vdphci_shaping shaping;
+        struct vdphci_ports_attach ports;
+        struct vdphci_io_batch batch;
+        __s32 fd;
+        __u32 ready;
     } value;
+    unsigned long flags;
 
     if (_IOC_TYPE(cmd) != VDPHCI_IOC_MAGIC) {
         return -ENOTTY;
@@ -1245,6 +2109,112 @@ static long vdphci_device_ioctl(struct file* file, unsigned int cmd, unsigned lo
             ret = -EFAULT;
         }
         break;
+    case VDPHCI_IOC_SET_OPTIONS:
+        if (copy_from_user(&value.options,
+            (const struct vdphci_options __user*)arg,
+            sizeof(value.options)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (value.options.flags &
+            ~(VDPHCI_OPTION_MAP | VDPHCI_OPTION_UNLINK_SET | VDPHCI_OPTION_TIMING)) {
+            ret = -EINVAL;
+            break;
+        }
+
+        if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        device->options = value.options;
+
+        mutex_unlock(&device->cdev_mutex);
+        break;
+    case VDPHCI_IOC_SET_SHAPING:
+        if (copy_from_user(&value.shaping,
+            (const struct vdphci_shaping __user*)arg,
+            sizeof(value.shaping)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        ret = vdphci_shaper_check_params(&value.shaping);
+
+        if (ret != 0) {
+            break;
+        }
+
+        vdphci_hcd_lock(device->parent_hcd, flags);
+        vdphci_shaper_set_params(&device->port->shaper, &value.shaping);
+        vdphci_hcd_unlock(device->parent_hcd, flags);
+        break;
+    case VDPHCI_IOC_ATTACH_PORTS:
+        if (copy_from_user(&value.ports,
+            (const struct vdphci_ports_attach __user*)arg,
+            sizeof(value.ports)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        ret = vdphci_device_attach_ports(device->parent_hcd, &value.ports);
+        break;
+    case VDPHCI_IOC_GET_EVENTS:
+    case VDPHCI_IOC_PUT_EVENTS:
+        if (copy_from_user(&value.batch,
+            (const struct vdphci_io_batch __user*)arg,
+            sizeof(value.batch)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        ret = vdphci_device_io_batch(&value.batch,
+            (cmd == VDPHCI_IOC_PUT_EVENTS),
+            vdphci_device_io_one,
+            device);
+
+        mutex_unlock(&device->cdev_mutex);
+        break;
+    case VDPHCI_IOC_SET_EVENTFD:
+        if (copy_from_user(&value.fd, (const __s32 __user*)arg, sizeof(value.fd)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        ret = vdphci_device_set_eventfd(device, value.fd);
+        break;
+    case VDPHCI_IOC_GET_READY_PORTS:
+        value.ready = vdphci_hcd_get_ready_ports(device->parent_hcd);
+
+        if (copy_to_user((__u32 __user*)arg, &value.ready, sizeof(value.ready)) != 0) {
+            ret = -EFAULT;
+        }
+        break;
+    case VDPHCI_IOC_GET_EVENT_SIZE:
+        /*
+         * Take the mutex so that the size doesn't change under a concurrent read.
+         */
+        if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        value.event_size = vdphci_device_next_hevent_size(device, NULL);
+
+        mutex_unlock(&device->cdev_mutex);
+
+        if (copy_to_user((__u32 __user*)arg,
+            &value.event_size,
+            sizeof(value.event_size)) != 0) {
+            ret = -EFAULT;
+        }
+        break;
     default:
         ret = -ENOTTY;
         break;
@@ -1259,12 +2229,42 @@ static struct file_operations vdphci_device_ops =
     .llseek = no_llseek,
     .open = vdphci_device_open,
     .release = vdphci_device_release,
-    .write = vdphci_device_write,
-    .read = vdphci_device_read,
+    .write_iter = vdphci_device_write_iter,
+    .read_iter = vdphci_device_read_iter,
     .poll = vdphci_device_poll,
+    .mmap = vdphci_device_mmap,
     .unlocked_ioctl = vdphci_device_ioctl
 };
 
+static ssize_t busnum_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct vdphci_device* device = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", vdphci_hcd_to_usb_hcd(device->parent_hcd)->self.busnum);
+}
+
+static DEVICE_ATTR_RO(busnum);
+
+static ssize_t portnum_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct vdphci_device* device = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", device->port->number);
+}
+
+static DEVICE_ATTR_RO(portnum);
+
+/*
+ * Same as VDPHCI_IOC_GET_INFO, but without opening the device.
+ */
+static struct attribute* vdphci_device_attrs[] = {
+    &dev_attr_busnum.attr,
+    &dev_attr_portnum.attr,
+    NULL
+};
+
+ATTRIBUTE_GROUPS(vdphci_device);
+
 int vdphci_device_init(struct vdphci_hcd* parent_hcd, struct vdphci_port* port, dev_t devno, struct vdphci_device* device)
 {
     int ret;
@@ -1297,20 +2297,51 @@ int vdphci_device_init(struct vdphci_hcd* parent_hcd, struct vdphci_port* port,
             ret,
             MAJOR(devno),
             MINOR(devno));
-    } else {
-        dprintk("%s: char device (%d, %d) created\n",
+
+        return ret;
+    }
+
+    /*
+     * The node shows up (and "add" uevent is sent) only once the device can be opened.
+     */
+    device->dev = device_create_with_groups(vdphci_class,
+        vdphci_hcd_to_usb_hcd(parent_hcd)->self.controller,
+        devno,
+        device,
+        vdphci_device_groups,
+        VDPHCI_DEVICE_PREFIX "%d",
+        (int)(MINOR(devno) - MINOR(parent_hcd->devno)));
+
+    if (IS_ERR(device->dev)) {
+        ret = PTR_ERR(device->dev);
+
+        device->dev = NULL;
+
+        dprintk("%s: error %d creating device node (%d, %d)\n",
             vdphci_hcd_to_usb_hcd(parent_hcd)->self.bus_name,
+            ret,
             MAJOR(devno),
             MINOR(devno));
+
+        cdev_del(&device->cdev);
+
+        return ret;
     }
 
-    return ret;
+    dprintk("%s: char device (%d, %d) created\n",
+        vdphci_hcd_to_usb_hcd(parent_hcd)->self.bus_name,
+        MAJOR(devno),
+        MINOR(devno));
+
+    return 0;
 }
 
 void vdphci_device_cleanup(struct vdphci_device* device)
 {
     BUG_ON(in_atomic());
 
+    device_destroy(vdphci_class, device->cdev.dev);
+
     cdev_del(&device->cdev);
 
     dprintk("%s: char device (%d, %d) removed\n",
@@ -30,8 +30,10 @@
 #include <linux/kernel.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/uio.h>
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
+#include "vdphci-common.h"
 
 struct vdphci_hcd;
 
@@ -58,12 +60,22 @@ struct vdphci_device
     struct cdev cdev;
     struct mutex cdev_mutex;
 
+    /*
+     * Node in vdphci_class, VDPHCI_DEVICE_PREFIX followed by device number.
+     */
+    struct device* dev;
+
     /*
      * We only allow one opened file at a time. Note that opening a device doesn't mean
      * being ready to work with it, user might wanted to just check if device is busy or not,
      * device shouldn't report itself as connected until 'attached' is true.
      */
     int opened;
+
+    /*
+     * Options set by the user that opened the device, see VDPHCI_IOC_SET_OPTIONS.
+     */
+    struct vdphci_options options;
     /*
      * @}
      */
@@ -74,6 +86,49 @@ static inline struct vdphci_device* cdev_to_vdphci_device(struct cdev* dev)
     return container_of((void*)dev, struct vdphci_device, cdev);
 }
 
+/*
+ * Makes the device owned by 'file', same as opening it. Returns -EBUSY if it's owned already.
+ * 'cdev_mutex' must NOT be held.
+ */
+int vdphci_device_claim(struct vdphci_device* device, struct file* file);
+
+/*
+ * Same as closing the device, 'cdev_mutex' must NOT be held.
+ */
+void vdphci_device_unclaim(struct vdphci_device* device, struct file* file);
+
+/*
+ * Read one HEvent, 'cdev_mutex' must be held. Returns number of bytes read, 0 if there's
+ * no event. 'type' (can be NULL) receives type of the event read.
+ */
+ssize_t vdphci_device_read_one(struct vdphci_device* device, struct iov_iter* to,
+    vdphci_hevent_type* type);
+
+/*
+ * Write one DEvent, 'cdev_mutex' must be held. Returns number of bytes written.
+ */
+ssize_t vdphci_device_write_one(struct vdphci_device* device, struct iov_iter* from);
+
+/*
+ * Reads or writes one event for 'vdphci_device_io_batch', sets 'last' if no more events
+ * should be read in this batch.
+ */
+typedef ssize_t (*vdphci_device_io_fn)(void* opaque, struct iov_iter* iter, int write, int* last);
+
+/*
+ * VDPHCI_IOC_GET_EVENTS/VDPHCI_IOC_PUT_EVENTS, returns number of vectors processed.
+ */
+long vdphci_device_io_batch(const struct vdphci_io_batch* batch,
+    int write,
+    vdphci_device_io_fn io,
+    void* opaque);
+
+/*
+ * VDPHCI_IOC_ATTACH_PORTS, 'cdev_mutex' of ports involved must NOT be held.
+ */
+int vdphci_device_attach_ports(struct vdphci_hcd* hcd,
+    const struct vdphci_ports_attach* ports);
+
 int vdphci_device_init(struct vdphci_hcd* parent_hcd, struct vdphci_port* port, dev_t devno, struct vdphci_device* device);
 
 void vdphci_device_cleanup(struct vdphci_device* device);
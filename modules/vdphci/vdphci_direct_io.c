@@ -29,88 +29,147 @@
 #include <linux/hardirq.h>
 #include <linux/pagemap.h>
 
-static int vdphci_direct_io_start(unsigned long start, size_t count, int write, struct page*** pages, int* num_pages)
+static void vdphci_direct_io_end(struct vdphci_direct_buf* buf, int dirty)
 {
-    int ret = 0;
-    *num_pages = PAGE_ALIGN((start & ~PAGE_MASK) + count) >> PAGE_SHIFT;
-    *pages = kmalloc((*num_pages) * sizeof(struct page*), GFP_KERNEL);
+    int i, j;
 
-    if (!(*pages)) {
-        return -ENOMEM;
+    for (i = 0; i < buf->num_segs; ++i) {
+        struct vdphci_direct_seg* seg = &buf->segs[i];
+
+        for (j = 0; j < seg->num_pages; ++j) {
+            if (dirty) {
+                set_page_dirty_lock(seg->pages[j]);
+            }
+
+            put_page(seg->pages[j]);
+        }
+
+        kvfree(seg->pages);
     }
 
-    down_read(&current->mm->mmap_sem);
+    kfree(buf->segs);
+
+    memset(buf, 0, sizeof(*buf));
+}
+
+static int vdphci_direct_io_start(struct iov_iter* iter, struct vdphci_direct_buf* buf)
+{
+    int max_segs = 0;
+    int retval = -ENOMEM;
+
+    memset(buf, 0, sizeof(*buf));
+
+    while (iov_iter_count(iter) > 0) {
+        struct vdphci_direct_seg* seg;
+        ssize_t length;
+
+        if (buf->num_segs == max_segs) {
+            struct vdphci_direct_seg* segs;
 
-    ret = get_user_pages(current, current->mm, start,
-        (*num_pages), write, 0, *pages, NULL);
+            max_segs = max_segs ? (max_segs * 2) : 4;
 
-    up_read(&current->mm->mmap_sem);
+            segs = krealloc(buf->segs, max_segs * sizeof(*segs), GFP_KERNEL);
 
-    if (ret < (*num_pages)) {
-        int i;
+            if (!segs) {
+                goto fail;
+            }
 
-        for (i = 0; i < ret; ++i) {
-            put_page((*pages)[i]);
+            buf->segs = segs;
         }
-        kfree(*pages);
 
-        return -ENOMEM;
-    }
+        seg = &buf->segs[buf->num_segs];
 
-    return 0;
-}
+        length = iov_iter_get_pages_alloc(iter, &seg->pages, iov_iter_count(iter), &seg->start);
 
-static void vdphci_direct_io_end(struct page** pages, int num_pages, int dirty)
-{
-    int i;
+        if (length <= 0) {
+            /*
+             * E.g. -EFAULT for a bad user pointer, report it as is.
+             */
+
+            retval = (length < 0) ? length : -EFAULT;
 
-    for (i = 0; i < num_pages; i++) {
-        if (dirty) {
-            set_page_dirty_lock(pages[i]);
+            goto fail;
         }
 
-        put_page(pages[i]);
+        seg->length = length;
+        seg->num_pages = PAGE_ALIGN(seg->start + length) >> PAGE_SHIFT;
+
+        ++buf->num_segs;
+
+        buf->count += length;
+
+        iov_iter_advance(iter, length);
     }
 
-    kfree(pages);
+    return 0;
+
+fail:
+    vdphci_direct_io_end(buf, 0);
+
+    return retval;
 }
 
-int vdphci_direct_read_start(const char __user* buf, size_t count, struct page*** pages, int* num_pages)
+int vdphci_direct_read_start(struct iov_iter* iter, struct vdphci_direct_buf* buf)
 {
     BUG_ON(in_atomic());
 
-    return vdphci_direct_io_start((unsigned long)buf, count, 0, pages, num_pages);
+    return vdphci_direct_io_start(iter, buf);
 }
 
-int vdphci_direct_write_start(char __user* buf, size_t count, struct page*** pages, int* num_pages)
+int vdphci_direct_write_start(struct iov_iter* iter, struct vdphci_direct_buf* buf)
 {
     BUG_ON(in_atomic());
 
-    return vdphci_direct_io_start((unsigned long)buf, count, 1, pages, num_pages);
+    return vdphci_direct_io_start(iter, buf);
 }
 
-void vdphci_direct_read_end(struct page** pages, int num_pages)
+void vdphci_direct_read_end(struct vdphci_direct_buf* buf)
 {
     BUG_ON(in_atomic());
 
-    vdphci_direct_io_end(pages, num_pages, 0);
+    vdphci_direct_io_end(buf, 0);
 }
 
-void vdphci_direct_write_end(struct page** pages, int num_pages)
+void vdphci_direct_write_end(struct vdphci_direct_buf* buf)
 {
     BUG_ON(in_atomic());
 
-    vdphci_direct_io_end(pages, num_pages, 1);
+    vdphci_direct_io_end(buf, 1);
+}
+
+/*
+ * Find segment that contains 'offset', on return 'offset' is relative to that segment.
+ */
+static const struct vdphci_direct_seg* vdphci_direct_find_seg(const struct vdphci_direct_buf* buf,
+    size_t* offset)
+{
+    int i;
+
+    for (i = 0; i < buf->num_segs; ++i) {
+        if (*offset < buf->segs[i].length) {
+            return &buf->segs[i];
+        }
+
+        *offset -= buf->segs[i].length;
+    }
+
+    return NULL;
 }
 
-int vdphci_direct_read(void* dst, size_t count, size_t offset, const char __user* buf, struct page** pages)
+int vdphci_direct_read(void* dst, size_t count, size_t offset, const struct vdphci_direct_buf* buf)
 {
-    size_t start_offset = (unsigned long)buf & (PAGE_SIZE - 1);
+    const struct vdphci_direct_seg* seg;
+
+    if ((offset + count) > buf->count) {
+        return -EINVAL;
+    }
+
+    seg = vdphci_direct_find_seg(buf, &offset);
 
     while (count > 0) {
-        size_t page_offset = (start_offset + offset) & (PAGE_SIZE - 1);
-        size_t num_transfer = min((size_t)PAGE_SIZE - page_offset, count);
-        void* vaddr = kmap_atomic(pages[(start_offset + offset) >> PAGE_SHIFT]);
+        size_t page_offset = (seg->start + offset) & (PAGE_SIZE - 1);
+        size_t num_transfer = min3((size_t)PAGE_SIZE - page_offset, count, seg->length - offset);
+        void* vaddr = kmap_atomic(seg->pages[(seg->start + offset) >> PAGE_SHIFT]);
 
         if (vaddr == NULL) {
             return -ENOMEM;
@@ -123,19 +182,30 @@ int vdphci_direct_read(void* dst, size_t count, size_t offset, const char __user
         offset += num_transfer;
         dst += num_transfer;
         count -= num_transfer;
+
+        if (offset == seg->length) {
+            ++seg;
+            offset = 0;
+        }
     }
 
     return 0;
 }
 
-int vdphci_direct_write(size_t offset, size_t count, const void* src, char __user* buf, struct page** pages)
+int vdphci_direct_write(size_t offset, size_t count, const void* src, struct vdphci_direct_buf* buf)
 {
-    size_t start_offset = (unsigned long)buf & (PAGE_SIZE - 1);
+    const struct vdphci_direct_seg* seg;
+
+    if ((offset + count) > buf->count) {
+        return -EINVAL;
+    }
+
+    seg = vdphci_direct_find_seg(buf, &offset);
 
     while (count > 0) {
-        size_t page_offset = (start_offset + offset) & (PAGE_SIZE - 1);
-        size_t num_transfer = min((size_t)PAGE_SIZE - page_offset, count);
-        void* vaddr = kmap_atomic(pages[(start_offset + offset) >> PAGE_SHIFT]);
+        size_t page_offset = (seg->start + offset) & (PAGE_SIZE - 1);
+        size_t num_transfer = min3((size_t)PAGE_SIZE - page_offset, count, seg->length - offset);
+        void* vaddr = kmap_atomic(seg->pages[(seg->start + offset) >> PAGE_SHIFT]);
 
         if (vaddr == NULL) {
             return -ENOMEM;
@@ -148,6 +218,11 @@ int vdphci_direct_write(size_t offset, size_t count, const void* src, char __use
         offset += num_transfer;
         src = ((const char*)src) + num_transfer;
         count -= num_transfer;
+
+        if (offset == seg->length) {
+            ++seg;
+            offset = 0;
+        }
     }
 
     return 0;
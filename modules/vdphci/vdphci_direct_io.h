@@ -28,19 +28,55 @@
 
 #include <linux/kernel.h>
 #include <linux/mm.h>
+#include <linux/uio.h>
+
+/*
+ * Contiguous piece of user buffer.
+ */
+struct vdphci_direct_seg
+{
+    struct page** pages;
+    int num_pages;
+
+    /*
+     * Offset of segment data in the first page.
+     */
+    size_t start;
+
+    size_t length;
+};
+
+/*
+ * User buffer pinned for direct I/O, it can be scattered across several
+ * segments (readv/writev), offsets passed to 'vdphci_direct_read'/'vdphci_direct_write'
+ * are offsets in the whole buffer.
+ */
+struct vdphci_direct_buf
+{
+    struct vdphci_direct_seg* segs;
+    int num_segs;
+
+    size_t count;
+};
 
 /*
  * The following functions MUST be called from a non-atomic context
  * @{
  */
 
-int vdphci_direct_read_start(const char __user* buf, size_t count, struct page*** pages, int* num_pages);
+/*
+ * Pin pages of 'iter' for reading (i.e. user's write), 'iter' is advanced to its end.
+ */
+int vdphci_direct_read_start(struct iov_iter* iter, struct vdphci_direct_buf* buf);
 
-int vdphci_direct_write_start(char __user* buf, size_t count, struct page*** pages, int* num_pages);
+/*
+ * Pin pages of 'iter' for writing (i.e. user's read), 'iter' is advanced to its end.
+ */
+int vdphci_direct_write_start(struct iov_iter* iter, struct vdphci_direct_buf* buf);
 
-void vdphci_direct_read_end(struct page** pages, int num_pages);
+void vdphci_direct_read_end(struct vdphci_direct_buf* buf);
 
-void vdphci_direct_write_end(struct page** pages, int num_pages);
+void vdphci_direct_write_end(struct vdphci_direct_buf* buf);
 
 /*
  * @}
@@ -51,9 +87,9 @@ void vdphci_direct_write_end(struct page** pages, int num_pages);
  * @{
  */
 
-int vdphci_direct_read(void* dst, size_t count, size_t offset, const char __user* buf, struct page** pages);
+int vdphci_direct_read(void* dst, size_t count, size_t offset, const struct vdphci_direct_buf* buf);
 
-int vdphci_direct_write(size_t offset, size_t count, const void* src, char __user* buf, struct page** pages);
+int vdphci_direct_write(size_t offset, size_t count, const void* src, struct vdphci_direct_buf* buf);
 
 /*
  * @}
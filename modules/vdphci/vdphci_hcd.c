@@ -28,13 +28,6 @@
 #include "debug.h"
 #include "print.h"
 
-#define VDPHCI_PORT_C_MASK \
-    ((USB_PORT_STAT_C_CONNECTION |\
-      USB_PORT_STAT_C_ENABLE |\
-      USB_PORT_STAT_C_SUSPEND |\
-      USB_PORT_STAT_C_OVERCURRENT |\
-      USB_PORT_STAT_C_RESET) << 16)
-
 static const char vdphci_hcd_name[] = VDPHCI_NAME "_hcd";
 
 #ifdef DEBUG
@@ -177,9 +170,9 @@ static int vdphci_register_chrdevs(struct vdphci_hcd* hcd)
         if (hcd->major) {
             devno = MKDEV(hcd->major, next_minor);
 
-            ret = register_chrdev_region(devno, hcd->num_ports, VDPHCI_NAME);
+            ret = register_chrdev_region(devno, VDPHCI_NUM_MINORS, VDPHCI_NAME);
         } else {
-            ret = alloc_chrdev_region(&devno, next_minor, hcd->num_ports, VDPHCI_NAME);
+            ret = alloc_chrdev_region(&devno, next_minor, VDPHCI_NUM_MINORS, VDPHCI_NAME);
         }
     }
 
@@ -188,7 +181,7 @@ static int vdphci_register_chrdevs(struct vdphci_hcd* hcd)
 
         dprintk("%s: can't register %d char devices for major %d\n",
             vdphci_hcd_to_usb_hcd(hcd)->self.bus_name,
-            hcd->num_ports,
+            VDPHCI_NUM_MINORS,
             hcd->major);
     } else {
         hcd->devno = devno;
@@ -199,12 +192,12 @@ static int vdphci_register_chrdevs(struct vdphci_hcd* hcd)
 
 static void vdphci_unregister_chrdevs(struct vdphci_hcd* hcd)
 {
-    unregister_chrdev_region(hcd->devno, hcd->num_ports);
+    unregister_chrdev_region(hcd->devno, VDPHCI_NUM_MINORS);
 }
 
 static int vdphci_start(struct usb_hcd* uhcd)
 {
-    int ret, devices_inited;
+    int ret, devices_inited, loopbacks_inited;
     struct vdphci_hcd* hcd = usb_hcd_to_vdphci_hcd(uhcd);
 
     dprintk("starting\n");
@@ -221,10 +214,10 @@ static int vdphci_start(struct usb_hcd* uhcd)
      * Initialize devices.
      */
 
-    for (devices_inited = 0; devices_inited < hcd->num_ports; ++devices_inited) {
+    for (devices_inited = 0; devices_inited < vdphci_hcd_num_devices(hcd); ++devices_inited) {
         dev_t devno = MKDEV(MAJOR(hcd->devno), MINOR(hcd->devno) + devices_inited);
 
-        vdphci_port_init(devices_inited, &hcd->ports[devices_inited]);
+        vdphci_port_init(devices_inited, &hcd->lock, &hcd->ports[devices_inited]);
 
         ret = vdphci_device_init(hcd, &hcd->ports[devices_inited], devno, &hcd->devices[devices_inited]);
 
@@ -235,6 +228,36 @@ static int vdphci_start(struct usb_hcd* uhcd)
         }
     }
 
+    ret = vdphci_mux_init(hcd,
+        MKDEV(MAJOR(hcd->devno), MINOR(hcd->devno) + VDPHCI_MUX_MINOR),
+        &hcd->mux);
+
+    if (ret != 0) {
+        goto fail2;
+    }
+
+    if (hcd->num_hub_ports > 0) {
+        vdphci_hub_init(&hcd->lock,
+            &hcd->ports[hcd->num_ports - 1],
+            &hcd->ports[hcd->num_ports],
+            hcd->num_hub_ports,
+            &hcd->hub);
+    }
+
+    for (loopbacks_inited = 0; loopbacks_inited < vdphci_hcd_num_devices(hcd); ++loopbacks_inited) {
+        if ((hcd->loopback_mask & (1 << loopbacks_inited)) == 0) {
+            continue;
+        }
+
+        ret = vdphci_loopback_init(&hcd->lock,
+            &hcd->ports[loopbacks_inited],
+            &hcd->loopbacks[loopbacks_inited]);
+
+        if (ret != 0) {
+            goto fail3;
+        }
+    }
+
     /*
      * Enter running state.
      */
@@ -246,6 +269,16 @@ static int vdphci_start(struct usb_hcd* uhcd)
 
     return 0;
 
+fail3:
+    while (loopbacks_inited-- > 0) {
+        if (hcd->loopback_mask & (1 << loopbacks_inited)) {
+            vdphci_loopback_cleanup(&hcd->loopbacks[loopbacks_inited]);
+        }
+    }
+    if (hcd->num_hub_ports > 0) {
+        vdphci_hub_cleanup(&hcd->hub);
+    }
+    vdphci_mux_cleanup(&hcd->mux);
 fail2:
     while (devices_inited-- > 0) {
         vdphci_device_cleanup(&hcd->devices[devices_inited]);
@@ -266,7 +299,19 @@ static void vdphci_stop(struct usb_hcd* uhcd)
 
     dprintk("stopping\n");
 
-    for (i = hcd->num_ports; i > 0; --i) {
+    for (i = vdphci_hcd_num_devices(hcd); i > 0; --i) {
+        if (hcd->loopback_mask & (1 << (i - 1))) {
+            vdphci_loopback_cleanup(&hcd->loopbacks[i - 1]);
+        }
+    }
+
+    if (hcd->num_hub_ports > 0) {
+        vdphci_hub_cleanup(&hcd->hub);
+    }
+
+    vdphci_mux_cleanup(&hcd->mux);
+
+    for (i = vdphci_hcd_num_devices(hcd); i > 0; --i) {
         vdphci_device_cleanup(&hcd->devices[i - 1]);
 
         vdphci_port_cleanup(&hcd->ports[i - 1]);
@@ -277,6 +322,45 @@ static void vdphci_stop(struct usb_hcd* uhcd)
     dprintk("stopped\n");
 }
 
+/*
+ * Find port 'udev' is connected to, devices behind the virtual hub have their own
+ * ports. Returns NULL if there's no such port.
+ */
+static struct vdphci_port* vdphci_get_port(struct vdphci_hcd* hcd, struct usb_device* udev)
+{
+    struct usb_device* parent = udev->parent;
+
+    if (!parent) {
+        return NULL;
+    }
+
+    if (!parent->parent) {
+        /*
+         * Connected to the root hub.
+         */
+
+        if ((udev->portnum > hcd->num_ports) || (udev->portnum < 1)) {
+            return NULL;
+        }
+
+        return &hcd->ports[udev->portnum - 1];
+    }
+
+    /*
+     * Must be connected to the virtual hub, it's always on the last root hub port.
+     */
+
+    if ((hcd->num_hub_ports == 0) ||
+        parent->parent->parent ||
+        (parent->portnum != hcd->num_ports) ||
+        (udev->portnum > hcd->num_hub_ports) ||
+        (udev->portnum < 1)) {
+        return NULL;
+    }
+
+    return &hcd->ports[hcd->num_ports + udev->portnum - 1];
+}
+
 static int vdphci_urb_enqueue(struct usb_hcd* uhcd,
     struct urb* urb,
     gfp_t mem_flags)
@@ -301,7 +385,9 @@ static int vdphci_urb_enqueue(struct usb_hcd* uhcd,
         return urb->status;
     }
 
-    if ((urb->dev->portnum > hcd->num_ports) || (urb->dev->portnum < 1)) {
+    port = vdphci_get_port(hcd, urb->dev);
+
+    if (!port) {
         print_error("%s: bad portnum %d\n", uhcd->self.bus_name, urb->dev->portnum);
 
         spin_unlock_irqrestore(&hcd->lock, flags);
@@ -309,8 +395,6 @@ static int vdphci_urb_enqueue(struct usb_hcd* uhcd,
         return -EINVAL;
     }
 
-    port = &hcd->ports[urb->dev->portnum - 1];
-
     if (!vdphci_port_is_enabled(port) || !HC_IS_RUNNING(uhcd->state)) {
         print_error("%s: port %d not enabled\n",
             uhcd->self.bus_name,
@@ -329,7 +413,13 @@ static int vdphci_urb_enqueue(struct usb_hcd* uhcd,
         goto fail1;
     }
 
-    ret = vdphci_port_urb_enqueue(port, urb, &seq_num);
+    if (vdphci_port_get_hub(port)) {
+        ret = vdphci_hub_urb_enqueue(vdphci_port_get_hub(port), urb);
+    } else if (vdphci_port_get_loopback(port)) {
+        ret = vdphci_loopback_urb_enqueue(vdphci_port_get_loopback(port), urb);
+    } else {
+        ret = vdphci_port_urb_enqueue(port, urb, &seq_num);
+    }
 
     if (ret != 0) {
         print_error("%s: cannot add URB to port: %d\n", uhcd->self.bus_name, ret);
@@ -408,7 +498,9 @@ static int vdphci_urb_dequeue(struct usb_hcd* uhcd, struct urb* urb, int status)
 
     spin_lock_irqsave(&hcd->lock, flags);
 
-    if ((urb->dev->portnum > hcd->num_ports) || (urb->dev->portnum < 1)) {
+    port = vdphci_get_port(hcd, urb->dev);
+
+    if (!port) {
         print_error("%s: bad portnum %d\n", uhcd->self.bus_name, urb->dev->portnum);
 
         spin_unlock_irqrestore(&hcd->lock, flags);
@@ -416,8 +508,6 @@ static int vdphci_urb_dequeue(struct usb_hcd* uhcd, struct urb* urb, int status)
         return -EINVAL;
     }
 
-    port = &hcd->ports[urb->dev->portnum - 1];
-
     ret = usb_hcd_check_unlink_urb(uhcd, urb, status);
 
     if (ret != 0) {
@@ -431,7 +521,13 @@ static int vdphci_urb_dequeue(struct usb_hcd* uhcd, struct urb* urb, int status)
             event->seq_num, (int)port->number);
     }
 
-    vdphci_port_urb_dequeue(port, urb, &giveback_list);
+    if (vdphci_port_get_hub(port)) {
+        vdphci_hub_urb_dequeue(vdphci_port_get_hub(port), urb, &giveback_list);
+    } else if (vdphci_port_get_loopback(port)) {
+        vdphci_loopback_urb_dequeue(vdphci_port_get_loopback(port), urb, &giveback_list);
+    } else {
+        vdphci_port_urb_dequeue(port, urb, &giveback_list);
+    }
 
     spin_unlock_irqrestore(&hcd->lock, flags);
 
@@ -475,14 +571,7 @@ static int vdphci_hub_status_data(struct usb_hcd* uhcd, char* buf)
     for (port_number = 0; port_number < hcd->num_ports; ++port_number) {
         struct vdphci_port* port = &hcd->ports[port_number];
 
-        if (vdphci_port_is_resuming(port) &&
-            time_after(jiffies, vdphci_port_get_re_timeout(port))) {
-            vdphci_port_set_status_bits(port, USB_PORT_STAT_C_SUSPEND << 16);
-            vdphci_port_reset_status_bits(port, USB_PORT_STAT_SUSPEND);
-            vdphci_port_update(port, &giveback_list);
-        }
-
-        if (vdphci_port_check_status_bits(port, VDPHCI_PORT_C_MASK)) {
+        if (vdphci_port_poll_resume(port, &giveback_list)) {
 #ifdef DEBUG
             char* status_str = vdphci_port_status_to_str(vdphci_port_get_status(port));
             if (status_str) {
@@ -526,6 +615,7 @@ static int vdphci_hub_control(struct usb_hcd* uhcd,
     struct vdphci_port* port;
     int need_invalidate = 0;
     struct list_head giveback_list;
+    u32 status;
 
     INIT_LIST_HEAD(&giveback_list);
 
@@ -561,18 +651,7 @@ static int vdphci_hub_control(struct usb_hcd* uhcd,
             break;
         }
 
-        switch (wValue) {
-        case USB_PORT_FEAT_SUSPEND: {
-            if (vdphci_port_check_status_bits(port, USB_PORT_STAT_SUSPEND)) {
-                vdphci_port_set_resuming(port, 1);
-                vdphci_port_set_re_timeout(port, 20);
-            }
-            break;
-        }
-        default:
-            vdphci_port_reset_status_bits(port, 1 << wValue);
-            vdphci_port_update(port, &giveback_list);
-        }
+        vdphci_port_clear_feature(port, wValue, &giveback_list);
 
         break;
     }
@@ -593,35 +672,10 @@ static int vdphci_hub_control(struct usb_hcd* uhcd,
             break;
         }
 
-        /*
-         * Whoever resets or resumes must GetPortStatus to
-         * complete it !!!
-         */
-
-        if (vdphci_port_is_resuming(port) &&
-            time_after(jiffies, vdphci_port_get_re_timeout(port))) {
-            vdphci_port_set_status_bits(port, USB_PORT_STAT_C_SUSPEND << 16);
-            vdphci_port_reset_status_bits(port, USB_PORT_STAT_SUSPEND);
-        }
+        status = vdphci_port_poll_status(port, &giveback_list);
 
-        if (vdphci_port_check_status_bits(port, USB_PORT_STAT_RESET) &&
-            time_after(jiffies, vdphci_port_get_re_timeout(port))) {
-            vdphci_port_set_status_bits(port, USB_PORT_STAT_C_RESET << 16);
-            vdphci_port_reset_status_bits(port, USB_PORT_STAT_RESET);
-
-            if (vdphci_port_is_device_attached(port)) {
-                dprintk("%s: port %d enabled\n",
-                    uhcd->self.bus_name,
-                    port->number);
-
-                vdphci_port_set_status_bits(port, USB_PORT_STAT_ENABLE);
-            }
-        }
-
-        vdphci_port_update(port, &giveback_list);
-
-        ((u16*)buf)[0] = cpu_to_le16(vdphci_port_get_status(port));
-        ((u16*)buf)[1] = cpu_to_le16(vdphci_port_get_status(port) >> 16);
+        ((u16*)buf)[0] = cpu_to_le16(status);
+        ((u16*)buf)[1] = cpu_to_le16(status >> 16);
 
         break;
     }
@@ -638,31 +692,7 @@ static int vdphci_hub_control(struct usb_hcd* uhcd,
             break;
         }
 
-        switch (wValue) {
-        case USB_PORT_FEAT_SUSPEND: {
-            if (vdphci_port_is_enabled(port)) {
-                vdphci_port_set_status_bits(port, USB_PORT_STAT_SUSPEND);
-                vdphci_port_update(port, &giveback_list);
-            }
-            break;
-        }
-        case USB_PORT_FEAT_POWER: {
-            vdphci_port_set_status_bits(port, USB_PORT_STAT_POWER);
-            vdphci_port_update(port, &giveback_list);
-            break;
-        }
-        case USB_PORT_FEAT_RESET: {
-            vdphci_port_reset_status_bits(port, (USB_PORT_STAT_ENABLE |
-                USB_PORT_STAT_LOW_SPEED |
-                USB_PORT_STAT_HIGH_SPEED));
-            vdphci_port_set_re_timeout(port, 50);
-        }
-        default:
-            if (vdphci_port_check_status_bits(port, USB_PORT_STAT_POWER)) {
-                vdphci_port_set_status_bits(port, 1 << wValue);
-                vdphci_port_update(port, &giveback_list);
-            }
-        }
+        vdphci_port_set_feature(port, wValue, &giveback_list);
 
         break;
     }
@@ -712,7 +742,7 @@ static int vdphci_bus_suspend(struct usb_hcd* uhcd)
 
     spin_lock_irqsave(&hcd->lock, flags);
 
-    for (port_number = 0; port_number < hcd->num_ports; ++port_number) {
+    for (port_number = 0; port_number < vdphci_hcd_num_devices(hcd); ++port_number) {
         struct vdphci_port* port = &hcd->ports[port_number];
 
         vdphci_port_set_hcd_suspended(port, 1);
@@ -751,7 +781,7 @@ static int vdphci_bus_resume(struct usb_hcd* uhcd)
         hcd->suspended = 0;
         uhcd->state = HC_STATE_RUNNING;
 
-        for (port_number = 0; port_number < hcd->num_ports; ++port_number) {
+        for (port_number = 0; port_number < vdphci_hcd_num_devices(hcd); ++port_number) {
             struct vdphci_port* port = &hcd->ports[port_number];
 
             vdphci_port_set_hcd_suspended(port, 0);
@@ -798,6 +828,21 @@ int vdphci_hcd_add(struct device* controller,
         return -EINVAL;
     }
 
+    if ((platform_data->num_hub_ports > VDPHCI_MAX_HUB_PORTS) ||
+        ((platform_data->num_hub_ports > 0) && (platform_data->num_ports == 0))) {
+        print_error("%s: num_hub_ports must be <= %d and needs a root hub port\n",
+            bus_name, VDPHCI_MAX_HUB_PORTS);
+        return -EINVAL;
+    }
+
+    if ((platform_data->loopback_mask >> (platform_data->num_ports + platform_data->num_hub_ports)) ||
+        ((platform_data->num_hub_ports > 0) &&
+        (platform_data->loopback_mask & (1 << (platform_data->num_ports - 1))))) {
+        print_error("%s: loopback_mask must only have bits of existing ports that aren't taken by the hub\n",
+            bus_name);
+        return -EINVAL;
+    }
+
     *hcd = usb_create_hcd(&vdphci_hc_driver, controller, bus_name);
 
     if (!*hcd) {
@@ -813,6 +858,8 @@ int vdphci_hcd_add(struct device* controller,
     vdphcd = usb_hcd_to_vdphci_hcd(*hcd);
 
     vdphcd->num_ports = platform_data->num_ports;
+    vdphcd->num_hub_ports = platform_data->num_hub_ports;
+    vdphcd->loopback_mask = platform_data->loopback_mask;
     vdphcd->major = platform_data->major;
 
     /*
@@ -838,9 +885,32 @@ void vdphci_hcd_remove(struct usb_hcd* hcd)
     usb_put_hcd(hcd);
 }
 
+u32 vdphci_hcd_get_ready_ports(struct vdphci_hcd* hcd)
+{
+    unsigned long flags;
+    u32 ready = 0;
+    int i;
+
+    vdphci_hcd_lock(hcd, flags);
+
+    for (i = 0; i < vdphci_hcd_num_devices(hcd); ++i) {
+        if (vdphci_port_khevent_current(&hcd->ports[i])) {
+            ready |= 1 << hcd->ports[i].number;
+        }
+    }
+
+    vdphci_hcd_unlock(hcd, flags);
+
+    return ready;
+}
+
 void vdphci_hcd_invalidate_ports(struct vdphci_hcd* hcd)
 {
     struct usb_hcd* uhcd = vdphci_hcd_to_usb_hcd(hcd);
 
     usb_hcd_poll_rh_status(uhcd);
+
+    if (hcd->num_hub_ports > 0) {
+        vdphci_hub_invalidate_ports(&hcd->hub);
+    }
 }
@@ -35,6 +35,9 @@
 #include "vdphci_platform_driver.h"
 #include "vdphci_device.h"
 #include "vdphci_port.h"
+#include "vdphci_hub.h"
+#include "vdphci_loopback.h"
+#include "vdphci_mux.h"
 
 struct vdphci_hcd
 {
@@ -43,6 +46,8 @@ struct vdphci_hcd
      */
 
     u8 num_ports;
+    u8 num_hub_ports;
+    u32 loopback_mask;
     int major;
 
     /*
@@ -58,25 +63,47 @@ struct vdphci_hcd
     int suspended;
 
     /*
-     * Begin of range of device numbers. Range is 'num_ports' long.
+     * Begin of range of device numbers. Range is VDPHCI_NUM_MINORS long, only the first
+     * 'num_ports + num_hub_ports' of them and VDPHCI_MUX_MINOR are used.
      */
     dev_t devno;
 
     /*
      * Virtual devices that user drives.
      */
-    struct vdphci_device devices[VDPHCI_MAX_PORTS];
+    struct vdphci_device devices[VDPHCI_MAX_DEVICES];
 
     /*
-     * Virtual ports, managed by HCD.
+     * Virtual ports, managed by HCD. Root hub ports come first, then virtual hub ports.
      */
-    struct vdphci_port ports[VDPHCI_MAX_PORTS];
+    struct vdphci_port ports[VDPHCI_MAX_DEVICES];
+
+    /*
+     * Virtual hub, connected to the last root hub port when 'num_hub_ports' is not 0.
+     */
+    struct vdphci_hub hub;
+
+    /*
+     * Loopback devices, 'loopbacks[i]' is connected to 'ports[i]' when bit 'i' of
+     * 'loopback_mask' is set.
+     */
+    struct vdphci_loopback loopbacks[VDPHCI_MAX_DEVICES];
+
+    /*
+     * Serves all ports over one file, its minor is VDPHCI_MUX_MINOR.
+     */
+    struct vdphci_mux mux;
 };
 
 #define vdphci_hcd_lock(hcd, flags) spin_lock_irqsave(&(hcd)->lock, flags)
 
 #define vdphci_hcd_unlock(hcd, flags) spin_unlock_irqrestore(&(hcd)->lock, flags)
 
+static inline int vdphci_hcd_num_devices(struct vdphci_hcd* hcd)
+{
+    return hcd->num_ports + hcd->num_hub_ports;
+}
+
 static inline struct vdphci_hcd* usb_hcd_to_vdphci_hcd(struct usb_hcd* hcd)
 {
     return (struct vdphci_hcd *)(hcd->hcd_priv);
@@ -102,4 +129,10 @@ void vdphci_hcd_remove(struct usb_hcd* hcd);
  */
 void vdphci_hcd_invalidate_ports(struct vdphci_hcd* hcd);
 
+/*
+ * Returns bitmap of ports that have pending khevents, bit N is for port number N.
+ * Must be called WITHOUT HCD lock being held.
+ */
+u32 vdphci_hcd_get_ready_ports(struct vdphci_hcd* hcd);
+
 #endif
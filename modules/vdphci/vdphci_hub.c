@@ -0,0 +1,509 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <linux/slab.h>
+#include "vdphci_hub.h"
+#include "debug.h"
+
+#define VDPHCI_HUB_VENDOR_ID 0x1d6b
+#define VDPHCI_HUB_PRODUCT_ID 0x0200
+
+#define VDPHCI_HUB_CONFIG_SIZE (USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + USB_DT_ENDPOINT_SIZE)
+
+/*
+ * Enough for any reply, the largest one is config descriptor.
+ */
+#define VDPHCI_HUB_MAX_REPLY 32
+
+static const struct usb_device_descriptor vdphci_hub_device_desc =
+{
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = cpu_to_le16(0x0200),
+    .bDeviceClass = USB_CLASS_HUB,
+    .bDeviceSubClass = 0,
+    .bDeviceProtocol = 1, /* Single TT */
+    .bMaxPacketSize0 = 64,
+    .idVendor = cpu_to_le16(VDPHCI_HUB_VENDOR_ID),
+    .idProduct = cpu_to_le16(VDPHCI_HUB_PRODUCT_ID),
+    .bcdDevice = cpu_to_le16(0x0100),
+    .iManufacturer = 0,
+    .iProduct = 0,
+    .iSerialNumber = 0,
+    .bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor vdphci_hub_config_desc =
+{
+    .bLength = USB_DT_CONFIG_SIZE,
+    .bDescriptorType = USB_DT_CONFIG,
+    .wTotalLength = cpu_to_le16(VDPHCI_HUB_CONFIG_SIZE),
+    .bNumInterfaces = 1,
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER | USB_CONFIG_ATT_WAKEUP,
+    .bMaxPower = 0
+};
+
+static const struct usb_interface_descriptor vdphci_hub_interface_desc =
+{
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = 0,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 1,
+    .bInterfaceClass = USB_CLASS_HUB,
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,
+    .iInterface = 0
+};
+
+static const struct usb_endpoint_descriptor vdphci_hub_endpoint_desc =
+{
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_DIR_IN | 1,
+    .bmAttributes = USB_ENDPOINT_XFER_INT,
+    .wMaxPacketSize = 0, /* Depends on number of ports */
+    .bInterval = 12
+};
+
+/*
+ * Size of the status change bitmap, bit 0 is for the hub itself.
+ */
+static inline int vdphci_hub_status_size(struct vdphci_hub* hub)
+{
+    return (hub->num_ports + 1 + 7) / 8;
+}
+
+static int vdphci_hub_get_hub_descriptor(struct vdphci_hub* hub, u8* data)
+{
+    int n = vdphci_hub_status_size(hub);
+    __le16 characteristics = cpu_to_le16(HUB_CHAR_INDV_PORT_LPSM | HUB_CHAR_INDV_PORT_OCPM);
+
+    data[0] = 7 + 2 * n;
+    data[1] = USB_DT_HUB;
+    data[2] = hub->num_ports;
+    memcpy(&data[3], &characteristics, sizeof(characteristics));
+    data[5] = 1; /* bPwrOn2PwrGood */
+    data[6] = 0; /* bHubContrCurrent */
+
+    /*
+     * All devices are removable, PortPwrCtrlMask is all ones for compatibility.
+     */
+
+    memset(&data[7], 0, n);
+    memset(&data[7 + n], 0xFF, n);
+
+    return 7 + 2 * n;
+}
+
+/*
+ * Returns descriptor length or -1 if there's no such descriptor.
+ */
+static int vdphci_hub_get_descriptor(struct vdphci_hub* hub, u16 value, u8* data)
+{
+    switch (value >> 8) {
+    case USB_DT_DEVICE:
+        memcpy(data, &vdphci_hub_device_desc, USB_DT_DEVICE_SIZE);
+        return USB_DT_DEVICE_SIZE;
+    case USB_DT_CONFIG: {
+        struct usb_endpoint_descriptor endpoint_desc = vdphci_hub_endpoint_desc;
+
+        if ((value & 0xFF) != 0) {
+            return -1;
+        }
+
+        endpoint_desc.wMaxPacketSize = cpu_to_le16(vdphci_hub_status_size(hub));
+
+        memcpy(data, &vdphci_hub_config_desc, USB_DT_CONFIG_SIZE);
+        data += USB_DT_CONFIG_SIZE;
+        memcpy(data, &vdphci_hub_interface_desc, USB_DT_INTERFACE_SIZE);
+        data += USB_DT_INTERFACE_SIZE;
+        memcpy(data, &endpoint_desc, USB_DT_ENDPOINT_SIZE);
+
+        return VDPHCI_HUB_CONFIG_SIZE;
+    }
+    case USB_DT_HUB:
+        return vdphci_hub_get_hub_descriptor(hub, data);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Process control request sent to the hub, returns URB status.
+ */
+static int vdphci_hub_control(struct vdphci_hub* hub,
+    const struct usb_ctrlrequest* req,
+    u8* buf,
+    u32 buf_len,
+    u32* actual_length,
+    struct list_head* giveback_list)
+{
+    u16 type_req = (req->bRequestType << 8) | req->bRequest;
+    u16 value = le16_to_cpu(req->wValue);
+    u16 index = le16_to_cpu(req->wIndex);
+    u16 length = le16_to_cpu(req->wLength);
+    struct vdphci_port* port = NULL;
+    u8 data[VDPHCI_HUB_MAX_REPLY];
+    int data_len = 0;
+    int ret = 0;
+
+    if ((index >= 1) && (index <= hub->num_ports)) {
+        port = &hub->ports[index - 1];
+    }
+
+    memset(data, 0, sizeof(data));
+
+    switch (type_req) {
+    case DeviceRequest | USB_REQ_GET_STATUS:
+        data[0] = (1 << USB_DEVICE_SELF_POWERED) |
+            (hub->remote_wakeup ? (1 << USB_DEVICE_REMOTE_WAKEUP) : 0);
+        data_len = 2;
+        break;
+    case InterfaceRequest | USB_REQ_GET_STATUS:
+    case EndpointRequest | USB_REQ_GET_STATUS:
+        data_len = 2;
+        break;
+    case DeviceOutRequest | USB_REQ_CLEAR_FEATURE:
+    case DeviceOutRequest | USB_REQ_SET_FEATURE:
+        if (value != USB_DEVICE_REMOTE_WAKEUP) {
+            ret = -EPIPE;
+            break;
+        }
+        hub->remote_wakeup = (req->bRequest == USB_REQ_SET_FEATURE);
+        break;
+    case EndpointOutRequest | USB_REQ_CLEAR_FEATURE:
+    case EndpointOutRequest | USB_REQ_SET_FEATURE:
+    case DeviceOutRequest | USB_REQ_SET_ADDRESS:
+        break;
+    case DeviceRequest | USB_REQ_GET_DESCRIPTOR:
+        data_len = vdphci_hub_get_descriptor(hub, value, data);
+        if (data_len < 0) {
+            ret = -EPIPE;
+        }
+        break;
+    case DeviceRequest | USB_REQ_GET_CONFIGURATION:
+        data[0] = hub->configuration;
+        data_len = 1;
+        break;
+    case DeviceOutRequest | USB_REQ_SET_CONFIGURATION:
+        if (value > 1) {
+            ret = -EPIPE;
+            break;
+        }
+        hub->configuration = value;
+        break;
+    case InterfaceRequest | USB_REQ_GET_INTERFACE:
+        data_len = 1;
+        break;
+    case InterfaceOutRequest | USB_REQ_SET_INTERFACE:
+        if (value != 0) {
+            ret = -EPIPE;
+        }
+        break;
+    case GetHubDescriptor:
+        data_len = vdphci_hub_get_hub_descriptor(hub, data);
+        break;
+    case GetHubStatus:
+        data_len = 4;
+        break;
+    case ClearHubFeature:
+    case SetHubFeature:
+        break;
+    case GetPortStatus: {
+        __le16 status[2];
+        u32 port_status;
+
+        if (!port) {
+            ret = -EPIPE;
+            break;
+        }
+
+        port_status = vdphci_port_poll_status(port, giveback_list);
+
+        status[0] = cpu_to_le16(port_status);
+        status[1] = cpu_to_le16(port_status >> 16);
+
+        memcpy(data, status, sizeof(status));
+        data_len = sizeof(status);
+        break;
+    }
+    case ClearPortFeature:
+        if (!port) {
+            ret = -EPIPE;
+            break;
+        }
+        vdphci_port_clear_feature(port, value, giveback_list);
+        break;
+    case SetPortFeature:
+        if (!port) {
+            ret = -EPIPE;
+            break;
+        }
+        vdphci_port_set_feature(port, value, giveback_list);
+        break;
+    case ClearTTBuffer:
+    case ResetHubTT:
+    case StopHubTT:
+        /*
+         * Nothing is buffered in our TT.
+         */
+        break;
+    default:
+        dprintk("hub: unsupported request 0x%X, wValue = 0x%X, wIndex = 0x%X\n",
+            type_req, value, index);
+        ret = -EPIPE;
+        break;
+    }
+
+    if (ret == 0) {
+        *actual_length = min3((u32)data_len, (u32)length, buf_len);
+
+        if (*actual_length > 0) {
+            memcpy(buf, data, *actual_length);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * URB served, it'll be given back from 'tasklet'.
+ */
+static void vdphci_hub_urb_done(struct vdphci_hub* hub, struct vdphci_khevent_urb* event)
+{
+    event->urb->hcpriv = NULL;
+
+    usb_hcd_unlink_urb_from_ep(bus_to_hcd(event->urb->dev->bus), event->urb);
+
+    list_add_tail(&event->list, &hub->done_list);
+}
+
+static void vdphci_hub_tasklet(unsigned long data)
+{
+    struct vdphci_hub* hub = (struct vdphci_hub*)data;
+    struct list_head giveback_list;
+    unsigned long flags;
+    u8 i;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    spin_lock_irqsave(hub->lock, flags);
+
+    if (hub->status_urb_khevent && hub->configuration) {
+        struct urb* urb = hub->status_urb_khevent->urb;
+        u8 bitmap[(VDPHCI_MAX_HUB_PORTS + 1 + 7) / 8];
+        int changed = 0;
+
+        memset(bitmap, 0, sizeof(bitmap));
+
+        for (i = 0; i < hub->num_ports; ++i) {
+            if (vdphci_port_poll_resume(&hub->ports[i], &hub->done_list)) {
+                bitmap[(i + 1) / 8] |= 1 << ((i + 1) % 8);
+                changed = 1;
+            }
+        }
+
+        if (changed) {
+            urb->actual_length = min_t(u32, urb->transfer_buffer_length, vdphci_hub_status_size(hub));
+            memcpy(urb->transfer_buffer, bitmap, urb->actual_length);
+            urb->status = 0;
+
+            vdphci_hub_urb_done(hub, hub->status_urb_khevent);
+
+            hub->status_urb_khevent = NULL;
+        }
+    }
+
+    list_splice_init(&hub->done_list, &giveback_list);
+
+    spin_unlock_irqrestore(hub->lock, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+}
+
+void vdphci_hub_init(spinlock_t* lock,
+    struct vdphci_port* upstream_port,
+    struct vdphci_port* ports,
+    u8 num_ports,
+    struct vdphci_hub* hub)
+{
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    memset(hub, 0, sizeof(*hub));
+
+    hub->lock = lock;
+    hub->upstream_port = upstream_port;
+    hub->ports = ports;
+    hub->num_ports = num_ports;
+
+    INIT_LIST_HEAD(&hub->done_list);
+
+    tasklet_init(&hub->tasklet, vdphci_hub_tasklet, (unsigned long)hub);
+
+    spin_lock_irqsave(lock, flags);
+
+    vdphci_port_set_hub(upstream_port, hub);
+    vdphci_port_set_device_attached(upstream_port, 1, USB_SPEED_HIGH);
+    vdphci_port_update(upstream_port, &giveback_list);
+
+    spin_unlock_irqrestore(lock, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+
+    dprintk("hub with %d ports connected to port %d\n", (int)num_ports, (int)upstream_port->number);
+}
+
+void vdphci_hub_cleanup(struct vdphci_hub* hub)
+{
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    spin_lock_irqsave(hub->lock, flags);
+
+    if (hub->status_urb_khevent) {
+        hub->status_urb_khevent->urb->status = -ESHUTDOWN;
+
+        vdphci_hub_urb_done(hub, hub->status_urb_khevent);
+
+        hub->status_urb_khevent = NULL;
+    }
+
+    vdphci_port_set_device_attached(hub->upstream_port, 0, USB_SPEED_UNKNOWN);
+    vdphci_port_update(hub->upstream_port, &giveback_list);
+    vdphci_port_set_hub(hub->upstream_port, NULL);
+
+    spin_unlock_irqrestore(hub->lock, flags);
+
+    tasklet_kill(&hub->tasklet);
+
+    list_splice_init(&hub->done_list, &giveback_list);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+}
+
+int vdphci_hub_urb_enqueue(struct vdphci_hub* hub, struct urb* urb)
+{
+    struct vdphci_khevent_urb* event;
+
+    switch (usb_pipetype(urb->pipe)) {
+    case PIPE_CONTROL:
+        if (usb_pipeendpoint(urb->pipe) != 0) {
+            return -EINVAL;
+        }
+        break;
+    case PIPE_INTERRUPT:
+        if ((usb_pipeendpoint(urb->pipe) != 1) || !usb_pipein(urb->pipe) ||
+            hub->status_urb_khevent) {
+            return -EINVAL;
+        }
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    event = kzalloc(sizeof(*event), GFP_ATOMIC);
+
+    if (event == NULL) {
+        return -ENOMEM;
+    }
+
+    event->type = vdphci_hevent_type_urb;
+    INIT_LIST_HEAD(&event->list);
+    event->urb = urb;
+    urb->hcpriv = event;
+
+    if (usb_pipetype(urb->pipe) == PIPE_INTERRUPT) {
+        /*
+         * Complete it when some downstream port status changes, some may be
+         * pending already.
+         */
+
+        hub->status_urb_khevent = event;
+    } else {
+        urb->status = vdphci_hub_control(hub,
+            (const struct usb_ctrlrequest*)urb->setup_packet,
+            urb->transfer_buffer,
+            urb->transfer_buffer_length,
+            &urb->actual_length,
+            &hub->done_list);
+
+        vdphci_hub_urb_done(hub, event);
+    }
+
+    tasklet_schedule(&hub->tasklet);
+
+    return 0;
+}
+
+void vdphci_hub_urb_dequeue(struct vdphci_hub* hub, struct urb* urb, struct list_head* giveback_list)
+{
+    struct vdphci_khevent_urb* event = urb->hcpriv;
+
+    if (!event) {
+        return;
+    }
+
+    BUG_ON(event != hub->status_urb_khevent);
+
+    hub->status_urb_khevent = NULL;
+
+    vdphci_hub_urb_done(hub, event);
+
+    list_move_tail(&event->list, giveback_list);
+}
+
+void vdphci_hub_signal(struct vdphci_hub* hub, vdphci_hsignal hsignal, struct list_head* giveback_list)
+{
+    u8 i;
+
+    switch (hsignal) {
+    case vdphci_hsignal_reset_start:
+    case vdphci_hsignal_power_off:
+        /*
+         * Hub forgets its configuration and powers its ports off.
+         */
+
+        dprintk("hub reset\n");
+
+        hub->configuration = 0;
+        hub->remote_wakeup = 0;
+
+        for (i = 0; i < hub->num_ports; ++i) {
+            vdphci_port_reset_status_bits(&hub->ports[i], USB_PORT_STAT_POWER);
+            vdphci_port_update(&hub->ports[i], giveback_list);
+        }
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDPHCI_HUB_H_
+#define _VDPHCI_HUB_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/usb.h>
+#include <linux/usb/hcd.h>
+#include "vdphci-common.h"
+#include "vdphci_port.h"
+
+/*
+ * Virtual USB 2.0 hub emulated in kernel. It's connected to a root hub port and
+ * has its own set of downstream ports, each of them is driven by the user just like
+ * a root hub port. Hub's own requests never reach the user.
+ */
+struct vdphci_hub
+{
+    /*
+     * HCD lock.
+     */
+    spinlock_t* lock;
+
+    /*
+     * Root hub port the hub is connected to.
+     */
+    struct vdphci_port* upstream_port;
+
+    /*
+     * Downstream ports, 'num_ports' long.
+     */
+    struct vdphci_port* ports;
+    u8 num_ports;
+
+    /*
+     * Standard device state.
+     * @{
+     */
+    u8 configuration;
+    int remote_wakeup;
+    /*
+     * @}
+     */
+
+    /*
+     * Pending status change interrupt URB, NULL if there's none.
+     */
+    struct vdphci_khevent_urb* status_urb_khevent;
+
+    /*
+     * Served URB khevents waiting for 'tasklet' to give them back.
+     */
+    struct list_head done_list;
+
+    struct tasklet_struct tasklet;
+};
+
+/*
+ * Initializes the hub and connects it to 'upstream_port', 'ports' must be initialized already.
+ * Must be called WITHOUT HCD lock being held.
+ */
+void vdphci_hub_init(spinlock_t* lock,
+    struct vdphci_port* upstream_port,
+    struct vdphci_port* ports,
+    u8 num_ports,
+    struct vdphci_hub* hub);
+
+/*
+ * Disconnects the hub and gives back all of its URBs, must be called WITHOUT HCD lock being held.
+ */
+void vdphci_hub_cleanup(struct vdphci_hub* hub);
+
+/*
+ * All of the functions below must be called WITH HCD lock being held
+ * @{
+ */
+
+/*
+ * Serve URB sent to the hub itself, URB must be linked to its endpoint already.
+ */
+int vdphci_hub_urb_enqueue(struct vdphci_hub* hub, struct urb* urb);
+
+/*
+ * Same as 'vdphci_port_urb_dequeue', but for URBs sent to the hub itself.
+ */
+void vdphci_hub_urb_dequeue(struct vdphci_hub* hub, struct urb* urb, struct list_head* giveback_list);
+
+/*
+ * Called on signals of 'upstream_port'.
+ */
+void vdphci_hub_signal(struct vdphci_hub* hub, vdphci_hsignal hsignal, struct list_head* giveback_list);
+
+/*
+ * @}
+ */
+
+/*
+ * Forces the hub to re-query downstream port statuses, must be called WITHOUT HCD lock being held.
+ */
+static inline void vdphci_hub_invalidate_ports(struct vdphci_hub* hub)
+{
+    tasklet_schedule(&hub->tasklet);
+}
+
+#endif
@@ -0,0 +1,618 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <linux/slab.h>
+#include "vdphci_loopback.h"
+#include "debug.h"
+
+/*
+ * Same IDs as g_zero, so usbtest binds to it.
+ */
+#define VDPHCI_LOOPBACK_VENDOR_ID 0x0525
+#define VDPHCI_LOOPBACK_PRODUCT_ID 0xa4a0
+
+/*
+ * g_zero vendor requests, write and read back the control buffer.
+ */
+#define VDPHCI_LOOPBACK_REQ_WRITE 0x5b
+#define VDPHCI_LOOPBACK_REQ_READ 0x5c
+
+/*
+ * Alternate setting 0 has bulk and interrupt endpoints, alternate setting 1 adds
+ * isochronous ones.
+ */
+#define VDPHCI_LOOPBACK_ALT0_EPS 4
+#define VDPHCI_LOOPBACK_ALT1_EPS 6
+
+#define VDPHCI_LOOPBACK_CONFIG_SIZE (USB_DT_CONFIG_SIZE + \
+    2 * USB_DT_INTERFACE_SIZE + \
+    (VDPHCI_LOOPBACK_ALT0_EPS + VDPHCI_LOOPBACK_ALT1_EPS) * USB_DT_ENDPOINT_SIZE)
+
+/*
+ * Enough for any reply except vendor ones, the largest one is config descriptor.
+ */
+#define VDPHCI_LOOPBACK_MAX_REPLY 128
+
+struct vdphci_loopback_ep
+{
+    u8 address;
+    u8 attributes;
+    u16 hs_max_packet;
+    u8 hs_interval;
+    u16 fs_max_packet;
+    u8 fs_interval;
+};
+
+/*
+ * Endpoint 'i + 1' is described by entry 'i'.
+ */
+static const struct vdphci_loopback_ep vdphci_loopback_eps[VDPHCI_LOOPBACK_ALT1_EPS] =
+{
+    { USB_DIR_IN | 1, USB_ENDPOINT_XFER_BULK, 512, 0, 64, 0 },
+    { USB_DIR_OUT | 2, USB_ENDPOINT_XFER_BULK, 512, 0, 64, 0 },
+    { USB_DIR_IN | 3, USB_ENDPOINT_XFER_INT, 1024, 4, 64, 1 },
+    { USB_DIR_OUT | 4, USB_ENDPOINT_XFER_INT, 1024, 4, 64, 1 },
+    { USB_DIR_IN | 5, USB_ENDPOINT_XFER_ISOC, 1024, 4, 1023, 1 },
+    { USB_DIR_OUT | 6, USB_ENDPOINT_XFER_ISOC, 1024, 4, 1023, 1 }
+};
+
+static const char* const vdphci_loopback_strings[] =
+{
+    NULL, /* LANGID table */
+    "vdphci",
+    "Loopback source/sink"
+};
+
+static const struct usb_device_descriptor vdphci_loopback_device_desc =
+{
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = cpu_to_le16(0x0200),
+    .bDeviceClass = USB_CLASS_VENDOR_SPEC,
+    .bDeviceSubClass = 0,
+    .bDeviceProtocol = 0,
+    .bMaxPacketSize0 = 64,
+    .idVendor = cpu_to_le16(VDPHCI_LOOPBACK_VENDOR_ID),
+    .idProduct = cpu_to_le16(VDPHCI_LOOPBACK_PRODUCT_ID),
+    .bcdDevice = cpu_to_le16(0x0100),
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 0,
+    .bNumConfigurations = 1
+};
+
+static const struct usb_qualifier_descriptor vdphci_loopback_qualifier_desc =
+{
+    .bLength = sizeof(struct usb_qualifier_descriptor),
+    .bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+    .bcdUSB = cpu_to_le16(0x0200),
+    .bDeviceClass = USB_CLASS_VENDOR_SPEC,
+    .bDeviceSubClass = 0,
+    .bDeviceProtocol = 0,
+    .bMaxPacketSize0 = 64,
+    .bNumConfigurations = 1,
+    .bRESERVED = 0
+};
+
+static const struct usb_config_descriptor vdphci_loopback_config_desc =
+{
+    .bLength = USB_DT_CONFIG_SIZE,
+    .bDescriptorType = USB_DT_CONFIG,
+    .wTotalLength = cpu_to_le16(VDPHCI_LOOPBACK_CONFIG_SIZE),
+    .bNumInterfaces = 1,
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER | USB_CONFIG_ATT_WAKEUP,
+    .bMaxPower = 0
+};
+
+/*
+ * Fill config descriptor, 'type' is either USB_DT_CONFIG or USB_DT_OTHER_SPEED_CONFIG.
+ */
+static int vdphci_loopback_get_config(u8 type, int high_speed, u8* data)
+{
+    struct usb_config_descriptor config_desc = vdphci_loopback_config_desc;
+    u8* p = data;
+    int alt, i;
+
+    config_desc.bDescriptorType = type;
+
+    memcpy(p, &config_desc, USB_DT_CONFIG_SIZE);
+    p += USB_DT_CONFIG_SIZE;
+
+    for (alt = 0; alt < 2; ++alt) {
+        struct usb_interface_descriptor interface_desc;
+        int num_eps = alt ? VDPHCI_LOOPBACK_ALT1_EPS : VDPHCI_LOOPBACK_ALT0_EPS;
+
+        memset(&interface_desc, 0, sizeof(interface_desc));
+
+        interface_desc.bLength = USB_DT_INTERFACE_SIZE;
+        interface_desc.bDescriptorType = USB_DT_INTERFACE;
+        interface_desc.bInterfaceNumber = 0;
+        interface_desc.bAlternateSetting = alt;
+        interface_desc.bNumEndpoints = num_eps;
+        interface_desc.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+
+        memcpy(p, &interface_desc, USB_DT_INTERFACE_SIZE);
+        p += USB_DT_INTERFACE_SIZE;
+
+        for (i = 0; i < num_eps; ++i) {
+            const struct vdphci_loopback_ep* ep = &vdphci_loopback_eps[i];
+            struct usb_endpoint_descriptor endpoint_desc;
+
+            memset(&endpoint_desc, 0, sizeof(endpoint_desc));
+
+            endpoint_desc.bLength = USB_DT_ENDPOINT_SIZE;
+            endpoint_desc.bDescriptorType = USB_DT_ENDPOINT;
+            endpoint_desc.bEndpointAddress = ep->address;
+            endpoint_desc.bmAttributes = ep->attributes;
+            endpoint_desc.wMaxPacketSize = cpu_to_le16(high_speed ? ep->hs_max_packet : ep->fs_max_packet);
+            endpoint_desc.bInterval = high_speed ? ep->hs_interval : ep->fs_interval;
+
+            memcpy(p, &endpoint_desc, USB_DT_ENDPOINT_SIZE);
+            p += USB_DT_ENDPOINT_SIZE;
+        }
+    }
+
+    return p - data;
+}
+
+static int vdphci_loopback_get_string(u8 index, u8* data)
+{
+    const char* str;
+    int i;
+
+    if (index == 0) {
+        data[0] = 4;
+        data[1] = USB_DT_STRING;
+        data[2] = 0x09; /* en-US */
+        data[3] = 0x04;
+
+        return 4;
+    }
+
+    if (index >= ARRAY_SIZE(vdphci_loopback_strings)) {
+        return -1;
+    }
+
+    str = vdphci_loopback_strings[index];
+
+    for (i = 0; str[i]; ++i) {
+        data[2 + i * 2] = str[i];
+        data[2 + i * 2 + 1] = 0;
+    }
+
+    data[0] = 2 + i * 2;
+    data[1] = USB_DT_STRING;
+
+    return data[0];
+}
+
+/*
+ * Returns descriptor length or -1 if there's no such descriptor.
+ */
+static int vdphci_loopback_get_descriptor(u16 value, u8* data)
+{
+    switch (value >> 8) {
+    case USB_DT_DEVICE:
+        memcpy(data, &vdphci_loopback_device_desc, USB_DT_DEVICE_SIZE);
+        return USB_DT_DEVICE_SIZE;
+    case USB_DT_DEVICE_QUALIFIER:
+        memcpy(data, &vdphci_loopback_qualifier_desc, sizeof(vdphci_loopback_qualifier_desc));
+        return sizeof(vdphci_loopback_qualifier_desc);
+    case USB_DT_CONFIG:
+    case USB_DT_OTHER_SPEED_CONFIG:
+        if ((value & 0xFF) != 0) {
+            return -1;
+        }
+        return vdphci_loopback_get_config(value >> 8, ((value >> 8) == USB_DT_CONFIG), data);
+    case USB_DT_STRING:
+        return vdphci_loopback_get_string(value & 0xFF, data);
+    default:
+        return -1;
+    }
+}
+
+static inline u32 vdphci_loopback_ep_bit(u8 address)
+{
+    return 1 << ((address & USB_ENDPOINT_NUMBER_MASK) + ((address & USB_DIR_IN) ? 16 : 0));
+}
+
+/*
+ * Returns endpoint with 'address' in current alternate setting or NULL if there's none.
+ */
+static const struct vdphci_loopback_ep* vdphci_loopback_find_ep(struct vdphci_loopback* loopback,
+    u8 address)
+{
+    u8 epnum = address & USB_ENDPOINT_NUMBER_MASK;
+    u8 num_eps = loopback->alt_setting ? VDPHCI_LOOPBACK_ALT1_EPS : VDPHCI_LOOPBACK_ALT0_EPS;
+
+    if (!loopback->configuration || (epnum == 0) || (epnum > num_eps)) {
+        return NULL;
+    }
+
+    if (vdphci_loopback_eps[epnum - 1].address != address) {
+        return NULL;
+    }
+
+    return &vdphci_loopback_eps[epnum - 1];
+}
+
+static void vdphci_loopback_set_interface(struct vdphci_loopback* loopback, u8 alt_setting)
+{
+    loopback->alt_setting = alt_setting;
+    loopback->halted = 0;
+}
+
+/*
+ * Process control request, returns URB status.
+ */
+static int vdphci_loopback_control(struct vdphci_loopback* loopback,
+    const struct usb_ctrlrequest* req,
+    u8* buf,
+    u32 buf_len,
+    u32* actual_length)
+{
+    u16 type_req = (req->bRequestType << 8) | req->bRequest;
+    u16 value = le16_to_cpu(req->wValue);
+    u16 index = le16_to_cpu(req->wIndex);
+    u16 length = le16_to_cpu(req->wLength);
+    u8 data[VDPHCI_LOOPBACK_MAX_REPLY];
+    const u8* reply = data;
+    int data_len = 0;
+    int ret = 0;
+
+    memset(data, 0, sizeof(data));
+
+    switch (type_req) {
+    case DeviceRequest | USB_REQ_GET_STATUS:
+        data[0] = (1 << USB_DEVICE_SELF_POWERED) |
+            (loopback->remote_wakeup ? (1 << USB_DEVICE_REMOTE_WAKEUP) : 0);
+        data_len = 2;
+        break;
+    case InterfaceRequest | USB_REQ_GET_STATUS:
+        data_len = 2;
+        break;
+    case EndpointRequest | USB_REQ_GET_STATUS:
+        if (((index & USB_ENDPOINT_NUMBER_MASK) != 0) && !vdphci_loopback_find_ep(loopback, index)) {
+            ret = -EPIPE;
+            break;
+        }
+        data[0] = (loopback->halted & vdphci_loopback_ep_bit(index)) ? 1 : 0;
+        data_len = 2;
+        break;
+    case DeviceOutRequest | USB_REQ_CLEAR_FEATURE:
+    case DeviceOutRequest | USB_REQ_SET_FEATURE:
+        if (value != USB_DEVICE_REMOTE_WAKEUP) {
+            ret = -EPIPE;
+            break;
+        }
+        loopback->remote_wakeup = (req->bRequest == USB_REQ_SET_FEATURE);
+        break;
+    case EndpointOutRequest | USB_REQ_CLEAR_FEATURE:
+    case EndpointOutRequest | USB_REQ_SET_FEATURE:
+        if (value != USB_ENDPOINT_HALT) {
+            ret = -EPIPE;
+            break;
+        }
+        if ((index & USB_ENDPOINT_NUMBER_MASK) == 0) {
+            break;
+        }
+        if (!vdphci_loopback_find_ep(loopback, index)) {
+            ret = -EPIPE;
+            break;
+        }
+        if (req->bRequest == USB_REQ_SET_FEATURE) {
+            loopback->halted |= vdphci_loopback_ep_bit(index);
+        } else {
+            loopback->halted &= ~vdphci_loopback_ep_bit(index);
+        }
+        break;
+    case DeviceOutRequest | USB_REQ_SET_ADDRESS:
+        break;
+    case DeviceRequest | USB_REQ_GET_DESCRIPTOR:
+        data_len = vdphci_loopback_get_descriptor(value, data);
+        if (data_len < 0) {
+            ret = -EPIPE;
+        }
+        break;
+    case DeviceRequest | USB_REQ_GET_CONFIGURATION:
+        data[0] = loopback->configuration;
+        data_len = 1;
+        break;
+    case DeviceOutRequest | USB_REQ_SET_CONFIGURATION:
+        if (value > 1) {
+            ret = -EPIPE;
+            break;
+        }
+        loopback->configuration = value;
+        vdphci_loopback_set_interface(loopback, 0);
+        break;
+    case InterfaceRequest | USB_REQ_GET_INTERFACE:
+        if (!loopback->configuration || (index != 0)) {
+            ret = -EPIPE;
+            break;
+        }
+        data[0] = loopback->alt_setting;
+        data_len = 1;
+        break;
+    case InterfaceOutRequest | USB_REQ_SET_INTERFACE:
+        if (!loopback->configuration || (index != 0) || (value > 1)) {
+            ret = -EPIPE;
+            break;
+        }
+        vdphci_loopback_set_interface(loopback, value);
+        break;
+    case ((USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE) << 8) | VDPHCI_LOOPBACK_REQ_WRITE:
+        if ((value != 0) || (index != 0) || (length > VDPHCI_LOOPBACK_CTRL_BUFF_SIZE)) {
+            ret = -EPIPE;
+            break;
+        }
+        *actual_length = min_t(u32, length, buf_len);
+        memcpy(loopback->ctrl_buff, buf, *actual_length);
+        return 0;
+    case ((USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE) << 8) | VDPHCI_LOOPBACK_REQ_READ:
+        if ((value != 0) || (index != 0) || (length > VDPHCI_LOOPBACK_CTRL_BUFF_SIZE)) {
+            ret = -EPIPE;
+            break;
+        }
+        reply = loopback->ctrl_buff;
+        data_len = length;
+        break;
+    default:
+        dprintk("loopback: unsupported request 0x%X, wValue = 0x%X, wIndex = 0x%X\n",
+            type_req, value, index);
+        ret = -EPIPE;
+        break;
+    }
+
+    if (ret == 0) {
+        *actual_length = min3((u32)data_len, (u32)length, buf_len);
+
+        if (*actual_length > 0) {
+            memcpy(buf, reply, *actual_length);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Source/sink, IN transfers return zeroes, OUT transfers are discarded.
+ */
+static void vdphci_loopback_transfer(struct urb* urb)
+{
+    int i;
+
+    if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+        urb->actual_length = 0;
+        urb->error_count = 0;
+
+        for (i = 0; i < urb->number_of_packets; ++i) {
+            struct usb_iso_packet_descriptor* desc = &urb->iso_frame_desc[i];
+
+            if (usb_pipein(urb->pipe)) {
+                memset(urb->transfer_buffer + desc->offset, 0, desc->length);
+            }
+
+            desc->actual_length = desc->length;
+            desc->status = 0;
+
+            urb->actual_length += desc->length;
+        }
+    } else {
+        if (usb_pipein(urb->pipe)) {
+            memset(urb->transfer_buffer, 0, urb->transfer_buffer_length);
+        }
+
+        urb->actual_length = urb->transfer_buffer_length;
+    }
+
+    urb->status = 0;
+}
+
+static int vdphci_loopback_pipe_xfer_type(unsigned int pipe)
+{
+    switch (usb_pipetype(pipe)) {
+    case PIPE_ISOCHRONOUS:
+        return USB_ENDPOINT_XFER_ISOC;
+    case PIPE_INTERRUPT:
+        return USB_ENDPOINT_XFER_INT;
+    case PIPE_BULK:
+        return USB_ENDPOINT_XFER_BULK;
+    default:
+        return USB_ENDPOINT_XFER_CONTROL;
+    }
+}
+
+/*
+ * URB served, it'll be given back from 'tasklet'.
+ */
+static void vdphci_loopback_urb_done(struct vdphci_loopback* loopback, struct vdphci_khevent_urb* event)
+{
+    event->urb->hcpriv = NULL;
+
+    usb_hcd_unlink_urb_from_ep(bus_to_hcd(event->urb->dev->bus), event->urb);
+
+    list_add_tail(&event->list, &loopback->done_list);
+}
+
+static void vdphci_loopback_tasklet(unsigned long data)
+{
+    struct vdphci_loopback* loopback = (struct vdphci_loopback*)data;
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    spin_lock_irqsave(loopback->lock, flags);
+
+    list_splice_init(&loopback->done_list, &giveback_list);
+
+    spin_unlock_irqrestore(loopback->lock, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+}
+
+int vdphci_loopback_init(spinlock_t* lock,
+    struct vdphci_port* port,
+    struct vdphci_loopback* loopback)
+{
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    memset(loopback, 0, sizeof(*loopback));
+
+    loopback->ctrl_buff = kzalloc(VDPHCI_LOOPBACK_CTRL_BUFF_SIZE, GFP_KERNEL);
+
+    if (!loopback->ctrl_buff) {
+        return -ENOMEM;
+    }
+
+    loopback->lock = lock;
+    loopback->port = port;
+
+    INIT_LIST_HEAD(&loopback->done_list);
+
+    tasklet_init(&loopback->tasklet, vdphci_loopback_tasklet, (unsigned long)loopback);
+
+    spin_lock_irqsave(lock, flags);
+
+    vdphci_port_set_loopback(port, loopback);
+    vdphci_port_set_device_attached(port, 1, USB_SPEED_HIGH);
+    vdphci_port_update(port, &giveback_list);
+
+    spin_unlock_irqrestore(lock, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+
+    dprintk("loopback device connected to port %d\n", (int)port->number);
+
+    return 0;
+}
+
+void vdphci_loopback_cleanup(struct vdphci_loopback* loopback)
+{
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    spin_lock_irqsave(loopback->lock, flags);
+
+    vdphci_port_set_device_attached(loopback->port, 0, USB_SPEED_UNKNOWN);
+    vdphci_port_update(loopback->port, &giveback_list);
+    vdphci_port_set_loopback(loopback->port, NULL);
+
+    spin_unlock_irqrestore(loopback->lock, flags);
+
+    tasklet_kill(&loopback->tasklet);
+
+    list_splice_init(&loopback->done_list, &giveback_list);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+
+    kfree(loopback->ctrl_buff);
+}
+
+int vdphci_loopback_urb_enqueue(struct vdphci_loopback* loopback, struct urb* urb)
+{
+    struct vdphci_khevent_urb* event;
+    u8 epnum = usb_pipeendpoint(urb->pipe);
+
+    if (epnum == 0) {
+        if (usb_pipetype(urb->pipe) != PIPE_CONTROL) {
+            return -EINVAL;
+        }
+    } else {
+        const struct vdphci_loopback_ep* ep =
+            vdphci_loopback_find_ep(loopback, epnum | (usb_pipein(urb->pipe) ? USB_DIR_IN : 0));
+
+        if (!ep || (ep->attributes != vdphci_loopback_pipe_xfer_type(urb->pipe))) {
+            return -EINVAL;
+        }
+    }
+
+    event = kzalloc(sizeof(*event), GFP_ATOMIC);
+
+    if (event == NULL) {
+        return -ENOMEM;
+    }
+
+    event->type = vdphci_hevent_type_urb;
+    INIT_LIST_HEAD(&event->list);
+    event->urb = urb;
+    urb->hcpriv = event;
+
+    if (epnum == 0) {
+        urb->status = vdphci_loopback_control(loopback,
+            (const struct usb_ctrlrequest*)urb->setup_packet,
+            urb->transfer_buffer,
+            urb->transfer_buffer_length,
+            &urb->actual_length);
+    } else if (loopback->halted & vdphci_loopback_ep_bit(epnum | (usb_pipein(urb->pipe) ? USB_DIR_IN : 0))) {
+        urb->actual_length = 0;
+        urb->status = -EPIPE;
+    } else {
+        vdphci_loopback_transfer(urb);
+    }
+
+    /*
+     * Everything is served immediately, but URBs can't be given back from here.
+     */
+
+    vdphci_loopback_urb_done(loopback, event);
+
+    tasklet_schedule(&loopback->tasklet);
+
+    return 0;
+}
+
+void vdphci_loopback_urb_dequeue(struct vdphci_loopback* loopback, struct urb* urb, struct list_head* giveback_list)
+{
+    /*
+     * URBs are served on enqueue, this one is waiting for the tasklet already.
+     */
+
+    WARN_ON(urb->hcpriv);
+}
+
+void vdphci_loopback_signal(struct vdphci_loopback* loopback, vdphci_hsignal hsignal, struct list_head* giveback_list)
+{
+    switch (hsignal) {
+    case vdphci_hsignal_reset_start:
+    case vdphci_hsignal_power_off:
+        dprintk("loopback reset\n");
+
+        loopback->configuration = 0;
+        loopback->remote_wakeup = 0;
+        vdphci_loopback_set_interface(loopback, 0);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDPHCI_LOOPBACK_H_
+#define _VDPHCI_LOOPBACK_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/usb.h>
+#include <linux/usb/hcd.h>
+#include "vdphci-common.h"
+#include "vdphci_port.h"
+
+#define VDPHCI_LOOPBACK_CTRL_BUFF_SIZE 4096
+
+/*
+ * In-kernel source/sink device in the spirit of g_zero, used to measure the HCD alone.
+ * It answers enumeration itself, IN transfers return zeroes and OUT transfers are discarded,
+ * vendor requests 0x5b/0x5c write and read back a control buffer. It's recognized by
+ * usbtest, so 'testusb' can be run against it.
+ */
+struct vdphci_loopback
+{
+    /*
+     * HCD lock.
+     */
+    spinlock_t* lock;
+
+    /*
+     * Port the device is connected to.
+     */
+    struct vdphci_port* port;
+
+    /*
+     * Standard device state.
+     * @{
+     */
+    u8 configuration;
+    u8 alt_setting;
+    int remote_wakeup;
+    /*
+     * @}
+     */
+
+    /*
+     * Halted endpoints, bit 'epnum' for OUT endpoints, bit '16 + epnum' for IN endpoints.
+     */
+    u32 halted;
+
+    /*
+     * Vendor request buffer, VDPHCI_LOOPBACK_CTRL_BUFF_SIZE long.
+     */
+    u8* ctrl_buff;
+
+    /*
+     * Served URB khevents waiting for 'tasklet' to give them back.
+     */
+    struct list_head done_list;
+
+    struct tasklet_struct tasklet;
+};
+
+/*
+ * Initializes the device and connects it to 'port', must be called WITHOUT HCD lock being held.
+ */
+int vdphci_loopback_init(spinlock_t* lock,
+    struct vdphci_port* port,
+    struct vdphci_loopback* loopback);
+
+/*
+ * Disconnects the device and gives back all of its URBs, must be called WITHOUT HCD lock being held.
+ */
+void vdphci_loopback_cleanup(struct vdphci_loopback* loopback);
+
+/*
+ * All of the functions below must be called WITH HCD lock being held
+ * @{
+ */
+
+/*
+ * Serve URB sent to the device, URB must be linked to its endpoint already.
+ */
+int vdphci_loopback_urb_enqueue(struct vdphci_loopback* loopback, struct urb* urb);
+
+/*
+ * Same as 'vdphci_port_urb_dequeue', but for URBs sent to the device.
+ */
+void vdphci_loopback_urb_dequeue(struct vdphci_loopback* loopback, struct urb* urb, struct list_head* giveback_list);
+
+/*
+ * Called on signals of the port.
+ */
+void vdphci_loopback_signal(struct vdphci_loopback* loopback, vdphci_hsignal hsignal, struct list_head* giveback_list);
+
+/*
+ * @}
+ */
+
+#endif
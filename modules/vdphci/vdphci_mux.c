@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <linux/poll.h>
+#include "vdphci_mux.h"
+#include "vdphci_hcd.h"
+#include "vdphci_device.h"
+#include "vdphci_port.h"
+#include "vdphci_class.h"
+#include "debug.h"
+
+static inline struct vdphci_mux* cdev_to_vdphci_mux(struct cdev* dev)
+{
+    return container_of((void*)dev, struct vdphci_mux, cdev);
+}
+
+static int vdphci_mux_open(struct inode* inode, struct file* file)
+{
+    struct vdphci_mux* mux = cdev_to_vdphci_mux(inode->i_cdev);
+    struct vdphci_hcd* hcd = mux->parent_hcd;
+    int i;
+
+    if (file->f_mode & FMODE_EXEC) {
+        return -EPERM;
+    }
+
+    if (mutex_lock_interruptible(&mux->mutex)) {
+        return -ERESTARTSYS;
+    }
+
+    if (mux->opened) {
+        mutex_unlock(&mux->mutex);
+
+        return -EBUSY;
+    }
+
+    mux->claimed = 0;
+    mux->next_port = 0;
+
+    for (i = 0; i < vdphci_hcd_num_devices(hcd); ++i) {
+        /*
+         * Ports opened by others and ports that can't be opened at all are skipped.
+         */
+
+        if (vdphci_device_claim(&hcd->devices[i], file) == 0) {
+            mux->claimed |= 1 << i;
+        }
+    }
+
+    mux->opened = 1;
+
+    file->private_data = mux;
+
+    mutex_unlock(&mux->mutex);
+
+    dprintk("%s: mux file %p opened, ports 0x%X\n",
+        vdphci_hcd_to_usb_hcd(hcd)->self.bus_name,
+        file,
+        mux->claimed);
+
+    return nonseekable_open(inode, file);
+}
+
+static int vdphci_mux_release(struct inode* inode, struct file* file)
+{
+    struct vdphci_mux* mux = cdev_to_vdphci_mux(inode->i_cdev);
+    struct vdphci_hcd* hcd = mux->parent_hcd;
+    int i;
+
+    mutex_lock(&mux->mutex);
+
+    for (i = 0; i < vdphci_hcd_num_devices(hcd); ++i) {
+        if (mux->claimed & (1 << i)) {
+            vdphci_device_unclaim(&hcd->devices[i], file);
+        }
+    }
+
+    mux->claimed = 0;
+    mux->opened = 0;
+
+    mutex_unlock(&mux->mutex);
+
+    dprintk("%s: mux file %p closed\n",
+        vdphci_hcd_to_usb_hcd(hcd)->self.bus_name,
+        file);
+
+    return 0;
+}
+
+/*
+ * Read one HEvent of some claimed port, 'mutex' must be held. Returns number of bytes read
+ * including the mux header, 0 if there're no events.
+ */
+static ssize_t vdphci_mux_read_one(struct vdphci_mux* mux, struct iov_iter* to, int* last)
+{
+    struct vdphci_hcd* hcd = mux->parent_hcd;
+    int num_devices = vdphci_hcd_num_devices(hcd);
+    u32 ready;
+    int i;
+
+    if (iov_iter_count(to) < (sizeof(struct vdphci_mux_header) + sizeof(struct vdphci_hevent_header))) {
+        return -EINVAL;
+    }
+
+    ready = vdphci_hcd_get_ready_ports(hcd) & mux->claimed;
+
+    for (i = 0; (i < num_devices) && ready; ++i) {
+        int n = (mux->next_port + i) % num_devices;
+        struct vdphci_device* device = &hcd->devices[n];
+        struct vdphci_mux_header header;
+        struct iov_iter header_iter = *to;
+        struct iov_iter event_iter = *to;
+        vdphci_hevent_type type = vdphci_hevent_type_signal;
+        ssize_t retval;
+
+        if ((ready & (1 << n)) == 0) {
+            continue;
+        }
+
+        ready &= ~(1 << n);
+
+        iov_iter_advance(&event_iter, sizeof(header));
+
+        if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+            return -ERESTARTSYS;
+        }
+
+        retval = vdphci_device_read_one(device, &event_iter, &type);
+
+        mutex_unlock(&device->cdev_mutex);
+
+        if (retval < 0) {
+            return retval;
+        }
+
+        if (retval == 0) {
+            /*
+             * Gone meanwhile.
+             */
+
+            continue;
+        }
+
+        memset(&header, 0, sizeof(header));
+
+        header.portnum = device->port->number;
+
+        if (copy_to_iter(&header, sizeof(header), &header_iter) != sizeof(header)) {
+            return -EFAULT;
+        }
+
+        if (retval <= (ssize_t)sizeof(struct vdphci_hevent_header)) {
+            /*
+             * Didn't fit, it stays pending and must be the next one read.
+             */
+
+            mux->next_port = n;
+            *last = 1;
+        } else {
+            mux->next_port = (n + 1) % num_devices;
+            *last = (type == vdphci_hevent_type_unlink_urbs);
+        }
+
+        return sizeof(header) + retval;
+    }
+
+    return 0;
+}
+
+/*
+ * Write one DEvent to a claimed port. Returns number of bytes written including the mux header.
+ */
+static ssize_t vdphci_mux_write_one(struct vdphci_mux* mux, struct iov_iter* from)
+{
+    struct vdphci_hcd* hcd = mux->parent_hcd;
+    struct vdphci_mux_header header;
+    struct vdphci_device* device;
+    ssize_t retval;
+
+    if (iov_iter_count(from) < sizeof(header)) {
+        return -EINVAL;
+    }
+
+    if (copy_from_iter(&header, sizeof(header), from) != sizeof(header)) {
+        return -EFAULT;
+    }
+
+    if ((header.portnum >= vdphci_hcd_num_devices(hcd)) ||
+        ((mux->claimed & (1 << header.portnum)) == 0)) {
+        return -EINVAL;
+    }
+
+    device = &hcd->devices[header.portnum];
+
+    if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+        return -ERESTARTSYS;
+    }
+
+    retval = vdphci_device_write_one(device, from);
+
+    mutex_unlock(&device->cdev_mutex);
+
+    if (retval < 0) {
+        return retval;
+    }
+
+    return sizeof(header) + retval;
+}
+
+/*
+ * 'vdphci_device_io_fn' for the mux, 'mutex' must be held.
+ */
+static ssize_t vdphci_mux_io_one(void* opaque, struct iov_iter* iter, int write, int* last)
+{
+    struct vdphci_mux* mux = opaque;
+
+    return write ? vdphci_mux_write_one(mux, iter) : vdphci_mux_read_one(mux, iter, last);
+}
+
+static ssize_t vdphci_mux_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct vdphci_mux* mux = iocb->ki_filp->private_data;
+    int last = 0;
+    ssize_t retval;
+
+    if (mutex_lock_interruptible(&mux->mutex) != 0) {
+        return -ERESTARTSYS;
+    }
+
+    retval = vdphci_mux_read_one(mux, to, &last);
+
+    mutex_unlock(&mux->mutex);
+
+    if (retval > 0) {
+        iocb->ki_pos += retval;
+    }
+
+    return retval;
+}
+
+static ssize_t vdphci_mux_write_iter(struct kiocb* iocb, struct iov_iter* from)
+{
+    struct vdphci_mux* mux = iocb->ki_filp->private_data;
+    ssize_t retval;
+
+    /*
+     * 'claimed' doesn't change while the file is opened, no need for 'mutex', so
+     * writes don't wait for reads.
+     */
+
+    retval = vdphci_mux_write_one(mux, from);
+
+    if (retval > 0) {
+        iocb->ki_pos += retval;
+    }
+
+    return retval;
+}
+
+static unsigned int vdphci_mux_poll(struct file* file, struct poll_table_struct* wait)
+{
+    struct vdphci_mux* mux = file->private_data;
+    struct vdphci_hcd* hcd = mux->parent_hcd;
+    unsigned int ret = 0;
+    int i;
+
+    for (i = 0; i < vdphci_hcd_num_devices(hcd); ++i) {
+        if (mux->claimed & (1 << i)) {
+            poll_wait(file, vdphci_port_get_khevent_wq(&hcd->ports[i]), wait);
+        }
+    }
+
+    if (vdphci_hcd_get_ready_ports(hcd) & mux->claimed) {
+        ret |= (POLLIN | POLLRDNORM);
+    }
+
+    ret |= (POLLOUT | POLLWRNORM);
+
+    return ret;
+}
+
+static long vdphci_mux_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+    struct vdphci_mux* mux = file->private_data;
+    struct vdphci_hcd* hcd = mux->parent_hcd;
+    long ret = 0;
+    union
+    {
+        struct vdphci_options options;
+        struct vdphci_ports_attach ports;
+        struct vdphci_io_batch batch;
+        __u32 bitmap;
+    } value;
+    int i;
+
+    if (_IOC_TYPE(cmd) != VDPHCI_IOC_MAGIC) {
+        return -ENOTTY;
+    }
+
+    switch (cmd) {
+    case VDPHCI_IOC_SET_OPTIONS:
+        if (copy_from_user(&value.options,
+            (const struct vdphci_options __user*)arg,
+            sizeof(value.options)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        /*
+         * Mapped URBs are mmap()ed via their port's file.
+         */
+
+        if (value.options.flags & ~(VDPHCI_OPTION_UNLINK_SET | VDPHCI_OPTION_TIMING)) {
+            ret = -EINVAL;
+            break;
+        }
+
+        for (i = 0; i < vdphci_hcd_num_devices(hcd); ++i) {
+            struct vdphci_device* device = &hcd->devices[i];
+
+            if ((mux->claimed & (1 << i)) == 0) {
+                continue;
+            }
+
+            if (mutex_lock_interruptible(&device->cdev_mutex) != 0) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+
+            device->options = value.options;
+
+            mutex_unlock(&device->cdev_mutex);
+        }
+        break;
+    case VDPHCI_IOC_ATTACH_PORTS:
+        if (copy_from_user(&value.ports,
+            (const struct vdphci_ports_attach __user*)arg,
+            sizeof(value.ports)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        ret = vdphci_device_attach_ports(hcd, &value.ports);
+        break;
+    case VDPHCI_IOC_GET_EVENTS:
+    case VDPHCI_IOC_PUT_EVENTS:
+        if (copy_from_user(&value.batch,
+            (const struct vdphci_io_batch __user*)arg,
+            sizeof(value.batch)) != 0) {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (mutex_lock_interruptible(&mux->mutex) != 0) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        ret = vdphci_device_io_batch(&value.batch,
+            (cmd == VDPHCI_IOC_PUT_EVENTS),
+            vdphci_mux_io_one,
+            mux);
+
+        mutex_unlock(&mux->mutex);
+        break;
+    case VDPHCI_IOC_GET_READY_PORTS:
+    case VDPHCI_IOC_GET_MUX_PORTS:
+        value.bitmap = mux->claimed;
+
+        if (cmd == VDPHCI_IOC_GET_READY_PORTS) {
+            value.bitmap &= vdphci_hcd_get_ready_ports(hcd);
+        }
+
+        if (copy_to_user((__u32 __user*)arg, &value.bitmap, sizeof(value.bitmap)) != 0) {
+            ret = -EFAULT;
+        }
+        break;
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+
+    return ret;
+}
+
+static struct file_operations vdphci_mux_ops =
+{
+    .owner = THIS_MODULE,
+    .llseek = no_llseek,
+    .open = vdphci_mux_open,
+    .release = vdphci_mux_release,
+    .write_iter = vdphci_mux_write_iter,
+    .read_iter = vdphci_mux_read_iter,
+    .poll = vdphci_mux_poll,
+    .unlocked_ioctl = vdphci_mux_ioctl
+};
+
+int vdphci_mux_init(struct vdphci_hcd* parent_hcd, dev_t devno, struct vdphci_mux* mux)
+{
+    int ret;
+
+    BUG_ON(in_atomic());
+
+    memset(mux, 0, sizeof(*mux));
+
+    mux->parent_hcd = parent_hcd;
+
+    cdev_init(&mux->cdev, &vdphci_mux_ops);
+
+    mux->cdev.owner = THIS_MODULE;
+    mux->cdev.ops = &vdphci_mux_ops;
+
+    mutex_init(&mux->mutex);
+
+    ret = cdev_add(&mux->cdev, devno, 1);
+
+    if (ret != 0) {
+        dprintk("%s: error %d adding mux char device (%d, %d)\n",
+            vdphci_hcd_to_usb_hcd(parent_hcd)->self.bus_name,
+            ret,
+            MAJOR(devno),
+            MINOR(devno));
+
+        return ret;
+    }
+
+    mux->dev = device_create(vdphci_class,
+        vdphci_hcd_to_usb_hcd(parent_hcd)->self.controller,
+        devno,
+        mux,
+        VDPHCI_MUX_NAME);
+
+    if (IS_ERR(mux->dev)) {
+        ret = PTR_ERR(mux->dev);
+
+        mux->dev = NULL;
+
+        dprintk("%s: error %d creating mux device node (%d, %d)\n",
+            vdphci_hcd_to_usb_hcd(parent_hcd)->self.bus_name,
+            ret,
+            MAJOR(devno),
+            MINOR(devno));
+
+        cdev_del(&mux->cdev);
+
+        return ret;
+    }
+
+    dprintk("%s: mux char device (%d, %d) created\n",
+        vdphci_hcd_to_usb_hcd(parent_hcd)->self.bus_name,
+        MAJOR(devno),
+        MINOR(devno));
+
+    return 0;
+}
+
+void vdphci_mux_cleanup(struct vdphci_mux* mux)
+{
+    BUG_ON(in_atomic());
+
+    device_destroy(vdphci_class, mux->cdev.dev);
+
+    cdev_del(&mux->cdev);
+}
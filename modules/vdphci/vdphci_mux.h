@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDPHCI_MUX_H_
+#define _VDPHCI_MUX_H_
+
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include "vdphci-common.h"
+
+struct vdphci_hcd;
+
+/*
+ * Char device that serves all ports of an HCD over one file, see 'vdphci_mux_header'.
+ */
+struct vdphci_mux
+{
+    struct vdphci_hcd* parent_hcd;
+
+    struct cdev cdev;
+
+    /*
+     * Node in vdphci_class, VDPHCI_MUX_NAME.
+     */
+    struct device* dev;
+
+    /*
+     * Protects the fields below, serializes reads.
+     */
+    struct mutex mutex;
+
+    int opened;
+
+    /*
+     * Ports claimed on open, bit N is for port number N.
+     */
+    u32 claimed;
+
+    /*
+     * Port to look for events first on the next read.
+     */
+    int next_port;
+};
+
+int vdphci_mux_init(struct vdphci_hcd* parent_hcd, dev_t devno, struct vdphci_mux* mux);
+
+void vdphci_mux_cleanup(struct vdphci_mux* mux);
+
+#endif
@@ -32,6 +32,16 @@ struct vdphci_platform_data
 {
     u8 num_ports;
 
+    /*
+     * Number of virtual hub downstream ports, 0 for no virtual hub.
+     */
+    u8 num_hub_ports;
+
+    /*
+     * Bit N set means device N is the in-kernel loopback device.
+     */
+    u32 loopback_mask;
+
     /*
      * Major number for devices. 0 for dynamic allocation.
      */
@@ -24,7 +24,10 @@
  */
 
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include "vdphci_port.h"
+#include "vdphci_hub.h"
+#include "vdphci_loopback.h"
 #include "debug.h"
 
 #ifdef DEBUG
@@ -66,6 +69,12 @@ static const char* vdphci_port_status_bit_to_str(u32 status_bit)
 
 #define seq_num_before_eq(a, b) seq_num_after_eq(b, a)
 
+/*
+ * Keep mmap() offsets below 2G so that 32-bit users without large file support
+ * can map too.
+ */
+#define VDPHCI_PORT_MAP_PGOFF_LIMIT (0x7FFFFFFFUL >> PAGE_SHIFT)
+
 static void vdphci_port_advance_current_urb_khevent(struct vdphci_port* port)
 {
     if (port->current_urb_khevent) {
@@ -94,13 +103,30 @@ static void vdphci_port_khevent_urb_free(struct vdphci_khevent_urb* event)
     kfree(event);
 }
 
-static void vdphci_port_khevent_unlink_urb_free(struct vdphci_khevent_unlink_urb* event)
+static void vdphci_port_khevent_unlink_urb_free(struct vdphci_port* port,
+    struct vdphci_khevent_unlink_urb* event)
 {
+    BUG_ON(port->num_unlink_urbs == 0);
+
+    --port->num_unlink_urbs;
+
     list_del(&event->list);
 
     kfree(event);
 }
 
+/*
+ * New khevent is available.
+ */
+static void vdphci_port_notify(struct vdphci_port* port)
+{
+    wake_up(&port->khevent_wq);
+
+    if (port->eventfd) {
+        eventfd_signal(port->eventfd, 1);
+    }
+}
+
 static void vdphci_port_khevent_signal_enqueue(struct vdphci_port* port,
     vdphci_hsignal hsignal)
 {
@@ -123,7 +149,31 @@ static void vdphci_port_khevent_signal_enqueue(struct vdphci_port* port,
 
     list_add_tail(&event->list, &port->signal_list);
 
-    wake_up(&port->khevent_wq);
+    vdphci_port_notify(port);
+}
+
+static void vdphci_port_signal(struct vdphci_port* port,
+    vdphci_hsignal hsignal,
+    struct list_head* giveback_list)
+{
+    if (port->hub) {
+        /*
+         * Nobody reads khevents of a port with the virtual hub on it, the hub
+         * reacts to signals itself.
+         */
+
+        vdphci_hub_signal(port->hub, hsignal, giveback_list);
+
+        return;
+    }
+
+    if (port->loopback) {
+        vdphci_loopback_signal(port->loopback, hsignal, giveback_list);
+
+        return;
+    }
+
+    vdphci_port_khevent_signal_enqueue(port, hsignal);
 }
 
 /*
@@ -175,10 +225,11 @@ static void vdphci_port_khevent_urb_dequeue(struct vdphci_port* port,
     unlink_urb_event->khevent_urb = event;
 
     list_add_tail(&unlink_urb_event->list, &port->unlink_urb_list);
+    ++port->num_unlink_urbs;
 
     event->khevent_unlink_urb = unlink_urb_event;
 
-    wake_up(&port->khevent_wq);
+    vdphci_port_notify(port);
 }
 
 /*
@@ -223,7 +274,38 @@ static void vdphci_port_unlink_all_urbs(struct vdphci_port* port, struct list_he
     }
 }
 
-void vdphci_port_init(u8 number, struct vdphci_port* port)
+static void vdphci_port_unmap_work(struct work_struct* work)
+{
+    struct vdphci_port* port = container_of(work, struct vdphci_port, unmap_work);
+    struct vdphci_khevent_urb* urb_event;
+    struct address_space* mapping;
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    vdphci_port_map_lock(port);
+
+    spin_lock_irqsave(port->lock, flags);
+    list_splice_init(&port->unmap_list, &giveback_list);
+    mapping = port->mapping;
+    spin_unlock_irqrestore(port->lock, flags);
+
+    list_for_each_entry(urb_event, &giveback_list, list) {
+        if (urb_event->mapped && mapping) {
+            unmap_mapping_range(mapping,
+                (loff_t)urb_event->map_pgoff << PAGE_SHIFT,
+                (loff_t)urb_event->map_pages << PAGE_SHIFT,
+                1);
+        }
+    }
+
+    vdphci_port_map_unlock(port);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+}
+
+void vdphci_port_init(u8 number, spinlock_t* lock, struct vdphci_port* port)
 {
     memset(port, 0, sizeof(*port));
 
@@ -239,6 +321,14 @@ void vdphci_port_init(u8 number, struct vdphci_port* port)
      * For testing sequence number wrap.
      */
     port->seq_num = 0xFFFFFF00;
+
+    port->lock = lock;
+
+    INIT_LIST_HEAD(&port->unmap_list);
+    INIT_WORK(&port->unmap_work, vdphci_port_unmap_work);
+    mutex_init(&port->map_mutex);
+
+    vdphci_shaper_init(lock, &port->shaper);
 }
 
 void vdphci_port_cleanup(struct vdphci_port* port)
@@ -251,6 +341,10 @@ void vdphci_port_cleanup(struct vdphci_port* port)
 
     vdphci_port_giveback_urbs(&giveback_list);
 
+    vdphci_shaper_cleanup(&port->shaper);
+
+    vdphci_port_flush_unmap(port);
+
     memset(port, 0, sizeof(*port));
 }
 
@@ -322,6 +416,8 @@ int vdphci_port_urb_enqueue(struct vdphci_port* port, struct urb* urb, u32* seq_
     INIT_LIST_HEAD(&event->list);
     event->seq_num = port->seq_num++;
     event->urb = urb;
+    event->enqueue_time = ktime_get();
+    event->frame_number = usb_get_current_frame_number(urb->dev);
     urb->hcpriv = event;
 
     list_add_tail(&event->list, &port->urb_list);
@@ -334,7 +430,7 @@ int vdphci_port_urb_enqueue(struct vdphci_port* port, struct urb* urb, u32* seq_
         port->current_urb_khevent = event;
     }
 
-    wake_up(&port->khevent_wq);
+    vdphci_port_notify(port);
 
     if (seq_num) {
         *seq_num = event->seq_num;
@@ -386,7 +482,7 @@ void vdphci_port_khevent_proceed(struct vdphci_port* port)
             urb_event->khevent_unlink_urb = NULL;
         }
 
-        vdphci_port_khevent_unlink_urb_free(event);
+        vdphci_port_khevent_unlink_urb_free(port, event);
     } else if (!list_empty(&port->signal_list)) {
         struct vdphci_khevent_signal* event =
             list_first_entry(&port->signal_list,
@@ -401,6 +497,18 @@ void vdphci_port_khevent_proceed(struct vdphci_port* port)
     }
 }
 
+struct vdphci_khevent_unlink_urb* vdphci_port_khevent_unlink_urb_next(struct vdphci_port* port,
+    struct vdphci_khevent_unlink_urb* event)
+{
+    struct list_head* next = event ? event->list.next : port->unlink_urb_list.next;
+
+    if (next == &port->unlink_urb_list) {
+        return NULL;
+    }
+
+    return list_entry(next, struct vdphci_khevent_unlink_urb, list);
+}
+
 struct vdphci_khevent_urb* vdphci_port_khevent_urb_find(struct vdphci_port* port,
     u32 seq_num)
 {
@@ -443,7 +551,7 @@ void vdphci_port_khevent_urb_remove(struct vdphci_port* port,
          * Free 'unlink urb' event first.
          */
 
-        vdphci_port_khevent_unlink_urb_free(unlink_urb_event);
+        vdphci_port_khevent_unlink_urb_free(port, unlink_urb_event);
 
         event->khevent_unlink_urb = NULL;
     }
@@ -460,7 +568,103 @@ void vdphci_port_khevent_urb_remove(struct vdphci_port* port,
 
     usb_hcd_unlink_urb_from_ep(bus_to_hcd(event->urb->dev->bus), event->urb);
 
-    list_move_tail(&event->list, giveback_list);
+    if (event->mapped || !list_empty(&port->unmap_list)) {
+        /*
+         * User still has the transfer buffer mapped, pages must be zapped
+         * from user's address space before the buffer goes back to the driver
+         * and we can't do that from here.
+         */
+
+        list_move_tail(&event->list, &port->unmap_list);
+
+        schedule_work(&port->unmap_work);
+    } else {
+        list_move_tail(&event->list, giveback_list);
+    }
+}
+
+/*
+ * Find a mapped URB on 'list' whose pages overlap [pgoff, pgoff + num_pages).
+ */
+static struct vdphci_khevent_urb* vdphci_port_find_map_overlap(struct list_head* list,
+    unsigned long pgoff,
+    unsigned long num_pages)
+{
+    struct vdphci_khevent_urb* tmp;
+
+    list_for_each_entry(tmp, list, list) {
+        if (tmp->map_pages &&
+            (tmp->map_pgoff < (pgoff + num_pages)) &&
+            (pgoff < (tmp->map_pgoff + tmp->map_pages))) {
+            return tmp;
+        }
+    }
+
+    return NULL;
+}
+
+void vdphci_port_khevent_urb_map(struct vdphci_port* port,
+    struct vdphci_khevent_urb* event)
+{
+    unsigned long num_pages = PAGE_ALIGN(event->urb->transfer_buffer_length) >> PAGE_SHIFT;
+    struct vdphci_khevent_urb* tmp;
+
+    BUG_ON(event->map_pages);
+
+    while (1) {
+        if ((port->map_pgoff + num_pages) > VDPHCI_PORT_MAP_PGOFF_LIMIT) {
+            port->map_pgoff = 0;
+        }
+
+        /*
+         * After a wrap an old mapping may still be around, skip past it. URBs waiting
+         * on 'unmap_list' count too, unmap work would otherwise zap our pages. Once
+         * unmap work took them off the list it holds the map lock until they're
+         * zapped, so the new range can't be mmap()ed before that.
+         */
+
+        tmp = vdphci_port_find_map_overlap(&port->urb_list, port->map_pgoff, num_pages);
+
+        if (!tmp) {
+            tmp = vdphci_port_find_map_overlap(&port->unmap_list, port->map_pgoff, num_pages);
+        }
+
+        if (!tmp) {
+            break;
+        }
+
+        port->map_pgoff = tmp->map_pgoff + tmp->map_pages;
+    }
+
+    event->map_pgoff = port->map_pgoff;
+    event->map_pages = num_pages;
+
+    port->map_pgoff += num_pages;
+}
+
+struct vdphci_khevent_urb* vdphci_port_khevent_urb_find_mapped(struct vdphci_port* port,
+    unsigned long pgoff,
+    unsigned long num_pages)
+{
+    struct vdphci_khevent_urb* event;
+
+    list_for_each_entry(event, &port->urb_list, list) {
+        if (event == port->current_urb_khevent) {
+            /*
+             * Not reported yet.
+             */
+
+            break;
+        }
+
+        if (event->map_pages &&
+            (event->map_pgoff == pgoff) &&
+            (num_pages <= event->map_pages)) {
+            return event;
+        }
+    }
+
+    return NULL;
 }
 
 void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_list)
@@ -512,14 +716,14 @@ void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_lis
 
             vdphci_port_unlink_all_urbs(port, giveback_list);
 
-            vdphci_port_khevent_signal_enqueue(port, vdphci_hsignal_reset_start);
+            vdphci_port_signal(port, vdphci_hsignal_reset_start, giveback_list);
         } else if ((port->old_status & USB_PORT_STAT_RESET) != 0 &&
             (port->status & USB_PORT_STAT_RESET) == 0) {
             /*
              * Reset end
              */
 
-            vdphci_port_khevent_signal_enqueue(port, vdphci_hsignal_reset_end);
+            vdphci_port_signal(port, vdphci_hsignal_reset_end, giveback_list);
         }
 
         if ((port->old_status & USB_PORT_STAT_POWER) == 0 &&
@@ -528,7 +732,7 @@ void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_lis
              * Power on
              */
 
-            vdphci_port_khevent_signal_enqueue(port, vdphci_hsignal_power_on);
+            vdphci_port_signal(port, vdphci_hsignal_power_on, giveback_list);
         } else if ((port->old_status & USB_PORT_STAT_POWER) != 0 &&
             (port->status & USB_PORT_STAT_POWER) == 0) {
             /*
@@ -537,8 +741,34 @@ void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_lis
 
             vdphci_port_unlink_all_urbs(port, giveback_list);
 
-            vdphci_port_khevent_signal_enqueue(port, vdphci_hsignal_power_off);
+            vdphci_port_signal(port, vdphci_hsignal_power_off, giveback_list);
         }
+
+        if ((port->status & USB_PORT_STAT_ENABLE) != 0 &&
+            ((port->status & USB_PORT_STAT_SUSPEND) != 0 || port->hcd_suspended)) {
+            if (!port->suspend_signaled) {
+                /*
+                 * Suspend
+                 */
+
+                port->suspend_signaled = 1;
+
+                vdphci_port_signal(port, vdphci_hsignal_suspend, giveback_list);
+            }
+        } else if (port->suspend_signaled) {
+            port->suspend_signaled = 0;
+
+            /*
+             * Resume, unless the port was disabled by reset or power off,
+             * the device gets those signals instead.
+             */
+
+            if ((port->status & USB_PORT_STAT_ENABLE) != 0) {
+                vdphci_port_signal(port, vdphci_hsignal_resume, giveback_list);
+            }
+        }
+    } else {
+        port->suspend_signaled = 0;
     }
 
     if ((port->old_status & USB_PORT_STAT_CONNECTION) != 0 &&
@@ -553,6 +783,114 @@ void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_lis
     port->old_status = port->status;
 }
 
+void vdphci_port_clear_feature(struct vdphci_port* port, u16 feature,
+    struct list_head* giveback_list)
+{
+    switch (feature) {
+    case USB_PORT_FEAT_SUSPEND: {
+        if (vdphci_port_check_status_bits(port, USB_PORT_STAT_SUSPEND)) {
+            vdphci_port_set_resuming(port, 1);
+            vdphci_port_set_re_timeout(port, 20);
+        }
+        break;
+    }
+    default:
+        vdphci_port_reset_status_bits(port, 1 << feature);
+        vdphci_port_update(port, giveback_list);
+    }
+}
+
+void vdphci_port_set_feature(struct vdphci_port* port, u16 feature,
+    struct list_head* giveback_list)
+{
+    switch (feature) {
+    case USB_PORT_FEAT_SUSPEND: {
+        if (vdphci_port_is_enabled(port)) {
+            vdphci_port_set_status_bits(port, USB_PORT_STAT_SUSPEND);
+            vdphci_port_update(port, giveback_list);
+        }
+        break;
+    }
+    case USB_PORT_FEAT_POWER: {
+        vdphci_port_set_status_bits(port, USB_PORT_STAT_POWER);
+        vdphci_port_update(port, giveback_list);
+        break;
+    }
+    case USB_PORT_FEAT_RESET: {
+        vdphci_port_reset_status_bits(port, (USB_PORT_STAT_ENABLE |
+            USB_PORT_STAT_LOW_SPEED |
+            USB_PORT_STAT_HIGH_SPEED));
+        vdphci_port_set_re_timeout(port, 50);
+    }
+    default:
+        if (vdphci_port_check_status_bits(port, USB_PORT_STAT_POWER)) {
+            vdphci_port_set_status_bits(port, 1 << feature);
+            vdphci_port_update(port, giveback_list);
+        }
+    }
+}
+
+u32 vdphci_port_poll_status(struct vdphci_port* port, struct list_head* giveback_list)
+{
+    /*
+     * Whoever resets or resumes must GetPortStatus to
+     * complete it !!!
+     */
+
+    if (vdphci_port_is_resuming(port) &&
+        time_after(jiffies, vdphci_port_get_re_timeout(port))) {
+        vdphci_port_set_status_bits(port, USB_PORT_STAT_C_SUSPEND << 16);
+        vdphci_port_reset_status_bits(port, USB_PORT_STAT_SUSPEND);
+    }
+
+    if (vdphci_port_check_status_bits(port, USB_PORT_STAT_RESET) &&
+        time_after(jiffies, vdphci_port_get_re_timeout(port))) {
+        vdphci_port_set_status_bits(port, USB_PORT_STAT_C_RESET << 16);
+        vdphci_port_reset_status_bits(port, USB_PORT_STAT_RESET);
+
+        if (vdphci_port_is_device_attached(port)) {
+            dprintk("port %d enabled\n", port->number);
+
+            vdphci_port_set_status_bits(port, USB_PORT_STAT_ENABLE);
+        }
+    }
+
+    vdphci_port_update(port, giveback_list);
+
+    return vdphci_port_get_status(port);
+}
+
+int vdphci_port_remote_wakeup(struct vdphci_port* port)
+{
+    if (!port->suspend_signaled) {
+        return 0;
+    }
+
+    if ((port->status & USB_PORT_STAT_SUSPEND) != 0 && !port->resuming) {
+        /*
+         * The device has already driven resume signaling, so no need to
+         * wait for 20ms, resume completes on next poll.
+         */
+
+        vdphci_port_set_resuming(port, 1);
+        port->re_timeout = jiffies - 1;
+    }
+
+    return 1;
+}
+
+int vdphci_port_poll_resume(struct vdphci_port* port, struct list_head* giveback_list)
+{
+    if (vdphci_port_is_resuming(port) &&
+        time_after(jiffies, vdphci_port_get_re_timeout(port))) {
+        vdphci_port_set_status_bits(port, USB_PORT_STAT_C_SUSPEND << 16);
+        vdphci_port_reset_status_bits(port, USB_PORT_STAT_SUSPEND);
+        vdphci_port_update(port, giveback_list);
+    }
+
+    return (vdphci_port_check_status_bits(port, VDPHCI_PORT_C_MASK) != 0);
+}
+
 void vdphci_port_giveback_urbs(struct list_head* list)
 {
     struct vdphci_khevent_urb *urb_event, *tmp;
@@ -576,3 +914,8 @@ void vdphci_port_giveback_urbs(struct list_head* list)
         vdphci_port_khevent_urb_free(urb_event);
     }
 }
+
+void vdphci_port_flush_unmap(struct vdphci_port* port)
+{
+    flush_work(&port->unmap_work);
+}
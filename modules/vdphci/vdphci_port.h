@@ -28,10 +28,26 @@
 
 #include <linux/kernel.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/fs.h>
+#include <linux/eventfd.h>
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
 #include "vdphci-common.h"
+#include "vdphci_shaper.h"
+
+/*
+ * Port status change bits.
+ */
+#define VDPHCI_PORT_C_MASK \
+    ((USB_PORT_STAT_C_CONNECTION |\
+      USB_PORT_STAT_C_ENABLE |\
+      USB_PORT_STAT_C_SUSPEND |\
+      USB_PORT_STAT_C_OVERCURRENT |\
+      USB_PORT_STAT_C_RESET) << 16)
 
 /*
  * Kernel part of HEvent. Use 'type' to cast it to what you need.
@@ -54,6 +70,9 @@ struct vdphci_khevent_signal
 
 struct vdphci_khevent_unlink_urb;
 
+struct vdphci_hub;
+struct vdphci_loopback;
+
 /*
  * Used to link pending URB. Note that a pointer to this structure
  * is always stored in 'urb->hcpriv' !
@@ -76,6 +95,26 @@ struct vdphci_khevent_urb
      * then we should set this field to NULL.
      */
     struct vdphci_khevent_unlink_urb* khevent_unlink_urb;
+
+    /*
+     * Non-zero 'map_pages' means that this urb was reported as mapped, its
+     * transfer buffer can be mmap()ed at 'map_pgoff'. 'mapped' is set once the user
+     * actually did that, such urb must be unmapped before giveback.
+     */
+    unsigned long map_pgoff;
+    unsigned long map_pages;
+    int mapped;
+
+    /*
+     * When the urb was enqueued, for VDPHCI_OPTION_TIMING.
+     */
+    ktime_t enqueue_time;
+    u32 frame_number;
+
+    /*
+     * When the shaper should give back the urb, ns.
+     */
+    u64 release_time;
 };
 
 struct vdphci_khevent_unlink_urb
@@ -125,6 +164,12 @@ struct vdphci_port
      * @}
      */
 
+    /*
+     * Device was told that it's suspended, either selectively or
+     * because the whole bus is suspended.
+     */
+    int suspend_signaled;
+
     /*
      * Device is attached to this port.
      */
@@ -150,6 +195,7 @@ struct vdphci_port
      * List of URB unlink events.
      */
     struct list_head unlink_urb_list;
+    unsigned int num_unlink_urbs;
 
     /*
      * When both 'signal_list' and 'unlink_urb_list' are empty we'll return
@@ -163,6 +209,11 @@ struct vdphci_port
      */
     wait_queue_head_t khevent_wq;
 
+    /*
+     * Signaled along with 'khevent_wq', see VDPHCI_IOC_SET_EVENTFD.
+     */
+    struct eventfd_ctx* eventfd;
+
     /*
      * Auto-incremented urb sequence number.
      */
@@ -171,9 +222,63 @@ struct vdphci_port
     /*
      * @}
      */
+
+    /*
+     * Mapped URBs related.
+     * @{
+     */
+
+    /*
+     * HCD lock, 'unmap_work' needs it.
+     */
+    spinlock_t* lock;
+
+    /*
+     * Address space of the file that currently owns the port, mapped URBs
+     * are zapped from it.
+     */
+    struct address_space* mapping;
+
+    /*
+     * Next free mmap() page offset.
+     */
+    unsigned long map_pgoff;
+
+    /*
+     * Removed URBs waiting to be unmapped and given back. Once this list is non-empty
+     * all removed URBs go here, otherwise they'll be given back out of order.
+     */
+    struct list_head unmap_list;
+    struct work_struct unmap_work;
+
+    /*
+     * Serializes mmap() against 'unmap_work'.
+     */
+    struct mutex map_mutex;
+
+    /*
+     * @}
+     */
+
+    /*
+     * Delays giveback of URBs completed by the user, see VDPHCI_IOC_SET_SHAPING.
+     */
+    struct vdphci_shaper shaper;
+
+    /*
+     * Non-NULL when the virtual hub is connected to this port. Such port has
+     * no user, URBs for the hub itself are served by the hub.
+     */
+    struct vdphci_hub* hub;
+
+    /*
+     * Non-NULL when the in-kernel loopback device is connected to this port, it
+     * serves all URBs itself and the port has no user.
+     */
+    struct vdphci_loopback* loopback;
 };
 
-void vdphci_port_init(u8 number, struct vdphci_port* port);
+void vdphci_port_init(u8 number, spinlock_t* lock, struct vdphci_port* port);
 
 void vdphci_port_cleanup(struct vdphci_port* port);
 
@@ -271,6 +376,48 @@ static inline int vdphci_port_is_enabled(struct vdphci_port* port)
     return port->enabled;
 }
 
+static inline unsigned int vdphci_port_get_num_unlink_urbs(struct vdphci_port* port)
+{
+    return port->num_unlink_urbs;
+}
+
+static inline void vdphci_port_set_hub(struct vdphci_port* port, struct vdphci_hub* hub)
+{
+    port->hub = hub;
+}
+
+static inline struct vdphci_hub* vdphci_port_get_hub(struct vdphci_port* port)
+{
+    return port->hub;
+}
+
+/*
+ * Returns previous eventfd, it's up to the caller to put it.
+ */
+static inline struct eventfd_ctx* vdphci_port_set_eventfd(struct vdphci_port* port, struct eventfd_ctx* eventfd)
+{
+    struct eventfd_ctx* old = port->eventfd;
+
+    port->eventfd = eventfd;
+
+    return old;
+}
+
+static inline void vdphci_port_set_loopback(struct vdphci_port* port, struct vdphci_loopback* loopback)
+{
+    port->loopback = loopback;
+}
+
+static inline struct vdphci_loopback* vdphci_port_get_loopback(struct vdphci_port* port)
+{
+    return port->loopback;
+}
+
+static inline void vdphci_port_set_mapping(struct vdphci_port* port, struct address_space* mapping)
+{
+    port->mapping = mapping;
+}
+
 /*
  * Add an urb khevent and signal waiters. 'seq_num' (can be NULL) receives assigned
  * sequence number just for debugging purposes.
@@ -299,6 +446,15 @@ struct vdphci_khevent* vdphci_port_khevent_current(struct vdphci_port* port);
  */
 void vdphci_port_khevent_proceed(struct vdphci_port* port);
 
+/*
+ * Return 'unlink urb' khevent that follows 'event' or the first one if 'event' is NULL,
+ * NULL if there's none. Pending 'unlink urb' khevents always come first, so the first
+ * 'vdphci_port_get_num_unlink_urbs' khevents can be consumed by calling
+ * 'vdphci_port_khevent_proceed' as many times.
+ */
+struct vdphci_khevent_unlink_urb* vdphci_port_khevent_unlink_urb_next(struct vdphci_port* port,
+    struct vdphci_khevent_unlink_urb* event);
+
 /*
  * Find urb khevent by sequence number. Returns NULL if not found.
  * Pointer returned can be considered valid only until next call to some
@@ -320,6 +476,23 @@ void vdphci_port_khevent_urb_remove(struct vdphci_port* port,
     struct vdphci_khevent_urb* event,
     struct list_head* giveback_list);
 
+/*
+ * Assign mmap() page offset to urb khevent, the number of pages is taken from
+ * urb's transfer buffer length.
+ */
+void vdphci_port_khevent_urb_map(struct vdphci_port* port,
+    struct vdphci_khevent_urb* event);
+
+/*
+ * Find already reported mapped urb khevent whose mapping starts at 'pgoff' and
+ * is at least 'num_pages' long. Returns NULL if not found.
+ * Must be called with 'map_mutex' held too, the khevent returned stays valid
+ * until 'map_mutex' is released if 'mapped' is set on it.
+ */
+struct vdphci_khevent_urb* vdphci_port_khevent_urb_find_mapped(struct vdphci_port* port,
+    unsigned long pgoff,
+    unsigned long num_pages);
+
 /*
  * Update port status.
  * 'giveback_list' is a list head that'll contain urbs to giveback. After this call
@@ -330,6 +503,36 @@ void vdphci_port_khevent_urb_remove(struct vdphci_port* port,
  */
 void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_list);
 
+/*
+ * Port feature requests, same for root hub ports and virtual hub ports. 'giveback_list'
+ * is the same as in 'vdphci_port_update'.
+ * @{
+ */
+void vdphci_port_clear_feature(struct vdphci_port* port, u16 feature,
+    struct list_head* giveback_list);
+
+void vdphci_port_set_feature(struct vdphci_port* port, u16 feature,
+    struct list_head* giveback_list);
+
+/*
+ * Complete reset/resume if it's time and return current status, for GetPortStatus.
+ */
+u32 vdphci_port_poll_status(struct vdphci_port* port, struct list_head* giveback_list);
+
+/*
+ * Device requests remote wakeup, completes port resume on next poll if the port is
+ * selectively suspended. Returns non-zero if the device is suspended and the host must be woken up.
+ */
+int vdphci_port_remote_wakeup(struct vdphci_port* port);
+
+/*
+ * Complete resume if it's time, returns non-zero if port has status changes to report.
+ */
+int vdphci_port_poll_resume(struct vdphci_port* port, struct list_head* giveback_list);
+/*
+ * @}
+ */
+
 /*
  * @}
  */
@@ -341,6 +544,21 @@ void vdphci_port_update(struct vdphci_port* port, struct list_head* giveback_lis
 
 void vdphci_port_giveback_urbs(struct list_head* list);
 
+static inline void vdphci_port_map_lock(struct vdphci_port* port)
+{
+    mutex_lock(&port->map_mutex);
+}
+
+static inline void vdphci_port_map_unlock(struct vdphci_port* port)
+{
+    mutex_unlock(&port->map_mutex);
+}
+
+/*
+ * Wait until all URBs waiting to be unmapped are given back.
+ */
+void vdphci_port_flush_unmap(struct vdphci_port* port);
+
 /*
  * @}
  */
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdphci_selftest.h"
+#include "vdphci_port.h"
+#include "print.h"
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+/*
+ * Queue depths to benchmark at, the last one is the maximum.
+ */
+static const int vdphci_selftest_depths[] = { 1, 16, 256, 4096 };
+
+#define VDPHCI_SELFTEST_MAX_URBS 4096
+
+#define VDPHCI_SELFTEST_ROUNDS 8
+
+struct vdphci_selftest
+{
+    spinlock_t lock;
+
+    struct vdphci_port port;
+
+    struct urb* urbs[VDPHCI_SELFTEST_MAX_URBS];
+
+    struct list_head giveback_list;
+
+    int failed;
+};
+
+#define vdphci_selftest_check(st, cond) \
+    do { \
+        if (!(cond)) { \
+            print_error("selftest: %s:%d: check failed: %s\n", __func__, __LINE__, #cond); \
+            (st)->failed = 1; \
+        } \
+    } while (0)
+
+static void vdphci_selftest_port_init(struct vdphci_selftest* st, u32 seq_num)
+{
+    vdphci_port_init(0, &st->lock, &st->port);
+
+    st->port.seq_num = seq_num;
+}
+
+/*
+ * URBs removed from the port are freed here instead of being given back,
+ * they were never submitted.
+ */
+static void vdphci_selftest_free_giveback(struct vdphci_selftest* st)
+{
+    struct vdphci_khevent_urb *event, *tmp;
+
+    list_for_each_entry_safe(event, tmp, &st->giveback_list, list) {
+        list_del(&event->list);
+        kfree(event);
+    }
+}
+
+static void vdphci_selftest_port_cleanup(struct vdphci_selftest* st)
+{
+    struct vdphci_khevent_urb *event, *tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&st->lock, flags);
+
+    list_for_each_entry_safe(event, tmp, &st->port.urb_list, list) {
+        vdphci_port_khevent_urb_remove(&st->port, event, &st->giveback_list);
+    }
+
+    spin_unlock_irqrestore(&st->lock, flags);
+
+    vdphci_selftest_free_giveback(st);
+
+    vdphci_port_cleanup(&st->port);
+}
+
+static int vdphci_selftest_enqueue(struct vdphci_selftest* st, int count, u32* seq_nums)
+{
+    unsigned long flags;
+    int i, ret = 0;
+
+    spin_lock_irqsave(&st->lock, flags);
+
+    for (i = 0; i < count; ++i) {
+        ret = vdphci_port_urb_enqueue(&st->port, st->urbs[i], &seq_nums[i]);
+
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&st->lock, flags);
+
+    vdphci_selftest_check(st, ret == 0);
+
+    return ret;
+}
+
+/*
+ * URB khevents come out in enqueue order and sequence numbers keep going up
+ * across the wrap.
+ */
+static void vdphci_selftest_order(struct vdphci_selftest* st)
+{
+    u32 seq_nums[32];
+    struct vdphci_khevent* event;
+    int i;
+
+    vdphci_selftest_port_init(st, 0xFFFFFFF0);
+
+    if (vdphci_selftest_enqueue(st, ARRAY_SIZE(seq_nums), seq_nums) != 0) {
+        goto out;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(seq_nums); ++i) {
+        vdphci_selftest_check(st, seq_nums[i] == (u32)(0xFFFFFFF0 + i));
+
+        event = vdphci_port_khevent_current(&st->port);
+
+        vdphci_selftest_check(st, event && (event->type == vdphci_hevent_type_urb));
+
+        if (!event || (event->type != vdphci_hevent_type_urb)) {
+            goto out;
+        }
+
+        vdphci_selftest_check(st, ((struct vdphci_khevent_urb*)event)->urb == st->urbs[i]);
+        vdphci_selftest_check(st, ((struct vdphci_khevent_urb*)event)->seq_num == seq_nums[i]);
+
+        vdphci_port_khevent_proceed(&st->port);
+    }
+
+    vdphci_selftest_check(st, vdphci_port_khevent_current(&st->port) == NULL);
+
+out:
+    vdphci_selftest_port_cleanup(st);
+}
+
+/*
+ * Only reported URBs can be found, lookup works across the wrap.
+ */
+static void vdphci_selftest_find(struct vdphci_selftest* st)
+{
+    u32 seq_nums[16];
+    int i;
+
+    vdphci_selftest_port_init(st, 0xFFFFFFF8);
+
+    if (vdphci_selftest_enqueue(st, ARRAY_SIZE(seq_nums), seq_nums) != 0) {
+        goto out;
+    }
+
+    vdphci_selftest_check(st, vdphci_port_khevent_urb_find(&st->port, seq_nums[0]) == NULL);
+
+    for (i = 0; i < (ARRAY_SIZE(seq_nums) / 2); ++i) {
+        vdphci_port_khevent_proceed(&st->port);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(seq_nums); ++i) {
+        struct vdphci_khevent_urb* event = vdphci_port_khevent_urb_find(&st->port, seq_nums[i]);
+
+        if (i < (ARRAY_SIZE(seq_nums) / 2)) {
+            vdphci_selftest_check(st, event && (event->urb == st->urbs[i]));
+        } else {
+            vdphci_selftest_check(st, event == NULL);
+        }
+    }
+
+    vdphci_selftest_check(st, vdphci_port_khevent_urb_find(&st->port, seq_nums[0] - 1) == NULL);
+    vdphci_selftest_check(st,
+        vdphci_port_khevent_urb_find(&st->port, seq_nums[ARRAY_SIZE(seq_nums) - 1] + 1) == NULL);
+
+out:
+    vdphci_selftest_port_cleanup(st);
+}
+
+/*
+ * Dequeue of an unreported URB removes it right away, dequeue of a reported one
+ * adds exactly one unlink khevent that goes away together with the URB.
+ */
+static void vdphci_selftest_unlink(struct vdphci_selftest* st)
+{
+    u32 seq_nums[4];
+    struct vdphci_khevent* event;
+    struct vdphci_khevent_urb* urb_event;
+
+    vdphci_selftest_port_init(st, 0xFFFFFFFE);
+
+    if (vdphci_selftest_enqueue(st, ARRAY_SIZE(seq_nums), seq_nums) != 0) {
+        goto out;
+    }
+
+    vdphci_port_khevent_proceed(&st->port);
+    vdphci_port_khevent_proceed(&st->port);
+
+    vdphci_port_urb_dequeue(&st->port, st->urbs[3], &st->giveback_list);
+
+    vdphci_selftest_check(st, st->urbs[3]->hcpriv == NULL);
+    vdphci_selftest_check(st, !list_empty(&st->giveback_list));
+    vdphci_selftest_check(st, st->port.num_unlink_urbs == 0);
+
+    vdphci_selftest_free_giveback(st);
+
+    urb_event = st->urbs[0]->hcpriv;
+
+    vdphci_port_urb_dequeue(&st->port, st->urbs[0], &st->giveback_list);
+    vdphci_port_urb_dequeue(&st->port, st->urbs[0], &st->giveback_list);
+
+    vdphci_selftest_check(st, st->port.num_unlink_urbs == 1);
+    vdphci_selftest_check(st, list_empty(&st->giveback_list));
+
+    event = vdphci_port_khevent_current(&st->port);
+
+    vdphci_selftest_check(st, event && (event->type == vdphci_hevent_type_unlink_urb));
+
+    if (!event || (event->type != vdphci_hevent_type_unlink_urb)) {
+        goto out;
+    }
+
+    vdphci_selftest_check(st, ((struct vdphci_khevent_unlink_urb*)event)->khevent_urb == urb_event);
+
+    vdphci_port_khevent_proceed(&st->port);
+
+    vdphci_selftest_check(st, st->port.num_unlink_urbs == 0);
+    vdphci_selftest_check(st, urb_event->khevent_unlink_urb == NULL);
+    vdphci_selftest_check(st, vdphci_port_khevent_urb_find(&st->port, seq_nums[0]) == urb_event);
+
+    urb_event = st->urbs[1]->hcpriv;
+
+    vdphci_port_urb_dequeue(&st->port, st->urbs[1], &st->giveback_list);
+
+    vdphci_selftest_check(st, st->port.num_unlink_urbs == 1);
+
+    vdphci_port_khevent_urb_remove(&st->port, urb_event, &st->giveback_list);
+
+    vdphci_selftest_check(st, st->port.num_unlink_urbs == 0);
+    vdphci_selftest_check(st, list_empty(&st->port.unlink_urb_list));
+
+    event = vdphci_port_khevent_current(&st->port);
+
+    vdphci_selftest_check(st, event && (event->type == vdphci_hevent_type_urb) &&
+        (((struct vdphci_khevent_urb*)event)->urb == st->urbs[2]));
+
+    vdphci_selftest_free_giveback(st);
+
+out:
+    vdphci_selftest_port_cleanup(st);
+}
+
+/*
+ * Enqueue, report, find and remove 'depth' URBs, returns ns per operation
+ * in 'times'.
+ */
+static void vdphci_selftest_bench_round(struct vdphci_selftest* st, int depth, u32 seq_num,
+    s64 times[3])
+{
+    static u32 seq_nums[VDPHCI_SELFTEST_MAX_URBS];
+    unsigned long flags;
+    ktime_t start;
+    int i;
+
+    vdphci_selftest_port_init(st, seq_num);
+
+    start = ktime_get();
+
+    for (i = 0; i < depth; ++i) {
+        spin_lock_irqsave(&st->lock, flags);
+        vdphci_port_urb_enqueue(&st->port, st->urbs[i], &seq_nums[i]);
+        spin_unlock_irqrestore(&st->lock, flags);
+    }
+
+    times[0] += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    spin_lock_irqsave(&st->lock, flags);
+
+    while (vdphci_port_khevent_current(&st->port)) {
+        vdphci_port_khevent_proceed(&st->port);
+    }
+
+    spin_unlock_irqrestore(&st->lock, flags);
+
+    start = ktime_get();
+
+    for (i = 0; i < depth; ++i) {
+        struct vdphci_khevent_urb* event;
+
+        spin_lock_irqsave(&st->lock, flags);
+        event = vdphci_port_khevent_urb_find(&st->port, seq_nums[i]);
+        spin_unlock_irqrestore(&st->lock, flags);
+
+        if (!event || (event->urb != st->urbs[i])) {
+            vdphci_selftest_check(st, event && (event->urb == st->urbs[i]));
+            break;
+        }
+    }
+
+    times[1] += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    start = ktime_get();
+
+    for (i = 0; i < depth; ++i) {
+        spin_lock_irqsave(&st->lock, flags);
+        if (st->urbs[i]->hcpriv) {
+            vdphci_port_khevent_urb_remove(&st->port, st->urbs[i]->hcpriv, &st->giveback_list);
+        }
+        spin_unlock_irqrestore(&st->lock, flags);
+    }
+
+    times[2] += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    vdphci_selftest_free_giveback(st);
+
+    vdphci_selftest_port_cleanup(st);
+}
+
+static void vdphci_selftest_bench(struct vdphci_selftest* st, int depth, int wrap)
+{
+    s64 times[3] = { 0, 0, 0 };
+    u32 seq_num = wrap ? (u32)(0 - (depth / 2)) : 0;
+    int i;
+
+    for (i = 0; i < VDPHCI_SELFTEST_ROUNDS; ++i) {
+        vdphci_selftest_bench_round(st, depth, seq_num, times);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(times); ++i) {
+        times[i] = div_s64(times[i], VDPHCI_SELFTEST_ROUNDS * depth);
+    }
+
+    print_info("selftest: depth %d%s: enqueue %lld ns, find %lld ns, remove %lld ns\n",
+        depth, (wrap ? " (wrap)" : ""), times[0], times[1], times[2]);
+}
+
+int vdphci_selftest_run(struct usb_hcd* uhcd)
+{
+    struct vdphci_selftest* st;
+    int i, ret = 0;
+
+    BUG_ON(in_atomic());
+
+    st = kzalloc(sizeof(*st), GFP_KERNEL);
+
+    if (!st) {
+        return -ENOMEM;
+    }
+
+    spin_lock_init(&st->lock);
+    INIT_LIST_HEAD(&st->giveback_list);
+
+    for (i = 0; i < VDPHCI_SELFTEST_MAX_URBS; ++i) {
+        st->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+
+        if (!st->urbs[i]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        st->urbs[i]->dev = uhcd->self.root_hub;
+    }
+
+    vdphci_selftest_order(st);
+    vdphci_selftest_find(st);
+    vdphci_selftest_unlink(st);
+
+    for (i = 0; i < ARRAY_SIZE(vdphci_selftest_depths); ++i) {
+        vdphci_selftest_bench(st, vdphci_selftest_depths[i], 0);
+        vdphci_selftest_bench(st, vdphci_selftest_depths[i], 1);
+    }
+
+    if (st->failed) {
+        print_error("selftest: FAILED\n");
+        ret = -EINVAL;
+    } else {
+        print_info("selftest: passed\n");
+    }
+
+out:
+    for (i = 0; i < VDPHCI_SELFTEST_MAX_URBS; ++i) {
+        usb_free_urb(st->urbs[i]);
+    }
+
+    kfree(st);
+
+    return ret;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "vdphci_shaper.h"
+#include "vdphci_port.h"
+#include "debug.h"
+
+static u32 vdphci_shaper_urb_type(struct urb* urb)
+{
+    switch (usb_pipetype(urb->pipe)) {
+    case PIPE_CONTROL: return vdphci_urb_type_control;
+    case PIPE_BULK: return vdphci_urb_type_bulk;
+    case PIPE_INTERRUPT: return vdphci_urb_type_int;
+    default: return vdphci_urb_type_iso;
+    }
+}
+
+static u32 vdphci_shaper_urb_bytes(struct urb* urb)
+{
+    int i;
+    u32 bytes = 0;
+
+    if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+        for (i = 0; i < urb->number_of_packets; ++i) {
+            bytes += urb->iso_frame_desc[i].actual_length;
+        }
+
+        return bytes;
+    }
+
+    if (usb_pipetype(urb->pipe) == PIPE_CONTROL) {
+        bytes += sizeof(struct usb_ctrlrequest);
+    }
+
+    return bytes + urb->actual_length;
+}
+
+/*
+ * Compute when 'urb' completed at 'now' (ns) should be given back.
+ */
+static u64 vdphci_shaper_release_time(struct vdphci_shaper* shaper, struct urb* urb, u64 now)
+{
+    const struct vdphci_shaping* params = &shaper->params;
+    u64 release_time;
+
+    if (params->bandwidth > 0) {
+        /*
+         * Token bucket: the bus may lag behind 'now' by at most 'burst' bytes
+         * worth of time, that's the credit accumulated while the bus was idle.
+         */
+        u64 credit = div_u64((u64)params->burst * NSEC_PER_SEC, params->bandwidth);
+        u64 start = (now > credit) ? (now - credit) : 0;
+
+        if (shaper->bus_free_time > start) {
+            start = shaper->bus_free_time;
+        }
+
+        shaper->bus_free_time = start +
+            div_u64((u64)vdphci_shaper_urb_bytes(urb) * NSEC_PER_SEC, params->bandwidth);
+
+        release_time = max(shaper->bus_free_time, now);
+    } else {
+        release_time = now;
+    }
+
+    release_time += (u64)params->latency[vdphci_shaper_urb_type(urb)] * NSEC_PER_USEC;
+
+    if (params->jitter > 0) {
+        u64 jitter;
+
+        /*
+         * In 64 bits, 'jitter + 1' mustn't wrap to 0.
+         */
+        div64_u64_rem(prandom_u32(), (u64)params->jitter + 1, &jitter);
+
+        release_time += jitter * NSEC_PER_USEC;
+    }
+
+    /*
+     * Jitter and different latencies must not reorder URBs.
+     */
+    if (release_time < shaper->last_release_time) {
+        release_time = shaper->last_release_time;
+    }
+
+    shaper->last_release_time = release_time;
+
+    return release_time;
+}
+
+static enum hrtimer_restart vdphci_shaper_timer(struct hrtimer* timer)
+{
+    struct vdphci_shaper* shaper = container_of(timer, struct vdphci_shaper, timer);
+    struct vdphci_khevent_urb *urb_event, *tmp;
+    struct list_head giveback_list;
+    unsigned long flags;
+    u64 now = ktime_get_ns();
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    spin_lock_irqsave(shaper->lock, flags);
+
+    list_for_each_entry_safe(urb_event, tmp, &shaper->urb_list, list) {
+        if (urb_event->release_time > now) {
+            hrtimer_set_expires(timer, ns_to_ktime(urb_event->release_time));
+            ret = HRTIMER_RESTART;
+            break;
+        }
+
+        list_move_tail(&urb_event->list, &giveback_list);
+    }
+
+    spin_unlock_irqrestore(shaper->lock, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+
+    return ret;
+}
+
+void vdphci_shaper_init(spinlock_t* lock, struct vdphci_shaper* shaper)
+{
+    memset(shaper, 0, sizeof(*shaper));
+
+    shaper->lock = lock;
+
+    INIT_LIST_HEAD(&shaper->urb_list);
+
+    hrtimer_init(&shaper->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    shaper->timer.function = vdphci_shaper_timer;
+}
+
+void vdphci_shaper_cleanup(struct vdphci_shaper* shaper)
+{
+    struct list_head giveback_list;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&giveback_list);
+
+    hrtimer_cancel(&shaper->timer);
+
+    spin_lock_irqsave(shaper->lock, flags);
+    list_splice_init(&shaper->urb_list, &giveback_list);
+    shaper->enabled = 0;
+    spin_unlock_irqrestore(shaper->lock, flags);
+
+    vdphci_port_giveback_urbs(&giveback_list);
+}
+
+int vdphci_shaper_check_params(const struct vdphci_shaping* params)
+{
+    int i;
+
+    if ((params->bandwidth > 0) && (params->bandwidth < VDPHCI_SHAPING_MIN_BANDWIDTH)) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(params->latency); ++i) {
+        if (params->latency[i] > VDPHCI_SHAPING_MAX_LATENCY) {
+            return -EINVAL;
+        }
+    }
+
+    if (params->jitter > VDPHCI_SHAPING_MAX_JITTER) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+void vdphci_shaper_set_params(struct vdphci_shaper* shaper, const struct vdphci_shaping* params)
+{
+    int i;
+
+    shaper->params = *params;
+
+    shaper->enabled = (params->bandwidth > 0) || (params->jitter > 0);
+
+    for (i = 0; i < ARRAY_SIZE(params->latency); ++i) {
+        shaper->enabled |= (params->latency[i] > 0);
+    }
+
+    shaper->bus_free_time = 0;
+}
+
+void vdphci_shaper_add(struct vdphci_shaper* shaper, struct list_head* giveback_list)
+{
+    struct vdphci_khevent_urb *urb_event, *tmp;
+    u64 now;
+    int was_empty = list_empty(&shaper->urb_list);
+
+    if (!shaper->enabled || list_empty(giveback_list)) {
+        return;
+    }
+
+    now = ktime_get_ns();
+
+    list_for_each_entry_safe(urb_event, tmp, giveback_list, list) {
+        urb_event->release_time = vdphci_shaper_release_time(shaper, urb_event->urb, now);
+
+        dprintk("urb %u: giveback in %llu ns\n",
+            urb_event->seq_num,
+            urb_event->release_time - now);
+
+        list_move_tail(&urb_event->list, &shaper->urb_list);
+    }
+
+    if (was_empty) {
+        urb_event = list_first_entry(&shaper->urb_list, struct vdphci_khevent_urb, list);
+
+        hrtimer_start(&shaper->timer, ns_to_ktime(urb_event->release_time), HRTIMER_MODE_ABS);
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDPHCI_SHAPER_H_
+#define _VDPHCI_SHAPER_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include "vdphci-common.h"
+
+struct vdphci_khevent_urb;
+
+/*
+ * Delays completed URBs giveback in order to mimic real bus: token bucket bandwidth
+ * limit, per transfer type latency and jitter, see VDPHCI_IOC_SET_SHAPING.
+ * URBs are given back in the order they were added.
+ */
+struct vdphci_shaper
+{
+    /*
+     * HCD lock.
+     */
+    spinlock_t* lock;
+
+    struct vdphci_shaping params;
+
+    int enabled;
+
+    /*
+     * Time (ns) when the bus is done transferring what was added so far.
+     */
+    u64 bus_free_time;
+
+    /*
+     * Release time (ns) of the last URB added, release times never go back in time.
+     */
+    u64 last_release_time;
+
+    /*
+     * URB khevents waiting for giveback, ordered by release time.
+     */
+    struct list_head urb_list;
+
+    struct hrtimer timer;
+};
+
+void vdphci_shaper_init(spinlock_t* lock, struct vdphci_shaper* shaper);
+
+/*
+ * Gives back all waiting URBs, must be called WITHOUT HCD lock being held.
+ */
+void vdphci_shaper_cleanup(struct vdphci_shaper* shaper);
+
+/*
+ * Returns 0 if 'params' are within VDPHCI_SHAPING_XXX limits, -EINVAL otherwise.
+ */
+int vdphci_shaper_check_params(const struct vdphci_shaping* params);
+
+/*
+ * All of the functions below must be called WITH HCD lock being held
+ * @{
+ */
+
+/*
+ * All zero 'params' turn shaping off, URBs that are already waiting are given back
+ * as scheduled.
+ */
+void vdphci_shaper_set_params(struct vdphci_shaper* shaper, const struct vdphci_shaping* params);
+
+static inline int vdphci_shaper_is_enabled(struct vdphci_shaper* shaper)
+{
+    return shaper->enabled;
+}
+
+/*
+ * Take completed URB khevents from 'giveback_list' and give them back later. Does
+ * nothing if shaping is off.
+ */
+void vdphci_shaper_add(struct vdphci_shaper* shaper, struct list_head* giveback_list);
+
+/*
+ * @}
+ */
+
+#endif
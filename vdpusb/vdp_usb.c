@@ -35,6 +35,8 @@ int vdp_usb_signal_type_validate(int value)
     case vdp_usb_signal_reset_end:
     case vdp_usb_signal_power_on:
     case vdp_usb_signal_power_off:
+    case vdp_usb_signal_suspend:
+    case vdp_usb_signal_resume:
         return 1;
     default:
         return 0;
@@ -77,6 +79,8 @@ const char* vdp_usb_signal_type_to_str(vdp_usb_signal_type signal_type)
     case vdp_usb_signal_reset_end: return "reset_end";
     case vdp_usb_signal_power_on: return "power_on";
     case vdp_usb_signal_power_off: return "power_off";
+    case vdp_usb_signal_suspend: return "suspend";
+    case vdp_usb_signal_resume: return "resume";
     default: return "undefined";
     };
 }
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdp_usb_capture.h"
+#include "vdp_usb_context.h"
+#include "vdp_usb_device.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define VDP_USB_CAPTURE_SNAPLEN_DEFAULT 4096
+#define VDP_USB_CAPTURE_RING_SIZE_DEFAULT 1024
+
+/*
+ * Writer thread checks the ring this often when it's idle, producers never wake it up
+ * so that recording stays free of system calls.
+ */
+#define VDP_USB_CAPTURE_IDLE_MS 10
+
+/*
+ * Ring cell, 'seq' tells who owns it: equal to position - free for a producer,
+ * position + 1 - filled, waiting for the writer (bounded MPMC queue by D. Vyukov,
+ * with a single consumer).
+ */
+struct vdp_usb_capture_slot
+{
+    size_t seq;
+
+    /*
+     * Record size, 'record', 'usbmon' and 'data' are written out as is,
+     * so they must be contiguous.
+     */
+    vdp_u64 size;
+
+    struct vdp_usb_capture_pcap_record record;
+    struct vdp_usb_capture_usbmon_header usbmon;
+    vdp_byte data[];
+};
+
+struct vdp_usb_capture
+{
+    struct vdp_usb_context* context;
+
+    FILE* file;
+
+    vdp_u32 snaplen;
+
+    size_t slot_size;
+    size_t mask;
+    char* slots;
+
+    /*
+     * Producers take positions from 'enqueue_pos', the writer owns 'dequeue_pos'.
+     * @{
+     */
+    size_t enqueue_pos __attribute__((aligned(64)));
+    size_t dequeue_pos __attribute__((aligned(64)));
+    /*
+     * @}
+     */
+
+    vdp_u64 num_dropped;
+
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int stop;
+};
+
+static inline struct vdp_usb_capture_slot* vdp_usb_capture_get_slot(struct vdp_usb_capture* capture,
+    size_t pos)
+{
+    return (struct vdp_usb_capture_slot*)(capture->slots + (pos & capture->mask) * capture->slot_size);
+}
+
+static vdp_u8 vdp_usb_capture_xfer_type(vdp_usb_urb_type type)
+{
+    switch (type) {
+    case vdp_usb_urb_iso: return 0;
+    case vdp_usb_urb_int: return 1;
+    case vdp_usb_urb_control: return 2;
+    case vdp_usb_urb_bulk: return 3;
+    default: return 3;
+    }
+}
+
+/*
+ * usbmon reports URB status as the kernel does.
+ */
+static vdp_s32 vdp_usb_capture_status(vdp_usb_urb_status status)
+{
+    switch (status) {
+    case vdp_usb_urb_status_completed: return 0;
+    case vdp_usb_urb_status_unlinked: return -ECONNRESET;
+    case vdp_usb_urb_status_stall: return -EPIPE;
+    case vdp_usb_urb_status_overflow: return -EOVERFLOW;
+    case vdp_usb_urb_status_error: return -EPROTO;
+    default: return -EPROTO;
+    }
+}
+
+/*
+ * Write out all filled slots, returns the number of records written.
+ */
+static int vdp_usb_capture_drain(struct vdp_usb_capture* capture)
+{
+    int num_written = 0;
+
+    while (1) {
+        size_t pos = capture->dequeue_pos;
+        struct vdp_usb_capture_slot* slot = vdp_usb_capture_get_slot(capture, pos);
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (pos + 1)) {
+            break;
+        }
+
+        if (fwrite(&slot->record, slot->size, 1, capture->file) != 1) {
+            VDP_USB_LOG_ERROR(capture->context, "cannot write capture record");
+        }
+
+        __atomic_store_n(&slot->seq, pos + capture->mask + 1, __ATOMIC_RELEASE);
+
+        capture->dequeue_pos = pos + 1;
+
+        ++num_written;
+    }
+
+    return num_written;
+}
+
+static void* vdp_usb_capture_thread(void* arg)
+{
+    struct vdp_usb_capture* capture = arg;
+
+    while (1) {
+        struct timespec ts;
+        int stop;
+
+        if (vdp_usb_capture_drain(capture) > 0) {
+            continue;
+        }
+
+        fflush(capture->file);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        ts.tv_nsec += VDP_USB_CAPTURE_IDLE_MS * 1000000L;
+
+        if (ts.tv_nsec >= 1000000000L) {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&capture->mtx);
+
+        if (!capture->stop) {
+            pthread_cond_timedwait(&capture->cond, &capture->mtx, &ts);
+        }
+
+        stop = capture->stop;
+
+        pthread_mutex_unlock(&capture->mtx);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    /*
+     * Devices are detached by now, nothing can be added.
+     */
+
+    vdp_usb_capture_drain(capture);
+
+    fflush(capture->file);
+
+    return NULL;
+}
+
+vdp_usb_result vdp_usb_capture_create(struct vdp_usb_context* context,
+    const char* file_path,
+    vdp_u32 snaplen,
+    vdp_u32 ring_size,
+    struct vdp_usb_capture** capture)
+{
+    vdp_usb_result vdp_res = vdp_usb_unknown;
+    struct vdp_usb_capture_pcap_header header;
+    size_t num_slots = 1;
+    size_t i;
+
+    assert(context && file_path && capture);
+    if (!context || !file_path || !capture) {
+        return vdp_usb_misuse;
+    }
+
+    assert(vdp_offsetof(struct vdp_usb_capture_slot, usbmon) ==
+        (vdp_offsetof(struct vdp_usb_capture_slot, record) + sizeof(struct vdp_usb_capture_pcap_record)));
+
+    if (snaplen == 0) {
+        snaplen = VDP_USB_CAPTURE_SNAPLEN_DEFAULT;
+    }
+
+    if (ring_size == 0) {
+        ring_size = VDP_USB_CAPTURE_RING_SIZE_DEFAULT;
+    }
+
+    while (num_slots < ring_size) {
+        num_slots <<= 1;
+    }
+
+    *capture = malloc(sizeof(**capture));
+
+    if (*capture == NULL) {
+        return vdp_usb_nomem;
+    }
+
+    memset(*capture, 0, sizeof(**capture));
+
+    (*capture)->context = context;
+    (*capture)->snaplen = snaplen;
+    (*capture)->slot_size = (sizeof(struct vdp_usb_capture_slot) + snaplen + 63) & ~(size_t)63;
+    (*capture)->mask = num_slots - 1;
+
+    (*capture)->slots = malloc((*capture)->slot_size * num_slots);
+
+    if (!(*capture)->slots) {
+        vdp_res = vdp_usb_nomem;
+
+        goto fail1;
+    }
+
+    for (i = 0; i < num_slots; ++i) {
+        vdp_usb_capture_get_slot(*capture, i)->seq = i;
+    }
+
+    (*capture)->file = fopen(file_path, "wb");
+
+    if (!(*capture)->file) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(context, "cannot create \"%s\": %s (%d)", file_path, strerror(error), error);
+
+        vdp_res = vdp_usb_not_found;
+
+        goto fail2;
+    }
+
+    memset(&header, 0, sizeof(header));
+
+    header.magic = VDP_USB_CAPTURE_PCAP_MAGIC;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.snaplen = sizeof(struct vdp_usb_capture_usbmon_header) + snaplen;
+    header.network = VDP_USB_CAPTURE_LINKTYPE_USB_LINUX_MMAPPED;
+
+    if (fwrite(&header, sizeof(header), 1, (*capture)->file) != 1) {
+        VDP_USB_LOG_ERROR(context, "cannot write pcap header to \"%s\"", file_path);
+
+        goto fail3;
+    }
+
+    pthread_mutex_init(&(*capture)->mtx, NULL);
+    pthread_cond_init(&(*capture)->cond, NULL);
+
+    if (pthread_create(&(*capture)->thread, NULL, &vdp_usb_capture_thread, *capture) != 0) {
+        VDP_USB_LOG_ERROR(context, "cannot create capture thread");
+
+        goto fail4;
+    }
+
+    VDP_USB_LOG_INFO(context, "capturing to \"%s\", snaplen %u, %u records",
+        file_path, snaplen, (vdp_u32)num_slots);
+
+    return vdp_usb_success;
+
+fail4:
+    pthread_cond_destroy(&(*capture)->cond);
+    pthread_mutex_destroy(&(*capture)->mtx);
+fail3:
+    fclose((*capture)->file);
+fail2:
+    free((*capture)->slots);
+fail1:
+    free(*capture);
+    *capture = NULL;
+
+    return vdp_res;
+}
+
+void vdp_usb_capture_destroy(struct vdp_usb_capture* capture)
+{
+    assert(capture);
+    if (!capture) {
+        return;
+    }
+
+    pthread_mutex_lock(&capture->mtx);
+    capture->stop = 1;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->mtx);
+
+    pthread_join(capture->thread, NULL);
+
+    pthread_cond_destroy(&capture->cond);
+    pthread_mutex_destroy(&capture->mtx);
+
+    if (capture->num_dropped > 0) {
+        VDP_USB_LOG_WARNING(capture->context, "%llu capture records dropped",
+            (unsigned long long)capture->num_dropped);
+    }
+
+    fclose(capture->file);
+
+    free(capture->slots);
+
+    free(capture);
+}
+
+vdp_u64 vdp_usb_capture_get_num_dropped(struct vdp_usb_capture* capture)
+{
+    assert(capture);
+    if (!capture) {
+        return 0;
+    }
+
+    return __atomic_load_n(&capture->num_dropped, __ATOMIC_RELAXED);
+}
+
+void vdp_usb_capture_urbi(struct vdp_usb_capture* capture,
+    const struct vdp_usb_urbi* urbi,
+    int complete,
+    int with_data)
+{
+    const struct vdp_usb_urb* urb = &urbi->urb;
+    struct vdp_usb_capture_slot* slot;
+    struct vdp_usb_capture_usbmon_header* usbmon;
+    struct timespec ts;
+    size_t pos = __atomic_load_n(&capture->enqueue_pos, __ATOMIC_RELAXED);
+    vdp_u32 data_length;
+
+    /*
+     * Claim a slot.
+     */
+
+    while (1) {
+        size_t seq;
+
+        slot = vdp_usb_capture_get_slot(capture, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&capture->enqueue_pos, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((ssize_t)(seq - pos) < 0) {
+            __atomic_add_fetch(&capture->num_dropped, 1, __ATOMIC_RELAXED);
+
+            return;
+        } else {
+            pos = __atomic_load_n(&capture->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    /*
+     * Payload is the OUT data on submission and the IN data on completion, iso
+     * payload is the whole buffer since packets can be anywhere in it.
+     */
+
+    if (!complete) {
+        data_length = VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address) ? 0 : urb->transfer_length;
+    } else if (!VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address)) {
+        data_length = 0;
+    } else {
+        data_length = (urb->type == vdp_usb_urb_iso) ? urb->transfer_length : urb->actual_length;
+    }
+
+    if (!with_data || !urb->transfer_buffer) {
+        data_length = 0;
+    }
+
+    usbmon = &slot->usbmon;
+
+    memset(usbmon, 0, sizeof(*usbmon));
+
+    usbmon->id = ((vdp_u64)urbi->device->device_number << 32) | urb->id;
+    usbmon->type = complete ? VDP_USB_CAPTURE_USBMON_COMPLETE : VDP_USB_CAPTURE_USBMON_SUBMIT;
+    usbmon->xfer_type = vdp_usb_capture_xfer_type(urb->type);
+    usbmon->epnum = urb->endpoint_address;
+    usbmon->devnum = urbi->device->device_number;
+    usbmon->busnum = urbi->device->busnum;
+    usbmon->flag_setup = '-';
+    usbmon->flag_data = (data_length > 0) ? 0 : (VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address) ? '<' : '>');
+    usbmon->ts_sec = ts.tv_sec;
+    usbmon->ts_usec = ts.tv_nsec / 1000;
+    usbmon->status = complete ? vdp_usb_capture_status(urb->status) : -EINPROGRESS;
+    usbmon->length = complete ? urb->actual_length : urb->transfer_length;
+    usbmon->len_cap = vdp_min(data_length, capture->snaplen);
+    usbmon->interval = urb->interval;
+    usbmon->xfer_flags = (urb->flags & VDP_USB_URB_ZERO_PACKET) ? VDP_USB_CAPTURE_URB_ZERO_PACKET : 0;
+
+    if ((urb->type == vdp_usb_urb_control) && !complete && urb->setup_packet) {
+        usbmon->flag_setup = 0;
+        memcpy(&usbmon->s.setup[0], urb->setup_packet, sizeof(usbmon->s.setup));
+    } else if (urb->type == vdp_usb_urb_iso) {
+        usbmon->s.iso.numdesc = urb->number_of_packets;
+    }
+
+    memcpy(&slot->data[0], urb->transfer_buffer, usbmon->len_cap);
+
+    slot->record.ts_sec = ts.tv_sec;
+    slot->record.ts_usec = ts.tv_nsec / 1000;
+    slot->record.incl_len = sizeof(*usbmon) + usbmon->len_cap;
+    slot->record.orig_len = sizeof(*usbmon) + data_length;
+
+    slot->size = sizeof(slot->record) + slot->record.incl_len;
+
+    /*
+     * Hand it to the writer.
+     */
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
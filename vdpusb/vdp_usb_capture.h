@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_CAPTURE_H_
+#define _VDP_USB_CAPTURE_H_
+
+#include "vdp/usb.h"
+#include "vdp_usb_urbi.h"
+
+/*
+ * pcap and usbmon formats, also read by vdp_usb_replay.
+ * @{
+ */
+
+#define VDP_USB_CAPTURE_PCAP_MAGIC 0xa1b2c3d4
+#define VDP_USB_CAPTURE_PCAP_MAGIC_NSEC 0xa1b23c4d
+#define VDP_USB_CAPTURE_LINKTYPE_USB_LINUX 189
+#define VDP_USB_CAPTURE_LINKTYPE_USB_LINUX_MMAPPED 220
+
+/*
+ * usbmon URB types, see Documentation/usb/usbmon.txt.
+ * @{
+ */
+#define VDP_USB_CAPTURE_USBMON_SUBMIT 'S'
+#define VDP_USB_CAPTURE_USBMON_COMPLETE 'C'
+
+/*
+ * Kernel's URB_ZERO_PACKET in 'xfer_flags'.
+ */
+#define VDP_USB_CAPTURE_URB_ZERO_PACKET 0x0040
+/*
+ * @}
+ */
+
+struct vdp_usb_capture_pcap_header
+{
+    vdp_u32 magic;
+    vdp_u16 version_major;
+    vdp_u16 version_minor;
+    vdp_s32 thiszone;
+    vdp_u32 sigfigs;
+    vdp_u32 snaplen;
+    vdp_u32 network;
+};
+
+struct vdp_usb_capture_pcap_record
+{
+    vdp_u32 ts_sec;
+    vdp_u32 ts_usec;
+    vdp_u32 incl_len;
+    vdp_u32 orig_len;
+};
+
+/*
+ * Same as kernel's 'struct mon_bin_hdr', 64 bytes in host byte order.
+ */
+struct vdp_usb_capture_usbmon_header
+{
+    vdp_u64 id;
+    vdp_u8 type;
+    vdp_u8 xfer_type;
+    vdp_u8 epnum;
+    vdp_u8 devnum;
+    vdp_u16 busnum;
+    char flag_setup;
+    char flag_data;
+    vdp_s64 ts_sec;
+    vdp_s32 ts_usec;
+    vdp_s32 status;
+    vdp_u32 length;
+    vdp_u32 len_cap;
+    union
+    {
+        vdp_u8 setup[8];
+        struct
+        {
+            vdp_s32 error_count;
+            vdp_s32 numdesc;
+        } iso;
+    } s;
+    vdp_s32 interval;
+    vdp_s32 start_frame;
+    vdp_u32 xfer_flags;
+    vdp_u32 ndesc;
+};
+
+/*
+ * LINKTYPE_USB_LINUX records only have the first 48 bytes of the header.
+ */
+#define VDP_USB_CAPTURE_USBMON_HEADER_SIZE_LINUX vdp_offsetof(struct vdp_usb_capture_usbmon_header, interval)
+
+/*
+ * @}
+ */
+
+/*
+ * Record 'urbi' as submitted (read from the kernel) or as completed (sent back to it),
+ * payload is only recorded if 'with_data' is set. Can be called from any thread.
+ */
+void vdp_usb_capture_urbi(struct vdp_usb_capture* capture,
+    const struct vdp_usb_urbi* urbi,
+    int complete,
+    int with_data);
+
+#endif
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -114,17 +115,112 @@ void vdp_usb_cleanup(struct vdp_usb_context* context)
     free(context);
 }
 
-vdp_usb_result vdp_usb_get_device_range(struct vdp_usb_context* context, vdp_u8* device_lower, vdp_u8* device_upper)
+int vdp_usb_sysfs_read_int(const char* dir_path, const char* attr)
+{
+    char path[PATH_MAX];
+    FILE* f;
+    int value;
+
+    int written = snprintf(&path[0], sizeof(path), "%s/%s", dir_path, attr);
+
+    if ((written >= sizeof(path)) || (written <= 0)) {
+        return -1;
+    }
+
+    f = fopen(path, "re");
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    if (fscanf(f, "%d", &value) != 1) {
+        value = -1;
+    }
+
+    fclose(f);
+
+    return value;
+}
+
+int vdp_usb_parse_device_name(const char* name)
+{
+    int device_num;
+    char c;
+
+    if (strncmp(name, VDPHCI_DEVICE_PREFIX, strlen(VDPHCI_DEVICE_PREFIX)) != 0) {
+        return -1;
+    }
+
+    if (sscanf(name + strlen(VDPHCI_DEVICE_PREFIX), "%d%c", &device_num, &c) != 1) {
+        return -1;
+    }
+
+    if ((device_num < 0) || (device_num > 255)) {
+        return -1;
+    }
+
+    return device_num;
+}
+
+static int vdp_usb_device_info_compare(const void* a, const void* b)
+{
+    const struct vdp_usb_device_info* info_a = a;
+    const struct vdp_usb_device_info* info_b = b;
+
+    return (int)info_a->device_number - (int)info_b->device_number;
+}
+
+/*
+ * vdphci class directory only has vdphci's own nodes, so this is a handful of entries
+ * regardless of how crowded /dev is.
+ */
+static int vdp_usb_get_devices_sysfs(struct vdp_usb_context* context,
+    struct vdp_usb_device_info* infos)
 {
     DIR* dir;
     struct dirent* de;
-    int found = 0;
+    int num_infos = 0;
 
-    assert(context);
-    if (!context) {
-        return vdp_usb_misuse;
+    dir = opendir(VDP_USB_SYSFS_CLASS_DIR);
+
+    if (dir == NULL) {
+        return -1;
     }
 
+    while ((de = readdir(dir)) && (num_infos < VDP_USB_MAX_DEVICES)) {
+        char dir_path[PATH_MAX];
+        int device_num = vdp_usb_parse_device_name(&de->d_name[0]);
+
+        if (device_num < 0) {
+            continue;
+        }
+
+        snprintf(&dir_path[0], sizeof(dir_path), VDP_USB_SYSFS_CLASS_DIR "/%s", &de->d_name[0]);
+
+        infos[num_infos].device_number = device_num;
+        infos[num_infos].busnum = vdp_usb_sysfs_read_int(dir_path, "busnum");
+        infos[num_infos].portnum = vdp_usb_sysfs_read_int(dir_path, "portnum");
+
+        ++num_infos;
+    }
+
+    closedir(dir);
+
+    VDP_USB_LOG_DEBUG(context, "found %d device(s) in " VDP_USB_SYSFS_CLASS_DIR, num_infos);
+
+    return num_infos;
+}
+
+/*
+ * For vdphci modules that don't register sysfs class.
+ */
+static int vdp_usb_get_devices_dev(struct vdp_usb_context* context,
+    struct vdp_usb_device_info* infos)
+{
+    DIR* dir;
+    struct dirent* de;
+    int num_infos = 0;
+
     dir = opendir("/dev");
 
     if (dir == NULL) {
@@ -132,53 +228,102 @@ vdp_usb_result vdp_usb_get_device_range(struct vdp_usb_context* context, vdp_u8*
 
         VDP_USB_LOG_ERROR(context, "cannot open /dev: %s (%d)", strerror(error), error);
 
-        return vdp_usb_not_found;
+        return -1;
     }
 
-    if (device_lower) {
-        *device_lower = 0;
+    while ((de = readdir(dir)) && (num_infos < VDP_USB_MAX_DEVICES)) {
+        int device_num;
+
+        if (de->d_type != DT_CHR) {
+            continue;
+        }
+
+        device_num = vdp_usb_parse_device_name(&de->d_name[0]);
+
+        if (device_num < 0) {
+            continue;
+        }
+
+        infos[num_infos].device_number = device_num;
+        infos[num_infos].busnum = -1;
+        infos[num_infos].portnum = -1;
+
+        ++num_infos;
     }
 
-    if (device_upper) {
-        *device_upper = 0;
+    closedir(dir);
+
+    return num_infos;
+}
+
+vdp_usb_result vdp_usb_get_devices(struct vdp_usb_context* context,
+    struct vdp_usb_device_info* infos,
+    int max_infos,
+    int* num_infos)
+{
+    struct vdp_usb_device_info all_infos[VDP_USB_MAX_DEVICES];
+    int num_all;
+
+    assert(context && (infos || (max_infos == 0)) && (max_infos >= 0) && num_infos);
+    if (!context || (!infos && (max_infos != 0)) || (max_infos < 0) || !num_infos) {
+        return vdp_usb_misuse;
+    }
+
+    *num_infos = 0;
+
+    num_all = vdp_usb_get_devices_sysfs(context, &all_infos[0]);
+
+    if (num_all < 0) {
+        VDP_USB_LOG_DEBUG(context, VDP_USB_SYSFS_CLASS_DIR " not available, scanning /dev");
+
+        num_all = vdp_usb_get_devices_dev(context, &all_infos[0]);
     }
 
-    errno = 0;
+    if (num_all <= 0) {
+        return vdp_usb_not_found;
+    }
 
-    while ((de = readdir(dir))) {
-        const char* f_name = &de->d_name[0];
+    qsort(&all_infos[0], num_all, sizeof(all_infos[0]), &vdp_usb_device_info_compare);
 
-        if ((de->d_type == DT_CHR) &&
-            (strncmp(f_name, VDPHCI_DEVICE_PREFIX, strlen(VDPHCI_DEVICE_PREFIX)) == 0)) {
-            int device_num;
+    memcpy(infos, &all_infos[0], vdp_min(num_all, max_infos) * sizeof(all_infos[0]));
 
-            int ret = sscanf(f_name + strlen(VDPHCI_DEVICE_PREFIX), "%d", &device_num);
+    *num_infos = num_all;
 
-            if ((ret == EOF) || (ret == 0)) {
-                VDP_USB_LOG_WARNING(context, "device \"%s\" does not contain a number", f_name);
+    return vdp_usb_success;
+}
 
-                continue;
-            }
+vdp_usb_result vdp_usb_get_device_range(struct vdp_usb_context* context, vdp_u8* device_lower, vdp_u8* device_upper)
+{
+    struct vdp_usb_device_info infos[VDP_USB_MAX_DEVICES];
+    int num_infos = 0;
+    vdp_usb_result vdp_res;
 
-            if (device_num < 0) {
-                VDP_USB_LOG_WARNING(context, "device \"%s\" number is less than zero", f_name);
+    assert(context);
+    if (!context) {
+        return vdp_usb_misuse;
+    }
 
-                continue;
-            }
+    if (device_lower) {
+        *device_lower = 0;
+    }
 
-            found = 1;
+    if (device_upper) {
+        *device_upper = 0;
+    }
 
-            if (device_lower && device_num < *device_lower) {
-                *device_lower = device_num;
-            }
+    vdp_res = vdp_usb_get_devices(context, &infos[0], VDP_USB_MAX_DEVICES, &num_infos);
 
-            if (device_upper && device_num > *device_upper) {
-                *device_upper = device_num;
-            }
-        }
+    if (vdp_res != vdp_usb_success) {
+        return vdp_res;
     }
 
-    closedir(dir);
+    if (device_lower) {
+        *device_lower = infos[0].device_number;
+    }
+
+    if (device_upper) {
+        *device_upper = infos[num_infos - 1].device_number;
+    }
 
-    return (found ? vdp_usb_success : vdp_usb_not_found);
+    return vdp_usb_success;
 }
@@ -57,4 +57,21 @@ struct vdp_usb_context
 #define VDP_USB_LOG_INFO_ENABLED(context) VDP_USB_LOG_ENABLED(context, LWL_PRI_INFO)
 #define VDP_USB_LOG_DEBUG_ENABLED(context) VDP_USB_LOG_ENABLED(context, LWL_PRI_DEBUG)
 
+#define VDP_USB_SYSFS_CLASS_DIR "/sys/class/" VDPHCI_NAME
+
+/*
+ * Device numbers are vdp_u8.
+ */
+#define VDP_USB_MAX_DEVICES 256
+
+/*
+ * Returns -1 if attribute can't be read.
+ */
+int vdp_usb_sysfs_read_int(const char* dir_path, const char* attr);
+
+/*
+ * Returns device number of VDPHCI_DEVICE_PREFIX "N" node name or -1 if it's not a device.
+ */
+int vdp_usb_parse_device_name(const char* name);
+
 #endif
@@ -26,13 +26,47 @@
 #include "vdp_usb_device.h"
 #include "vdp_usb_context.h"
 #include "vdp_usb_urbi.h"
+#include "vdp_usb_probes.h"
+#include "vdp_usb_capture.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+/*
+ * vdp_usb_complete_urb_iov won't allocate for up to this number of iovecs.
+ */
+#define VDP_USB_COMPLETE_IOV_STATIC 8
+
+/*
+ * Initial event buffer size, most events (especially URBs) fit into it.
+ */
+#define VDP_USB_EVENT_BUFF_MIN 4096
+
+/*
+ * Event buffer won't be learned past this size, larger events are read with buffers
+ * of exact size.
+ */
+#define VDP_USB_EVENT_BUFF_MAX (1024 * 1024)
+
+/*
+ * Initial room for urbi after the event in the read buffer, enough for URB
+ * structures and small IN transfers. Grows up to VDP_USB_EVENT_BUFF_MAX as well.
+ */
+#define VDP_USB_URBI_BUFF_MIN 1024
+
+/*
+ * Learned sizes are halved after this many events in a row that would've fit into
+ * half of them, so that after a large transfer small events stop pinning large buffers.
+ */
+#define VDP_USB_BUFF_DECAY_EVENTS 64
 
 static vdp_usb_result vdp_usb_device_translate_io_error(int error)
 {
@@ -45,6 +79,46 @@ static vdp_usb_result vdp_usb_device_translate_io_error(int error)
     }
 }
 
+/*
+ * Send URB DEvent, to the kernel or to the sink.
+ * @{
+ */
+
+static int vdp_usb_device_sendv(struct vdp_usb_device* device, const struct iovec* vec, int count)
+{
+    if (device->sink) {
+        int ret = device->sink(device->sink_data, vec, count);
+
+        if (ret < 0) {
+            errno = -ret;
+
+            return -1;
+        }
+
+        return 0;
+    }
+
+    return (writev(device->fd, vec, count) == -1) ? -1 : 0;
+}
+
+static int vdp_usb_device_send(struct vdp_usb_device* device, const void* buff, size_t size)
+{
+    if (device->sink) {
+        struct iovec vec;
+
+        vec.iov_base = (void*)buff;
+        vec.iov_len = size;
+
+        return vdp_usb_device_sendv(device, &vec, 1);
+    }
+
+    return (write(device->fd, buff, size) == -1) ? -1 : 0;
+}
+
+/*
+ * @}
+ */
+
 static void vdp_usb_device_complete_unprocessed_urb(struct vdp_usb_device* device, vdp_u32 seq_num)
 {
     char buff[sizeof(struct vdphci_devent_header) + sizeof(struct vdphci_devent_urb)];
@@ -66,7 +140,7 @@ static void vdp_usb_device_complete_unprocessed_urb(struct vdp_usb_device* devic
     memcpy(&buff[0], &header, sizeof(header));
     memcpy(&buff[0] + sizeof(header), &urb, vdp_offsetof(struct vdphci_devent_urb, data.buff));
 
-    if (write(device->fd, &buff[0], sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff)) == -1) {
+    if (vdp_usb_device_send(device, &buff[0], sizeof(header) + vdp_offsetof(struct vdphci_devent_urb, data.buff)) == -1) {
         int error = errno;
 
         VDP_USB_LOG_ERROR(device->context, "device %d: cannot complete urb: %s (%d)",
@@ -74,13 +148,64 @@ static void vdp_usb_device_complete_unprocessed_urb(struct vdp_usb_device* devic
     }
 }
 
+vdp_usb_result vdp_usb_device_create(struct vdp_usb_context* context,
+    vdp_u8 device_number,
+    vdp_fd fd,
+    int busnum,
+    int portnum,
+    struct vdp_usb_device** device)
+{
+    int error;
+
+    *device = malloc(sizeof(**device));
+
+    if (*device == NULL) {
+        return vdp_usb_nomem;
+    }
+
+    memset(*device, 0, sizeof(**device));
+
+    (*device)->context = context;
+
+    (*device)->device_number = device_number;
+
+    (*device)->fd = fd;
+
+    (*device)->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if ((*device)->completion_fd == -1) {
+        error = errno;
+
+        VDP_USB_LOG_ERROR(context, "device %d: cannot create completion eventfd: %s (%d)",
+            device_number, strerror(error), error);
+
+        free(*device);
+        *device = NULL;
+
+        return vdp_usb_unknown;
+    }
+
+    vdp_usb_mpsc_init(&(*device)->completions);
+
+    (*device)->busnum = busnum;
+    (*device)->portnum = portnum;
+    (*device)->event_buff_size = VDP_USB_EVENT_BUFF_MIN;
+    (*device)->urbi_buff_size = VDP_USB_URBI_BUFF_MIN;
+
+    vdp_usb_pool_init(&(*device)->pool);
+
+    return vdp_usb_success;
+}
+
 vdp_usb_result vdp_usb_device_open(struct vdp_usb_context* context,
     vdp_u8 device_number,
     struct vdp_usb_device** device)
 {
     char device_path[255];
     int error;
+    vdp_fd fd;
     struct vdphci_info info = { 0, 0 };
+    vdp_usb_result res;
 
     assert(context && device);
     if (!context || !device) {
@@ -98,26 +223,13 @@ vdp_usb_result vdp_usb_device_open(struct vdp_usb_context* context,
         return vdp_usb_unknown;
     }
 
-    *device = malloc(sizeof(**device));
-
-    if (*device == NULL) {
-        return vdp_usb_nomem;
-    }
-
-    memset(*device, 0, sizeof(**device));
-
-    (*device)->context = context;
-
-    (*device)->device_number = device_number;
+    *device = NULL;
 
-    (*device)->fd = open(device_path, O_RDWR);
+    fd = open(device_path, O_RDWR);
 
     error = errno;
 
-    if ((*device)->fd == -1) {
-        free(*device);
-        *device = NULL;
-
+    if (fd == -1) {
         if (error == EBUSY) {
             VDP_USB_LOG_ERROR(context, "device %d is busy", device_number);
 
@@ -133,39 +245,304 @@ vdp_usb_result vdp_usb_device_open(struct vdp_usb_context* context,
         }
     }
 
-    if (ioctl((*device)->fd, VDPHCI_IOC_GET_INFO, &info) == -1) {
+    if (ioctl(fd, VDPHCI_IOC_GET_INFO, &info) == -1) {
         VDP_USB_LOG_ERROR(context, "device %d does not accept info ioctl", device_number);
 
-        close((*device)->fd);
-        free(*device);
-        *device = NULL;
+        close(fd);
 
         return vdp_usb_protocol_error;
     }
 
-    (*device)->busnum = info.busnum;
-    (*device)->portnum = info.portnum;
+    res = vdp_usb_device_create(context, device_number, fd, info.busnum, info.portnum, device);
+
+    if (res != vdp_usb_success) {
+        close(fd);
+
+        return res;
+    }
 
     VDP_USB_LOG_DEBUG(context, "device %d opened", device_number);
 
     return vdp_usb_success;
 }
 
+/*
+ * Take up to 'max' queued urbis, at least 'max' urbis must have been counted in
+ * 'num_completions'.
+ */
+static int vdp_usb_device_pop_completions(struct vdp_usb_device* device,
+    struct vdp_usb_urbi** urbis,
+    int max)
+{
+    int num = 0;
+
+    while (num < max) {
+        struct vdp_usb_mpsc_node* node = vdp_usb_mpsc_pop(&device->completions);
+
+        if (!node) {
+            if (num > 0) {
+                break;
+            }
+
+            /*
+             * A producer is in the middle of a push, it's just a few instructions away.
+             */
+            sched_yield();
+
+            continue;
+        }
+
+        urbis[num++] = vdp_containerof(node, struct vdp_usb_urbi, completion_node);
+    }
+
+    return num;
+}
+
 void vdp_usb_device_close(struct vdp_usb_device* device)
 {
+    struct vdp_usb_urbi* urbis[VDPHCI_IO_BATCH_MAX];
+    vdp_u32 pending;
+    int i, num;
+
     assert(device);
     if (!device) {
         return;
     }
 
-    close(device->fd);
-    device->fd = -1;
+    if (device->fd != -1) {
+        close(device->fd);
+        device->fd = -1;
+    }
+
+    /*
+     * URBs still queued for completion are dropped, the device is gone anyway.
+     */
+
+    pending = __atomic_load_n(&device->num_completions, __ATOMIC_ACQUIRE);
+
+    while (pending > 0) {
+        num = vdp_usb_device_pop_completions(device, urbis,
+            (pending < VDPHCI_IO_BATCH_MAX) ? pending : VDPHCI_IO_BATCH_MAX);
+
+        for (i = 0; i < num; ++i) {
+            vdp_usb_urbi_destroy(urbis[i]);
+        }
+
+        pending = __atomic_sub_fetch(&device->num_completions, num, __ATOMIC_ACQ_REL);
+    }
+
+    close(device->completion_fd);
+    device->completion_fd = -1;
+
+    free(device->unlink_ids);
+    device->unlink_ids = NULL;
 
     VDP_USB_LOG_DEBUG(device->context, "device %d closed", device->device_number);
 
+    vdp_usb_pool_cleanup(&device->pool);
+
+    if (device->pool.num_outstanding > 0) {
+        /*
+         * Some URBs are still around, the last one to be freed frees the device.
+         */
+
+        device->closed = 1;
+
+        return;
+    }
+
     free(device);
 }
 
+void* vdp_usb_device_alloc_buff(struct vdp_usb_device* device, size_t size)
+{
+    return vdp_usb_pool_alloc(&device->pool, size);
+}
+
+void vdp_usb_device_free_buff(struct vdp_usb_device* device, void* buff)
+{
+    vdp_usb_pool_free(&device->pool, buff);
+
+    if (device->closed && (device->pool.num_outstanding == 0)) {
+        free(device);
+    }
+}
+
+/*
+ * Grow learned buffer size to 'size' or decay it towards 'min_size', 'num_small' counts
+ * sizes in a row that fit into half of it.
+ */
+static void vdp_usb_device_learn_size(size_t* learned_size,
+    vdp_u32* num_small,
+    size_t min_size,
+    size_t size)
+{
+    if (size > *learned_size) {
+        if (size <= VDP_USB_EVENT_BUFF_MAX) {
+            *learned_size = size;
+        }
+
+        *num_small = 0;
+    } else if ((*learned_size > min_size) && (size <= (*learned_size / 2))) {
+        if (++*num_small >= VDP_USB_BUFF_DECAY_EVENTS) {
+            *learned_size = vdp_max(*learned_size / 2, min_size);
+            *num_small = 0;
+        }
+    } else {
+        *num_small = 0;
+    }
+}
+
+static void vdp_usb_device_learn_event_size(struct vdp_usb_device* device, size_t size)
+{
+    vdp_usb_device_learn_size(&device->event_buff_size, &device->event_buff_num_small,
+        VDP_USB_EVENT_BUFF_MIN, size);
+}
+
+void vdp_usb_device_learn_urbi_size(struct vdp_usb_device* device, size_t size)
+{
+    vdp_usb_device_learn_size(&device->urbi_buff_size, &device->urbi_buff_num_small,
+        VDP_USB_URBI_BUFF_MIN, size);
+}
+
+/*
+ * Read buffer for an event of up to 'event_size' bytes, with room for urbi after it.
+ */
+static size_t vdp_usb_device_read_buff_size(struct vdp_usb_device* device, size_t event_size)
+{
+    return ((event_size + 15) & ~(size_t)15) + device->urbi_buff_size;
+}
+
+vdp_usb_result vdp_usb_device_get_alloc_stats(struct vdp_usb_device* device,
+    struct vdp_usb_alloc_stats* stats)
+{
+    assert(device);
+    assert(stats);
+    if (!device || !stats) {
+        return vdp_usb_misuse;
+    }
+
+    *stats = device->pool.stats;
+
+    return vdp_usb_success;
+}
+
+static vdp_u64 vdp_usb_device_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (vdp_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vdp_usb_device_account_event(struct vdp_usb_device* device,
+    const struct vdp_usb_event* event)
+{
+    VDP_USB_PROBE2(event_read, device->device_number, event->type);
+
+    if ((unsigned int)event->type < VDP_USB_STATS_EVENT_TYPES) {
+        ++device->stats.num_events[event->type];
+    }
+}
+
+static void vdp_usb_device_capture_urbi(struct vdp_usb_urbi* urbi, int complete, int with_data)
+{
+    struct vdp_usb_device* device = urbi->device;
+
+    if (device->capture &&
+        (device->capture_endpoints & VDP_USB_CAPTURE_EP(urbi->urb.endpoint_address))) {
+        vdp_usb_capture_urbi(device->capture, urbi, complete, with_data);
+    }
+}
+
+/*
+ * 'urbi' has been sent to the kernel at 'now', 'with_data' is 0 if IN payload
+ * was streamed and isn't in the transfer buffer.
+ */
+static void vdp_usb_device_account_urbi(struct vdp_usb_urbi* urbi, vdp_u64 now, int with_data)
+{
+    struct vdp_usb_stats* stats = &urbi->device->stats;
+    const struct vdp_usb_urb* urb = &urbi->urb;
+    vdp_u64 latency = (now > urbi->read_time) ? (now - urbi->read_time) : 0;
+    int bucket = latency ? (63 - __builtin_clzll(latency)) : 0;
+
+    VDP_USB_PROBE5(urb_complete, urbi->device->device_number, urb->id,
+        urb->endpoint_address, urb->actual_length, urb->status);
+
+    /*
+     * URBs can be completed synchronously from any thread, so URB counters are
+     * updated atomically, unlike event counters that only the event thread touches.
+     */
+
+    if ((unsigned int)urb->type < VDP_USB_STATS_URB_TYPES) {
+        __atomic_fetch_add(&stats->num_urbs_by_type[urb->type], 1, __ATOMIC_RELAXED);
+    }
+
+    if ((unsigned int)urb->status < VDP_USB_STATS_URB_STATUSES) {
+        __atomic_fetch_add(&stats->num_urbs_by_status[urb->status], 1, __ATOMIC_RELAXED);
+    }
+
+    if (VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address)) {
+        __atomic_fetch_add(&stats->bytes_in, urb->actual_length, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&stats->bytes_out, urb->actual_length, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_add(&stats->latency[vdp_min(bucket, VDP_USB_STATS_LATENCY_BUCKETS - 1)],
+        1, __ATOMIC_RELAXED);
+
+    vdp_usb_device_capture_urbi(urbi, 1, with_data);
+}
+
+vdp_usb_result vdp_usb_device_set_capture(struct vdp_usb_device* device,
+    struct vdp_usb_capture* capture,
+    vdp_u32 endpoints)
+{
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    device->capture = capture;
+    device->capture_endpoints = endpoints;
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_device_get_stats(struct vdp_usb_device* device,
+    struct vdp_usb_stats* stats)
+{
+    int i;
+
+    assert(device);
+    assert(stats);
+    if (!device || !stats) {
+        return vdp_usb_misuse;
+    }
+
+    *stats = device->stats;
+
+    for (i = 0; i < VDP_USB_STATS_URB_TYPES; ++i) {
+        stats->num_urbs_by_type[i] =
+            __atomic_load_n(&device->stats.num_urbs_by_type[i], __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < VDP_USB_STATS_URB_STATUSES; ++i) {
+        stats->num_urbs_by_status[i] =
+            __atomic_load_n(&device->stats.num_urbs_by_status[i], __ATOMIC_RELAXED);
+    }
+
+    stats->bytes_in = __atomic_load_n(&device->stats.bytes_in, __ATOMIC_RELAXED);
+    stats->bytes_out = __atomic_load_n(&device->stats.bytes_out, __ATOMIC_RELAXED);
+
+    for (i = 0; i < VDP_USB_STATS_LATENCY_BUCKETS; ++i) {
+        stats->latency[i] = __atomic_load_n(&device->stats.latency[i], __ATOMIC_RELAXED);
+    }
+
+    return vdp_usb_success;
+}
+
 int vdp_usb_speed_validate(int value)
 {
     switch (value) {
@@ -248,286 +625,1266 @@ vdp_usb_result vdp_usb_device_detach(struct vdp_usb_device* device)
     }
 }
 
-int vdp_usb_device_get_busnum(struct vdp_usb_device* device)
+vdp_usb_result vdp_usb_device_remote_wakeup(struct vdp_usb_device* device)
 {
+    char buff[sizeof(struct vdphci_devent_header) + sizeof(struct vdphci_devent_signal)];
+    struct vdphci_devent_header header;
+    struct vdphci_devent_signal event;
+
     assert(device);
     if (!device) {
-        return 0;
+        return vdp_usb_misuse;
     }
 
-    return device->busnum;
-}
+    memset(&header, 0, sizeof(header));
+    memset(&event, 0, sizeof(event));
 
-int vdp_usb_device_get_portnum(struct vdp_usb_device* device)
-{
-    assert(device);
-    if (!device) {
-        return 0;
-    }
+    header.type = vdphci_devent_type_signal;
+    event.signal = vdphci_dsignal_remote_wakeup;
 
-    return device->portnum;
-}
+    memcpy(&buff[0], &header, sizeof(header));
+    memcpy(&buff[0] + sizeof(header), &event, sizeof(event));
 
-vdp_usb_result vdp_usb_device_wait_event(struct vdp_usb_device* device, vdp_fd* fd)
-{
-    assert(device);
-    if (!device) {
-        return vdp_usb_misuse;
-    }
+    if (write(device->fd, &buff[0], sizeof(buff)) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot signal remote wakeup: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    } else {
+        VDP_USB_LOG_DEBUG(device->context, "device %d remote wakeup", device->device_number);
+
+        return vdp_usb_success;
+    }
+}
+
+/*
+ * 'speeds' == NULL means detach.
+ */
+static vdp_usb_result vdp_usb_devices_attach_common(struct vdp_usb_device** devices,
+    const vdp_usb_speed* speeds,
+    int count)
+{
+    struct vdphci_ports_attach ports;
+    char* done = NULL;
+    int i, j;
+
+    assert(devices);
+    assert(count >= 0);
+    if (!devices || (count < 0)) {
+        return vdp_usb_misuse;
+    }
+
+    for (i = 0; i < count; ++i) {
+        assert(devices[i]);
+        if (!devices[i]) {
+            return vdp_usb_misuse;
+        }
+
+        if (speeds && !vdp_usb_speed_validate(speeds[i])) {
+            return vdp_usb_misuse;
+        }
+    }
+
+    done = malloc(count + 1);
+
+    if (!done) {
+        return vdp_usb_nomem;
+    }
+
+    memset(done, 0, count + 1);
+
+    /*
+     * One ioctl per bus, on the first device of that bus.
+     */
+
+    for (i = 0; i < count; ++i) {
+        if (done[i]) {
+            continue;
+        }
+
+        memset(&ports, 0, sizeof(ports));
+
+        for (j = i; j < count; ++j) {
+            if (done[j] || (devices[j]->busnum != devices[i]->busnum)) {
+                continue;
+            }
+
+            if (ports.count >= VDPHCI_MAX_DEVICES) {
+                free(done);
+
+                return vdp_usb_misuse;
+            }
+
+            ports.ports[ports.count].portnum = devices[j]->portnum;
+            ports.ports[ports.count].attach = (speeds != NULL);
+            ports.ports[ports.count].speed = speeds ? speeds[j] : 0;
+            ++ports.count;
+
+            done[j] = 1;
+        }
+
+        if (ioctl(devices[i]->fd, VDPHCI_IOC_ATTACH_PORTS, &ports) == -1) {
+            int error = errno;
+
+            VDP_USB_LOG_ERROR(devices[i]->context, "bus %d: cannot %s %u devices: %s (%d)",
+                devices[i]->busnum, (speeds ? "attach" : "detach"), ports.count, strerror(error), error);
+
+            free(done);
+
+            return vdp_usb_device_translate_io_error(error);
+        }
+
+        VDP_USB_LOG_DEBUG(devices[i]->context, "bus %d: %u devices %s",
+            devices[i]->busnum, ports.count, (speeds ? "attached" : "detached"));
+    }
+
+    free(done);
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_devices_attach(struct vdp_usb_device** devices,
+    const vdp_usb_speed* speeds,
+    int count)
+{
+    assert(speeds);
+    if (!speeds) {
+        return vdp_usb_misuse;
+    }
+
+    return vdp_usb_devices_attach_common(devices, speeds, count);
+}
+
+vdp_usb_result vdp_usb_devices_detach(struct vdp_usb_device** devices,
+    int count)
+{
+    return vdp_usb_devices_attach_common(devices, NULL, count);
+}
+
+int vdp_usb_device_get_busnum(struct vdp_usb_device* device)
+{
+    assert(device);
+    if (!device) {
+        return 0;
+    }
+
+    return device->busnum;
+}
+
+int vdp_usb_device_get_portnum(struct vdp_usb_device* device)
+{
+    assert(device);
+    if (!device) {
+        return 0;
+    }
+
+    return device->portnum;
+}
+
+static vdp_usb_result vdp_usb_device_set_options(struct vdp_usb_device* device,
+    vdp_u32 flags,
+    vdp_u32 map_threshold)
+{
+    struct vdphci_options options;
+
+    memset(&options, 0, sizeof(options));
+
+    options.flags = flags;
+    options.map_threshold = map_threshold;
+
+    if (ioctl(device->fd, VDPHCI_IOC_SET_OPTIONS, &options) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot set options: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    }
+
+    device->option_flags = flags;
+    device->map_threshold = map_threshold;
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_device_set_map_threshold(struct vdp_usb_device* device,
+    vdp_u32 threshold)
+{
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    if (threshold > 0) {
+        return vdp_usb_device_set_options(device,
+            device->option_flags | VDPHCI_OPTION_MAP,
+            threshold);
+    } else {
+        return vdp_usb_device_set_options(device,
+            device->option_flags & ~VDPHCI_OPTION_MAP,
+            0);
+    }
+}
+
+vdp_usb_result vdp_usb_device_set_unlink_sets(struct vdp_usb_device* device,
+    int enable)
+{
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    if (enable) {
+        return vdp_usb_device_set_options(device,
+            device->option_flags | VDPHCI_OPTION_UNLINK_SET,
+            device->map_threshold);
+    } else {
+        return vdp_usb_device_set_options(device,
+            device->option_flags & ~VDPHCI_OPTION_UNLINK_SET,
+            device->map_threshold);
+    }
+}
+
+vdp_usb_result vdp_usb_device_set_urb_timing(struct vdp_usb_device* device,
+    int enable)
+{
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    if (enable) {
+        return vdp_usb_device_set_options(device,
+            device->option_flags | VDPHCI_OPTION_TIMING,
+            device->map_threshold);
+    } else {
+        return vdp_usb_device_set_options(device,
+            device->option_flags & ~VDPHCI_OPTION_TIMING,
+            device->map_threshold);
+    }
+}
+
+vdp_usb_result vdp_usb_device_set_shaping(struct vdp_usb_device* device,
+    const struct vdp_usb_shaping* shaping)
+{
+    struct vdphci_shaping params;
+
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    memset(&params, 0, sizeof(params));
+
+    if (shaping) {
+        params.bandwidth = shaping->bandwidth;
+        params.burst = shaping->burst;
+        params.latency[vdphci_urb_type_control] = shaping->latency[vdp_usb_urb_control];
+        params.latency[vdphci_urb_type_bulk] = shaping->latency[vdp_usb_urb_bulk];
+        params.latency[vdphci_urb_type_int] = shaping->latency[vdp_usb_urb_int];
+        params.latency[vdphci_urb_type_iso] = shaping->latency[vdp_usb_urb_iso];
+        params.jitter = shaping->jitter;
+    }
+
+    if (ioctl(device->fd, VDPHCI_IOC_SET_SHAPING, &params) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot set shaping: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    }
+
+    return vdp_usb_success;
+}
+
+static int vdp_usb_device_id_compare(const void* a, const void* b)
+{
+    vdp_u32 id_a = *(const vdp_u32*)a;
+    vdp_u32 id_b = *(const vdp_u32*)b;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+vdp_usb_result vdp_usb_device_get_event_size(struct vdp_usb_device* device, vdp_u32* size)
+{
+    __u32 event_size = 0;
+
+    assert(device);
+    assert(size);
+    if (!device || !size) {
+        return vdp_usb_misuse;
+    }
+
+    if (ioctl(device->fd, VDPHCI_IOC_GET_EVENT_SIZE, &event_size) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot get event size: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    }
+
+    *size = event_size;
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_device_set_eventfd(struct vdp_usb_device* device, vdp_fd fd)
+{
+    __s32 value = fd;
+
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    if (ioctl(device->fd, VDPHCI_IOC_SET_EVENTFD, &value) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot set eventfd: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    }
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_device_get_ready_ports(struct vdp_usb_device* device, vdp_u32* ready)
+{
+    __u32 value = 0;
+
+    assert(device);
+    assert(ready);
+    if (!device || !ready) {
+        return vdp_usb_misuse;
+    }
+
+    if (ioctl(device->fd, VDPHCI_IOC_GET_READY_PORTS, &value) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot get ready ports: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    }
+
+    *ready = value;
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_device_wait_event(struct vdp_usb_device* device, vdp_fd* fd)
+{
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
 
     if (fd) {
         *fd = device->fd;
     }
 
-    return vdp_usb_success;
+    return vdp_usb_success;
+}
+
+/*
+ * Decode event of 'num_read' bytes read into 'buff' of 'buff_size' bytes. If 'buff' was
+ * too small for the event '*needed_size' receives the size required and the event stays
+ * pending, otherwise it's 0. URB events take ownership of 'buff' on success, their
+ * urbis are built in 'buff' past the event, 'buff_alloc_size' is the whole size of 'buff'.
+ */
+static vdp_usb_result vdp_usb_device_decode_event(struct vdp_usb_device* device,
+    char* buff,
+    size_t buff_size,
+    size_t buff_alloc_size,
+    ssize_t num_read,
+    struct vdp_usb_event* event,
+    size_t* needed_size)
+{
+    vdp_usb_result res = vdp_usb_unknown;
+    struct vdphci_hevent_header* header = NULL;
+    struct vdphci_hevent_signal* signal_event = NULL;
+    struct vdphci_hevent_unlink_urb* unlink_urb_event = NULL;
+    struct vdphci_hevent_unlink_urbs* unlink_urbs_event = NULL;
+    struct vdp_usb_urbi* urbi = NULL;
+
+    *needed_size = 0;
+
+    memset(event, 0, sizeof(*event));
+
+    if (num_read == 0) {
+        /*
+         * No event pending
+         */
+
+        event->type = vdp_usb_event_none;
+
+        return vdp_usb_success;
+    }
+
+    if (num_read < sizeof(*header)) {
+        VDP_USB_LOG_ERROR(device->context, "device %d: bad event header",
+            device->device_number);
+
+        return vdp_usb_protocol_error;
+    }
+
+    header = (struct vdphci_hevent_header*)buff;
+
+    switch (header->type) {
+    case vdphci_hevent_type_signal: {
+        if (header->length != sizeof(*signal_event)) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: signal event header reports bad length - %d",
+                device->device_number, header->length);
+
+            return vdp_usb_protocol_error;
+        }
+
+        if (buff_size < (sizeof(*header) + sizeof(*signal_event))) {
+            break;
+        }
+
+        if (num_read != (sizeof(*header) + sizeof(*signal_event))) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: bad signal event length - %d",
+                device->device_number, num_read);
+
+            return vdp_usb_protocol_error;
+        }
+
+        signal_event = (struct vdphci_hevent_signal*)(buff + sizeof(*header));
+
+        switch (signal_event->signal) {
+        case vdphci_hsignal_reset_start: {
+            event->data.signal.type = vdp_usb_signal_reset_start;
+            break;
+        }
+        case vdphci_hsignal_reset_end: {
+            event->data.signal.type = vdp_usb_signal_reset_end;
+            break;
+        }
+        case vdphci_hsignal_power_on: {
+            event->data.signal.type = vdp_usb_signal_power_on;
+            break;
+        }
+        case vdphci_hsignal_power_off: {
+            event->data.signal.type = vdp_usb_signal_power_off;
+            break;
+        }
+        case vdphci_hsignal_suspend: {
+            event->data.signal.type = vdp_usb_signal_suspend;
+            break;
+        }
+        case vdphci_hsignal_resume: {
+            event->data.signal.type = vdp_usb_signal_resume;
+            break;
+        }
+        default:
+            VDP_USB_LOG_ERROR(device->context, "device %d: bad signal type - %d",
+                device->device_number, signal_event->signal);
+
+            return vdp_usb_protocol_error;
+        }
+
+        event->type = vdp_usb_event_signal;
+
+        return vdp_usb_success;
+    }
+    case vdphci_hevent_type_urb: {
+        if (header->length < vdp_offsetof(struct vdphci_hevent_urb, data.buff)) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: urb event header reports bad length - %d",
+                device->device_number, header->length);
+
+            return vdp_usb_protocol_error;
+        }
+
+        if (buff_size < (sizeof(*header) + header->length)) {
+            break;
+        }
+
+        if (num_read != (sizeof(*header) + header->length)) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: bad urb event length - %d",
+                device->device_number, num_read);
+
+            return vdp_usb_protocol_error;
+        }
+
+        res = vdp_usb_urbi_create(device, buff, num_read, buff_alloc_size, &urbi);
+
+        if (res != vdp_usb_success) {
+            /*
+             * Since we did read the urb and we're not giving it to the user
+             * because of errors we must complete it here.
+             */
+
+            struct vdphci_hevent_urb* urb = (struct vdphci_hevent_urb*)(buff + sizeof(*header));
+
+            vdp_usb_device_complete_unprocessed_urb(device, urb->seq_num);
+
+            return res;
+        }
+
+        urbi->read_time = device->read_time;
+
+        VDP_USB_PROBE5(urbi_create, device->device_number, urbi->urb.id,
+            urbi->urb.endpoint_address, urbi->urb.transfer_length, urbi->urb.type);
+
+        vdp_usb_device_capture_urbi(urbi, 0, 1);
+
+        event->type = vdp_usb_event_urb;
+        event->data.urb = &urbi->urb;
+
+        return vdp_usb_success;
+    }
+    case vdphci_hevent_type_unlink_urb: {
+        if (header->length != sizeof(*unlink_urb_event)) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: unlink urb event header reports bad length - %d",
+                device->device_number, header->length);
+
+            return vdp_usb_protocol_error;
+        }
+
+        if (buff_size < (sizeof(*header) + sizeof(*unlink_urb_event))) {
+            break;
+        }
+
+        if (num_read != (sizeof(*header) + sizeof(*unlink_urb_event))) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: bad unlink urb event length - %d",
+                device->device_number, num_read);
+
+            return vdp_usb_protocol_error;
+        }
+
+        unlink_urb_event = (struct vdphci_hevent_unlink_urb*)(buff + sizeof(*header));
+
+        event->type = vdp_usb_event_unlink_urb;
+        event->data.unlink_urb.id = unlink_urb_event->seq_num;
+
+        return vdp_usb_success;
+    }
+    case vdphci_hevent_type_unlink_urbs: {
+        vdp_u32 count;
+
+        if (header->length < vdp_offsetof(struct vdphci_hevent_unlink_urbs, seq_nums[1])) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: unlink urbs event header reports bad length - %d",
+                device->device_number, header->length);
+
+            return vdp_usb_protocol_error;
+        }
+
+        if (buff_size < (sizeof(*header) + header->length)) {
+            break;
+        }
+
+        unlink_urbs_event = (struct vdphci_hevent_unlink_urbs*)(buff + sizeof(*header));
+
+        count = unlink_urbs_event->count;
+
+        if ((num_read != (sizeof(*header) + header->length)) ||
+            (header->length != (vdp_offsetof(struct vdphci_hevent_unlink_urbs, seq_nums) +
+                sizeof(unlink_urbs_event->seq_nums[0]) * count))) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: bad unlink urbs event length - %d",
+                device->device_number, num_read);
+
+            return vdp_usb_protocol_error;
+        }
+
+        if (device->unlink_ids_size < count) {
+            vdp_u32* ids = realloc(device->unlink_ids, sizeof(*ids) * count);
+
+            if (!ids) {
+                return vdp_usb_nomem;
+            }
+
+            device->unlink_ids = ids;
+            device->unlink_ids_size = count;
+        }
+
+        memcpy(device->unlink_ids, &unlink_urbs_event->seq_nums[0],
+            sizeof(device->unlink_ids[0]) * count);
+
+        qsort(device->unlink_ids, count, sizeof(device->unlink_ids[0]), &vdp_usb_device_id_compare);
+
+        event->type = vdp_usb_event_unlink_urbs;
+        event->data.unlink_urbs.ids = device->unlink_ids;
+        event->data.unlink_urbs.count = count;
+
+        return vdp_usb_success;
+    }
+    default:
+        VDP_USB_LOG_ERROR(device->context, "device %d: bad event type - %d",
+            device->device_number, header->type);
+
+        return vdp_usb_protocol_error;
+    }
+
+    *needed_size = sizeof(*header) + header->length;
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_device_get_event(struct vdp_usb_device* device, struct vdp_usb_event* event)
+{
+    ssize_t num_read = 0;
+    vdp_usb_result res = vdp_usb_unknown;
+    char* buff = NULL;
+    size_t buff_size = 0;
+    size_t buff_alloc_size = 0;
+    size_t needed_size = 0;
+
+    assert(device);
+    assert(event);
+
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    if (!event) {
+        return vdp_usb_misuse;
+    }
+
+    memset(event, 0, sizeof(*event));
+
+    /*
+     * Read with a buffer that fits the largest recent event, the kernel only pins
+     * what the event needs, so a large buffer doesn't cost us much. If it's still too small
+     * the kernel gives us the header only and we grow the buffer. URB structures and
+     * IN transfer buffer are built right after the event, in the same buffer.
+     */
+
+    assert(sizeof(struct vdphci_hevent_header) <= VDP_USB_EVENT_BUFF_MIN);
+
+    buff_size = device->event_buff_size;
+    buff_alloc_size = vdp_usb_device_read_buff_size(device, buff_size);
+
+    buff = vdp_usb_device_alloc_buff(device, buff_alloc_size);
+
+    if (!buff) {
+        return vdp_usb_nomem;
+    }
+
+    while (1) {
+        num_read = read(device->fd, buff, buff_size);
+
+        ++device->stats.num_reads;
+
+        if (num_read == -1) {
+            int error = errno;
+
+            VDP_USB_LOG_ERROR(device->context, "device %d: error reading event: %s (%d)",
+                device->device_number, strerror(error), error);
+
+            res = vdp_usb_device_translate_io_error(error);
+
+            break;
+        }
+
+        device->read_time = vdp_usb_device_now();
+
+        res = vdp_usb_device_decode_event(device, buff, buff_size, buff_alloc_size,
+            num_read, event, &needed_size);
+
+        if ((res != vdp_usb_success) || (needed_size == 0)) {
+            break;
+        }
+
+        ++device->stats.num_regrows;
+
+        buff_size = needed_size;
+
+        /*
+         * The header has been consumed, nothing to preserve.
+         */
+
+        vdp_usb_device_free_buff(device, buff);
+
+        buff_alloc_size = vdp_usb_device_read_buff_size(device, buff_size);
+
+        buff = vdp_usb_device_alloc_buff(device, buff_alloc_size);
+
+        if (!buff) {
+            return vdp_usb_nomem;
+        }
+    }
+
+    if (res == vdp_usb_success) {
+        if (event->type != vdp_usb_event_none) {
+            vdp_usb_device_learn_event_size(device, num_read);
+        }
+
+        vdp_usb_device_account_event(device, event);
+    }
+
+    if ((res != vdp_usb_success) || (event->type != vdp_usb_event_urb)) {
+        vdp_usb_device_free_buff(device, buff);
+    }
+
+    return res;
+}
+
+vdp_usb_result vdp_usb_device_inject_event(struct vdp_usb_device* device,
+    const void* hevent,
+    size_t size,
+    struct vdp_usb_event* event)
+{
+    vdp_usb_result res;
+    char* buff;
+    size_t buff_alloc_size = vdp_usb_device_read_buff_size(device, size);
+    size_t needed_size = 0;
+
+    buff = vdp_usb_device_alloc_buff(device, buff_alloc_size);
+
+    if (!buff) {
+        return vdp_usb_nomem;
+    }
+
+    memcpy(buff, hevent, size);
+
+    device->read_time = vdp_usb_device_now();
+
+    res = vdp_usb_device_decode_event(device, buff, size, buff_alloc_size,
+        size, event, &needed_size);
+
+    assert((res != vdp_usb_success) || (needed_size == 0));
+
+    if (res == vdp_usb_success) {
+        vdp_usb_device_account_event(device, event);
+    }
+
+    if ((res != vdp_usb_success) || (event->type != vdp_usb_event_urb)) {
+        vdp_usb_device_free_buff(device, buff);
+    }
+
+    return res;
+}
+
+vdp_usb_result vdp_usb_device_get_events(struct vdp_usb_device* device,
+    struct vdp_usb_event* events,
+    int max_events,
+    int* num_events)
+{
+    struct vdphci_io_vec vecs[VDPHCI_IO_BATCH_MAX];
+    char* buffs[VDPHCI_IO_BATCH_MAX];
+    struct vdphci_io_batch batch;
+    vdp_usb_result res = vdp_usb_success;
+    size_t buff_size = 0;
+    size_t buff_alloc_size = 0;
+    int i, count;
+
+    assert(device);
+    assert(events);
+    assert(max_events > 0);
+    assert(num_events);
+
+    if (!device || !events || (max_events <= 0) || !num_events) {
+        return vdp_usb_misuse;
+    }
+
+    *num_events = 0;
+
+    if (max_events > VDPHCI_IO_BATCH_MAX) {
+        max_events = VDPHCI_IO_BATCH_MAX;
+    }
+
+    /*
+     * Most of the time there's only one or two events pending and they're small, so
+     * the batch is read into buffers of the smallest sizes, they come from the pool
+     * and cost next to nothing when unused. An event that doesn't fit stays pending and
+     * is read with vdp_usb_device_get_event, which uses the learned sizes.
+     */
+
+    buff_size = VDP_USB_EVENT_BUFF_MIN;
+    buff_alloc_size = ((buff_size + 15) & ~(size_t)15) + VDP_USB_URBI_BUFF_MIN;
+
+    memset(&buffs[0], 0, sizeof(buffs[0]) * max_events);
+
+    for (i = 0; i < max_events; ++i) {
+        buffs[i] = vdp_usb_device_alloc_buff(device, buff_alloc_size);
+
+        if (!buffs[i]) {
+            res = vdp_usb_nomem;
+
+            goto out;
+        }
+
+        vecs[i].buff = (vdp_u64)(vdp_uintptr)buffs[i];
+        vecs[i].size = buff_size;
+        vecs[i].result = 0;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+
+    batch.vecs = (vdp_u64)(vdp_uintptr)&vecs[0];
+    batch.count = max_events;
+
+    count = ioctl(device->fd, VDPHCI_IOC_GET_EVENTS, &batch);
+
+    ++device->stats.num_reads;
+
+    if (count == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context, "device %d: error reading events: %s (%d)",
+            device->device_number, strerror(error), error);
+
+        res = vdp_usb_device_translate_io_error(error);
+
+        goto out;
+    }
+
+    device->read_time = vdp_usb_device_now();
+
+    if (count == 0) {
+        ++device->stats.num_events[vdp_usb_event_none];
+    }
+
+    for (i = 0; i < count; ++i) {
+        size_t needed_size = 0;
+
+        if (vecs[i].result < 0) {
+            VDP_USB_LOG_ERROR(device->context, "device %d: error reading event: %s (%d)",
+                device->device_number, strerror(-vecs[i].result), -vecs[i].result);
+
+            res = vdp_usb_device_translate_io_error(-vecs[i].result);
+
+            break;
+        }
+
+        res = vdp_usb_device_decode_event(device, buffs[i], buff_size, buff_alloc_size,
+            vecs[i].result, &events[i], &needed_size);
+
+        if (res != vdp_usb_success) {
+            break;
+        }
+
+        if (needed_size != 0) {
+            /*
+             * The event didn't fit, it's still pending and it's the last one, get it
+             * the usual way.
+             */
+
+            res = vdp_usb_device_get_event(device, &events[i]);
+
+            if ((res != vdp_usb_success) || (events[i].type == vdp_usb_event_none)) {
+                break;
+            }
+        } else {
+            vdp_usb_device_learn_event_size(device, vecs[i].result);
+
+            vdp_usb_device_account_event(device, &events[i]);
+
+            if (events[i].type == vdp_usb_event_urb) {
+                /*
+                 * The buffer is owned by the urb now.
+                 */
+
+                buffs[i] = NULL;
+            }
+        }
+
+        ++*num_events;
+    }
+
+out:
+    for (i = 0; i < max_events; ++i) {
+        vdp_usb_device_free_buff(device, buffs[i]);
+    }
+
+    return res;
 }
 
-vdp_usb_result vdp_usb_device_get_event(struct vdp_usb_device* device, struct vdp_usb_event* event)
+vdp_usb_result vdp_usb_complete_urb(struct vdp_usb_urb* urb)
 {
-    ssize_t num_read = 0;
+    struct vdp_usb_urbi* urbi = NULL;
     vdp_usb_result res = vdp_usb_unknown;
-    char* buff = NULL;
-    size_t buff_size = 0;
+    vdp_u32 event_size = 0;
 
-    assert(device);
-    assert(event);
+    assert(urb);
 
-    if (!device) {
+    if (!urb) {
         return vdp_usb_misuse;
     }
 
-    if (!event) {
-        return vdp_usb_misuse;
+    urbi = vdp_containerof(urb, struct vdp_usb_urbi, urb);
+
+    res = vdp_usb_urbi_update(urbi);
+
+    if (res != vdp_usb_success) {
+        return res;
     }
 
-    memset(event, 0, sizeof(*event));
+    event_size = vdp_usb_urbi_get_effective_size(urbi) -
+        vdp_offsetof(struct vdp_usb_urbi, devent_header);
 
-    /*
-     * We assume that most events (especially URBs) will fit into 4K, if not
-     * we'll increase the buffer
-     */
+    if (vdp_usb_device_send(urbi->device, &urbi->devent_header, event_size) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(urbi->device->context, "device %d: cannot complete urb: %s (%d)",
+            urbi->device->device_number, strerror(error), error);
+
+        return vdp_usb_device_translate_io_error(error);
+    } else {
+        vdp_usb_device_account_urbi(urbi, vdp_usb_device_now(), 1);
 
-    assert(sizeof(struct vdphci_hevent_header) <= 4096);
+        return vdp_usb_success;
+    }
+}
 
-    buff_size = 4096;
+vdp_usb_result vdp_usb_complete_urb_iov(struct vdp_usb_urb* urb,
+    const struct iovec* iov,
+    int iovcnt)
+{
+    struct vdp_usb_urbi* urbi = NULL;
+    vdp_usb_result res = vdp_usb_unknown;
+    struct iovec static_vec[VDP_USB_COMPLETE_IOV_STATIC + 1];
+    struct iovec* vec = &static_vec[0];
+    size_t total_length = 0;
+    int has_payload = 0;
+    int i;
 
-    buff = malloc(buff_size);
+    assert(urb);
+    assert((iovcnt == 0) || iov);
+    assert(iovcnt >= 0);
 
-    if (!buff) {
-        return vdp_usb_nomem;
+    if (!urb || ((iovcnt != 0) && !iov) || (iovcnt < 0)) {
+        return vdp_usb_misuse;
     }
 
-    while (1) {
-        struct vdphci_hevent_header* header = NULL;
-        struct vdphci_hevent_signal* signal_event = NULL;
-        struct vdphci_hevent_unlink_urb* unlink_urb_event = NULL;
-        struct vdp_usb_urbi* urbi = NULL;
+    urbi = vdp_containerof(urb, struct vdp_usb_urbi, urb);
 
-        num_read = read(device->fd, buff, buff_size);
+    for (i = 0; i < iovcnt; ++i) {
+        total_length += iov[i].iov_len;
+    }
 
-        if (num_read == -1) {
-            int error = errno;
+    has_payload = VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address) &&
+        ((urb->flags & VDP_USB_URB_MAPPED) == 0);
 
-            VDP_USB_LOG_ERROR(device->context, "device %d: error reading event: %s (%d)",
-                device->device_number, strerror(error), error);
+    if (!has_payload) {
+        if (total_length != 0) {
+            VDP_USB_LOG_ERROR(urbi->device->context, "device %d: urb %u has no payload",
+                urbi->device->device_number, urb->id);
 
-            res = vdp_usb_device_translate_io_error(error);
+            return vdp_usb_misuse;
+        }
+    } else if (urb->type == vdp_usb_urb_iso) {
+        if (total_length != urb->transfer_length) {
+            VDP_USB_LOG_ERROR(urbi->device->context, "device %d: urb %u iso payload must be %u bytes",
+                urbi->device->device_number, urb->id, urb->transfer_length);
 
-            goto out_free_buff;
+            return vdp_usb_misuse;
         }
+    } else {
+        if (total_length > urb->transfer_length) {
+            VDP_USB_LOG_ERROR(urbi->device->context, "device %d: urb %u payload is too large",
+                urbi->device->device_number, urb->id);
 
-        if (num_read == 0) {
-            /*
-             * No event pending
-             */
+            return vdp_usb_misuse;
+        }
+
+        urb->actual_length = total_length;
+    }
+
+    res = vdp_usb_urbi_update(urbi);
 
-            event->type = vdp_usb_event_none;
+    if (res != vdp_usb_success) {
+        return res;
+    }
 
-            res = vdp_usb_success;
+    if (iovcnt > VDP_USB_COMPLETE_IOV_STATIC) {
+        vec = malloc(sizeof(*vec) * (iovcnt + 1));
 
-            goto out_free_buff;
+        if (!vec) {
+            return vdp_usb_nomem;
         }
+    }
 
-        if (num_read < sizeof(*header)) {
-            VDP_USB_LOG_ERROR(device->context, "device %d: bad event header",
-                device->device_number);
+    vec[0].iov_base = &urbi->devent_header;
+    vec[0].iov_len = vdp_usb_urbi_get_header_size(urbi);
 
-            res = vdp_usb_protocol_error;
+    if (iovcnt > 0) {
+        memcpy(&vec[1], iov, sizeof(*vec) * iovcnt);
+    }
 
-            goto out_free_buff;
-        }
+    if (vdp_usb_device_sendv(urbi->device, vec, iovcnt + 1) == -1) {
+        int error = errno;
 
-        header = (struct vdphci_hevent_header*)buff;
+        VDP_USB_LOG_ERROR(urbi->device->context, "device %d: cannot complete urb: %s (%d)",
+            urbi->device->device_number, strerror(error), error);
+
+        res = vdp_usb_device_translate_io_error(error);
+    } else {
+        vdp_usb_device_account_urbi(urbi, vdp_usb_device_now(), 1);
 
-        switch (header->type) {
-        case vdphci_hevent_type_signal: {
-            if (header->length != sizeof(*signal_event)) {
-                VDP_USB_LOG_ERROR(device->context, "device %d: signal event header reports bad length - %d",
-                    device->device_number, header->length);
+        res = vdp_usb_success;
+    }
 
-                res = vdp_usb_protocol_error;
+    if (vec != &static_vec[0]) {
+        free(vec);
+    }
 
-                goto out_free_buff;
-            }
+    return res;
+}
 
-            if (buff_size < (sizeof(*header) + sizeof(*signal_event))) {
-                break;
-            }
+vdp_usb_result vdp_usb_complete_urb_data(struct vdp_usb_urb* urb,
+    const void* data,
+    vdp_u32 length,
+    int final)
+{
+    struct vdp_usb_urbi* urbi = NULL;
+    struct vdphci_devent_header header;
+    struct vdphci_devent_urb_data data_devent;
+    struct iovec vec[3];
+    vdp_usb_result res;
 
-            if (num_read != (sizeof(*header) + sizeof(*signal_event))) {
-                VDP_USB_LOG_ERROR(device->context, "device %d: bad signal event length - %d",
-                    device->device_number, num_read);
+    assert(urb);
+    assert(data || (length == 0));
 
-                res = vdp_usb_protocol_error;
+    if (!urb || (!data && (length != 0))) {
+        return vdp_usb_misuse;
+    }
 
-                goto out_free_buff;
-            }
+    urbi = vdp_containerof(urb, struct vdp_usb_urbi, urb);
 
-            signal_event = (struct vdphci_hevent_signal*)(buff + sizeof(*header));
+    if (!VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address) ||
+        (urb->type == vdp_usb_urb_iso) ||
+        (urb->flags & VDP_USB_URB_MAPPED)) {
+        VDP_USB_LOG_ERROR(urbi->device->context, "device %d: urb %u can't be streamed",
+            urbi->device->device_number, urb->id);
 
-            switch (signal_event->signal) {
-            case vdphci_hsignal_reset_start: {
-                event->data.signal.type = vdp_usb_signal_reset_start;
-                break;
-            }
-            case vdphci_hsignal_reset_end: {
-                event->data.signal.type = vdp_usb_signal_reset_end;
-                break;
-            }
-            case vdphci_hsignal_power_on: {
-                event->data.signal.type = vdp_usb_signal_power_on;
-                break;
-            }
-            case vdphci_hsignal_power_off: {
-                event->data.signal.type = vdp_usb_signal_power_off;
-                break;
-            }
-            default:
-                VDP_USB_LOG_ERROR(device->context, "device %d: bad signal type - %d",
-                    device->device_number, signal_event->signal);
+        return vdp_usb_misuse;
+    }
 
-                res = vdp_usb_protocol_error;
+    if (length > (urb->transfer_length - urb->actual_length)) {
+        VDP_USB_LOG_ERROR(urbi->device->context, "device %d: urb %u payload is too large",
+            urbi->device->device_number, urb->id);
 
-                goto out_free_buff;
-            }
+        return vdp_usb_misuse;
+    }
 
-            event->type = vdp_usb_event_signal;
+    memset(&header, 0, sizeof(header));
+    memset(&data_devent, 0, sizeof(data_devent));
 
-            res = vdp_usb_success;
+    header.type = vdphci_devent_type_urb_data;
+    data_devent.seq_num = urbi->devent_urb.seq_num;
+    data_devent.length = length;
 
-            goto out_free_buff;
-        }
-        case vdphci_hevent_type_urb: {
-            if (header->length < vdp_offsetof(struct vdphci_hevent_urb, data.buff)) {
-                VDP_USB_LOG_ERROR(device->context, "device %d: urb event header reports bad length - %d",
-                    device->device_number, header->length);
+    urb->actual_length += length;
 
-                res = vdp_usb_protocol_error;
+    if (final) {
+        /*
+         * Validates and translates 'urb->status'.
+         */
 
-                goto out_free_buff;
-            }
+        res = vdp_usb_urbi_update(urbi);
 
-            if (buff_size < (sizeof(*header) + header->length)) {
-                break;
-            }
+        if (res != vdp_usb_success) {
+            urb->actual_length -= length;
 
-            if (num_read != (sizeof(*header) + header->length)) {
-                VDP_USB_LOG_ERROR(device->context, "device %d: bad urb event length - %d",
-                    device->device_number, num_read);
+            return res;
+        }
 
-                res = vdp_usb_protocol_error;
+        data_devent.flags |= VDPHCI_URB_DATA_FINAL;
+        data_devent.status = urbi->devent_urb.status;
+    }
 
-                goto out_free_buff;
-            }
+    vec[0].iov_base = &header;
+    vec[0].iov_len = sizeof(header);
+    vec[1].iov_base = &data_devent;
+    vec[1].iov_len = vdp_offsetof(struct vdphci_devent_urb_data, buff);
+    vec[2].iov_base = (void*)data;
+    vec[2].iov_len = length;
 
-            res = vdp_usb_urbi_create(device, buff, num_read, &urbi);
+    if (vdp_usb_device_sendv(urbi->device, vec, 3) == -1) {
+        int error = errno;
 
-            if (res != vdp_usb_success) {
-                /*
-                 * Since we did read the urb and we're not giving it to the user
-                 * because of errors we must complete it here.
-                 */
+        VDP_USB_LOG_ERROR(urbi->device->context, "device %d: cannot stream urb %u data: %s (%d)",
+            urbi->device->device_number, urb->id, strerror(error), error);
+
+        urb->actual_length -= length;
 
-                struct vdphci_hevent_urb* urb = (struct vdphci_hevent_urb*)(buff + sizeof(*header));
+        return vdp_usb_device_translate_io_error(error);
+    }
+
+    if (final) {
+        vdp_usb_device_account_urbi(urbi, vdp_usb_device_now(), 0);
+    }
 
-                vdp_usb_device_complete_unprocessed_urb(device, urb->seq_num);
+    return vdp_usb_success;
+}
+
+/*
+ * Send up to VDPHCI_IO_BATCH_MAX updated urbis of 'device' to the kernel with
+ * a single system call, the first error is returned.
+ */
+static vdp_usb_result vdp_usb_device_put_urbis(struct vdp_usb_device* device,
+    struct vdp_usb_urbi** urbis,
+    int count)
+{
+    struct vdphci_io_vec vecs[VDPHCI_IO_BATCH_MAX];
+    struct vdphci_io_batch batch;
+    vdp_usb_result res = vdp_usb_success;
+    vdp_u64 now;
+    int i;
+
+    assert(count <= VDPHCI_IO_BATCH_MAX);
+
+    for (i = 0; i < count; ++i) {
+        vecs[i].buff = (vdp_u64)(vdp_uintptr)&urbis[i]->devent_header;
+        vecs[i].size = vdp_usb_urbi_get_effective_size(urbis[i]) -
+            vdp_offsetof(struct vdp_usb_urbi, devent_header);
+        vecs[i].result = 0;
+    }
 
-                goto out_free_buff;
+    if (device->sink) {
+        for (i = 0; i < count; ++i) {
+            if (vdp_usb_device_send(device, (const void*)(vdp_uintptr)vecs[i].buff, vecs[i].size) == -1) {
+                vecs[i].result = -errno;
             }
+        }
+    } else {
+        memset(&batch, 0, sizeof(batch));
+
+        batch.vecs = (vdp_u64)(vdp_uintptr)&vecs[0];
+        batch.count = count;
+
+        if (ioctl(device->fd, VDPHCI_IOC_PUT_EVENTS, &batch) == -1) {
+            int error = errno;
 
-            event->type = vdp_usb_event_urb;
-            event->data.urb = &urbi->urb;
+            VDP_USB_LOG_ERROR(device->context, "device %d: cannot complete %d urbs: %s (%d)",
+                device->device_number, count, strerror(error), error);
 
-            goto out_keep_buff;
+            return vdp_usb_device_translate_io_error(error);
         }
-        case vdphci_hevent_type_unlink_urb: {
-            if (header->length != sizeof(*unlink_urb_event)) {
-                VDP_USB_LOG_ERROR(device->context, "device %d: unlink urb event header reports bad length - %d",
-                    device->device_number, header->length);
+    }
 
-                res = vdp_usb_protocol_error;
+    now = vdp_usb_device_now();
 
-                goto out_free_buff;
-            }
+    for (i = 0; i < count; ++i) {
+        if (vecs[i].result >= 0) {
+            vdp_usb_device_account_urbi(urbis[i], now, 1);
 
-            if (buff_size < (sizeof(*header) + sizeof(*unlink_urb_event))) {
-                break;
-            }
+            continue;
+        }
 
-            if (num_read != (sizeof(*header) + sizeof(*unlink_urb_event))) {
-                VDP_USB_LOG_ERROR(device->context, "device %d: bad unlink urb event length - %d",
-                    device->device_number, num_read);
+        VDP_USB_LOG_ERROR(device->context, "device %d: cannot complete urb %u: %s (%d)",
+            device->device_number, urbis[i]->urb.id, strerror(-vecs[i].result), -vecs[i].result);
 
-                res = vdp_usb_protocol_error;
+        if (res == vdp_usb_success) {
+            res = vdp_usb_device_translate_io_error(-vecs[i].result);
+        }
+    }
 
-                goto out_free_buff;
-            }
+    return res;
+}
+
+vdp_usb_result vdp_usb_complete_urbs(struct vdp_usb_urb** urbs, int count)
+{
+    struct vdp_usb_urbi* urbis[VDPHCI_IO_BATCH_MAX];
+    vdp_usb_result res = vdp_usb_success;
+    char static_done[VDPHCI_IO_BATCH_MAX + 1];
+    char* done = &static_done[0];
+    int i, j;
 
-            unlink_urb_event = (struct vdphci_hevent_unlink_urb*)(buff + sizeof(*header));
+    assert(urbs || (count == 0));
+    assert(count >= 0);
 
-            event->type = vdp_usb_event_unlink_urb;
-            event->data.unlink_urb.id = unlink_urb_event->seq_num;
+    if ((!urbs && (count != 0)) || (count < 0)) {
+        return vdp_usb_misuse;
+    }
 
-            res = vdp_usb_success;
+    if (count > VDPHCI_IO_BATCH_MAX) {
+        done = malloc(count + 1);
 
-            goto out_free_buff;
+        if (!done) {
+            return vdp_usb_nomem;
         }
-        default:
-            VDP_USB_LOG_ERROR(device->context, "device %d: bad event type - %d",
-                device->device_number, header->type);
+    }
 
-            res = vdp_usb_protocol_error;
+    memset(done, 0, count + 1);
 
-            goto out_free_buff;
+    /*
+     * One call per device, URBs of the device keep their order.
+     */
+
+    for (i = 0; i < count; ++i) {
+        struct vdp_usb_device* device;
+        vdp_usb_result put_res;
+        int num_vecs = 0;
+
+        if (done[i]) {
+            continue;
         }
 
-        buff_size = sizeof(*header) + header->length;
+        device = vdp_containerof(urbs[i], struct vdp_usb_urbi, urb)->device;
 
-        free(buff);
+        for (j = i; (j < count) && (num_vecs < VDPHCI_IO_BATCH_MAX); ++j) {
+            struct vdp_usb_urbi* urbi = vdp_containerof(urbs[j], struct vdp_usb_urbi, urb);
+            vdp_usb_result update_res;
 
-        buff = malloc(buff_size);
+            if (done[j] || (urbi->device != device)) {
+                continue;
+            }
 
-        if (!buff) {
-            res = vdp_usb_nomem;
+            done[j] = 1;
+
+            update_res = vdp_usb_urbi_update(urbi);
+
+            if (update_res != vdp_usb_success) {
+                if (res == vdp_usb_success) {
+                    res = update_res;
+                }
+
+                continue;
+            }
+
+            urbis[num_vecs++] = urbi;
+        }
+
+        if (num_vecs == 0) {
+            continue;
+        }
+
+        put_res = vdp_usb_device_put_urbis(device, urbis, num_vecs);
 
-            goto out_free_buff;
+        if (res == vdp_usb_success) {
+            res = put_res;
         }
     }
 
-out_free_buff:
-    if (buff) {
-        free(buff);
+    if (done != &static_done[0]) {
+        free(done);
     }
 
-out_keep_buff:
     return res;
 }
 
-vdp_usb_result vdp_usb_complete_urb(struct vdp_usb_urb* urb)
+static void vdp_usb_device_queue_urbi(struct vdp_usb_urbi* urbi, int complete)
 {
-    struct vdp_usb_urbi* urbi = NULL;
-    vdp_usb_result res = vdp_usb_unknown;
-    vdp_u32 event_size = 0;
+    struct vdp_usb_device* device = urbi->device;
+
+    urbi->complete = complete;
+
+    vdp_usb_mpsc_push(&device->completions, &urbi->completion_node);
+
+    /*
+     * Counted after the push, so the consumer never takes more than it can find.
+     */
+
+    if (__atomic_fetch_add(&device->num_completions, 1, __ATOMIC_ACQ_REL) == 0) {
+        vdp_u64 value = 1;
+        ssize_t res = write(device->completion_fd, &value, sizeof(value));
+
+        (void)res;
+    }
+}
+
+vdp_usb_result vdp_usb_complete_urb_async(struct vdp_usb_urb* urb)
+{
+    struct vdp_usb_urbi* urbi;
+    vdp_usb_result res;
 
     assert(urb);
 
@@ -543,19 +1900,83 @@ vdp_usb_result vdp_usb_complete_urb(struct vdp_usb_urb* urb)
         return res;
     }
 
-    event_size = vdp_usb_urbi_get_effective_size(urbi) -
-        vdp_offsetof(struct vdp_usb_urbi, devent_header);
+    vdp_usb_device_queue_urbi(urbi, 1);
 
-    if (write(urbi->device->fd, &urbi->devent_header, event_size) == -1) {
-        int error = errno;
+    return vdp_usb_success;
+}
 
-        VDP_USB_LOG_ERROR(urbi->device->context, "device %d: cannot complete urb: %s (%d)",
-            urbi->device->device_number, strerror(error), error);
+void vdp_usb_free_urb_async(struct vdp_usb_urb* urb)
+{
+    assert(urb);
+    if (!urb) {
+        return;
+    }
 
-        return vdp_usb_device_translate_io_error(error);
-    } else {
-        return vdp_usb_success;
+    vdp_usb_device_queue_urbi(vdp_containerof(urb, struct vdp_usb_urbi, urb), 0);
+}
+
+vdp_fd vdp_usb_device_get_completion_fd(struct vdp_usb_device* device)
+{
+    assert(device);
+    if (!device) {
+        return -1;
+    }
+
+    return device->completion_fd;
+}
+
+vdp_usb_result vdp_usb_device_flush(struct vdp_usb_device* device)
+{
+    struct vdp_usb_urbi* urbis[VDPHCI_IO_BATCH_MAX];
+    struct vdp_usb_urbi* complete_urbis[VDPHCI_IO_BATCH_MAX];
+    vdp_usb_result res = vdp_usb_success;
+    vdp_u32 pending;
+    vdp_u64 value;
+    ssize_t io_res;
+
+    assert(device);
+    if (!device) {
+        return vdp_usb_misuse;
+    }
+
+    /*
+     * Reset the eventfd first, producers signal it again once 'num_completions'
+     * drops to 0 below.
+     */
+    io_res = read(device->completion_fd, &value, sizeof(value));
+    (void)io_res;
+
+    pending = __atomic_load_n(&device->num_completions, __ATOMIC_ACQUIRE);
+
+    while (pending > 0) {
+        int num_complete = 0;
+        int i, num;
+
+        num = vdp_usb_device_pop_completions(device, urbis,
+            (pending < VDPHCI_IO_BATCH_MAX) ? pending : VDPHCI_IO_BATCH_MAX);
+
+        for (i = 0; i < num; ++i) {
+            if (urbis[i]->complete) {
+                complete_urbis[num_complete++] = urbis[i];
+            }
+        }
+
+        if (num_complete > 0) {
+            vdp_usb_result put_res = vdp_usb_device_put_urbis(device, complete_urbis, num_complete);
+
+            if (res == vdp_usb_success) {
+                res = put_res;
+            }
+        }
+
+        for (i = 0; i < num; ++i) {
+            vdp_usb_urbi_destroy(urbis[i]);
+        }
+
+        pending = __atomic_sub_fetch(&device->num_completions, num, __ATOMIC_ACQ_REL);
     }
+
+    return res;
 }
 
 void vdp_usb_free_urb(struct vdp_usb_urb* urb)
@@ -27,9 +27,17 @@
 #define _VDP_USB_DEVICE_H_
 
 #include "vdp/usb.h"
+#include "vdp_usb_pool.h"
+#include "vdp_usb_mpsc.h"
+#include <sys/uio.h>
 
 struct vdp_usb_context;
 
+/*
+ * Takes DEvent made of 'vec' instead of the kernel, returns 0 or -errno.
+ */
+typedef int (*vdp_usb_device_sink)(void* /*sink_data*/, const struct iovec* /*vec*/, int /*count*/);
+
 struct vdp_usb_device
 {
     struct vdp_usb_context* context;
@@ -40,6 +48,112 @@ struct vdp_usb_device
 
     int busnum;
     int portnum;
+
+    /*
+     * Buffer size to read events with, grows up to the largest event seen and decays
+     * back when events get small, see vdp_usb_device_get_event.
+     */
+    size_t event_buff_size;
+    vdp_u32 event_buff_num_small;
+
+    /*
+     * Room reserved after the event in the read buffer so that urbi can be
+     * built in place, learned the same way as 'event_buff_size'.
+     */
+    size_t urbi_buff_size;
+    vdp_u32 urbi_buff_num_small;
+
+    /*
+     * Options last set via VDPHCI_IOC_SET_OPTIONS.
+     * @{
+     */
+    vdp_u32 option_flags;
+    vdp_u32 map_threshold;
+    /*
+     * @}
+     */
+
+    /*
+     * Holds ids of vdp_usb_event_unlink_urbs event.
+     */
+    vdp_u32* unlink_ids;
+    vdp_u32 unlink_ids_size;
+
+    /*
+     * Event buffers and urbis come from here. If URBs are still around when the device
+     * is closed it's freed once the last of them is freed.
+     */
+    struct vdp_usb_pool pool;
+    int closed;
+
+    /*
+     * URBs completed or freed with vdp_usb_complete_urb_async/vdp_usb_free_urb_async,
+     * 'num_completions' counts pushed URBs not yet drained by vdp_usb_device_flush,
+     * 'completion_fd' is signaled when it goes from 0 to 1.
+     * @{
+     */
+    struct vdp_usb_mpsc completions;
+    vdp_u32 num_completions;
+    vdp_fd completion_fd;
+    /*
+     * @}
+     */
+
+    /*
+     * Driven by vdp_usb_replay, there's no vdphci behind the device ('fd' is -1),
+     * URB DEvents go to 'sink'.
+     * @{
+     */
+    vdp_usb_device_sink sink;
+    void* sink_data;
+    /*
+     * @}
+     */
+
+    struct vdp_usb_stats stats;
+
+    /*
+     * See vdp_usb_device_set_capture.
+     * @{
+     */
+    struct vdp_usb_capture* capture;
+    vdp_u32 capture_endpoints;
+    /*
+     * @}
+     */
+
+    /*
+     * Time of the last event read, see 'vdp_usb_urbi::read_time'.
+     */
+    vdp_u64 read_time;
 };
 
+/*
+ * Create device on top of 'fd', 'fd' is owned by the device on success.
+ */
+vdp_usb_result vdp_usb_device_create(struct vdp_usb_context* context,
+    vdp_u8 device_number,
+    vdp_fd fd,
+    int busnum,
+    int portnum,
+    struct vdp_usb_device** device);
+
+/*
+ * Same as vdp_usb_device_get_event, but 'hevent' of 'size' bytes is taken as if it was
+ * read from the device.
+ */
+vdp_usb_result vdp_usb_device_inject_event(struct vdp_usb_device* device,
+    const void* hevent,
+    size_t size,
+    struct vdp_usb_event* event);
+
+void* vdp_usb_device_alloc_buff(struct vdp_usb_device* device, size_t size);
+
+void vdp_usb_device_free_buff(struct vdp_usb_device* device, void* buff);
+
+/*
+ * Urbi of 'size' was built, adjust the room reserved for it by the following reads.
+ */
+void vdp_usb_device_learn_urbi_size(struct vdp_usb_device* device, size_t size);
+
 #endif
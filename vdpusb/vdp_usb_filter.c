@@ -25,19 +25,13 @@
 
 #include "vdp/usb_filter.h"
 #include "vdp/byte_order.h"
+#include "vdp_usb_probes.h"
 #include <assert.h>
 #include <string.h>
 
-int vdp_usb_filter(struct vdp_usb_urb* urb, struct vdp_usb_filter_ops* ops,
+static int vdp_usb_filter_standard(struct vdp_usb_urb* urb, struct vdp_usb_filter_ops* ops,
     void* user_data)
 {
-    assert(urb);
-    assert(ops);
-
-    if (!urb || !ops) {
-        return 0;
-    }
-
     if ((urb->type != vdp_usb_urb_control) ||
         (VDP_USB_REQUESTTYPE_TYPE(urb->setup_packet->bRequestType) != VDP_USB_REQUESTTYPE_TYPE_STANDARD) ||
         (VDP_USB_URB_ENDPOINT_NUMBER(urb->endpoint_address) != 0)) {
@@ -224,3 +218,23 @@ int vdp_usb_filter(struct vdp_usb_urb* urb, struct vdp_usb_filter_ops* ops,
 
     return 0;
 }
+
+int vdp_usb_filter(struct vdp_usb_urb* urb, struct vdp_usb_filter_ops* ops,
+    void* user_data)
+{
+    assert(urb);
+    assert(ops);
+
+    if (!urb || !ops) {
+        return 0;
+    }
+
+    if (!vdp_usb_filter_standard(urb, ops, user_data)) {
+        return 0;
+    }
+
+    VDP_USB_PROBE5(filter_hit, vdp_usb_probe_device_number(urb), urb->id,
+        urb->setup_packet->bRequest, urb->status, urb->actual_length);
+
+    return 1;
+}
@@ -26,6 +26,9 @@
 #include "vdp/usb_gadget.h"
 #include "vdp/usb_filter.h"
 #include "vdp/byte_order.h"
+#include "vdp_usb_workers.h"
+#include "vdp_usb_mpsc.h"
+#include "vdp_usb_probes.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -94,6 +97,71 @@ static int ptr_array_count(void** arr)
 
 struct vdp_usb_gadget_epi;
 
+/*
+ * Per gadget state of threaded dispatch, see vdp_usb_gadget_set_workers.
+ */
+struct vdp_usb_gadget_dispatch
+{
+    struct vdp_usb_workers* workers;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+
+    /*
+     * Endpoint work posted and not finished yet.
+     */
+    int num_pending;
+
+    /*
+     * Requests destroyed on workers, the event thread frees them, see
+     * vdp_usb_gadget_dispatch_reap.
+     */
+    struct vdp_usb_mpsc destroyed;
+};
+
+typedef enum
+{
+    vdp_usb_gadget_ep_work_enable = 0,
+    vdp_usb_gadget_ep_work_enqueue = 1,
+    vdp_usb_gadget_ep_work_dequeue = 2,
+    vdp_usb_gadget_ep_work_clear_stall = 3,
+    vdp_usb_gadget_ep_work_get_stalled = 4
+} vdp_usb_gadget_ep_work_type;
+
+/*
+ * Endpoint callback invocation handed to the endpoint's worker.
+ */
+struct vdp_usb_gadget_ep_work
+{
+    struct vdp_usb_work work;
+
+    vdp_usb_gadget_ep_work_type type;
+
+    struct vdp_usb_gadget_epi* epi;
+
+    /*
+     * Poster waits for 'done', otherwise the worker frees dequeue work.
+     */
+    int sync;
+    int done;
+
+    /*
+     * vdp_usb_gadget_ep_work_enable and vdp_usb_gadget_ep_work_get_stalled.
+     */
+    int value;
+
+    /*
+     * vdp_usb_gadget_ep_work_clear_stall.
+     */
+    vdp_usb_urb_status status;
+
+    /*
+     * vdp_usb_gadget_ep_work_dequeue, sorted.
+     */
+    const vdp_u32* ids;
+    vdp_u32 count;
+};
+
 struct vdp_usb_gadget_requesti
 {
     struct vdp_usb_gadget_request request;
@@ -101,6 +169,25 @@ struct vdp_usb_gadget_requesti
     struct vdp_usb_urb* urb;
 
     struct vdp_usb_gadget_epi* epi;
+
+    /*
+     * For probes, 'urb' may be gone by the time the request is dequeued.
+     */
+    int device_number;
+
+    /*
+     * Threaded dispatch only, 'urb' has been queued with vdp_usb_complete_urb_async
+     * and belongs to the device now. 'dispatch_entry' is on the endpoint's
+     * 'dispatch_requests' until the event thread reaps the request.
+     * @{
+     */
+    struct vdp_usb_gadget_ep_work enqueue_work;
+    int urb_queued;
+    struct vdp_list dispatch_entry;
+    struct vdp_usb_mpsc_node destroyed_node;
+    /*
+     * @}
+     */
 };
 
 struct vdp_usb_gadget_epi
@@ -111,25 +198,59 @@ struct vdp_usb_gadget_epi
 
     struct vdp_usb_endpoint_descriptor descriptor_in;
     struct vdp_usb_endpoint_descriptor descriptor_out;
+
+    /*
+     * Threaded dispatch only, 'dispatch_requests' are requests enqueued and
+     * not reaped yet, it's the event thread's view of 'ep.requests', which
+     * belongs to the worker. 'ep.active' and 'ep.stalled' belong to the worker
+     * as well, the event thread only touches them through vdp_usb_gadget_ep_call.
+     * @{
+     */
+    struct vdp_usb_gadget_dispatch* dispatch;
+    int shard;
+    struct vdp_list dispatch_requests;
+    /*
+     * @}
+     */
 };
 
 static vdp_usb_result vdp_usb_gadget_request_complete(struct vdp_usb_gadget_request* request)
 {
     struct vdp_usb_gadget_requesti* requesti;
     vdp_usb_result res;
+    int stall;
 
     assert(request);
 
     requesti = vdp_containerof(request, struct vdp_usb_gadget_requesti, request);
 
+    if (requesti->urb_queued) {
+        /*
+         * Already completed, the URB may be gone.
+         */
+        return vdp_usb_success;
+    }
+
     requesti->urb->actual_length = request->actual_length;
     requesti->urb->status = request->status;
 
-    res = vdp_usb_complete_urb(requesti->urb);
+    stall = ((requesti->urb->type == vdp_usb_urb_bulk) || (requesti->urb->type == vdp_usb_urb_int)) &&
+        (request->status == vdp_usb_urb_status_stall);
+
+    if (requesti->epi->dispatch) {
+        /*
+         * On a worker, the device completes and frees the URB on the event thread.
+         */
+        res = vdp_usb_complete_urb_async(requesti->urb);
+
+        if (res == vdp_usb_success) {
+            requesti->urb_queued = 1;
+        }
+    } else {
+        res = vdp_usb_complete_urb(requesti->urb);
+    }
 
-    if ((res == vdp_usb_success) &&
-        ((requesti->urb->type == vdp_usb_urb_bulk) || (requesti->urb->type == vdp_usb_urb_int)) &&
-        (request->status == vdp_usb_urb_status_stall)) {
+    if ((res == vdp_usb_success) && stall) {
         if (requesti->epi->ep.active) {
             requesti->epi->ep.stalled = 1;
         }
@@ -148,31 +269,310 @@ static void vdp_usb_gadget_request_destroy(struct vdp_usb_gadget_request* reques
 
     vdp_list_remove(&request->entry);
 
-    vdp_usb_free_urb(requesti->urb);
+    if (requesti->epi->dispatch) {
+        if (!requesti->urb_queued) {
+            vdp_usb_free_urb_async(requesti->urb);
+        }
+
+        vdp_usb_mpsc_push(&requesti->epi->dispatch->destroyed, &requesti->destroyed_node);
+
+        return;
+    }
+
+    if (!requesti->urb_queued) {
+        vdp_usb_free_urb(requesti->urb);
+    }
+
+    /*
+     * Enqueued before the gadget went back to synchronous dispatch.
+     */
+    vdp_list_remove(&requesti->dispatch_entry);
 
     free(requesti);
 }
 
+/*
+ * Free requests destroyed on workers, event thread only.
+ */
+static void vdp_usb_gadget_dispatch_reap(struct vdp_usb_gadget_dispatch* dispatch)
+{
+    struct vdp_usb_mpsc_node* node;
+
+    while ((node = vdp_usb_mpsc_pop(&dispatch->destroyed)) != NULL) {
+        struct vdp_usb_gadget_requesti* requesti =
+            vdp_containerof(node, struct vdp_usb_gadget_requesti, destroyed_node);
+
+        vdp_list_remove(&requesti->dispatch_entry);
+
+        free(requesti);
+    }
+}
+
+static void vdp_usb_gadget_ep_do_enable(struct vdp_usb_gadget_epi* epi, int value)
+{
+    if (value) {
+        epi->ep.active = 1;
+        epi->ops.enable(&epi->ep, 1);
+    } else {
+        epi->ops.enable(&epi->ep, 0);
+        epi->ep.active = 0;
+        epi->ep.stalled = 0;
+    }
+}
+
+static vdp_usb_urb_status vdp_usb_gadget_ep_do_clear_stall(struct vdp_usb_gadget_epi* epi)
+{
+    vdp_usb_urb_status status = epi->ops.clear_stall(&epi->ep);
+
+    if (status == vdp_usb_urb_status_completed) {
+        epi->ep.stalled = 0;
+    }
+
+    return status;
+}
+
+/*
+ * Dequeue all requests whose ids are in 'ids' (sorted), returns the number of
+ * requests dequeued.
+ */
+static vdp_u32 vdp_usb_gadget_ep_dequeue_ids(struct vdp_usb_gadget_epi* epi,
+    const vdp_u32* ids, vdp_u32 count);
+
+static void vdp_usb_gadget_ep_work_run(struct vdp_usb_work* work)
+{
+    struct vdp_usb_gadget_ep_work* ep_work = vdp_containerof(work, struct vdp_usb_gadget_ep_work, work);
+    struct vdp_usb_gadget_epi* epi = ep_work->epi;
+    struct vdp_usb_gadget_dispatch* dispatch = epi->dispatch;
+    vdp_usb_gadget_ep_work_type type = ep_work->type;
+    int sync = ep_work->sync;
+
+    switch (type) {
+    case vdp_usb_gadget_ep_work_enable:
+        vdp_usb_gadget_ep_do_enable(epi, ep_work->value);
+        break;
+    case vdp_usb_gadget_ep_work_enqueue: {
+        /*
+         * 'ep_work' is a part of the request, it's gone once the request is destroyed.
+         */
+        struct vdp_usb_gadget_requesti* requesti =
+            vdp_containerof(ep_work, struct vdp_usb_gadget_requesti, enqueue_work);
+
+        vdp_list_add_tail(&epi->ep.requests, &requesti->request.entry);
+
+        epi->ops.enqueue(&epi->ep, &requesti->request);
+        break;
+    }
+    case vdp_usb_gadget_ep_work_dequeue:
+        vdp_usb_gadget_ep_dequeue_ids(epi, ep_work->ids, ep_work->count);
+        break;
+    case vdp_usb_gadget_ep_work_clear_stall:
+        ep_work->status = vdp_usb_gadget_ep_do_clear_stall(epi);
+        break;
+    case vdp_usb_gadget_ep_work_get_stalled:
+        ep_work->value = epi->ep.stalled;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    pthread_mutex_lock(&dispatch->mtx);
+
+    if (sync) {
+        ep_work->done = 1;
+    }
+
+    --dispatch->num_pending;
+
+    if (sync || (dispatch->num_pending == 0)) {
+        pthread_cond_broadcast(&dispatch->cond);
+    }
+
+    pthread_mutex_unlock(&dispatch->mtx);
+
+    if (!sync && (type == vdp_usb_gadget_ep_work_dequeue)) {
+        free(ep_work);
+    }
+}
+
+static void vdp_usb_gadget_ep_post(struct vdp_usb_gadget_epi* epi,
+    struct vdp_usb_gadget_ep_work* ep_work)
+{
+    ep_work->work.func = &vdp_usb_gadget_ep_work_run;
+    ep_work->epi = epi;
+
+    pthread_mutex_lock(&epi->dispatch->mtx);
+    ++epi->dispatch->num_pending;
+    pthread_mutex_unlock(&epi->dispatch->mtx);
+
+    vdp_usb_workers_post(epi->dispatch->workers, epi->shard, &ep_work->work);
+}
+
+/*
+ * Run 'ep_work' on the endpoint's worker and wait for it to finish.
+ */
+static void vdp_usb_gadget_ep_call(struct vdp_usb_gadget_epi* epi,
+    struct vdp_usb_gadget_ep_work* ep_work)
+{
+    ep_work->sync = 1;
+    ep_work->done = 0;
+
+    vdp_usb_gadget_ep_post(epi, ep_work);
+
+    pthread_mutex_lock(&epi->dispatch->mtx);
+
+    while (!ep_work->done) {
+        pthread_cond_wait(&epi->dispatch->cond, &epi->dispatch->mtx);
+    }
+
+    pthread_mutex_unlock(&epi->dispatch->mtx);
+}
+
+static void vdp_usb_gadget_ep_enable(struct vdp_usb_gadget_epi* epi, int value)
+{
+    struct vdp_usb_gadget_ep_work ep_work;
+
+    if (!epi->dispatch) {
+        vdp_usb_gadget_ep_do_enable(epi, value);
+        return;
+    }
+
+    memset(&ep_work, 0, sizeof(ep_work));
+
+    ep_work.type = vdp_usb_gadget_ep_work_enable;
+    ep_work.value = value;
+
+    vdp_usb_gadget_ep_call(epi, &ep_work);
+}
+
+static vdp_usb_urb_status vdp_usb_gadget_ep_clear_stall(struct vdp_usb_gadget_epi* epi)
+{
+    struct vdp_usb_gadget_ep_work ep_work;
+
+    if (!epi->dispatch) {
+        return vdp_usb_gadget_ep_do_clear_stall(epi);
+    }
+
+    memset(&ep_work, 0, sizeof(ep_work));
+
+    ep_work.type = vdp_usb_gadget_ep_work_clear_stall;
+
+    vdp_usb_gadget_ep_call(epi, &ep_work);
+
+    return ep_work.status;
+}
+
+/*
+ * With threaded dispatch stalls are set by completions on the worker, so this
+ * also waits for the endpoint's work posted so far.
+ */
+static int vdp_usb_gadget_ep_stalled(struct vdp_usb_gadget_epi* epi)
+{
+    struct vdp_usb_gadget_ep_work ep_work;
+
+    if (!epi->dispatch) {
+        return epi->ep.stalled;
+    }
+
+    memset(&ep_work, 0, sizeof(ep_work));
+
+    ep_work.type = vdp_usb_gadget_ep_work_get_stalled;
+
+    vdp_usb_gadget_ep_call(epi, &ep_work);
+
+    return ep_work.value;
+}
+
+static int vdp_usb_gadget_id_compare(const void* a, const void* b)
+{
+    vdp_u32 id_a = *(const vdp_u32*)a;
+    vdp_u32 id_b = *(const vdp_u32*)b;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/*
+ * Hand dequeue of the endpoint's requests whose ids are in 'ids' (sorted) over
+ * to the endpoint's worker, returns the number of such requests. Some of them
+ * may be already destroyed on the worker, but no other endpoint has them, so
+ * the caller can stop once all ids are found.
+ */
+static vdp_u32 vdp_usb_gadget_ep_dequeue_post(struct vdp_usb_gadget_epi* epi,
+    const vdp_u32* ids, vdp_u32 count)
+{
+    struct vdp_usb_gadget_requesti* requesti;
+    struct vdp_usb_gadget_ep_work* ep_work;
+    vdp_u32* own_ids;
+    vdp_u32 num_own = 0;
+
+    vdp_usb_gadget_dispatch_reap(epi->dispatch);
+
+    vdp_list_for_each(struct vdp_usb_gadget_requesti, requesti, &epi->dispatch_requests, dispatch_entry) {
+        if (bsearch(&requesti->request.id, ids, count, sizeof(ids[0]), &vdp_usb_gadget_id_compare)) {
+            ++num_own;
+        }
+    }
+
+    if (num_own == 0) {
+        return 0;
+    }
+
+    ep_work = malloc(sizeof(*ep_work) + sizeof(ids[0]) * num_own);
+
+    if (ep_work == NULL) {
+        struct vdp_usb_gadget_ep_work sync_work;
+
+        memset(&sync_work, 0, sizeof(sync_work));
+
+        sync_work.type = vdp_usb_gadget_ep_work_dequeue;
+        sync_work.ids = ids;
+        sync_work.count = count;
+
+        vdp_usb_gadget_ep_call(epi, &sync_work);
+
+        return num_own;
+    }
+
+    memset(ep_work, 0, sizeof(*ep_work));
+
+    own_ids = (vdp_u32*)(ep_work + 1);
+    num_own = 0;
+
+    vdp_list_for_each(struct vdp_usb_gadget_requesti, requesti, &epi->dispatch_requests, dispatch_entry) {
+        if (bsearch(&requesti->request.id, ids, count, sizeof(ids[0]), &vdp_usb_gadget_id_compare)) {
+            own_ids[num_own++] = requesti->request.id;
+        }
+    }
+
+    qsort(own_ids, num_own, sizeof(own_ids[0]), &vdp_usb_gadget_id_compare);
+
+    ep_work->type = vdp_usb_gadget_ep_work_dequeue;
+    ep_work->ids = own_ids;
+    ep_work->count = num_own;
+
+    vdp_usb_gadget_ep_post(epi, ep_work);
+
+    return num_own;
+}
+
 static void vdp_usb_gadget_ep_activate(struct vdp_usb_gadget_ep* ep, int value)
 {
     struct vdp_usb_gadget_epi* epi;
 
     value = !!value;
 
+    /*
+     * With threaded dispatch 'active' is only written on the worker while
+     * this thread waits in vdp_usb_gadget_ep_enable, so reading it here doesn't race.
+     */
+
     if (!ep || (ep->active == value)) {
         return;
     }
 
     epi = vdp_containerof(ep, struct vdp_usb_gadget_epi, ep);
 
-    if (value) {
-        ep->active = 1;
-        epi->ops.enable(ep, 1);
-    } else {
-        epi->ops.enable(ep, 0);
-        ep->active = 0;
-        ep->stalled = 0;
-    }
+    vdp_usb_gadget_ep_enable(epi, value);
 }
 
 static void vdp_usb_gadget_ep_enqueue(struct vdp_usb_gadget_ep* ep, struct vdp_usb_urb* urb)
@@ -218,6 +618,7 @@ static void vdp_usb_gadget_ep_enqueue(struct vdp_usb_gadget_ep* ep, struct vdp_u
     memset(requesti, 0, sizeof(*requesti));
 
     vdp_list_init(&requesti->request.entry);
+    vdp_list_init(&requesti->dispatch_entry);
     requesti->request.id = urb->id;
     requesti->request.in = !!VDP_USB_URB_ENDPOINT_IN(urb->endpoint_address);
     requesti->request.flags = urb->flags;
@@ -243,6 +644,18 @@ static void vdp_usb_gadget_ep_enqueue(struct vdp_usb_gadget_ep* ep, struct vdp_u
 
     requesti->urb = urb;
     requesti->epi = epi;
+    requesti->device_number = vdp_usb_probe_device_number(urb);
+
+    VDP_USB_PROBE4(gadget_enqueue, requesti->device_number, urb->id,
+        urb->endpoint_address, urb->transfer_length);
+
+    if (epi->dispatch) {
+        vdp_usb_gadget_dispatch_reap(epi->dispatch);
+        vdp_list_add_tail(&epi->dispatch_requests, &requesti->dispatch_entry);
+        requesti->enqueue_work.type = vdp_usb_gadget_ep_work_enqueue;
+        vdp_usb_gadget_ep_post(epi, &requesti->enqueue_work);
+        return;
+    }
 
     vdp_list_add_tail(&ep->requests, &requesti->request.entry);
 
@@ -267,8 +680,16 @@ static int vdp_usb_gadget_ep_dequeue(struct vdp_usb_gadget_ep* ep, vdp_u32 id)
 
     epi = vdp_containerof(ep, struct vdp_usb_gadget_epi, ep);
 
+    if (epi->dispatch) {
+        return vdp_usb_gadget_ep_dequeue_post(epi, &id, 1);
+    }
+
     vdp_list_for_each(struct vdp_usb_gadget_request, request, &ep->requests, entry) {
         if (request->id == id) {
+            VDP_USB_PROBE3(gadget_dequeue,
+                vdp_containerof(request, struct vdp_usb_gadget_requesti, request)->device_number,
+                request->id, ep->caps.address);
+
             epi->ops.dequeue(ep, request);
             return 1;
         }
@@ -277,6 +698,49 @@ static int vdp_usb_gadget_ep_dequeue(struct vdp_usb_gadget_ep* ep, vdp_u32 id)
     return 0;
 }
 
+static vdp_u32 vdp_usb_gadget_ep_dequeue_ids(struct vdp_usb_gadget_epi* epi,
+    const vdp_u32* ids, vdp_u32 count)
+{
+    struct vdp_usb_gadget_request* request;
+    struct vdp_usb_gadget_request* tmp;
+    vdp_u32 num_dequeued = 0;
+
+    vdp_list_for_each_safe(struct vdp_usb_gadget_request, request, tmp, &epi->ep.requests, entry) {
+        if (bsearch(&request->id, ids, count, sizeof(ids[0]), &vdp_usb_gadget_id_compare)) {
+            VDP_USB_PROBE3(gadget_dequeue,
+                vdp_containerof(request, struct vdp_usb_gadget_requesti, request)->device_number,
+                request->id, epi->ep.caps.address);
+
+            epi->ops.dequeue(&epi->ep, request);
+            ++num_dequeued;
+        }
+    }
+
+    return num_dequeued;
+}
+
+/*
+ * Dequeue all requests whose ids are in 'ids' (sorted), returns the number of
+ * requests dequeued.
+ */
+static vdp_u32 vdp_usb_gadget_ep_dequeue_set(struct vdp_usb_gadget_ep* ep,
+    const vdp_u32* ids, vdp_u32 count)
+{
+    struct vdp_usb_gadget_epi* epi;
+
+    if (!ep) {
+        return 0;
+    }
+
+    epi = vdp_containerof(ep, struct vdp_usb_gadget_epi, ep);
+
+    if (epi->dispatch) {
+        return vdp_usb_gadget_ep_dequeue_post(epi, ids, count);
+    }
+
+    return vdp_usb_gadget_ep_dequeue_ids(epi, ids, count);
+}
+
 struct vdp_usb_gadget_ep* vdp_usb_gadget_ep_create(const struct vdp_usb_gadget_ep_caps* caps,
     const struct vdp_usb_gadget_ep_ops* ops, void* priv)
 {
@@ -323,6 +787,7 @@ struct vdp_usb_gadget_ep* vdp_usb_gadget_ep_create(const struct vdp_usb_gadget_e
     epi->ep.active = 0;
     epi->ep.stalled = 0;
     vdp_list_init(&epi->ep.requests);
+    vdp_list_init(&epi->dispatch_requests);
 
     memcpy(&epi->ops, ops, sizeof(*ops));
 
@@ -441,6 +906,23 @@ static int vdp_usb_gadget_interface_dequeue(struct vdp_usb_gadget_interface* int
     return 0;
 }
 
+static vdp_u32 vdp_usb_gadget_interface_dequeue_set(struct vdp_usb_gadget_interface* interface,
+    const vdp_u32* ids, vdp_u32 count)
+{
+    vdp_u32 num_dequeued = 0;
+    int i;
+
+    if (!interface) {
+        return 0;
+    }
+
+    for (i = 0; interface->caps.endpoints[i]; ++i) {
+        num_dequeued += vdp_usb_gadget_ep_dequeue_set(interface->caps.endpoints[i], ids, count);
+    }
+
+    return num_dequeued;
+}
+
 static void vdp_usb_gadget_interface_activate(struct vdp_usb_gadget_interface* interface, int value)
 {
     struct vdp_usb_gadget_interfacei* interfacei;
@@ -834,6 +1316,8 @@ struct vdp_usb_gadgeti
 
     struct vdp_usb_device_descriptor descriptor;
     struct vdp_usb_qualifier_descriptor qual_descriptor;
+
+    struct vdp_usb_gadget_dispatch* dispatch;
 };
 
 struct vdp_usb_gadget_ep* gadget_find_ep(struct vdp_usb_gadget* gadget, vdp_u8 index)
@@ -964,6 +1448,7 @@ static vdp_usb_urb_status gadget_get_status(void* user_data,
 
     switch (recipient) {
     case VDP_USB_REQUESTTYPE_RECIPIENT_DEVICE:
+        *status = (gadgeti->gadget.remote_wakeup ? (1 << VDP_USB_FEATURE_DEVICE_REMOTE_WAKEUP) : 0);
         return vdp_usb_urb_status_completed;
     case VDP_USB_REQUESTTYPE_RECIPIENT_INTERFACE:
         return vdp_usb_urb_status_completed;
@@ -972,7 +1457,7 @@ static vdp_usb_urb_status gadget_get_status(void* user_data,
         if (!ep) {
             return vdp_usb_urb_status_stall;
         }
-        *status = (ep->stalled ? 1 : 0);
+        *status = (vdp_usb_gadget_ep_stalled(vdp_containerof(ep, struct vdp_usb_gadget_epi, ep)) ? 1 : 0);
         return vdp_usb_urb_status_completed;
     }
     default:
@@ -986,28 +1471,41 @@ static vdp_usb_urb_status gadget_enable_feature(void* user_data,
     struct vdp_usb_gadgeti* gadgeti = user_data;
 
     switch (recipient) {
-    case VDP_USB_REQUESTTYPE_RECIPIENT_DEVICE:
+    case VDP_USB_REQUESTTYPE_RECIPIENT_DEVICE: {
+        int i;
+
+        if (feature != VDP_USB_FEATURE_DEVICE_REMOTE_WAKEUP) {
+            return vdp_usb_urb_status_stall;
+        }
+
+        if (!enable) {
+            gadgeti->gadget.remote_wakeup = 0;
+            return vdp_usb_urb_status_completed;
+        }
+
+        for (i = 0; gadgeti->gadget.caps.configs[i]; ++i) {
+            struct vdp_usb_gadget_config* cfg = gadgeti->gadget.caps.configs[i];
+            if (cfg->active) {
+                if ((cfg->caps.attributes & vdp_usb_gadget_config_att_wakeup) == 0) {
+                    break;
+                }
+                gadgeti->gadget.remote_wakeup = 1;
+                return vdp_usb_urb_status_completed;
+            }
+        }
+
         return vdp_usb_urb_status_stall;
+    }
     case VDP_USB_REQUESTTYPE_RECIPIENT_INTERFACE:
         return vdp_usb_urb_status_stall;
     case VDP_USB_REQUESTTYPE_RECIPIENT_ENDPOINT: {
         struct vdp_usb_gadget_ep* ep = gadget_find_ep(&gadgeti->gadget, index);
-        struct vdp_usb_gadget_epi* epi;
-        vdp_usb_urb_status res;
 
-        if (!ep || (feature != 0) || enable) {
+        if (!ep || (feature != VDP_USB_FEATURE_ENDPOINT_HALT) || enable) {
             return vdp_usb_urb_status_stall;
         }
 
-        epi = vdp_containerof(ep, struct vdp_usb_gadget_epi, ep);
-
-        res = epi->ops.clear_stall(ep);
-
-        if (res == vdp_usb_urb_status_completed) {
-            ep->stalled = 0;
-        }
-
-        return res;
+        return vdp_usb_gadget_ep_clear_stall(vdp_containerof(ep, struct vdp_usb_gadget_epi, ep));
     }
     default:
         return vdp_usb_urb_status_stall;
@@ -1226,6 +1724,63 @@ fail1:
     return NULL;
 }
 
+static void gadget_ep_set_dispatch(struct vdp_usb_gadget_ep* ep,
+    struct vdp_usb_gadget_dispatch* dispatch)
+{
+    struct vdp_usb_gadget_epi* epi = vdp_containerof(ep, struct vdp_usb_gadget_epi, ep);
+
+    epi->dispatch = dispatch;
+
+    if (dispatch) {
+        epi->shard = vdp_usb_workers_assign(dispatch->workers);
+    }
+}
+
+static void gadget_set_dispatch(struct vdp_usb_gadgeti* gadgeti,
+    struct vdp_usb_gadget_dispatch* dispatch)
+{
+    int i, j, k;
+
+    gadgeti->dispatch = dispatch;
+
+    gadget_ep_set_dispatch(&gadgeti->endpoint0i->ep, dispatch);
+
+    for (i = 0; gadgeti->gadget.caps.configs[i]; ++i) {
+        struct vdp_usb_gadget_config* cfg = gadgeti->gadget.caps.configs[i];
+        for (j = 0; cfg->caps.interfaces[j]; ++j) {
+            struct vdp_usb_gadget_interface* interface = cfg->caps.interfaces[j];
+            for (k = 0; interface->caps.endpoints[k]; ++k) {
+                gadget_ep_set_dispatch(interface->caps.endpoints[k], dispatch);
+            }
+        }
+    }
+}
+
+/*
+ * Wait for workers to finish with the gadget and go back to synchronous dispatch.
+ */
+static void gadget_dispatch_destroy(struct vdp_usb_gadgeti* gadgeti)
+{
+    struct vdp_usb_gadget_dispatch* dispatch = gadgeti->dispatch;
+
+    pthread_mutex_lock(&dispatch->mtx);
+
+    while (dispatch->num_pending > 0) {
+        pthread_cond_wait(&dispatch->cond, &dispatch->mtx);
+    }
+
+    pthread_mutex_unlock(&dispatch->mtx);
+
+    vdp_usb_gadget_dispatch_reap(dispatch);
+
+    gadget_set_dispatch(gadgeti, NULL);
+
+    pthread_cond_destroy(&dispatch->cond);
+    pthread_mutex_destroy(&dispatch->mtx);
+
+    free(dispatch);
+}
+
 void vdp_usb_gadget_event(struct vdp_usb_gadget* gadget, struct vdp_usb_event* event)
 {
     struct vdp_usb_gadgeti* gadgeti;
@@ -1248,6 +1803,8 @@ void vdp_usb_gadget_event(struct vdp_usb_gadget* gadget, struct vdp_usb_event* e
             gadget_reset_configuration(gadget);
             vdp_usb_gadget_ep_activate(&gadgeti->endpoint0i->ep, 0);
             gadgeti->gadget.address = 0;
+            gadgeti->gadget.remote_wakeup = 0;
+            gadgeti->gadget.suspended = 0;
             break;
         case vdp_usb_signal_reset_end:
             gadgeti->ops.reset(gadget, 0);
@@ -1261,6 +1818,15 @@ void vdp_usb_gadget_event(struct vdp_usb_gadget* gadget, struct vdp_usb_event* e
             gadget_reset_configuration(gadget);
             vdp_usb_gadget_ep_activate(&gadgeti->endpoint0i->ep, 0);
             gadgeti->gadget.address = 0;
+            gadgeti->gadget.remote_wakeup = 0;
+            gadgeti->gadget.suspended = 0;
+            break;
+        case vdp_usb_signal_suspend:
+        case vdp_usb_signal_resume:
+            gadgeti->gadget.suspended = (event->data.signal.type == vdp_usb_signal_suspend);
+            if (gadgeti->ops.suspend) {
+                gadgeti->ops.suspend(gadget, gadgeti->gadget.suspended);
+            }
             break;
         default:
             assert(0);
@@ -1333,6 +1899,30 @@ void vdp_usb_gadget_event(struct vdp_usb_gadget* gadget, struct vdp_usb_event* e
 
         break;
     }
+    case vdp_usb_event_unlink_urbs: {
+        /*
+         * Walk every request list once instead of searching for each id.
+         */
+        const vdp_u32* ids = event->data.unlink_urbs.ids;
+        vdp_u32 count = event->data.unlink_urbs.count;
+        vdp_u32 num_dequeued;
+        int j;
+
+        if (!gadgeti->endpoint0i->ep.active) {
+            break;
+        }
+
+        num_dequeued = vdp_usb_gadget_ep_dequeue_set(&gadgeti->endpoint0i->ep, ids, count);
+
+        for (i = 0; (num_dequeued < count) && gadget->caps.configs[i]; ++i) {
+            struct vdp_usb_gadget_config* cfg = gadget->caps.configs[i];
+            for (j = 0; (num_dequeued < count) && cfg->caps.interfaces[j]; ++j) {
+                num_dequeued += vdp_usb_gadget_interface_dequeue_set(cfg->caps.interfaces[j], ids, count);
+            }
+        }
+
+        break;
+    }
     default:
         assert(0);
         break;
@@ -1350,6 +1940,10 @@ void vdp_usb_gadget_destroy(struct vdp_usb_gadget* gadget)
 
     gadgeti = vdp_containerof(gadget, struct vdp_usb_gadgeti, gadget);
 
+    if (gadgeti->dispatch) {
+        gadget_dispatch_destroy(gadgeti);
+    }
+
     gadgeti->ops.destroy(gadget);
 
     for (i = 0; gadget->caps.configs[i]; ++i) {
@@ -1371,3 +1965,41 @@ void vdp_usb_gadget_destroy(struct vdp_usb_gadget* gadget)
 
     free(gadgeti);
 }
+
+vdp_usb_result vdp_usb_gadget_set_workers(struct vdp_usb_gadget* gadget,
+    struct vdp_usb_workers* workers)
+{
+    struct vdp_usb_gadgeti* gadgeti;
+    struct vdp_usb_gadget_dispatch* dispatch;
+
+    assert(gadget);
+    assert(workers);
+    if (!gadget || !workers) {
+        return vdp_usb_misuse;
+    }
+
+    gadgeti = vdp_containerof(gadget, struct vdp_usb_gadgeti, gadget);
+
+    if (gadgeti->dispatch) {
+        return vdp_usb_misuse;
+    }
+
+    dispatch = malloc(sizeof(*dispatch));
+
+    if (dispatch == NULL) {
+        return vdp_usb_nomem;
+    }
+
+    memset(dispatch, 0, sizeof(*dispatch));
+
+    dispatch->workers = workers;
+
+    pthread_mutex_init(&dispatch->mtx, NULL);
+    pthread_cond_init(&dispatch->cond, NULL);
+
+    vdp_usb_mpsc_init(&dispatch->destroyed);
+
+    gadget_set_dispatch(gadgeti, dispatch);
+
+    return vdp_usb_success;
+}
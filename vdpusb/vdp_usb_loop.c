@@ -0,0 +1,772 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdp/usb_loop.h"
+#include "vdp/list.h"
+#include "vdp_usb_context.h"
+#include "vdp_usb_device.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*
+ * Max number of epoll events handled per iteration.
+ */
+#define VDP_USB_LOOP_MAX_READY 64
+
+typedef enum
+{
+    vdp_usb_loop_source_device = 0,
+    vdp_usb_loop_source_fd = 1,
+    vdp_usb_loop_source_timer = 2,
+    vdp_usb_loop_source_completions = 3
+} vdp_usb_loop_source_type;
+
+struct vdp_usb_loop_source
+{
+    struct vdp_list list;
+
+    vdp_usb_loop_source_type type;
+
+    vdp_fd fd;
+
+    /*
+     * Removed from within a callback, freed once current iteration is over.
+     */
+    int removed;
+
+    void* user_data;
+
+    /*
+     * vdp_usb_loop_source_device only, either 'gadget' or 'device_cb' is set.
+     * @{
+     */
+    struct vdp_usb_device* device;
+    struct vdp_usb_gadget* gadget;
+    vdp_usb_loop_device_cb device_cb;
+    /*
+     * @}
+     */
+
+    /*
+     * Completion fd source of the device (URBs completed from other threads),
+     * removed together with the device source.
+     */
+    struct vdp_usb_loop_source* completions;
+
+    vdp_usb_loop_fd_cb fd_cb;
+};
+
+struct vdp_usb_loop_timer
+{
+    struct vdp_usb_loop_source source;
+
+    vdp_usb_loop_timer_cb cb;
+};
+
+struct vdp_usb_loop
+{
+    struct vdp_usb_context* context;
+
+    int epoll_fd;
+
+    int budget;
+
+    volatile sig_atomic_t stopped;
+
+    struct vdp_list sources;
+
+    struct vdp_list removed_sources;
+
+    struct vdp_usb_event events[VDP_USB_LOOP_DEFAULT_BUDGET];
+    struct vdp_usb_event* events_buff;
+};
+
+static int vdp_usb_loop_to_epoll_events(int events)
+{
+    int epoll_events = 0;
+
+    if (events & VDP_USB_LOOP_READ) {
+        epoll_events |= EPOLLIN;
+    }
+
+    if (events & VDP_USB_LOOP_WRITE) {
+        epoll_events |= EPOLLOUT;
+    }
+
+    return epoll_events;
+}
+
+static int vdp_usb_loop_from_epoll_events(int epoll_events)
+{
+    int events = 0;
+
+    if (epoll_events & EPOLLIN) {
+        events |= VDP_USB_LOOP_READ;
+    }
+
+    if (epoll_events & EPOLLOUT) {
+        events |= VDP_USB_LOOP_WRITE;
+    }
+
+    if (epoll_events & (EPOLLERR | EPOLLHUP)) {
+        events |= VDP_USB_LOOP_ERROR;
+    }
+
+    return events;
+}
+
+static vdp_usb_result vdp_usb_loop_add_source(struct vdp_usb_loop* loop,
+    struct vdp_usb_loop_source* source,
+    int epoll_events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = epoll_events;
+    ev.data.ptr = source;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(loop->context, "cannot add fd %d to epoll: %s (%d)",
+            source->fd, strerror(error), error);
+
+        return (error == ENOMEM) ? vdp_usb_nomem : vdp_usb_misuse;
+    }
+
+    vdp_list_add_tail(&loop->sources, &source->list);
+
+    return vdp_usb_success;
+}
+
+/*
+ * The source can't be freed right away, epoll events of current iteration may still
+ * point to it.
+ */
+static void vdp_usb_loop_remove_source(struct vdp_usb_loop* loop,
+    struct vdp_usb_loop_source* source)
+{
+    if (source->completions && !source->completions->removed) {
+        vdp_usb_loop_remove_source(loop, source->completions);
+    }
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+    if (source->type == vdp_usb_loop_source_timer) {
+        close(source->fd);
+    }
+
+    source->removed = 1;
+
+    vdp_list_remove(&source->list);
+    vdp_list_add_tail(&loop->removed_sources, &source->list);
+}
+
+static void vdp_usb_loop_free_removed(struct vdp_usb_loop* loop)
+{
+    struct vdp_usb_loop_source *source, *tmp;
+
+    vdp_list_for_each_safe(struct vdp_usb_loop_source, source, tmp, &loop->removed_sources, list) {
+        vdp_list_remove(&source->list);
+        free(source);
+    }
+}
+
+static struct vdp_usb_loop_source* vdp_usb_loop_find_source(struct vdp_usb_loop* loop,
+    vdp_usb_loop_source_type type,
+    vdp_fd fd)
+{
+    struct vdp_usb_loop_source* source;
+
+    vdp_list_for_each(struct vdp_usb_loop_source, source, &loop->sources, list) {
+        if ((source->type == type) && (source->fd == fd)) {
+            return source;
+        }
+    }
+
+    return NULL;
+}
+
+static vdp_usb_result vdp_usb_loop_add_device_common(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device,
+    struct vdp_usb_gadget* gadget,
+    vdp_usb_loop_device_cb cb,
+    void* user_data)
+{
+    struct vdp_usb_loop_source* source;
+    vdp_usb_result res;
+
+    source = malloc(sizeof(*source));
+
+    if (!source) {
+        return vdp_usb_nomem;
+    }
+
+    memset(source, 0, sizeof(*source));
+
+    vdp_list_init(&source->list);
+    source->type = vdp_usb_loop_source_device;
+    source->user_data = user_data;
+    source->device = device;
+    source->gadget = gadget;
+    source->device_cb = cb;
+
+    res = vdp_usb_device_wait_event(device, &source->fd);
+
+    if (res != vdp_usb_success) {
+        goto fail1;
+    }
+
+    source->completions = malloc(sizeof(*source->completions));
+
+    if (!source->completions) {
+        res = vdp_usb_nomem;
+        goto fail1;
+    }
+
+    memset(source->completions, 0, sizeof(*source->completions));
+
+    vdp_list_init(&source->completions->list);
+    source->completions->type = vdp_usb_loop_source_completions;
+    source->completions->fd = vdp_usb_device_get_completion_fd(device);
+    source->completions->device = device;
+
+    res = vdp_usb_loop_add_source(loop, source, EPOLLIN);
+
+    if (res != vdp_usb_success) {
+        goto fail2;
+    }
+
+    res = vdp_usb_loop_add_source(loop, source->completions, EPOLLIN);
+
+    if (res != vdp_usb_success) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+        vdp_list_remove(&source->list);
+        goto fail2;
+    }
+
+    return vdp_usb_success;
+
+fail2:
+    free(source->completions);
+fail1:
+    free(source);
+
+    return res;
+}
+
+/*
+ * Handle up to 'budget' events of the device, the rest is left for the next
+ * iteration, so one busy device can't starve others.
+ */
+static vdp_usb_result vdp_usb_loop_dispatch_device(struct vdp_usb_loop* loop,
+    struct vdp_usb_loop_source* source)
+{
+    vdp_usb_result res;
+    int num_events = 0;
+    int i;
+
+    res = vdp_usb_device_get_events(source->device, loop->events_buff, loop->budget, &num_events);
+
+    for (i = 0; i < num_events; ++i) {
+        if (source->removed) {
+            /*
+             * Removed by a callback, events that are left must still be
+             * released.
+             */
+
+            if (loop->events_buff[i].type == vdp_usb_event_urb) {
+                loop->events_buff[i].data.urb->status = vdp_usb_urb_status_error;
+                vdp_usb_complete_urb(loop->events_buff[i].data.urb);
+                vdp_usb_free_urb(loop->events_buff[i].data.urb);
+            }
+
+            continue;
+        }
+
+        if (source->gadget) {
+            vdp_usb_gadget_event(source->gadget, &loop->events_buff[i]);
+        } else {
+            source->device_cb(loop, source->device, &loop->events_buff[i], source->user_data);
+        }
+    }
+
+    if (res != vdp_usb_success) {
+        VDP_USB_LOG_ERROR(loop->context, "device %d: cannot get events",
+            source->device->device_number);
+    }
+
+    return res;
+}
+
+static void vdp_usb_loop_dispatch_timer(struct vdp_usb_loop* loop,
+    struct vdp_usb_loop_timer* timer)
+{
+    vdp_u64 expirations = 0;
+
+    if (read(timer->source.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    timer->cb(loop, timer, timer->source.user_data);
+}
+
+vdp_usb_result vdp_usb_loop_create(struct vdp_usb_context* context,
+    struct vdp_usb_loop** loop)
+{
+    assert(context);
+    assert(loop);
+    if (!context || !loop) {
+        return vdp_usb_misuse;
+    }
+
+    *loop = malloc(sizeof(**loop));
+
+    if (!*loop) {
+        return vdp_usb_nomem;
+    }
+
+    memset(*loop, 0, sizeof(**loop));
+
+    (*loop)->context = context;
+    (*loop)->budget = VDP_USB_LOOP_DEFAULT_BUDGET;
+    (*loop)->events_buff = &(*loop)->events[0];
+
+    vdp_list_init(&(*loop)->sources);
+    vdp_list_init(&(*loop)->removed_sources);
+
+    (*loop)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if ((*loop)->epoll_fd == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(context, "cannot create epoll: %s (%d)", strerror(error), error);
+
+        free(*loop);
+        *loop = NULL;
+
+        return vdp_usb_unknown;
+    }
+
+    return vdp_usb_success;
+}
+
+void vdp_usb_loop_destroy(struct vdp_usb_loop* loop)
+{
+    struct vdp_usb_loop_source* source;
+
+    assert(loop);
+    if (!loop) {
+        return;
+    }
+
+    /*
+     * Removing a device source also removes its completions source, so
+     * the list can't be walked.
+     */
+    while (!vdp_list_empty(&loop->sources)) {
+        vdp_list_first(struct vdp_usb_loop_source, source, &loop->sources, list);
+        vdp_usb_loop_remove_source(loop, source);
+    }
+
+    vdp_usb_loop_free_removed(loop);
+
+    close(loop->epoll_fd);
+
+    if (loop->events_buff != &loop->events[0]) {
+        free(loop->events_buff);
+    }
+
+    free(loop);
+}
+
+vdp_usb_result vdp_usb_loop_set_budget(struct vdp_usb_loop* loop, int budget)
+{
+    struct vdp_usb_event* events_buff = &loop->events[0];
+
+    assert(loop);
+    assert(budget > 0);
+    if (!loop || (budget <= 0)) {
+        return vdp_usb_misuse;
+    }
+
+    if (budget > VDP_USB_LOOP_DEFAULT_BUDGET) {
+        events_buff = malloc(sizeof(*events_buff) * budget);
+
+        if (!events_buff) {
+            return vdp_usb_nomem;
+        }
+    }
+
+    if (loop->events_buff != &loop->events[0]) {
+        free(loop->events_buff);
+    }
+
+    loop->events_buff = events_buff;
+    loop->budget = budget;
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_loop_add_gadget(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device,
+    struct vdp_usb_gadget* gadget)
+{
+    assert(loop);
+    assert(device);
+    assert(gadget);
+    if (!loop || !device || !gadget) {
+        return vdp_usb_misuse;
+    }
+
+    return vdp_usb_loop_add_device_common(loop, device, gadget, NULL, NULL);
+}
+
+vdp_usb_result vdp_usb_loop_add_device(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device,
+    vdp_usb_loop_device_cb cb,
+    void* user_data)
+{
+    assert(loop);
+    assert(device);
+    assert(cb);
+    if (!loop || !device || !cb) {
+        return vdp_usb_misuse;
+    }
+
+    return vdp_usb_loop_add_device_common(loop, device, NULL, cb, user_data);
+}
+
+vdp_usb_result vdp_usb_loop_remove_device(struct vdp_usb_loop* loop,
+    struct vdp_usb_device* device)
+{
+    struct vdp_usb_loop_source* source;
+
+    assert(loop);
+    assert(device);
+    if (!loop || !device) {
+        return vdp_usb_misuse;
+    }
+
+    source = vdp_usb_loop_find_source(loop, vdp_usb_loop_source_device, device->fd);
+
+    if (!source) {
+        return vdp_usb_not_found;
+    }
+
+    vdp_usb_loop_remove_source(loop, source);
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_loop_add_fd(struct vdp_usb_loop* loop,
+    vdp_fd fd,
+    int events,
+    vdp_usb_loop_fd_cb cb,
+    void* user_data)
+{
+    struct vdp_usb_loop_source* source;
+    vdp_usb_result res;
+
+    assert(loop);
+    assert(fd >= 0);
+    assert(cb);
+    if (!loop || (fd < 0) || !cb) {
+        return vdp_usb_misuse;
+    }
+
+    source = malloc(sizeof(*source));
+
+    if (!source) {
+        return vdp_usb_nomem;
+    }
+
+    memset(source, 0, sizeof(*source));
+
+    vdp_list_init(&source->list);
+    source->type = vdp_usb_loop_source_fd;
+    source->fd = fd;
+    source->user_data = user_data;
+    source->fd_cb = cb;
+
+    res = vdp_usb_loop_add_source(loop, source, vdp_usb_loop_to_epoll_events(events));
+
+    if (res != vdp_usb_success) {
+        free(source);
+    }
+
+    return res;
+}
+
+vdp_usb_result vdp_usb_loop_modify_fd(struct vdp_usb_loop* loop,
+    vdp_fd fd,
+    int events)
+{
+    struct vdp_usb_loop_source* source;
+    struct epoll_event ev;
+
+    assert(loop);
+    if (!loop) {
+        return vdp_usb_misuse;
+    }
+
+    source = vdp_usb_loop_find_source(loop, vdp_usb_loop_source_fd, fd);
+
+    if (!source) {
+        return vdp_usb_not_found;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = vdp_usb_loop_to_epoll_events(events);
+    ev.data.ptr = source;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(loop->context, "cannot modify fd %d: %s (%d)",
+            fd, strerror(error), error);
+
+        return vdp_usb_unknown;
+    }
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_loop_remove_fd(struct vdp_usb_loop* loop, vdp_fd fd)
+{
+    struct vdp_usb_loop_source* source;
+
+    assert(loop);
+    if (!loop) {
+        return vdp_usb_misuse;
+    }
+
+    source = vdp_usb_loop_find_source(loop, vdp_usb_loop_source_fd, fd);
+
+    if (!source) {
+        return vdp_usb_not_found;
+    }
+
+    vdp_usb_loop_remove_source(loop, source);
+
+    return vdp_usb_success;
+}
+
+vdp_usb_result vdp_usb_loop_add_timer(struct vdp_usb_loop* loop,
+    vdp_u32 timeout_ms,
+    vdp_u32 interval_ms,
+    vdp_usb_loop_timer_cb cb,
+    void* user_data,
+    struct vdp_usb_loop_timer** timer)
+{
+    struct itimerspec spec;
+    vdp_usb_result res;
+
+    assert(loop);
+    assert(cb);
+    assert(timer);
+    if (!loop || !cb || !timer) {
+        return vdp_usb_misuse;
+    }
+
+    *timer = malloc(sizeof(**timer));
+
+    if (!*timer) {
+        return vdp_usb_nomem;
+    }
+
+    memset(*timer, 0, sizeof(**timer));
+
+    vdp_list_init(&(*timer)->source.list);
+    (*timer)->source.type = vdp_usb_loop_source_timer;
+    (*timer)->source.user_data = user_data;
+    (*timer)->cb = cb;
+
+    (*timer)->source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if ((*timer)->source.fd == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(loop->context, "cannot create timer: %s (%d)", strerror(error), error);
+
+        res = vdp_usb_unknown;
+
+        goto fail1;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+
+    /*
+     * Zero 'it_value' disarms the timer, fire as soon as possible instead.
+     */
+
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000 + ((timeout_ms == 0) ? 1 : 0);
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+
+    if (timerfd_settime((*timer)->source.fd, 0, &spec, NULL) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(loop->context, "cannot set timer: %s (%d)", strerror(error), error);
+
+        res = vdp_usb_unknown;
+
+        goto fail2;
+    }
+
+    res = vdp_usb_loop_add_source(loop, &(*timer)->source, EPOLLIN);
+
+    if (res != vdp_usb_success) {
+        goto fail2;
+    }
+
+    return vdp_usb_success;
+
+fail2:
+    close((*timer)->source.fd);
+fail1:
+    free(*timer);
+    *timer = NULL;
+
+    return res;
+}
+
+void vdp_usb_loop_remove_timer(struct vdp_usb_loop* loop,
+    struct vdp_usb_loop_timer* timer)
+{
+    assert(loop);
+    assert(timer);
+    if (!loop || !timer || timer->source.removed) {
+        return;
+    }
+
+    vdp_usb_loop_remove_source(loop, &timer->source);
+}
+
+vdp_usb_result vdp_usb_loop_run_once(struct vdp_usb_loop* loop, int timeout_ms)
+{
+    struct epoll_event ready[VDP_USB_LOOP_MAX_READY];
+    vdp_usb_result res = vdp_usb_success;
+    int num_ready, i;
+
+    assert(loop);
+    if (!loop) {
+        return vdp_usb_misuse;
+    }
+
+    num_ready = epoll_wait(loop->epoll_fd, &ready[0], VDP_USB_LOOP_MAX_READY, timeout_ms);
+
+    if (num_ready == -1) {
+        int error = errno;
+
+        if (error == EINTR) {
+            return vdp_usb_success;
+        }
+
+        VDP_USB_LOG_ERROR(loop->context, "epoll error: %s (%d)", strerror(error), error);
+
+        return vdp_usb_unknown;
+    }
+
+    for (i = 0; i < num_ready; ++i) {
+        struct vdp_usb_loop_source* source = ready[i].data.ptr;
+
+        if (source->removed) {
+            continue;
+        }
+
+        switch (source->type) {
+        case vdp_usb_loop_source_device: {
+            vdp_usb_result device_res = vdp_usb_loop_dispatch_device(loop, source);
+
+            if ((device_res != vdp_usb_success) && (res == vdp_usb_success)) {
+                res = device_res;
+            }
+
+            break;
+        }
+        case vdp_usb_loop_source_fd:
+            source->fd_cb(loop, source->fd,
+                vdp_usb_loop_from_epoll_events(ready[i].events), source->user_data);
+            break;
+        case vdp_usb_loop_source_timer:
+            vdp_usb_loop_dispatch_timer(loop, vdp_containerof(source, struct vdp_usb_loop_timer, source));
+            break;
+        case vdp_usb_loop_source_completions: {
+            vdp_usb_result flush_res = vdp_usb_device_flush(source->device);
+
+            if ((flush_res != vdp_usb_success) && (res == vdp_usb_success)) {
+                res = flush_res;
+            }
+
+            break;
+        }
+        default:
+            assert(0);
+            break;
+        }
+    }
+
+    vdp_usb_loop_free_removed(loop);
+
+    return res;
+}
+
+vdp_usb_result vdp_usb_loop_run(struct vdp_usb_loop* loop)
+{
+    vdp_usb_result res = vdp_usb_success;
+
+    assert(loop);
+    if (!loop) {
+        return vdp_usb_misuse;
+    }
+
+    loop->stopped = 0;
+
+    while (!loop->stopped && (res == vdp_usb_success)) {
+        res = vdp_usb_loop_run_once(loop, -1);
+    }
+
+    return res;
+}
+
+void vdp_usb_loop_stop(struct vdp_usb_loop* loop)
+{
+    assert(loop);
+    if (!loop) {
+        return;
+    }
+
+    loop->stopped = 1;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * For struct ucred.
+ */
+#define _GNU_SOURCE
+
+#include "vdp_usb_context.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+/*
+ * Kernel broadcasts raw uevents to group 1, udev rebroadcasts them to group 2 once it's
+ * done processing, i.e. once device node is created.
+ */
+#define VDP_USB_MONITOR_GROUP_KERNEL 1
+#define VDP_USB_MONITOR_GROUP_UDEV 2
+
+#define VDP_USB_MONITOR_UDEV_CONTROL "/run/udev/control"
+
+#define VDP_USB_MONITOR_UDEV_PREFIX "libudev"
+#define VDP_USB_MONITOR_UDEV_MAGIC 0xfeedcafe
+
+#define VDP_USB_MONITOR_BUFF_SIZE 8192
+
+/*
+ * Header of udev rebroadcasted messages, only fields we need.
+ */
+struct vdp_usb_monitor_udev_header
+{
+    char prefix[8];
+    uint32_t magic; /* network byte order */
+    uint32_t header_size;
+    uint32_t properties_off;
+    uint32_t properties_len;
+};
+
+struct vdp_usb_monitor
+{
+    struct vdp_usb_context* context;
+
+    vdp_fd fd;
+
+    int udev;
+
+    char buff[VDP_USB_MONITOR_BUFF_SIZE];
+};
+
+/*
+ * Returns NUL separated KEY=VALUE list of the message or NULL if message is
+ * malformed or comes from someone we don't trust.
+ */
+static const char* vdp_usb_monitor_get_properties(struct vdp_usb_monitor* monitor,
+    struct msghdr* msg, size_t size, size_t* properties_len)
+{
+    const struct sockaddr_nl* snl = msg->msg_name;
+
+    if (monitor->udev) {
+        const struct vdp_usb_monitor_udev_header* hdr = (const void*)&monitor->buff[0];
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+        const struct ucred* cred;
+
+        if ((snl->nl_groups != VDP_USB_MONITOR_GROUP_UDEV) || (snl->nl_pid == 0)) {
+            return NULL;
+        }
+
+        if (!cmsg || (cmsg->cmsg_type != SCM_CREDENTIALS)) {
+            return NULL;
+        }
+
+        cred = (const struct ucred*)CMSG_DATA(cmsg);
+
+        if (cred->uid != 0) {
+            return NULL;
+        }
+
+        if ((size < sizeof(*hdr)) ||
+            (memcmp(&hdr->prefix[0], VDP_USB_MONITOR_UDEV_PREFIX, sizeof(VDP_USB_MONITOR_UDEV_PREFIX)) != 0) ||
+            (ntohl(hdr->magic) != VDP_USB_MONITOR_UDEV_MAGIC) ||
+            (hdr->properties_off > size) ||
+            (hdr->properties_len > (size - hdr->properties_off))) {
+            return NULL;
+        }
+
+        *properties_len = hdr->properties_len;
+
+        return &monitor->buff[hdr->properties_off];
+    } else {
+        size_t header_len;
+
+        if (snl->nl_pid != 0) {
+            return NULL;
+        }
+
+        /*
+         * "ACTION@DEVPATH" comes first, properties follow.
+         */
+        header_len = strlen(&monitor->buff[0]) + 1;
+
+        if ((header_len >= size) || !strchr(&monitor->buff[0], '@')) {
+            return NULL;
+        }
+
+        *properties_len = size - header_len;
+
+        return &monitor->buff[header_len];
+    }
+}
+
+vdp_usb_result vdp_usb_monitor_create(struct vdp_usb_context* context,
+    struct vdp_usb_monitor** monitor)
+{
+    vdp_usb_result vdp_res = vdp_usb_unknown;
+    struct sockaddr_nl snl;
+    int on = 1;
+
+    assert(context && monitor);
+    if (!context || !monitor) {
+        return vdp_usb_misuse;
+    }
+
+    *monitor = malloc(sizeof(**monitor));
+
+    if (*monitor == NULL) {
+        return vdp_usb_nomem;
+    }
+
+    memset(*monitor, 0, sizeof(**monitor));
+
+    (*monitor)->context = context;
+    (*monitor)->udev = (access(VDP_USB_MONITOR_UDEV_CONTROL, F_OK) == 0);
+
+    (*monitor)->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+    if ((*monitor)->fd == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(context, "cannot create uevent socket: %s (%d)", strerror(error), error);
+
+        goto fail1;
+    }
+
+    if (setsockopt((*monitor)->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(context, "cannot set SO_PASSCRED: %s (%d)", strerror(error), error);
+
+        goto fail2;
+    }
+
+    memset(&snl, 0, sizeof(snl));
+
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = (*monitor)->udev ? VDP_USB_MONITOR_GROUP_UDEV : VDP_USB_MONITOR_GROUP_KERNEL;
+
+    if (bind((*monitor)->fd, (struct sockaddr*)&snl, sizeof(snl)) == -1) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(context, "cannot bind uevent socket: %s (%d)", strerror(error), error);
+
+        goto fail2;
+    }
+
+    VDP_USB_LOG_DEBUG(context, "monitor created, listening to %s uevents",
+        ((*monitor)->udev ? "udev" : "kernel"));
+
+    return vdp_usb_success;
+
+fail2:
+    close((*monitor)->fd);
+fail1:
+    free(*monitor);
+    *monitor = NULL;
+
+    return vdp_res;
+}
+
+void vdp_usb_monitor_destroy(struct vdp_usb_monitor* monitor)
+{
+    assert(monitor);
+    if (!monitor) {
+        return;
+    }
+
+    close(monitor->fd);
+
+    free(monitor);
+}
+
+vdp_fd vdp_usb_monitor_get_fd(struct vdp_usb_monitor* monitor)
+{
+    assert(monitor);
+    if (!monitor) {
+        return -1;
+    }
+
+    return monitor->fd;
+}
+
+vdp_usb_result vdp_usb_monitor_get_event(struct vdp_usb_monitor* monitor,
+    struct vdp_usb_monitor_event* event)
+{
+    assert(monitor && event);
+    if (!monitor || !event) {
+        return vdp_usb_misuse;
+    }
+
+    memset(event, 0, sizeof(*event));
+
+    event->type = vdp_usb_monitor_event_none;
+
+    while (1) {
+        struct sockaddr_nl snl;
+        char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
+        struct iovec iov;
+        struct msghdr msg;
+        ssize_t ret;
+        const char* properties;
+        size_t properties_len = 0;
+        size_t i;
+        const char* action = NULL;
+        const char* subsystem = NULL;
+        const char* devname = NULL;
+        const char* devpath = NULL;
+        int device_num;
+
+        iov.iov_base = &monitor->buff[0];
+        iov.iov_len = sizeof(monitor->buff) - 1;
+
+        memset(&msg, 0, sizeof(msg));
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_name = &snl;
+        msg.msg_namelen = sizeof(snl);
+        msg.msg_control = &cred_msg[0];
+        msg.msg_controllen = sizeof(cred_msg);
+
+        ret = recvmsg(monitor->fd, &msg, 0);
+
+        if (ret == -1) {
+            int error = errno;
+
+            if ((error == EAGAIN) || (error == EWOULDBLOCK)) {
+                return vdp_usb_success;
+            }
+
+            if (error == EINTR) {
+                continue;
+            }
+
+            if (error == ENOBUFS) {
+                VDP_USB_LOG_WARNING(monitor->context, "uevent socket overrun, events were lost");
+
+                continue;
+            }
+
+            VDP_USB_LOG_ERROR(monitor->context, "cannot read uevent: %s (%d)", strerror(error), error);
+
+            return vdp_usb_unknown;
+        }
+
+        if (msg.msg_flags & MSG_TRUNC) {
+            continue;
+        }
+
+        monitor->buff[ret] = '\0';
+
+        properties = vdp_usb_monitor_get_properties(monitor, &msg, ret, &properties_len);
+
+        if (!properties) {
+            continue;
+        }
+
+        for (i = 0; i < properties_len; i += strlen(&properties[i]) + 1) {
+            const char* prop = &properties[i];
+
+            if (strncmp(prop, "ACTION=", 7) == 0) {
+                action = prop + 7;
+            } else if (strncmp(prop, "SUBSYSTEM=", 10) == 0) {
+                subsystem = prop + 10;
+            } else if (strncmp(prop, "DEVNAME=", 8) == 0) {
+                devname = prop + 8;
+            } else if (strncmp(prop, "DEVPATH=", 8) == 0) {
+                devpath = prop + 8;
+            }
+        }
+
+        if (!action || !subsystem || !devname || !devpath ||
+            (strcmp(subsystem, VDPHCI_NAME) != 0)) {
+            continue;
+        }
+
+        /*
+         * Kernel reports DEVNAME relative to /dev, udev reports full path.
+         */
+        if (strrchr(devname, '/')) {
+            devname = strrchr(devname, '/') + 1;
+        }
+
+        device_num = vdp_usb_parse_device_name(devname);
+
+        if (device_num < 0) {
+            continue;
+        }
+
+        event->info.device_number = device_num;
+        event->info.busnum = -1;
+        event->info.portnum = -1;
+
+        if (strcmp(action, "add") == 0) {
+            char dir_path[PATH_MAX];
+
+            event->type = vdp_usb_monitor_event_add;
+
+            snprintf(&dir_path[0], sizeof(dir_path), "/sys%s", devpath);
+
+            event->info.busnum = vdp_usb_sysfs_read_int(dir_path, "busnum");
+            event->info.portnum = vdp_usb_sysfs_read_int(dir_path, "portnum");
+        } else if (strcmp(action, "remove") == 0) {
+            event->type = vdp_usb_monitor_event_remove;
+        } else {
+            continue;
+        }
+
+        VDP_USB_LOG_DEBUG(monitor->context, "%s " VDPHCI_DEVICE_PREFIX "%d",
+            action, device_num);
+
+        return vdp_usb_success;
+    }
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_MPSC_H_
+#define _VDP_USB_MPSC_H_
+
+#include "vdp/types.h"
+#include <stddef.h>
+
+/*
+ * Intrusive multi-producer single-consumer queue (Dmitry Vyukov's). Push is
+ * wait-free, pop is lock-free but may return NULL while a producer is
+ * in the middle of a push even though the queue isn't empty, callers
+ * must track the number of queued nodes if they need to tell these apart.
+ */
+
+struct vdp_usb_mpsc_node
+{
+    struct vdp_usb_mpsc_node* next;
+};
+
+struct vdp_usb_mpsc
+{
+    /*
+     * Producers' end.
+     */
+    struct vdp_usb_mpsc_node* head;
+
+    /*
+     * Consumer's end.
+     */
+    struct vdp_usb_mpsc_node* tail;
+
+    struct vdp_usb_mpsc_node stub;
+};
+
+static __inline void vdp_usb_mpsc_init(struct vdp_usb_mpsc* q)
+{
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+/*
+ * Can be called from any thread.
+ */
+static __inline void vdp_usb_mpsc_push(struct vdp_usb_mpsc* q, struct vdp_usb_mpsc_node* node)
+{
+    struct vdp_usb_mpsc_node* prev;
+
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+
+    prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer only.
+ */
+static __inline struct vdp_usb_mpsc_node* vdp_usb_mpsc_pop(struct vdp_usb_mpsc* q)
+{
+    struct vdp_usb_mpsc_node* tail = q->tail;
+    struct vdp_usb_mpsc_node* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        /*
+         * A producer has swapped 'head' but hasn't linked the node yet.
+         */
+        return NULL;
+    }
+
+    /*
+     * 'tail' is the last node, put the stub behind it so that it can be taken.
+     */
+    vdp_usb_mpsc_push(q, &q->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+#endif
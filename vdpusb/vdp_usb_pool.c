@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdp_usb_pool.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Lives right before the buffer handed out.
+ */
+struct vdp_usb_pool_block
+{
+    union
+    {
+        /*
+         * Free blocks only.
+         */
+        struct vdp_usb_pool_block* next;
+
+        /*
+         * Allocated blocks only, VDP_USB_POOL_NUM_CLASSES means the block
+         * is not pooled.
+         */
+        vdp_u32 size_class;
+
+        /*
+         * Keep the buffer aligned as malloc would.
+         */
+        vdp_u64 align[2];
+    } u;
+};
+
+static vdp_u32 vdp_usb_pool_size_class(size_t size)
+{
+    vdp_u32 size_class = 0;
+
+    while ((size_class < VDP_USB_POOL_NUM_CLASSES) &&
+        (size > ((size_t)1 << (size_class + VDP_USB_POOL_MIN_SHIFT)))) {
+        ++size_class;
+    }
+
+    return size_class;
+}
+
+static vdp_u32 vdp_usb_pool_max_free_blocks(vdp_u32 size_class)
+{
+    vdp_u32 max_blocks = VDP_USB_POOL_CLASS_CACHE_BYTES >> (size_class + VDP_USB_POOL_MIN_SHIFT);
+
+    return (max_blocks < 2) ? 2 : max_blocks;
+}
+
+void vdp_usb_pool_init(struct vdp_usb_pool* pool)
+{
+    memset(pool, 0, sizeof(*pool));
+}
+
+void vdp_usb_pool_cleanup(struct vdp_usb_pool* pool)
+{
+    vdp_u32 i;
+
+    for (i = 0; i < VDP_USB_POOL_NUM_CLASSES; ++i) {
+        while (pool->free_blocks[i]) {
+            struct vdp_usb_pool_block* block = pool->free_blocks[i];
+
+            pool->free_blocks[i] = block->u.next;
+
+            free(block);
+
+            ++pool->stats.num_frees;
+        }
+
+        pool->num_free_blocks[i] = 0;
+    }
+
+    pool->closed = 1;
+}
+
+void* vdp_usb_pool_alloc(struct vdp_usb_pool* pool, size_t size)
+{
+    vdp_u32 size_class = vdp_usb_pool_size_class(size);
+    struct vdp_usb_pool_block* block;
+
+    assert(!pool->closed);
+
+    ++pool->stats.num_allocs;
+
+    if ((size_class < VDP_USB_POOL_NUM_CLASSES) && pool->free_blocks[size_class]) {
+        block = pool->free_blocks[size_class];
+
+        pool->free_blocks[size_class] = block->u.next;
+        --pool->num_free_blocks[size_class];
+    } else {
+        if (size_class < VDP_USB_POOL_NUM_CLASSES) {
+            size = (size_t)1 << (size_class + VDP_USB_POOL_MIN_SHIFT);
+        }
+
+        block = malloc(sizeof(*block) + size);
+
+        if (!block) {
+            return NULL;
+        }
+
+        ++pool->stats.num_mallocs;
+    }
+
+    block->u.size_class = size_class;
+
+    ++pool->num_outstanding;
+
+    return block + 1;
+}
+
+void vdp_usb_pool_free(struct vdp_usb_pool* pool, void* ptr)
+{
+    struct vdp_usb_pool_block* block;
+    vdp_u32 size_class;
+
+    if (!ptr) {
+        return;
+    }
+
+    block = (struct vdp_usb_pool_block*)ptr - 1;
+    size_class = block->u.size_class;
+
+    assert(size_class <= VDP_USB_POOL_NUM_CLASSES);
+    assert(pool->num_outstanding > 0);
+
+    --pool->num_outstanding;
+
+    if (pool->closed ||
+        (size_class >= VDP_USB_POOL_NUM_CLASSES) ||
+        (pool->num_free_blocks[size_class] >= vdp_usb_pool_max_free_blocks(size_class))) {
+        free(block);
+
+        ++pool->stats.num_frees;
+
+        return;
+    }
+
+    block->u.next = pool->free_blocks[size_class];
+    pool->free_blocks[size_class] = block;
+    ++pool->num_free_blocks[size_class];
+}
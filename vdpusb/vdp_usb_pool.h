@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_POOL_H_
+#define _VDP_USB_POOL_H_
+
+#include "vdp/usb.h"
+
+/*
+ * Power of two size classes from 256 bytes to 1M, larger buffers are
+ * malloc'ed and freed every time.
+ */
+#define VDP_USB_POOL_MIN_SHIFT 8
+#define VDP_USB_POOL_MAX_SHIFT 20
+#define VDP_USB_POOL_NUM_CLASSES (VDP_USB_POOL_MAX_SHIFT - VDP_USB_POOL_MIN_SHIFT + 1)
+
+/*
+ * Each class caches at most this many bytes worth of free buffers, but at least
+ * two buffers.
+ */
+#define VDP_USB_POOL_CLASS_CACHE_BYTES (256 * 1024)
+
+struct vdp_usb_pool_block;
+
+/*
+ * Recycles event buffers and urbis of a device so that steady state event
+ * processing doesn't call malloc/free. Not thread-safe, just like the device itself.
+ */
+struct vdp_usb_pool
+{
+    struct vdp_usb_pool_block* free_blocks[VDP_USB_POOL_NUM_CLASSES];
+    vdp_u32 num_free_blocks[VDP_USB_POOL_NUM_CLASSES];
+
+    /*
+     * Buffers handed out and not returned yet.
+     */
+    vdp_u32 num_outstanding;
+
+    /*
+     * Set by 'vdp_usb_pool_cleanup', returned buffers are freed right away.
+     */
+    int closed;
+
+    struct vdp_usb_alloc_stats stats;
+};
+
+void vdp_usb_pool_init(struct vdp_usb_pool* pool);
+
+/*
+ * Frees all cached buffers, outstanding buffers can still be returned after this.
+ */
+void vdp_usb_pool_cleanup(struct vdp_usb_pool* pool);
+
+void* vdp_usb_pool_alloc(struct vdp_usb_pool* pool, size_t size);
+
+void vdp_usb_pool_free(struct vdp_usb_pool* pool, void* ptr);
+
+#endif
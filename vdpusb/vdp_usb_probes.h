@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_PROBES_H_
+#define _VDP_USB_PROBES_H_
+
+#include "vdp_usb_urbi.h"
+#include "vdp_usb_device.h"
+
+/*
+ * USDT probes of provider "vdpusb", each one is a single nop unless a tracer is attached,
+ * e.g. "bpftrace -l 'usdt:./vdpusb-mouse2:vdpusb:*'". Probes and their arguments:
+ *
+ * event_read(device_number, event_type)
+ * urbi_create(device_number, urb_id, endpoint_address, transfer_length, urb_type)
+ * filter_hit(device_number, urb_id, request, status, actual_length)
+ * gadget_enqueue(device_number, urb_id, endpoint_address, transfer_length)
+ * gadget_dequeue(device_number, urb_id, endpoint_address)
+ * urb_complete(device_number, urb_id, endpoint_address, actual_length, status)
+ * urb_free(device_number, urb_id)
+ *
+ * Pairing urbi_create with urb_complete by device number and URB id gives per-URB latency.
+ */
+
+#ifdef VDP_USB_HAVE_SDT
+#include <sys/sdt.h>
+
+#define VDP_USB_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(vdpusb, name, a1, a2)
+#define VDP_USB_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(vdpusb, name, a1, a2, a3)
+#define VDP_USB_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(vdpusb, name, a1, a2, a3, a4)
+#define VDP_USB_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(vdpusb, name, a1, a2, a3, a4, a5)
+#else
+#define VDP_USB_PROBE2(name, a1, a2) do {} while (0)
+#define VDP_USB_PROBE3(name, a1, a2, a3) do {} while (0)
+#define VDP_USB_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#define VDP_USB_PROBE5(name, a1, a2, a3, a4, a5) do {} while (0)
+#endif
+
+/*
+ * Only valid while the URB is alive.
+ */
+static inline int vdp_usb_probe_device_number(const struct vdp_usb_urb* urb)
+{
+    return vdp_containerof(urb, struct vdp_usb_urbi, urb)->device->device_number;
+}
+
+#endif
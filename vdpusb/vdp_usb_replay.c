@@ -0,0 +1,1001 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdp/usb_replay.h"
+#include "vdp_usb_capture.h"
+#include "vdp_usb_context.h"
+#include "vdp_usb_device.h"
+#include "vdphci-common.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+/*
+ * How long to wait for the gadget to complete URBs before unlinking them.
+ */
+#define VDP_USB_REPLAY_SETTLE_TIMEOUT_MS 100
+
+/*
+ * Recorded URB.
+ */
+struct vdp_usb_replay_urbi
+{
+    /*
+     * usbmon URB id, used to match completion record with submission record.
+     */
+    vdp_u64 trace_id;
+
+    /*
+     * HEvent to inject, built as vdphci would build it.
+     */
+    char* hevent;
+    size_t hevent_size;
+
+    /*
+     * Recorded IN payload, only 'expected_data_length' bytes were captured.
+     */
+    vdp_byte* expected_data;
+    vdp_u32 expected_data_length;
+
+    int unlinked_in_trace;
+
+    /*
+     * Replay state.
+     * @{
+     */
+    int submitted;
+    int data_mismatch;
+    vdp_u32 streamed_length;
+    /*
+     * @}
+     */
+
+    struct vdp_usb_replay_urb result;
+};
+
+/*
+ * Point of the trace when something is to be done, either submit
+ * an URB or unlink it.
+ */
+struct vdp_usb_replay_item
+{
+    int unlink;
+
+    /*
+     * Nanoseconds since the first item.
+     */
+    vdp_u64 time;
+
+    vdp_u32 index;
+};
+
+struct vdp_usb_replay
+{
+    struct vdp_usb_context* context;
+
+    int devnum;
+    int busnum;
+
+    struct vdp_usb_replay_urbi* urbis;
+    vdp_u32 num_urbis;
+    vdp_u32 max_urbis;
+
+    struct vdp_usb_replay_item* items;
+    vdp_u32 num_items;
+    vdp_u32 max_items;
+
+    vdp_u32 num_skipped;
+
+    /*
+     * URBs submitted, but not completed yet.
+     */
+    vdp_u32 num_pending;
+};
+
+static vdp_u64 vdp_usb_replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (vdp_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static vdp_usb_urb_status vdp_usb_replay_trace_status(vdp_s32 status)
+{
+    switch (status) {
+    case 0: return vdp_usb_urb_status_completed;
+    case -ECONNRESET:
+    case -ENOENT: return vdp_usb_urb_status_unlinked;
+    case -EPIPE: return vdp_usb_urb_status_stall;
+    case -EOVERFLOW: return vdp_usb_urb_status_overflow;
+    default: return vdp_usb_urb_status_error;
+    }
+}
+
+static vdp_usb_urb_status vdp_usb_replay_devent_status(vdphci_urb_status status)
+{
+    switch (status) {
+    case vdphci_urb_status_completed: return vdp_usb_urb_status_completed;
+    case vdphci_urb_status_unlinked: return vdp_usb_urb_status_unlinked;
+    case vdphci_urb_status_stall: return vdp_usb_urb_status_stall;
+    case vdphci_urb_status_overflow: return vdp_usb_urb_status_overflow;
+    default: return vdp_usb_urb_status_error;
+    }
+}
+
+static vdp_usb_result vdp_usb_replay_add_item(struct vdp_usb_replay* replay,
+    int unlink,
+    vdp_u64 time,
+    vdp_u32 index)
+{
+    struct vdp_usb_replay_item* item;
+
+    if (replay->num_items == replay->max_items) {
+        vdp_u32 max_items = replay->max_items ? (replay->max_items * 2) : 64;
+        struct vdp_usb_replay_item* items = realloc(replay->items, max_items * sizeof(*items));
+
+        if (!items) {
+            return vdp_usb_nomem;
+        }
+
+        replay->items = items;
+        replay->max_items = max_items;
+    }
+
+    item = &replay->items[replay->num_items++];
+
+    item->unlink = unlink;
+    item->time = time;
+    item->index = index;
+
+    return vdp_usb_success;
+}
+
+static vdp_usb_result vdp_usb_replay_load_submit(struct vdp_usb_replay* replay,
+    const struct vdp_usb_capture_usbmon_header* usbmon,
+    const vdp_byte* data,
+    vdp_u32 data_length,
+    vdp_u64 time)
+{
+    struct vdp_usb_replay_urbi* urbi;
+    struct vdphci_hevent_header header;
+    struct vdphci_hevent_urb urb;
+    vdp_u32 setup_length = 0;
+    vdp_u32 out_length = 0;
+    size_t hevent_length;
+    vdp_usb_result res;
+
+    memset(&header, 0, sizeof(header));
+    memset(&urb, 0, sizeof(urb));
+
+    urb.endpoint_address = usbmon->epnum;
+    urb.transfer_length = usbmon->length;
+
+    switch (usbmon->xfer_type) {
+    case 1: {
+        urb.type = vdphci_urb_type_int;
+        break;
+    }
+    case 2: {
+        const vdp_u8* setup = &usbmon->s.setup[0];
+
+        if (usbmon->flag_setup != 0) {
+            ++replay->num_skipped;
+
+            return vdp_usb_success;
+        }
+
+        urb.type = vdphci_urb_type_control;
+        urb.endpoint_address = (usbmon->epnum & 0x7F) | (setup[0] & 0x80);
+        urb.transfer_length = (vdp_u32)setup[6] | ((vdp_u32)setup[7] << 8);
+        setup_length = sizeof(usbmon->s.setup);
+        break;
+    }
+    case 3: {
+        urb.type = vdphci_urb_type_bulk;
+        break;
+    }
+    default:
+        /*
+         * Isochronous.
+         */
+        ++replay->num_skipped;
+
+        return vdp_usb_success;
+    }
+
+    if (VDPHCI_USB_ENDPOINT_OUT(urb.endpoint_address)) {
+        out_length = urb.transfer_length;
+    }
+
+    hevent_length = vdp_offsetof(struct vdphci_hevent_urb, data.buff) + setup_length;
+
+    /*
+     * OUT payload is carried in the HEvent, whose length is 32-bit, a corrupted
+     * trace can have it overflow.
+     */
+
+    if (out_length > (0xFFFFFFFFU - sizeof(header) - hevent_length)) {
+        ++replay->num_skipped;
+
+        return vdp_usb_success;
+    }
+
+    hevent_length += out_length;
+
+    if (usbmon->xfer_flags & VDP_USB_CAPTURE_URB_ZERO_PACKET) {
+        urb.flags |= VDPHCI_URB_ZERO_PACKET;
+    }
+
+    urb.interval = (usbmon->interval > 0) ? usbmon->interval : 0;
+
+    if (replay->num_urbis == replay->max_urbis) {
+        vdp_u32 max_urbis = replay->max_urbis ? (replay->max_urbis * 2) : 64;
+        struct vdp_usb_replay_urbi* urbis = realloc(replay->urbis, max_urbis * sizeof(*urbis));
+
+        if (!urbis) {
+            return vdp_usb_nomem;
+        }
+
+        replay->urbis = urbis;
+        replay->max_urbis = max_urbis;
+    }
+
+    urb.seq_num = replay->num_urbis + 1;
+
+    header.type = vdphci_hevent_type_urb;
+    header.length = (vdp_u32)hevent_length;
+
+    urbi = &replay->urbis[replay->num_urbis];
+
+    memset(urbi, 0, sizeof(*urbi));
+
+    urbi->trace_id = usbmon->id;
+    urbi->hevent_size = sizeof(header) + hevent_length;
+    urbi->hevent = malloc(urbi->hevent_size);
+
+    if (!urbi->hevent) {
+        return vdp_usb_nomem;
+    }
+
+    /*
+     * Payload that wasn't captured is zero.
+     */
+
+    memset(urbi->hevent, 0, urbi->hevent_size);
+    memcpy(urbi->hevent, &header, sizeof(header));
+    memcpy(urbi->hevent + sizeof(header), &urb, vdp_offsetof(struct vdphci_hevent_urb, data.buff));
+    memcpy(urbi->hevent + sizeof(header) + vdp_offsetof(struct vdphci_hevent_urb, data.buff),
+        &usbmon->s.setup[0], setup_length);
+    memcpy(urbi->hevent + sizeof(header) + vdp_offsetof(struct vdphci_hevent_urb, data.buff) + setup_length,
+        data, vdp_min(data_length, out_length));
+
+    urbi->result.id = urb.seq_num;
+    urbi->result.endpoint_address = urb.endpoint_address;
+    urbi->result.transfer_length = urb.transfer_length;
+
+    switch (urb.type) {
+    case vdphci_urb_type_control: urbi->result.type = vdp_usb_urb_control; break;
+    case vdphci_urb_type_int: urbi->result.type = vdp_usb_urb_int; break;
+    default: urbi->result.type = vdp_usb_urb_bulk; break;
+    }
+
+    res = vdp_usb_replay_add_item(replay, 0, time, replay->num_urbis);
+
+    if (res != vdp_usb_success) {
+        free(urbi->hevent);
+
+        return res;
+    }
+
+    ++replay->num_urbis;
+
+    return vdp_usb_success;
+}
+
+static vdp_usb_result vdp_usb_replay_load_complete(struct vdp_usb_replay* replay,
+    const struct vdp_usb_capture_usbmon_header* usbmon,
+    const vdp_byte* data,
+    vdp_u32 data_length,
+    vdp_u64 time)
+{
+    struct vdp_usb_replay_urbi* urbi = NULL;
+    vdp_u32 i;
+
+    /*
+     * usbmon ids are URB addresses, so they're reused, the latest URB is the one.
+     */
+
+    for (i = replay->num_urbis; i > 0; --i) {
+        if ((replay->urbis[i - 1].trace_id == usbmon->id) && !replay->urbis[i - 1].result.has_expected) {
+            urbi = &replay->urbis[i - 1];
+
+            break;
+        }
+    }
+
+    if (!urbi) {
+        /*
+         * Skipped URB or the trace started in the middle.
+         */
+
+        return vdp_usb_success;
+    }
+
+    urbi->result.has_expected = 1;
+    urbi->result.expected_status = vdp_usb_replay_trace_status(usbmon->status);
+    urbi->result.expected_actual_length = usbmon->length;
+
+    if (VDP_USB_URB_ENDPOINT_IN(urbi->result.endpoint_address) && (data_length > 0)) {
+        urbi->expected_data_length = vdp_min(data_length, usbmon->length);
+        urbi->expected_data = malloc(urbi->expected_data_length);
+
+        if (!urbi->expected_data) {
+            return vdp_usb_nomem;
+        }
+
+        memcpy(urbi->expected_data, data, urbi->expected_data_length);
+    }
+
+    if (urbi->result.expected_status == vdp_usb_urb_status_unlinked) {
+        urbi->unlinked_in_trace = 1;
+
+        return vdp_usb_replay_add_item(replay, 1, time, i - 1);
+    }
+
+    return vdp_usb_success;
+}
+
+static vdp_usb_result vdp_usb_replay_load(struct vdp_usb_replay* replay, FILE* file)
+{
+    vdp_usb_result res = vdp_usb_success;
+    struct vdp_usb_capture_pcap_header header;
+    struct vdp_usb_capture_pcap_record record;
+    struct vdp_usb_capture_usbmon_header usbmon;
+    size_t usbmon_size;
+    vdp_u64 ts_mul;
+    vdp_u64 start_time = 0;
+    int have_start_time = 0;
+    vdp_byte* buff = NULL;
+    vdp_u32 buff_size = 0;
+
+    if (fread(&header, sizeof(header), 1, file) != 1) {
+        VDP_USB_LOG_ERROR(replay->context, "replay: cannot read pcap header");
+
+        return vdp_usb_protocol_error;
+    }
+
+    if (header.magic == VDP_USB_CAPTURE_PCAP_MAGIC) {
+        ts_mul = 1000;
+    } else if (header.magic == VDP_USB_CAPTURE_PCAP_MAGIC_NSEC) {
+        ts_mul = 1;
+    } else {
+        VDP_USB_LOG_ERROR(replay->context, "replay: bad pcap magic 0x%X, only host byte order is supported",
+            header.magic);
+
+        return vdp_usb_protocol_error;
+    }
+
+    if (header.network == VDP_USB_CAPTURE_LINKTYPE_USB_LINUX_MMAPPED) {
+        usbmon_size = sizeof(usbmon);
+    } else if (header.network == VDP_USB_CAPTURE_LINKTYPE_USB_LINUX) {
+        usbmon_size = VDP_USB_CAPTURE_USBMON_HEADER_SIZE_LINUX;
+    } else {
+        VDP_USB_LOG_ERROR(replay->context, "replay: bad pcap link type %u, usbmon is expected",
+            header.network);
+
+        return vdp_usb_protocol_error;
+    }
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        const vdp_byte* data;
+        vdp_u32 data_length;
+        vdp_u64 time;
+
+        if (record.incl_len > buff_size) {
+            vdp_byte* tmp = realloc(buff, record.incl_len);
+
+            if (!tmp) {
+                res = vdp_usb_nomem;
+
+                break;
+            }
+
+            buff = tmp;
+            buff_size = record.incl_len;
+        }
+
+        if ((record.incl_len > 0) && (fread(buff, record.incl_len, 1, file) != 1)) {
+            VDP_USB_LOG_WARNING(replay->context, "replay: truncated pcap record");
+
+            break;
+        }
+
+        if (record.incl_len < usbmon_size) {
+            ++replay->num_skipped;
+
+            continue;
+        }
+
+        memset(&usbmon, 0, sizeof(usbmon));
+        memcpy(&usbmon, buff, usbmon_size);
+
+        if (replay->devnum < 0) {
+            replay->devnum = usbmon.devnum;
+        }
+
+        if (usbmon.devnum != replay->devnum) {
+            continue;
+        }
+
+        if (replay->busnum < 0) {
+            replay->busnum = usbmon.busnum;
+        }
+
+        if (usbmon.busnum != replay->busnum) {
+            continue;
+        }
+
+        data = buff + usbmon_size;
+        data_length = vdp_min(record.incl_len - (vdp_u32)usbmon_size, usbmon.len_cap);
+
+        time = (vdp_u64)record.ts_sec * 1000000000ULL + (vdp_u64)record.ts_usec * ts_mul;
+
+        if (!have_start_time) {
+            start_time = time;
+            have_start_time = 1;
+        }
+
+        time = (time > start_time) ? (time - start_time) : 0;
+
+        if (usbmon.type == VDP_USB_CAPTURE_USBMON_SUBMIT) {
+            res = vdp_usb_replay_load_submit(replay, &usbmon, data, data_length, time);
+        } else if (usbmon.type == VDP_USB_CAPTURE_USBMON_COMPLETE) {
+            res = vdp_usb_replay_load_complete(replay, &usbmon, data, data_length, time);
+        } else {
+            /*
+             * Submission error.
+             */
+            ++replay->num_skipped;
+        }
+
+        if (res != vdp_usb_success) {
+            break;
+        }
+    }
+
+    free(buff);
+
+    return res;
+}
+
+vdp_usb_result vdp_usb_replay_create(struct vdp_usb_context* context,
+    const char* file_path,
+    int devnum,
+    struct vdp_usb_replay** replay)
+{
+    vdp_usb_result res;
+    FILE* file;
+
+    assert(context && file_path && replay);
+    if (!context || !file_path || !replay) {
+        return vdp_usb_misuse;
+    }
+
+    file = fopen(file_path, "rb");
+
+    if (!file) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(context, "cannot open %s: %s (%d)", file_path, strerror(error), error);
+
+        return (error == ENOENT) ? vdp_usb_not_found : vdp_usb_unknown;
+    }
+
+    *replay = malloc(sizeof(**replay));
+
+    if (*replay == NULL) {
+        fclose(file);
+
+        return vdp_usb_nomem;
+    }
+
+    memset(*replay, 0, sizeof(**replay));
+
+    (*replay)->context = context;
+    (*replay)->devnum = devnum;
+    (*replay)->busnum = -1;
+
+    res = vdp_usb_replay_load(*replay, file);
+
+    fclose(file);
+
+    if (res != vdp_usb_success) {
+        vdp_usb_replay_destroy(*replay);
+        *replay = NULL;
+
+        return res;
+    }
+
+    VDP_USB_LOG_DEBUG(context, "replay: %s loaded, device %d, %u urbs, %u skipped",
+        file_path, (*replay)->devnum, (*replay)->num_urbis, (*replay)->num_skipped);
+
+    return vdp_usb_success;
+}
+
+void vdp_usb_replay_destroy(struct vdp_usb_replay* replay)
+{
+    vdp_u32 i;
+
+    assert(replay);
+    if (!replay) {
+        return;
+    }
+
+    for (i = 0; i < replay->num_urbis; ++i) {
+        free(replay->urbis[i].hevent);
+        free(replay->urbis[i].expected_data);
+    }
+
+    free(replay->urbis);
+    free(replay->items);
+    free(replay);
+}
+
+/*
+ * Copy 'size' bytes at 'offset' of DEvent scattered across 'vec'.
+ */
+static int vdp_usb_replay_iov_read(const struct iovec* vec, int count,
+    size_t offset,
+    void* buff,
+    size_t size)
+{
+    int i;
+
+    for (i = 0; (i < count) && (size > 0); ++i) {
+        size_t n;
+
+        if (offset >= vec[i].iov_len) {
+            offset -= vec[i].iov_len;
+
+            continue;
+        }
+
+        n = vdp_min(vec[i].iov_len - offset, size);
+
+        memcpy(buff, (const char*)vec[i].iov_base + offset, n);
+
+        buff = (char*)buff + n;
+        size -= n;
+        offset = 0;
+    }
+
+    return (size == 0);
+}
+
+/*
+ * Compare 'size' bytes at 'offset' of DEvent with 'buff'.
+ */
+static int vdp_usb_replay_iov_equal(const struct iovec* vec, int count,
+    size_t offset,
+    const void* buff,
+    size_t size)
+{
+    int i;
+
+    for (i = 0; (i < count) && (size > 0); ++i) {
+        size_t n;
+
+        if (offset >= vec[i].iov_len) {
+            offset -= vec[i].iov_len;
+
+            continue;
+        }
+
+        n = vdp_min(vec[i].iov_len - offset, size);
+
+        if (memcmp(buff, (const char*)vec[i].iov_base + offset, n) != 0) {
+            return 0;
+        }
+
+        buff = (const char*)buff + n;
+        size -= n;
+        offset = 0;
+    }
+
+    return (size == 0);
+}
+
+/*
+ * Check gadget's IN payload at 'offset' of the transfer against the recorded one,
+ * as far as it was recorded.
+ */
+static void vdp_usb_replay_check_data(struct vdp_usb_replay_urbi* urbi,
+    const struct iovec* vec, int count,
+    size_t vec_offset,
+    vdp_u32 offset,
+    vdp_u32 length)
+{
+    if (!urbi->expected_data || (offset >= urbi->expected_data_length)) {
+        return;
+    }
+
+    length = vdp_min(length, urbi->expected_data_length - offset);
+
+    if (!vdp_usb_replay_iov_equal(vec, count, vec_offset, urbi->expected_data + offset, length)) {
+        urbi->data_mismatch = 1;
+    }
+}
+
+static void vdp_usb_replay_complete(struct vdp_usb_replay* replay,
+    struct vdp_usb_replay_urbi* urbi,
+    vdp_usb_urb_status status,
+    vdp_u32 actual_length)
+{
+    urbi->result.completed = 1;
+    urbi->result.status = status;
+    urbi->result.actual_length = actual_length;
+
+    --replay->num_pending;
+}
+
+static struct vdp_usb_replay_urbi* vdp_usb_replay_find(struct vdp_usb_replay* replay, vdp_u32 seq_num)
+{
+    struct vdp_usb_replay_urbi* urbi;
+
+    if ((seq_num == 0) || (seq_num > replay->num_urbis)) {
+        VDP_USB_LOG_ERROR(replay->context, "replay: completion of unknown urb %u", seq_num);
+
+        return NULL;
+    }
+
+    urbi = &replay->urbis[seq_num - 1];
+
+    if (!urbi->submitted || urbi->result.completed) {
+        VDP_USB_LOG_ERROR(replay->context, "replay: urb %u completed twice", seq_num);
+
+        return NULL;
+    }
+
+    return urbi;
+}
+
+/*
+ * Takes DEvents from the device instead of vdphci.
+ */
+static int vdp_usb_replay_sink(void* sink_data, const struct iovec* vec, int count)
+{
+    struct vdp_usb_replay* replay = sink_data;
+    struct vdphci_devent_header header;
+    struct vdp_usb_replay_urbi* urbi;
+    size_t offset = sizeof(header);
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        total += vec[i].iov_len;
+    }
+
+    if (!vdp_usb_replay_iov_read(vec, count, 0, &header, sizeof(header))) {
+        return -EINVAL;
+    }
+
+    switch (header.type) {
+    case vdphci_devent_type_urb: {
+        struct vdphci_devent_urb urb;
+
+        if (!vdp_usb_replay_iov_read(vec, count, offset, &urb, vdp_offsetof(struct vdphci_devent_urb, data.buff))) {
+            return -EINVAL;
+        }
+
+        offset += vdp_offsetof(struct vdphci_devent_urb, data.buff);
+
+        urbi = vdp_usb_replay_find(replay, urb.seq_num);
+
+        if (!urbi) {
+            return -EINVAL;
+        }
+
+        /*
+         * It replaces everything streamed so far.
+         */
+
+        vdp_usb_replay_check_data(urbi, vec, count, offset, 0, total - offset);
+
+        vdp_usb_replay_complete(replay, urbi, vdp_usb_replay_devent_status(urb.status), urb.actual_length);
+
+        return 0;
+    }
+    case vdphci_devent_type_urb_data: {
+        struct vdphci_devent_urb_data urb_data;
+
+        if (!vdp_usb_replay_iov_read(vec, count, offset, &urb_data, vdp_offsetof(struct vdphci_devent_urb_data, buff))) {
+            return -EINVAL;
+        }
+
+        offset += vdp_offsetof(struct vdphci_devent_urb_data, buff);
+
+        urbi = vdp_usb_replay_find(replay, urb_data.seq_num);
+
+        if (!urbi) {
+            return -EINVAL;
+        }
+
+        vdp_usb_replay_check_data(urbi, vec, count, offset, urbi->streamed_length, urb_data.length);
+
+        urbi->streamed_length += urb_data.length;
+
+        if (urb_data.flags & VDPHCI_URB_DATA_FINAL) {
+            vdp_usb_replay_complete(replay, urbi, vdp_usb_replay_devent_status(urb_data.status),
+                urbi->streamed_length);
+        } else if (urbi->streamed_length >= urbi->result.transfer_length) {
+            vdp_usb_replay_complete(replay, urbi, vdp_usb_urb_status_completed,
+                urbi->streamed_length);
+        }
+
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+static void vdp_usb_replay_signal(struct vdp_usb_replay* replay,
+    struct vdp_usb_device* device,
+    struct vdp_usb_gadget* gadget,
+    vdphci_hsignal signal)
+{
+    char buff[sizeof(struct vdphci_hevent_header) + sizeof(struct vdphci_hevent_signal)];
+    struct vdphci_hevent_header header;
+    struct vdphci_hevent_signal signal_event;
+    struct vdp_usb_event event;
+
+    header.type = vdphci_hevent_type_signal;
+    header.length = sizeof(signal_event);
+    signal_event.signal = signal;
+
+    memcpy(&buff[0], &header, sizeof(header));
+    memcpy(&buff[0] + sizeof(header), &signal_event, sizeof(signal_event));
+
+    if (vdp_usb_device_inject_event(device, &buff[0], sizeof(buff), &event) == vdp_usb_success) {
+        vdp_usb_gadget_event(gadget, &event);
+    }
+}
+
+static void vdp_usb_replay_unlink(struct vdp_usb_replay* replay,
+    struct vdp_usb_device* device,
+    struct vdp_usb_gadget* gadget,
+    vdp_u32 seq_num)
+{
+    char buff[sizeof(struct vdphci_hevent_header) + sizeof(struct vdphci_hevent_unlink_urb)];
+    struct vdphci_hevent_header header;
+    struct vdphci_hevent_unlink_urb unlink_urb;
+    struct vdp_usb_event event;
+
+    header.type = vdphci_hevent_type_unlink_urb;
+    header.length = sizeof(unlink_urb);
+    unlink_urb.seq_num = seq_num;
+
+    memcpy(&buff[0], &header, sizeof(header));
+    memcpy(&buff[0] + sizeof(header), &unlink_urb, sizeof(unlink_urb));
+
+    if (vdp_usb_device_inject_event(device, &buff[0], sizeof(buff), &event) == vdp_usb_success) {
+        vdp_usb_gadget_event(gadget, &event);
+    }
+}
+
+/*
+ * Give workers a chance to complete what they've got.
+ */
+static void vdp_usb_replay_settle(struct vdp_usb_replay* replay, struct vdp_usb_device* device)
+{
+    struct pollfd pfd;
+
+    vdp_usb_device_flush(device);
+
+    pfd.fd = vdp_usb_device_get_completion_fd(device);
+    pfd.events = POLLIN;
+
+    while (replay->num_pending > 0) {
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, VDP_USB_REPLAY_SETTLE_TIMEOUT_MS) <= 0) {
+            break;
+        }
+
+        vdp_usb_device_flush(device);
+    }
+}
+
+vdp_usb_result vdp_usb_replay_run(struct vdp_usb_replay* replay,
+    struct vdp_usb_gadget* gadget,
+    int realtime,
+    vdp_usb_replay_urb_cb cb,
+    void* user_data,
+    struct vdp_usb_replay_stats* stats)
+{
+    struct vdp_usb_device* device = NULL;
+    vdp_usb_result res;
+    vdp_u64 start_time;
+    vdp_u32 i;
+
+    assert(replay && gadget);
+    if (!replay || !gadget) {
+        return vdp_usb_misuse;
+    }
+
+    for (i = 0; i < replay->num_urbis; ++i) {
+        struct vdp_usb_replay_urbi* urbi = &replay->urbis[i];
+
+        urbi->submitted = 0;
+        urbi->data_mismatch = 0;
+        urbi->streamed_length = 0;
+        urbi->result.handler_time = 0;
+        urbi->result.completed = 0;
+        urbi->result.status = vdp_usb_urb_status_undefined;
+        urbi->result.actual_length = 0;
+        urbi->result.match = 0;
+    }
+
+    replay->num_pending = 0;
+
+    res = vdp_usb_device_create(replay->context, (vdp_u8)replay->devnum, -1,
+        (replay->busnum >= 0) ? replay->busnum : 0, 0, &device);
+
+    if (res != vdp_usb_success) {
+        return res;
+    }
+
+    device->sink = &vdp_usb_replay_sink;
+    device->sink_data = replay;
+
+    start_time = vdp_usb_replay_now();
+
+    vdp_usb_replay_signal(replay, device, gadget, vdphci_hsignal_power_on);
+    vdp_usb_replay_signal(replay, device, gadget, vdphci_hsignal_reset_start);
+    vdp_usb_replay_signal(replay, device, gadget, vdphci_hsignal_reset_end);
+
+    for (i = 0; i < replay->num_items; ++i) {
+        const struct vdp_usb_replay_item* item = &replay->items[i];
+        struct vdp_usb_replay_urbi* urbi = &replay->urbis[item->index];
+
+        if (realtime) {
+            vdp_u64 t = start_time + item->time;
+            struct timespec ts;
+
+            ts.tv_sec = t / 1000000000ULL;
+            ts.tv_nsec = t % 1000000000ULL;
+
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        }
+
+        if (item->unlink) {
+            if (!urbi->result.completed) {
+                vdp_usb_replay_unlink(replay, device, gadget, urbi->result.id);
+            }
+        } else {
+            struct vdp_usb_event event;
+
+            urbi->submitted = 1;
+            ++replay->num_pending;
+
+            res = vdp_usb_device_inject_event(device, urbi->hevent, urbi->hevent_size, &event);
+
+            if (res == vdp_usb_success) {
+                vdp_u64 t = vdp_usb_replay_now();
+
+                vdp_usb_gadget_event(gadget, &event);
+
+                urbi->result.handler_time = vdp_usb_replay_now() - t;
+            } else {
+                VDP_USB_LOG_ERROR(replay->context, "replay: cannot inject urb %u: %s",
+                    urbi->result.id, vdp_usb_result_to_str(res));
+            }
+        }
+
+        vdp_usb_device_flush(device);
+    }
+
+    vdp_usb_replay_settle(replay, device);
+
+    /*
+     * Streaming stopped with a short packet, vdphci would've completed these.
+     */
+
+    for (i = 0; i < replay->num_urbis; ++i) {
+        struct vdp_usb_replay_urbi* urbi = &replay->urbis[i];
+
+        if (urbi->submitted && !urbi->result.completed && (urbi->streamed_length > 0)) {
+            vdp_usb_replay_complete(replay, urbi, vdp_usb_urb_status_completed, urbi->streamed_length);
+        }
+    }
+
+    for (i = 0; i < replay->num_urbis; ++i) {
+        struct vdp_usb_replay_urbi* urbi = &replay->urbis[i];
+
+        if (urbi->submitted && !urbi->result.completed) {
+            vdp_usb_replay_unlink(replay, device, gadget, urbi->result.id);
+        }
+    }
+
+    vdp_usb_replay_settle(replay, device);
+
+    vdp_usb_replay_signal(replay, device, gadget, vdphci_hsignal_power_off);
+
+    vdp_usb_replay_settle(replay, device);
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+
+        stats->num_urbs = replay->num_urbis;
+        stats->num_skipped = replay->num_skipped;
+        stats->run_time = vdp_usb_replay_now() - start_time;
+    }
+
+    for (i = 0; i < replay->num_urbis; ++i) {
+        struct vdp_usb_replay_urbi* urbi = &replay->urbis[i];
+        struct vdp_usb_replay_urb* result = &urbi->result;
+
+        result->match = result->completed && result->has_expected &&
+            (result->status == result->expected_status) &&
+            (result->actual_length == result->expected_actual_length) &&
+            !urbi->data_mismatch;
+
+        if (stats) {
+            if (result->completed) {
+                ++stats->num_completed;
+            }
+
+            if (result->has_expected && !result->match) {
+                ++stats->num_mismatched;
+            }
+
+            stats->total_handler_time += result->handler_time;
+
+            if (result->handler_time > stats->max_handler_time) {
+                stats->max_handler_time = result->handler_time;
+            }
+        }
+
+        if (cb) {
+            cb(result, user_data);
+        }
+    }
+
+    /*
+     * Whatever the gadget still holds goes nowhere.
+     */
+
+    device->sink = NULL;
+
+    vdp_usb_device_close(device);
+
+    return vdp_usb_success;
+}
@@ -26,10 +26,14 @@
 #include "vdp_usb_urbi.h"
 #include "vdp_usb_device.h"
 #include "vdp_usb_context.h"
+#include "vdp_usb_probes.h"
 #include "vdp/byte_order.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
 
 static inline struct vdphci_hevent_urb* urbi_get_hevent_urb(struct vdp_usb_urbi* urbi)
 {
@@ -72,15 +76,65 @@ static int translate_urb_status(vdp_usb_urb_status status, vdphci_urb_status* re
     return 1;
 }
 
+/*
+ * Event as it was read, 'buff_size' is the size of the whole buffer it was read into.
+ */
+struct urbi_event
+{
+    const void* buff;
+    size_t size;
+    size_t buff_size;
+};
+
+static inline size_t urbi_align(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+/*
+ * ISO packets of ISO urbis live in the same buffer, right after 'urbi->size' bytes.
+ */
+static inline vdp_u32 urbi_iso_packets_offset(vdp_u32 urbi_size)
+{
+    return urbi_align(urbi_size);
+}
+
+/*
+ * Build the urbi right after the event if there's room in the read buffer, so that
+ * the URB takes one buffer. Otherwise allocate it separately, the following reads
+ * reserve enough room.
+ */
+static struct vdp_usb_urbi* urbi_alloc(struct vdp_usb_device* device,
+    const struct urbi_event* event,
+    size_t size)
+{
+    size_t offset = urbi_align(event->size);
+
+    vdp_usb_device_learn_urbi_size(device, size);
+
+    if ((offset + size) <= event->buff_size) {
+        return (struct vdp_usb_urbi*)((char*)event->buff + offset);
+    }
+
+    return vdp_usb_device_alloc_buff(device, size);
+}
+
+static inline struct vdp_usb_iso_packet* urbi_iso_packets(struct vdp_usb_urbi* urbi)
+{
+    return (struct vdp_usb_iso_packet*)((char*)urbi + urbi_iso_packets_offset(urbi->size));
+}
+
 static void urbi_fill_common(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urbi_size,
     struct vdp_usb_urbi* urbi)
 {
     urbi->size = urbi_size;
     urbi->device = device;
-    urbi->event = event;
+    urbi->event = event->buff;
+    urbi->in_place = (((const char*)urbi >= (const char*)event->buff) &&
+        ((const char*)urbi < ((const char*)event->buff + event->buff_size)));
     urbi->urb.id = urb->seq_num;
 
     switch (urb->type) {
@@ -123,7 +177,7 @@ static void urbi_fill_common(struct vdp_usb_device* device,
 }
 
 static vdp_usb_result urbi_create_in_iso(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
@@ -180,7 +234,8 @@ static vdp_usb_result urbi_create_in_iso(struct vdp_usb_device* device,
 
     tmp_size = data_offset + actual_transfer_length;
 
-    *urbi = malloc(tmp_size);
+    *urbi = urbi_alloc(device, event,
+        urbi_iso_packets_offset(tmp_size) + sizeof(struct vdp_usb_iso_packet) * num_iso_packets);
 
     if (*urbi == NULL) {
         return vdp_usb_nomem;
@@ -190,18 +245,9 @@ static vdp_usb_result urbi_create_in_iso(struct vdp_usb_device* device,
 
     urbi_fill_common(device, event, urb, tmp_size, *urbi);
 
-    tmp_size = sizeof(struct vdp_usb_iso_packet) * num_iso_packets;
+    (*urbi)->urb.iso_packets = urbi_iso_packets(*urbi);
 
-    (*urbi)->urb.iso_packets = malloc(tmp_size);
-
-    if ((*urbi)->urb.iso_packets == NULL) {
-        free(*urbi);
-        *urbi = NULL;
-
-        return vdp_usb_nomem;
-    }
-
-    memset((*urbi)->urb.iso_packets, 0, tmp_size);
+    memset((*urbi)->urb.iso_packets, 0, sizeof(struct vdp_usb_iso_packet) * num_iso_packets);
 
     /*
      * Fill urbi.urb
@@ -235,7 +281,7 @@ static vdp_usb_result urbi_create_in_iso(struct vdp_usb_device* device,
 }
 
 static vdp_usb_result urbi_create_in_control(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
@@ -285,7 +331,7 @@ static vdp_usb_result urbi_create_in_control(struct vdp_usb_device* device,
 
     tmp_size = data_offset + urb->transfer_length;
 
-    *urbi = malloc(tmp_size);
+    *urbi = urbi_alloc(device, event, tmp_size);
 
     if (*urbi == NULL) {
         return vdp_usb_nomem;
@@ -307,7 +353,7 @@ static vdp_usb_result urbi_create_in_control(struct vdp_usb_device* device,
 }
 
 static vdp_usb_result urbi_create_in_other(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
@@ -336,7 +382,7 @@ static vdp_usb_result urbi_create_in_other(struct vdp_usb_device* device,
 
     tmp_size = data_offset + urb->transfer_length;
 
-    *urbi = malloc(tmp_size);
+    *urbi = urbi_alloc(device, event, tmp_size);
 
     if (*urbi == NULL) {
         return vdp_usb_nomem;
@@ -356,7 +402,7 @@ static vdp_usb_result urbi_create_in_other(struct vdp_usb_device* device,
 }
 
 static vdp_usb_result urbi_create_out_iso(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
@@ -421,7 +467,8 @@ static vdp_usb_result urbi_create_out_iso(struct vdp_usb_device* device,
         vdp_offsetof(struct vdphci_devent_urb, data.packets) +
         (sizeof(struct vdphci_d_iso_packet) * urb->number_of_packets);
 
-    *urbi = malloc(tmp_size);
+    *urbi = urbi_alloc(device, event,
+        urbi_iso_packets_offset(tmp_size) + sizeof(struct vdp_usb_iso_packet) * urb->number_of_packets);
 
     if (*urbi == NULL) {
         return vdp_usb_nomem;
@@ -431,18 +478,9 @@ static vdp_usb_result urbi_create_out_iso(struct vdp_usb_device* device,
 
     urbi_fill_common(device, event, urb, tmp_size, *urbi);
 
-    tmp_size = sizeof(struct vdp_usb_iso_packet) * urb->number_of_packets;
+    (*urbi)->urb.iso_packets = urbi_iso_packets(*urbi);
 
-    (*urbi)->urb.iso_packets = malloc(tmp_size);
-
-    if ((*urbi)->urb.iso_packets == NULL) {
-        free(*urbi);
-        *urbi = NULL;
-
-        return vdp_usb_nomem;
-    }
-
-    memset((*urbi)->urb.iso_packets, 0, tmp_size);
+    memset((*urbi)->urb.iso_packets, 0, sizeof(struct vdp_usb_iso_packet) * urb->number_of_packets);
 
     /*
      * Fill urbi.urb
@@ -476,7 +514,7 @@ static vdp_usb_result urbi_create_out_iso(struct vdp_usb_device* device,
 }
 
 static vdp_usb_result urbi_create_out_control(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
@@ -535,7 +573,7 @@ static vdp_usb_result urbi_create_out_control(struct vdp_usb_device* device,
     tmp_size = vdp_offsetof(struct vdp_usb_urbi, devent_urb) +
         vdp_offsetof(struct vdphci_devent_urb, data.buff);
 
-    *urbi = malloc(tmp_size);
+    *urbi = urbi_alloc(device, event, tmp_size);
 
     if (*urbi == NULL) {
         return vdp_usb_nomem;
@@ -557,7 +595,7 @@ static vdp_usb_result urbi_create_out_control(struct vdp_usb_device* device,
 }
 
 static vdp_usb_result urbi_create_out_other(struct vdp_usb_device* device,
-    const void* event,
+    const struct urbi_event* event,
     struct vdphci_hevent_urb* urb,
     vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
@@ -584,7 +622,7 @@ static vdp_usb_result urbi_create_out_other(struct vdp_usb_device* device,
     tmp_size = vdp_offsetof(struct vdp_usb_urbi, devent_urb) +
         vdp_offsetof(struct vdphci_devent_urb, data.buff);
 
-    *urbi = malloc(tmp_size);
+    *urbi = urbi_alloc(device, event, tmp_size);
 
     if (*urbi == NULL) {
         return vdp_usb_nomem;
@@ -603,30 +641,105 @@ static vdp_usb_result urbi_create_out_other(struct vdp_usb_device* device,
     return vdp_usb_success;
 }
 
-vdp_usb_result vdp_usb_urbi_create(struct vdp_usb_device* device,
-    const void* event,
-    size_t event_size,
+static vdp_usb_result urbi_create_mapped(struct vdp_usb_device* device,
+    const struct urbi_event* event,
+    struct vdphci_hevent_urb* urb,
+    vdp_u32 urb_size,
     struct vdp_usb_urbi** urbi)
 {
-    struct vdphci_hevent_urb* urb;
-    size_t urb_size;
+    vdp_u32 tmp_size = 0;
+    void* map_addr = NULL;
+    long page_size = sysconf(_SC_PAGESIZE);
 
-    assert(device);
-    assert(event);
-    assert(urbi);
-    assert(event_size >= sizeof(struct vdphci_hevent_header));
+    /*
+     * Validate the URB.
+     */
 
-    urb = (struct vdphci_hevent_urb*)((const char*)event + sizeof(struct vdphci_hevent_header));
-    urb_size = event_size - sizeof(struct vdphci_hevent_header);
+    if (urb_size != (vdp_offsetof(struct vdphci_hevent_urb, data.map) + sizeof(struct vdphci_h_map))) {
+        VDP_USB_LOG_ERROR(device->context,
+            "device %d: bad mapped urb size",
+            device->device_number);
 
-    assert(urb_size >= vdp_offsetof(struct vdphci_hevent_urb, data.buff));
+        return vdp_usb_protocol_error;
+    }
+
+    if ((urb->data.map.length < urb->transfer_length) ||
+        ((urb->data.map.length % page_size) != 0)) {
+        VDP_USB_LOG_ERROR(device->context,
+            "device %d: bad mapped urb, map length == %u, transfer length == %u",
+            device->device_number,
+            urb->data.map.length,
+            urb->transfer_length);
+
+        return vdp_usb_protocol_error;
+    }
+
+    map_addr = mmap(NULL, urb->data.map.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+        device->fd, (off_t)urb->data.map.pgoff * page_size);
+
+    if (map_addr == MAP_FAILED) {
+        int error = errno;
+
+        VDP_USB_LOG_ERROR(device->context,
+            "device %d: cannot map urb %u: %s (%d)",
+            device->device_number,
+            urb->seq_num,
+            strerror(error),
+            error);
+
+        return vdp_usb_unknown;
+    }
 
     /*
-     * Ok, here's what we have: 'urb' and it's size in 'urb_size', the structure itself
-     * must be validated below.
+     * Allocate urbi, payload lives in the mapping.
      */
 
-    if (VDPHCI_USB_ENDPOINT_IN(urb->endpoint_address)) {
+    tmp_size = vdp_offsetof(struct vdp_usb_urbi, devent_urb) +
+        vdp_offsetof(struct vdphci_devent_urb, data.buff);
+
+    *urbi = urbi_alloc(device, event, tmp_size);
+
+    if (*urbi == NULL) {
+        munmap(map_addr, urb->data.map.length);
+
+        return vdp_usb_nomem;
+    }
+
+    memset(*urbi, 0, tmp_size);
+
+    urbi_fill_common(device, event, urb, tmp_size, *urbi);
+
+    (*urbi)->map_addr = map_addr;
+    (*urbi)->map_length = urb->data.map.length;
+
+    /*
+     * Fill urbi.urb
+     */
+
+    (*urbi)->urb.transfer_buffer = map_addr;
+
+    return vdp_usb_success;
+}
+
+static vdp_usb_result urbi_create_typed(struct vdp_usb_device* device,
+    const struct urbi_event* event,
+    struct vdphci_hevent_urb* urb,
+    vdp_u32 urb_size,
+    struct vdp_usb_urbi** urbi)
+{
+    if (urb->flags & VDPHCI_URB_MAPPED) {
+        switch (urb->type) {
+        case vdphci_urb_type_bulk:
+        case vdphci_urb_type_int: {
+            return urbi_create_mapped(device, event, urb, urb_size, urbi);
+        }
+        default:
+            VDP_USB_LOG_ERROR(device->context,
+                "device %d: bad mapped urb type",
+                device->device_number);
+            return vdp_usb_protocol_error;
+        }
+    } else if (VDPHCI_USB_ENDPOINT_IN(urb->endpoint_address)) {
         switch (urb->type) {
         case vdphci_urb_type_control: {
             return urbi_create_in_control(device, event, urb, urb_size, urbi);
@@ -665,6 +778,64 @@ vdp_usb_result vdp_usb_urbi_create(struct vdp_usb_device* device,
     }
 }
 
+vdp_usb_result vdp_usb_urbi_create(struct vdp_usb_device* device,
+    const void* event,
+    size_t event_size,
+    size_t buff_size,
+    struct vdp_usb_urbi** urbi)
+{
+    struct urbi_event ev;
+    struct vdphci_hevent_urb* urb;
+    size_t urb_size;
+    struct vdphci_h_urb_timing timing;
+    vdp_usb_result res;
+
+    assert(device);
+    assert(event);
+    assert(urbi);
+    assert(event_size >= sizeof(struct vdphci_hevent_header));
+    assert(buff_size >= event_size);
+
+    ev.buff = event;
+    ev.size = event_size;
+    ev.buff_size = buff_size;
+
+    urb = (struct vdphci_hevent_urb*)((const char*)event + sizeof(struct vdphci_hevent_header));
+    urb_size = event_size - sizeof(struct vdphci_hevent_header);
+
+    assert(urb_size >= vdp_offsetof(struct vdphci_hevent_urb, data.buff));
+
+    memset(&timing, 0, sizeof(timing));
+
+    if (urb->flags & VDPHCI_URB_TIMING) {
+        if (urb_size < (vdp_offsetof(struct vdphci_hevent_urb, data.buff) + sizeof(timing))) {
+            VDP_USB_LOG_ERROR(device->context,
+                "device %d: bad urb size, no room for timing",
+                device->device_number);
+
+            return vdp_usb_protocol_error;
+        }
+
+        urb_size -= sizeof(timing);
+
+        memcpy(&timing, (const char*)urb + urb_size, sizeof(timing));
+    }
+
+    /*
+     * Ok, here's what we have: 'urb' and it's size in 'urb_size', the structure itself
+     * must be validated below.
+     */
+
+    res = urbi_create_typed(device, &ev, urb, urb_size, urbi);
+
+    if (res == vdp_usb_success) {
+        (*urbi)->urb.enqueue_time = timing.enqueue_time;
+        (*urbi)->urb.frame_number = timing.frame_number;
+    }
+
+    return res;
+}
+
 vdp_usb_result vdp_usb_urbi_update(struct vdp_usb_urbi* urbi)
 {
     struct vdphci_hevent_urb* original_urb;
@@ -755,7 +926,9 @@ vdp_u32 vdp_usb_urbi_get_effective_size(struct vdp_usb_urbi* urbi)
 
     original_urb = urbi_get_hevent_urb(urbi);
 
-    if (VDPHCI_USB_ENDPOINT_IN(original_urb->endpoint_address)) {
+    if (urbi->map_addr) {
+        return urbi->size;
+    } else if (VDPHCI_USB_ENDPOINT_IN(original_urb->endpoint_address)) {
         switch (original_urb->type) {
         case vdphci_urb_type_control:
         case vdphci_urb_type_bulk:
@@ -769,14 +942,55 @@ vdp_u32 vdp_usb_urbi_get_effective_size(struct vdp_usb_urbi* urbi)
     }
 }
 
+vdp_u32 vdp_usb_urbi_get_header_size(struct vdp_usb_urbi* urbi)
+{
+    struct vdphci_hevent_urb* original_urb;
+    vdp_u32 size;
+
+    assert(urbi);
+    if (!urbi) {
+        return 0;
+    }
+
+    original_urb = urbi_get_hevent_urb(urbi);
+
+    size = vdp_offsetof(struct vdp_usb_urbi, devent_urb) -
+        vdp_offsetof(struct vdp_usb_urbi, devent_header);
+
+    if (original_urb->type == vdphci_urb_type_iso) {
+        return size + vdp_offsetof(struct vdphci_devent_urb, data.packets) +
+            (sizeof(struct vdphci_d_iso_packet) * original_urb->number_of_packets);
+    } else {
+        return size + vdp_offsetof(struct vdphci_devent_urb, data.buff);
+    }
+}
+
 void vdp_usb_urbi_destroy(struct vdp_usb_urbi* urbi)
 {
+    struct vdp_usb_device* device;
+    void* event;
+
     assert(urbi);
     if (!urbi) {
         return;
     }
 
-    free(urbi->urb.iso_packets);
-    free((void*)urbi->event);
-    free(urbi);
+    VDP_USB_PROBE2(urb_free, urbi->device->device_number, urbi->urb.id);
+
+    if (urbi->map_addr) {
+        munmap(urbi->map_addr, urbi->map_length);
+    }
+
+    device = urbi->device;
+    event = (void*)urbi->event;
+
+    if (!urbi->in_place) {
+        vdp_usb_device_free_buff(device, urbi);
+    }
+
+    /*
+     * In place urbi goes away with the event buffer.
+     */
+
+    vdp_usb_device_free_buff(device, event);
 }
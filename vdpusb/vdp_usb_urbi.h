@@ -28,6 +28,7 @@
 
 #include "vdp/usb.h"
 #include "vdphci-common.h"
+#include "vdp_usb_mpsc.h"
 
 struct vdp_usb_device;
 
@@ -48,6 +49,29 @@ struct vdp_usb_urbi
      */
     const void* event;
 
+    /*
+     * Urbi lives in the same buffer as 'event', right after it.
+     */
+    int in_place;
+
+    /*
+     * Mapped URBs only, transfer buffer mapping.
+     */
+    void* map_addr;
+    vdp_u32 map_length;
+
+    /*
+     * Queued to device's completions, 'complete' is 0 if the URB only
+     * needs to be freed.
+     */
+    struct vdp_usb_mpsc_node completion_node;
+    int complete;
+
+    /*
+     * CLOCK_MONOTONIC time the URB was read at, in nanoseconds.
+     */
+    vdp_u64 read_time;
+
     struct vdp_usb_urb urb;
 
     struct vdphci_devent_header devent_header;
@@ -57,11 +81,14 @@ struct vdp_usb_urbi
 
 /*
  * 'event' is a pointer to "hevent header + urb hevent" read from fd, if this function returns success
- * then 'event' shouldn't be freed by caller, it'll be freed in 'vdp_usb_urbi_destroy'
+ * then 'event' shouldn't be freed by caller, it'll be freed in 'vdp_usb_urbi_destroy'.
+ * 'event' must come from vdp_usb_device_alloc_buff, 'buff_size' is the size it was allocated with,
+ * urbi is built in place after the event if it fits.
  */
 vdp_usb_result vdp_usb_urbi_create(struct vdp_usb_device* device,
     const void* event,
     size_t event_size,
+    size_t buff_size,
     struct vdp_usb_urbi** urbi);
 
 /*
@@ -76,6 +103,11 @@ vdp_usb_result vdp_usb_urbi_update(struct vdp_usb_urbi* urbi);
  */
 vdp_u32 vdp_usb_urbi_get_effective_size(struct vdp_usb_urbi* urbi);
 
+/*
+ * Size of what's sent to the kernel before the payload, starting from 'devent_header'.
+ */
+vdp_u32 vdp_usb_urbi_get_header_size(struct vdp_usb_urbi* urbi);
+
 void vdp_usb_urbi_destroy(struct vdp_usb_urbi* urbi);
 
 #endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vdp_usb_workers.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void* vdp_usb_worker_thread(void* arg)
+{
+    struct vdp_usb_worker* worker = arg;
+    struct vdp_usb_work* work;
+
+    pthread_mutex_lock(&worker->mtx);
+
+    while (1) {
+        while (vdp_list_empty(&worker->queue) && !worker->stop) {
+            pthread_cond_wait(&worker->cond, &worker->mtx);
+        }
+
+        /*
+         * Work that's already posted is still run on stop.
+         */
+        if (vdp_list_empty(&worker->queue)) {
+            break;
+        }
+
+        vdp_list_first(struct vdp_usb_work, work, &worker->queue, entry);
+        vdp_list_remove(&work->entry);
+
+        pthread_mutex_unlock(&worker->mtx);
+
+        work->func(work);
+
+        pthread_mutex_lock(&worker->mtx);
+    }
+
+    pthread_mutex_unlock(&worker->mtx);
+
+    return NULL;
+}
+
+static void vdp_usb_workers_stop(struct vdp_usb_workers* workers, int num_started)
+{
+    int i;
+
+    for (i = 0; i < num_started; ++i) {
+        pthread_mutex_lock(&workers->workers[i].mtx);
+        workers->workers[i].stop = 1;
+        pthread_cond_signal(&workers->workers[i].cond);
+        pthread_mutex_unlock(&workers->workers[i].mtx);
+    }
+
+    for (i = 0; i < num_started; ++i) {
+        pthread_join(workers->workers[i].thread, NULL);
+        pthread_cond_destroy(&workers->workers[i].cond);
+        pthread_mutex_destroy(&workers->workers[i].mtx);
+    }
+}
+
+struct vdp_usb_workers* vdp_usb_workers_create(int num_threads)
+{
+    struct vdp_usb_workers* workers;
+    int i;
+
+    if (num_threads <= 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        num_threads = (num_cpus > 0) ? (int)num_cpus : 1;
+    }
+
+    workers = malloc(sizeof(*workers));
+
+    if (workers == NULL) {
+        goto fail1;
+    }
+
+    memset(workers, 0, sizeof(*workers));
+
+    workers->workers = malloc(sizeof(workers->workers[0]) * num_threads);
+
+    if (workers->workers == NULL) {
+        goto fail2;
+    }
+
+    memset(workers->workers, 0, sizeof(workers->workers[0]) * num_threads);
+
+    for (i = 0; i < num_threads; ++i) {
+        struct vdp_usb_worker* worker = &workers->workers[i];
+
+        vdp_list_init(&worker->queue);
+        pthread_mutex_init(&worker->mtx, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+
+        if (pthread_create(&worker->thread, NULL, &vdp_usb_worker_thread, worker) != 0) {
+            pthread_cond_destroy(&worker->cond);
+            pthread_mutex_destroy(&worker->mtx);
+            goto fail3;
+        }
+    }
+
+    workers->num_workers = num_threads;
+
+    return workers;
+
+fail3:
+    vdp_usb_workers_stop(workers, i);
+    free(workers->workers);
+fail2:
+    free(workers);
+fail1:
+
+    return NULL;
+}
+
+void vdp_usb_workers_destroy(struct vdp_usb_workers* workers)
+{
+    if (!workers) {
+        return;
+    }
+
+    vdp_usb_workers_stop(workers, workers->num_workers);
+
+    free(workers->workers);
+    free(workers);
+}
+
+int vdp_usb_workers_assign(struct vdp_usb_workers* workers)
+{
+    assert(workers);
+
+    return (int)((unsigned int)__sync_fetch_and_add(&workers->next_shard, 1) % workers->num_workers);
+}
+
+void vdp_usb_workers_post(struct vdp_usb_workers* workers, int shard, struct vdp_usb_work* work)
+{
+    struct vdp_usb_worker* worker;
+    int was_empty;
+
+    assert(workers);
+    assert((shard >= 0) && (shard < workers->num_workers));
+    assert(work);
+
+    worker = &workers->workers[shard];
+
+    pthread_mutex_lock(&worker->mtx);
+
+    was_empty = vdp_list_empty(&worker->queue);
+
+    vdp_list_add_tail(&worker->queue, &work->entry);
+
+    if (was_empty) {
+        pthread_cond_signal(&worker->cond);
+    }
+
+    pthread_mutex_unlock(&worker->mtx);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017, Stanislav Vorobiov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VDP_USB_WORKERS_H_
+#define _VDP_USB_WORKERS_H_
+
+#include "vdp/usb_gadget.h"
+#include <pthread.h>
+
+struct vdp_usb_work;
+
+typedef void (*vdp_usb_work_func)(struct vdp_usb_work* /*work*/);
+
+struct vdp_usb_work
+{
+    struct vdp_list entry;
+
+    vdp_usb_work_func func;
+};
+
+struct vdp_usb_worker
+{
+    pthread_t thread;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+
+    struct vdp_list queue;
+
+    int stop;
+};
+
+/*
+ * Fixed set of threads, each with its own FIFO queue (shard). Work posted to
+ * the same shard runs in posting order, work posted to different shards runs
+ * in parallel.
+ */
+struct vdp_usb_workers
+{
+    int num_workers;
+
+    int next_shard;
+
+    struct vdp_usb_worker* workers;
+};
+
+/*
+ * Pick a shard for a new work source, shards are handed out round-robin.
+ */
+int vdp_usb_workers_assign(struct vdp_usb_workers* workers);
+
+void vdp_usb_workers_post(struct vdp_usb_workers* workers, int shard, struct vdp_usb_work* work);
+
+#endif